@@ -50,7 +50,21 @@ extern "C" {
 #endif
 
 
+/*
+ * Scalar type for coordinates, transforms and other parameters. The library
+ * can be built with ZD_SINGLE_PRECISION defined (CMake option), to use float
+ * instead of double. Applications must then be compiled with it defined too!
+ *
+ * NOTE:
+ *	With float, positions are off by a noticeable fraction of a pixel where
+ *	scenes use coordinates around 1e6 and up. (See test/precision.c.) The
+ *	state time loses precision in very long sessions as well.
+ */
+#ifdef	ZD_SINGLE_PRECISION
+typedef float ZD_f;
+#else
 typedef double ZD_f;
+#endif
 
 
 /*---------------------------------------------------------
@@ -110,6 +124,8 @@ typedef struct ZD_texture ZD_texture;
   ZD_DEFERR(ZD_CLIPPING,	"Region requires clipping")\
   ZD_DEFERR(ZD_INVALIDPARENT,	"Entity cannot be child of specified parent")\
   ZD_DEFERR(ZD_INVALIDPARAM,	"Invalid parameter")\
+  ZD_DEFERR(ZD_INCOMPLETE,	"Operation not completed")\
+  ZD_DEFERR(ZD_BADHANDLE,	"Invalid or stale entity handle")\
   \
   ZD_DEFERR(ZD_INTERNAL,	"INTERNAL ERROR")
 
@@ -135,12 +151,64 @@ const char *zd_ErrorString(ZD_errors errorcode);
 
 typedef enum ZD_openflags
 {
-	ZD__DUMMY = 0
+	/*
+	 * Number of threads to render with, including the one calling
+	 * zd_Render(). 0 or 1 renders in the calling thread only. Ignored by
+	 * backends that cannot render in parallel.
+	 */
+	ZD__THREADS =	0x000000ff,
+
+	/*
+	 * Calculate the transforms of all moving entities in one pass before
+	 * rendering, rather than during rendering, as entities are visited.
+	 * This may be faster when most entities move and are in view, but
+	 * transforms are calculated for entities culled by the view as well.
+	 */
+	ZD_BATCHTRANSFORM =	0x00000100
 } ZD_openflags;
 
+/* Draw list counters maintained by the "null" backend */
+typedef struct ZD_rendercounts
+{
+	unsigned	frames;		/* zd_Render() calls */
+	unsigned	layers;
+	unsigned	windows;
+	unsigned	groups;		/* Including the root */
+	unsigned	sprites;
+	unsigned	primitives;
+	unsigned	vertices;	/* Total for all primitives rendered */
+	unsigned	fills;
+	unsigned	buffers;	/* Buffered entities redrawn */
+} ZD_rendercounts;
+
+/*
+ * Open a new state, using the backend named 'renderer'. The meaning of
+ * 'context' depends on the backend:
+ *
+ *	"opengl"	The SDL_Surface of the OpenGL display.
+ *
+ *	"software"	A ZD_pixels descriptor of a ZD_RGBA (or ZD_RGB) buffer
+ *			to render into; 'pixels', 'w', 'h' and 'pitch' are
+ *			used. The descriptor is read at the start of every
+ *			zd_Render(), so the application may switch buffers
+ *			between frames. Rendering is multithreaded if more
+ *			than one thread is specified via ZD__THREADS.
+ *
+ *	"null"		NULL, or a ZD_rendercounts struct, that will have its
+ *			counters incremented as entities are rendered. Nothing
+ *			is drawn, but the scene graph is processed as usual.
+ */
 ZD_state *zd_Open(const char *renderer, ZD_openflags flags, void *context);
 void zd_Close(ZD_state *state);
 
+/*
+ * Get the number of driver state calls filtered out by the state cache of the
+ * backend ('hits'), and passed on to the driver ('misses'), since zd_Open().
+ * Only the "opengl" backend has a state cache; others return ZD_NOTSUPPORTED.
+ */
+ZD_errors zd_StateCacheCounts(ZD_state *state, unsigned *hits,
+		unsigned *misses);
+
 
 /*---------------------------------------------------------
 	Textures
@@ -189,7 +257,8 @@ typedef enum ZD_texflags
 	ZD_NOCLEAR =		0x00010000,
 
 	/* Internal state flags */
-	ZD_UNDEFINED =		0x00100000
+	ZD_UNDEFINED =		0x00100000,
+	ZD_PREMULTIPLIED =	0x00200000	/* Buffer; premultiplied alpha */
 } ZD_texflags;
 
 /* Descriptor for locked texture areas */
@@ -205,7 +274,14 @@ typedef struct ZD_pixels
 /* Virtual texture rendering callback */
 typedef ZD_errors (*ZD_texrendercb)(ZD_pixels *pixels, void *userdata);
 
-/* Create a new texture */
+/*
+ * Create a new texture
+ *
+ *	The backend may pack small textures without mipmaps into shared atlas
+ *	pages, so that sprites with different textures can be drawn together.
+ *	Such a texture is moved to a texture of its own when it is used by a
+ *	fill or primitive, as those may need it to wrap.
+ */
 ZD_texture *zd_Texture(ZD_state *state, ZD_pixelformats format,
 		ZD_texflags flags, unsigned w, unsigned h);
 
@@ -223,10 +299,26 @@ ZD_errors zd_TextureWrite(ZD_texture *texture,
 ZD_texture *zd_TextureFromData(ZD_state *state, ZD_pixelformats format,
 		ZD_texflags flags, unsigned w, unsigned h, void *pixels);
 
-/* Set rendering callback for a virtual texture */
+/*
+ * Set rendering callback for a virtual texture
+ *
+ *	Virtual textures are rendered in tiles, as needed, by calls to the
+ *	callback with 'pixels' describing the area of the texture to render.
+ *	Rendered tiles are cached, up to a limit set by zd_TextureCacheSize(),
+ *	and rendered again when evicted and needed again. Setting the callback
+ *	again has all tiles rendered again.
+ *
+ * NOTE:
+ *	Virtual textures can not be locked, and can not be used by primitives.
+ *	Tiles beyond the size of the cache are not drawn, so heavily minified
+ *	virtual textures may need a bigger cache.
+ */
 ZD_errors zd_TextureOnRender(ZD_texture *texture,
 		ZD_texrendercb callback, void *userdata);
 
+/* Set the max number of tiles cached for a virtual texture */
+ZD_errors zd_TextureCacheSize(ZD_texture *texture, unsigned tiles);
+
 ZD_errors zd_LockTexture(ZD_texture *texture, ZD_pixels *pixels);
 ZD_errors zd_LockTextureRegion(ZD_texture *texture, ZD_pixels *pixels,
 		unsigned x, unsigned y, unsigned w, unsigned h);
@@ -264,12 +356,20 @@ typedef enum ZD_entityflags
 	ZD_IMMEDIATE =		0x00000001,
 #endif
 	ZD_VISIBLE =		0x00000010,	/* Entity is visible */
-	ZD_BUFFERED =		0x00000020,	/* Buffered rendering */
+	ZD_BUFFERED =		0x00000020,	/* Buffered rendering; zd_Group() */
 	ZD_CLEAR =		0x00000040,	/* Clear area before rendering */
 	ZD_SETORIGO =		0x00000080,	/* Set new origo (window) */
 	ZD_CLIP =		0x00000100,	/* Enable clipping (window) */
 	ZD_ANIMATED =		0x00001000,	/* Entity is animated */
-	ZD_RETHINK =		0x00002000	/* Recalculate transforms */
+	ZD_RETHINK =		0x00002000,	/* Recalculate transforms */
+
+	/* Internal state flags */
+	ZD_ANIMCONTENT =	0x00040000,	/* Animated descendants */
+	ZD_REBUFFER =		0x00100000,	/* Buffer needs redrawing */
+	ZD_NEWBOUNDS =		0x00200000,	/* Transform bounding box */
+	ZD_NEWCONTENT =		0x00400000,	/* Recalculate bounding box */
+	ZD_NOCULL =		0x00800000,	/* Bounding box not usable */
+	ZD_PHASE =		0x01000000	/* Compaction phase */
 } ZD_entityflags;
 
 
@@ -339,6 +439,13 @@ ZD_entity *zd_First(ZD_entity *parent);
 /* Get next entity in list */
 ZD_entity *zd_Next(ZD_entity *entity);
 
+/*
+ * Move entity 'e', with any children, to the end of the child list of
+ * 'parent'. The new parent must be in the same layer or window as the old one,
+ * and not inside the subtree of 'e'.
+ */
+ZD_errors zd_SetParent(ZD_entity *e, ZD_entity *parent);
+
 /* Entity ownership management */
 void zd_RetainEntity(ZD_entity *e);
 void zd_ReleaseEntity(ZD_entity *e);
@@ -379,6 +486,16 @@ ZD_entity *zd_Window(ZD_entity *parent, ZD_entityflags flags,
  *	A group is a non-rendering entity that applies transforms to its
  *	children.
  *
+ *	Buffered groups and windows (ZD_BUFFERED) render their children into
+ *	an offscreen buffer, that is drawn as a single textured quad, and only
+ *	redrawn when something in the subtree changes. Moving, rotating or
+ *	scaling a buffered group, or the parent of a buffered window, does not
+ *	require a redraw, unless the pixel size of the buffer changes.
+ *	Subtrees with animated (zd_CMove() etc) entities, or with fills
+ *	outside of clipping windows, are rendered as usual. Writing to a
+ *	texture used in a buffered subtree, or changing the render callback
+ *	of a virtual texture, has the buffer redrawn as well.
+ *
  * NOTE:
  *	Being non-rendering, a group does not have a position or orientation
  *	of its own! Those arguments passed here are equivalent to setting the
@@ -470,6 +587,70 @@ ZD_errors zd_OnTransformChange(ZD_entity *e, ZD_entitycb callback, void *userdat
 #endif
 
 
+/*---------------------------------------------------------
+	Entity handles
+---------------------------------------------------------*/
+
+/*
+ * Handles are 32 bit references to entities, that remain valid when entities
+ * are moved by zd_Compact(). They are plain integers, so they can be stored,
+ * serialized and passed between threads freely, but they only have meaning to
+ * the state they came from. 0 is never a valid handle.
+ *
+ * When an entity is destroyed, its handle becomes stale, and zd_Entity()
+ * returns NULL for it, rather than a pointer to some other entity that may
+ * have reused the memory. (Handles are recycled eventually, so a handle that
+ * has been stale for a very long time may refer to a new entity.)
+ */
+typedef unsigned ZD_handle;
+
+/* Get the handle of an entity */
+ZD_handle zd_Handle(ZD_entity *entity);
+
+/* Get the entity of a handle, or NULL if the handle is invalid or stale */
+ZD_entity *zd_Entity(ZD_state *state, ZD_handle handle);
+
+/*
+ * Entity API calls taking handles. These fail with ZD_BADHANDLE if a handle
+ * is invalid or stale, and otherwise do the same as the respective calls
+ * without the 'H'.
+ */
+ZD_errors zd_HSetParent(ZD_state *state, ZD_handle h, ZD_handle parent);
+ZD_errors zd_HReleaseEntity(ZD_state *state, ZD_handle h);
+ZD_errors zd_HSetTransform(ZD_state *state, ZD_handle h,
+		ZD_f x, ZD_f y, ZD_f z, ZD_f s, ZD_f r);
+ZD_errors zd_HSetPosition(ZD_state *state, ZD_handle h, ZD_f x, ZD_f y);
+ZD_errors zd_HSetPosition3D(ZD_state *state, ZD_handle h,
+		ZD_f x, ZD_f y, ZD_f z);
+ZD_errors zd_HSetScale(ZD_state *state, ZD_handle h, ZD_f scale);
+ZD_errors zd_HSetRotation(ZD_state *state, ZD_handle h, ZD_f rotation);
+ZD_errors zd_HMove(ZD_state *state, ZD_handle h, ZD_f x, ZD_f y);
+ZD_errors zd_HMove3D(ZD_state *state, ZD_handle h, ZD_f x, ZD_f y, ZD_f z);
+ZD_errors zd_HScale(ZD_state *state, ZD_handle h, ZD_f scale);
+ZD_errors zd_HRotate(ZD_state *state, ZD_handle h, ZD_f rotation);
+ZD_errors zd_HSetColor(ZD_state *state, ZD_handle h,
+		float r, float g, float b, float a);
+ZD_errors zd_HSetBGColor(ZD_state *state, ZD_handle h,
+		float r, float g, float b, float a);
+ZD_errors zd_HSetTexture(ZD_state *state, ZD_handle h, ZD_entityflags flags,
+		ZD_texture *texture);
+ZD_errors zd_HSetView(ZD_state *state, ZD_handle h,
+		ZD_f left, ZD_f right, ZD_f bottom, ZD_f top);
+ZD_errors zd_HSetParameter(ZD_state *state, ZD_handle h,
+		ZD_parameter param, ZD_f value);
+ZD_errors zd_HGetParameter(ZD_state *state, ZD_handle h,
+		ZD_parameter param, ZD_f *value);
+ZD_errors zd_HSetParameters(ZD_state *state, ZD_handle h,
+		unsigned count, unsigned *params, ZD_f *values);
+ZD_errors zd_HGetParameters(ZD_state *state, ZD_handle h,
+		unsigned count, unsigned *params, ZD_f *values);
+ZD_errors zd_HCMove(ZD_state *state, ZD_handle h, ZD_f x, ZD_f y);
+ZD_errors zd_HCMove3D(ZD_state *state, ZD_handle h, ZD_f x, ZD_f y, ZD_f z);
+ZD_errors zd_HCScale(ZD_state *state, ZD_handle h, ZD_f scale);
+ZD_errors zd_HCRotate(ZD_state *state, ZD_handle h, ZD_f rotation);
+ZD_errors zd_HCStop(ZD_state *state, ZD_handle h);
+
+
 /*---------------------------------------------------------
 	Primitives
 ---------------------------------------------------------*/
@@ -490,7 +671,17 @@ ZD_entity *zd_Primitive(ZD_entity *parent, ZD_entityflags flags,
 		ZD_primitives pkind, ZD_texture *texture,
 		ZD_f x, ZD_f y, ZD_f size, ZD_f rotation);
 
-/* Primitive data interface */
+/*
+ * Primitive data interface
+ *
+ *	zd_Vertex*() and zd_Vertices() append vertices, in the local coordinate
+ *	space of the primitive. 'data' for zd_Vertices() holds 'dimensions'
+ *	(2 or 3) values per vertex.
+ *
+ *	New vertices get the texture coordinate last set with zd_TexCoord().
+ *	zd_TexCoords() sets the texture coordinates of the last 'count'
+ *	vertices added, from 'count' (x, y) pairs in 'data'.
+ */
 ZD_errors zd_Vertex2D(ZD_entity *entity, ZD_f x, ZD_f y);
 ZD_errors zd_Vertex3D(ZD_entity *entity, ZD_f x, ZD_f y, ZD_f z);
 ZD_errors zd_Vertices(ZD_entity *entity, unsigned dimensions, unsigned count,
@@ -513,6 +704,19 @@ ZD_errors zd_Advance(ZD_state *state, ZD_f dt);
 
 ZD_errors zd_Render(ZD_state *state);
 
+/*
+ * Move entities into depth first order in memory, so that rendering walks
+ * memory mostly linearly again after lots of entities have been created and
+ * destroyed. At most 'count' entities are visited per call, or all of them if
+ * 'count' is 0. Returns ZD_INCOMPLETE if further calls are needed to finish.
+ *
+ * NOTE:
+ *	This moves entities! Entity pointers held by the application are not
+ *	valid after this call; use handles (see zd_Handle()) to keep track of
+ *	entities across zd_Compact() calls. Must not be called from callbacks.
+ */
+ZD_errors zd_Compact(ZD_state *state, unsigned count);
+
 #ifdef __cplusplus
 };
 #endif
@@ -70,6 +70,7 @@ static struct
 	{"glLoadIdentity", offsetof(ZD_glinterface, LoadIdentity) },
 	{"glLoadMatrixd", offsetof(ZD_glinterface, LoadMatrixd) },
 	{"glMultMatrixd", offsetof(ZD_glinterface, MultMatrixd) },
+	{"glMultMatrixf", offsetof(ZD_glinterface, MultMatrixf) },
 	{"glRotated", offsetof(ZD_glinterface, Rotated) },
 	{"glScaled", offsetof(ZD_glinterface, Scaled) },
 	{"glTranslated", offsetof(ZD_glinterface, Translated) },
@@ -97,6 +98,8 @@ static struct
 	{"glEnd", offsetof(ZD_glinterface, End) },
 	{"glVertex2d", offsetof(ZD_glinterface, Vertex2d) },
 	{"glVertex3d", offsetof(ZD_glinterface, Vertex3d) },
+	{"glVertex2f", offsetof(ZD_glinterface, Vertex2f) },
+	{"glVertex3f", offsetof(ZD_glinterface, Vertex3f) },
 	{"glVertex4d", offsetof(ZD_glinterface, Vertex4d) },
 	{"glNormal3d", offsetof(ZD_glinterface, Normal3d) },
 	{"glColor3d", offsetof(ZD_glinterface, Color3d) },
@@ -104,12 +107,14 @@ static struct
 	{"glColor4f", offsetof(ZD_glinterface, Color4f) },
 	{"glTexCoord1d", offsetof(ZD_glinterface, TexCoord1d) },
 	{"glTexCoord2d", offsetof(ZD_glinterface, TexCoord2d) },
+	{"glTexCoord2f", offsetof(ZD_glinterface, TexCoord2f) },
 	{"glTexCoord3d", offsetof(ZD_glinterface, TexCoord3d) },
 	{"glTexCoord4d", offsetof(ZD_glinterface, TexCoord4d) },
 
 	/* Arrays */
 	{"glVertexPointer", offsetof(ZD_glinterface, VertexPointer) },
 	{"glTexCoordPointer", offsetof(ZD_glinterface, TexCoordPointer) },
+	{"glColorPointer", offsetof(ZD_glinterface, ColorPointer) },
 	{"glDrawArrays", offsetof(ZD_glinterface, DrawArrays) },
 
 	{NULL, 0 },
@@ -121,8 +126,26 @@ static struct
 	/* OpenGL 1.2 core functions */
 	{"glBlendEquation", offsetof(ZD_glinterface, _BlendEquation) },
 
+	/* OpenGL 1.4 core functions */
+	{"glBlendFuncSeparate", offsetof(ZD_glinterface, _BlendFuncSeparate) },
+
 	/* 3.0+ mipmap generation */
 	{"glGenerateMipmap", offsetof(ZD_glinterface, _GenerateMipmap) },
+
+	/* OpenGL 1.5 buffer objects */
+	{"glGenBuffers", offsetof(ZD_glinterface, _GenBuffers) },
+	{"glDeleteBuffers", offsetof(ZD_glinterface, _DeleteBuffers) },
+	{"glBindBuffer", offsetof(ZD_glinterface, _BindBuffer) },
+	{"glBufferData", offsetof(ZD_glinterface, _BufferData) },
+
+	/* OpenGL 3.0 framebuffer objects */
+	{"glGenFramebuffers", offsetof(ZD_glinterface, _GenFramebuffers) },
+	{"glDeleteFramebuffers", offsetof(ZD_glinterface, _DeleteFramebuffers) },
+	{"glBindFramebuffer", offsetof(ZD_glinterface, _BindFramebuffer) },
+	{"glFramebufferTexture2D",
+			offsetof(ZD_glinterface, _FramebufferTexture2D) },
+	{"glCheckFramebufferStatus",
+			offsetof(ZD_glinterface, _CheckFramebufferStatus) },
 	
 	{NULL, 0 }
 };
@@ -40,6 +40,7 @@
 #		include <GL/glu.h>
 #	endif
 #endif
+#include <stddef.h>
 
 #ifndef GL_CLAMP_TO_EDGE
 #	define	GL_CLAMP_TO_EDGE	0x812F
@@ -82,6 +83,21 @@
 #ifndef	GL_GENERATE_MIPMAP_HINT
 #	define	GL_GENERATE_MIPMAP_HINT	0x8192
 #endif
+#ifndef	GL_ARRAY_BUFFER
+#	define	GL_ARRAY_BUFFER		0x8892
+#endif
+#ifndef	GL_STATIC_DRAW
+#	define	GL_STATIC_DRAW		0x88E4
+#endif
+#ifndef	GL_FRAMEBUFFER
+#	define	GL_FRAMEBUFFER		0x8D40
+#endif
+#ifndef	GL_COLOR_ATTACHMENT0
+#	define	GL_COLOR_ATTACHMENT0	0x8CE0
+#endif
+#ifndef	GL_FRAMEBUFFER_COMPLETE
+#	define	GL_FRAMEBUFFER_COMPLETE	0x8CD5
+#endif
 
 
 typedef struct ZD_glinterface
@@ -127,6 +143,7 @@ typedef struct ZD_glinterface
 	void	(APIENTRY *LoadIdentity)(void);
 	void	(APIENTRY *LoadMatrixd)(const GLdouble *m);
 	void	(APIENTRY *MultMatrixd)(const GLdouble *m);
+	void	(APIENTRY *MultMatrixf)(const GLfloat *m);
 	void	(APIENTRY *Rotated)(GLdouble, GLdouble, GLdouble, GLdouble);
 	void	(APIENTRY *Scaled)(GLdouble, GLdouble, GLdouble);
 	void	(APIENTRY *Translated)(GLdouble x, GLdouble y, GLdouble z);
@@ -159,6 +176,8 @@ typedef struct ZD_glinterface
 	void	(APIENTRY *End)(void);
 	void	(APIENTRY *Vertex2d)(GLdouble x, GLdouble y);
 	void	(APIENTRY *Vertex3d)(GLdouble x, GLdouble y, GLdouble z);
+	void	(APIENTRY *Vertex2f)(GLfloat x, GLfloat y);
+	void	(APIENTRY *Vertex3f)(GLfloat x, GLfloat y, GLfloat z);
 	void	(APIENTRY *Vertex4d)(GLdouble x, GLdouble y, GLdouble z, GLdouble w);
 	void	(APIENTRY *Normal3d)(GLdouble nx, GLdouble ny, GLdouble nz);
 	void	(APIENTRY *Color3d)(GLdouble red, GLdouble green, GLdouble blue);
@@ -166,12 +185,14 @@ typedef struct ZD_glinterface
 	void	(APIENTRY *Color4f)(GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha);
 	void	(APIENTRY *TexCoord1d)(GLdouble s);
 	void	(APIENTRY *TexCoord2d)(GLdouble s, GLdouble t);
+	void	(APIENTRY *TexCoord2f)(GLfloat s, GLfloat t);
 	void	(APIENTRY *TexCoord3d)(GLdouble s, GLdouble t, GLdouble u);
 	void	(APIENTRY *TexCoord4d)(GLdouble s, GLdouble t, GLdouble u, GLdouble v);
 
 	/* Arrays */
 	void	(APIENTRY *VertexPointer)(GLint size, GLenum type, GLsizei stride, const GLvoid *pointer);
 	void	(APIENTRY *TexCoordPointer)(GLint size, GLenum type, GLsizei stride, const GLvoid *pointer);
+	void	(APIENTRY *ColorPointer)(GLint size, GLenum type, GLsizei stride, const GLvoid *pointer);
 	void	(APIENTRY *DrawArrays)(GLenum mode, GLint first, GLsizei count);
 
 	/*
@@ -181,21 +202,66 @@ typedef struct ZD_glinterface
 		/* OpenGL 1.2 core functions */
 	void	(APIENTRY *_BlendEquation)(GLenum);
 
+	/* OpenGL 1.4 core functions */
+	void	(APIENTRY *_BlendFuncSeparate)(GLenum srgb, GLenum drgb,
+			GLenum salpha, GLenum dalpha);
+
 	/* 3.0+ Texture handling */
 	void	(APIENTRY *_GenerateMipmap)(GLenum target);
 
+	/* OpenGL 1.5 buffer objects */
+	void	(APIENTRY *_GenBuffers)(GLsizei n, GLuint *buffers);
+	void	(APIENTRY *_DeleteBuffers)(GLsizei n, const GLuint *buffers);
+	void	(APIENTRY *_BindBuffer)(GLenum target, GLuint buffer);
+	void	(APIENTRY *_BufferData)(GLenum target, ptrdiff_t size,
+			const GLvoid *data, GLenum usage);
+
+	/* OpenGL 3.0 framebuffer objects */
+	void	(APIENTRY *_GenFramebuffers)(GLsizei n, GLuint *framebuffers);
+	void	(APIENTRY *_DeleteFramebuffers)(GLsizei n,
+			const GLuint *framebuffers);
+	void	(APIENTRY *_BindFramebuffer)(GLenum target, GLuint framebuffer);
+	void	(APIENTRY *_FramebufferTexture2D)(GLenum target,
+			GLenum attachment, GLenum textarget, GLuint texture,
+			GLint level);
+	GLenum	(APIENTRY *_CheckFramebufferStatus)(GLenum target);
+
 	/*
-	 * OpenGL ntate cache
+	 * OpenGL state cache
+	 *
+	 * -1 (or the like) means "unknown", forcing the next call through.
 	 */
 	struct
 	{
 		int	blend;
 		int	texture_2d;
 		int	scissor_test;
+		int	stencil_test;
 	} caps;
+	struct
+	{
+		int	vertex_array;
+		int	texture_coord_array;
+		int	color_array;
+	} clientcaps;
 	GLenum	sfactor;
 	GLenum	dfactor;
+	GLenum	sfactora;	/* Alpha; glBlendFuncSeparate() */
+	GLenum	dfactora;
 	GLuint	texture2d;
+	GLfloat	color[4];
+	int	colorvalid;
+	GLenum	stencilfunc;
+	GLint	stencilref;
+	GLuint	stencilmask;
+	GLenum	stencilop[3];
+	GLint	scissor[4];
+	int	colormask;	/* RGBA in bits 0..3 */
+	GLenum	matrixmode;
+
+	/* Calls filtered out by the cache, and calls passed on */
+	unsigned	hits;
+	unsigned	misses;
 
 	/*
 	 * OpenGL version info
@@ -219,9 +285,21 @@ static inline void gli_Reset(ZD_glinterface *gli)
 	gli->caps.blend = -1;
 	gli->caps.texture_2d = -1;
 	gli->caps.scissor_test = -1;
+	gli->caps.stencil_test = -1;
+	gli->clientcaps.vertex_array = -1;
+	gli->clientcaps.texture_coord_array = -1;
+	gli->clientcaps.color_array = -1;
 	gli->texture2d = -1;
 	gli->sfactor = 0xffffffff;
 	gli->dfactor = 0xffffffff;
+	gli->sfactora = 0xffffffff;
+	gli->dfactora = 0xffffffff;
+	gli->colorvalid = 0;
+	gli->stencilfunc = 0xffffffff;
+	gli->stencilop[0] = 0xffffffff;
+	gli->scissor[2] = -1;
+	gli->colormask = -1;
+	gli->matrixmode = 0xffffffff;
 }
 
 static inline int *gli_GetState(ZD_glinterface *gli, GLenum cap)
@@ -234,6 +312,8 @@ static inline int *gli_GetState(ZD_glinterface *gli, GLenum cap)
 		return &gli->caps.texture_2d;
 	  case GL_SCISSOR_TEST:
 		return &gli->caps.scissor_test;
+	  case GL_STENCIL_TEST:
+		return &gli->caps.stencil_test;
 	  default:
 		return NULL;
 	}
@@ -246,8 +326,13 @@ static inline void gli_Enable(ZD_glinterface *gli, GLenum cap)
 	{
 		gli->Enable(cap);
 		if(state)
+		{
 			*state = 1;
+			++gli->misses;
+		}
 	}
+	else
+		++gli->hits;
 }
 
 static inline void gli_Disable(ZD_glinterface *gli, GLenum cap)
@@ -257,17 +342,92 @@ static inline void gli_Disable(ZD_glinterface *gli, GLenum cap)
 	{
 		gli->Disable(cap);
 		if(state)
+		{
 			*state = 0;
+			++gli->misses;
+		}
 	}
+	else
+		++gli->hits;
+}
+
+static inline int *gli_GetClientState(ZD_glinterface *gli, GLenum cap)
+{
+	switch(cap)
+	{
+	  case GL_VERTEX_ARRAY:
+		return &gli->clientcaps.vertex_array;
+	  case GL_TEXTURE_COORD_ARRAY:
+		return &gli->clientcaps.texture_coord_array;
+	  case GL_COLOR_ARRAY:
+		return &gli->clientcaps.color_array;
+	  default:
+		return NULL;
+	}
+}
+
+static inline void gli_EnableClientState(ZD_glinterface *gli, GLenum cap)
+{
+	int *state = gli_GetClientState(gli, cap);
+	if(!state || (*state != 1))
+	{
+		gli->EnableClientState(cap);
+		if(state)
+		{
+			*state = 1;
+			++gli->misses;
+		}
+	}
+	else
+		++gli->hits;
+}
+
+static inline void gli_DisableClientState(ZD_glinterface *gli, GLenum cap)
+{
+	int *state = gli_GetClientState(gli, cap);
+	if(!state || (*state != 0))
+	{
+		gli->DisableClientState(cap);
+		if(state)
+		{
+			*state = 0;
+			++gli->misses;
+		}
+	}
+	else
+		++gli->hits;
 }
 
 static inline void gli_BlendFunc(ZD_glinterface *gli, GLenum sfactor, GLenum dfactor)
 {
-	if((sfactor == gli->sfactor) && (dfactor == gli->dfactor))
+	if((sfactor == gli->sfactor) && (dfactor == gli->dfactor) &&
+			(sfactor == gli->sfactora) && (dfactor == gli->dfactora))
+	{
+		++gli->hits;
 		return;
+	}
 	gli->BlendFunc(sfactor, dfactor);
-	gli->sfactor = sfactor;
-	gli->dfactor = dfactor;
+	gli->sfactor = gli->sfactora = sfactor;
+	gli->dfactor = gli->dfactora = dfactor;
+	++gli->misses;
+}
+
+/* NOTE: Check for gli->_BlendFuncSeparate before using this! */
+static inline void gli_BlendFuncSeparate(ZD_glinterface *gli,
+		GLenum srgb, GLenum drgb, GLenum salpha, GLenum dalpha)
+{
+	if((srgb == gli->sfactor) && (drgb == gli->dfactor) &&
+			(salpha == gli->sfactora) && (dalpha == gli->dfactora))
+	{
+		++gli->hits;
+		return;
+	}
+	gli->_BlendFuncSeparate(srgb, drgb, salpha, dalpha);
+	gli->sfactor = srgb;
+	gli->dfactor = drgb;
+	gli->sfactora = salpha;
+	gli->dfactora = dalpha;
+	++gli->misses;
 }
 
 static inline void gli_BindTexture(ZD_glinterface *gli, GLenum target, GLuint tx)
@@ -278,9 +438,120 @@ static inline void gli_BindTexture(ZD_glinterface *gli, GLenum target, GLuint tx
 		return;
 	}
 	if(tx == gli->texture2d)
+	{
+		++gli->hits;
 		return;
+	}
 	gli->BindTexture(target, tx);
 	gli->texture2d = tx;
+	++gli->misses;
+}
+
+static inline void gli_Color4f(ZD_glinterface *gli, GLfloat r, GLfloat g,
+		GLfloat b, GLfloat a)
+{
+	if(gli->colorvalid && (r == gli->color[0]) && (g == gli->color[1]) &&
+			(b == gli->color[2]) && (a == gli->color[3]))
+	{
+		++gli->hits;
+		return;
+	}
+	gli->Color4f(r, g, b, a);
+	gli->color[0] = r;
+	gli->color[1] = g;
+	gli->color[2] = b;
+	gli->color[3] = a;
+	gli->colorvalid = 1;
+	++gli->misses;
+}
+
+static inline void gli_StencilFunc(ZD_glinterface *gli, GLenum func,
+		GLint ref, GLuint mask)
+{
+	if((func == gli->stencilfunc) && (ref == gli->stencilref) &&
+			(mask == gli->stencilmask))
+	{
+		++gli->hits;
+		return;
+	}
+	gli->StencilFunc(func, ref, mask);
+	gli->stencilfunc = func;
+	gli->stencilref = ref;
+	gli->stencilmask = mask;
+	++gli->misses;
+}
+
+static inline void gli_StencilOp(ZD_glinterface *gli, GLenum sfail,
+		GLenum dpfail, GLenum dppass)
+{
+	if((sfail == gli->stencilop[0]) && (dpfail == gli->stencilop[1]) &&
+			(dppass == gli->stencilop[2]))
+	{
+		++gli->hits;
+		return;
+	}
+	gli->StencilOp(sfail, dpfail, dppass);
+	gli->stencilop[0] = sfail;
+	gli->stencilop[1] = dpfail;
+	gli->stencilop[2] = dppass;
+	++gli->misses;
+}
+
+static inline void gli_Scissor(ZD_glinterface *gli, GLint x, GLint y,
+		GLsizei width, GLsizei height)
+{
+	if((x == gli->scissor[0]) && (y == gli->scissor[1]) &&
+			(width == gli->scissor[2]) &&
+			(height == gli->scissor[3]))
+	{
+		++gli->hits;
+		return;
+	}
+	gli->Scissor(x, y, width, height);
+	gli->scissor[0] = x;
+	gli->scissor[1] = y;
+	gli->scissor[2] = width;
+	gli->scissor[3] = height;
+	++gli->misses;
+}
+
+static inline void gli_ColorMask(ZD_glinterface *gli, GLboolean red,
+		GLboolean green, GLboolean blue, GLboolean alpha)
+{
+	int mask = (red ? 1 : 0) | (green ? 2 : 0) | (blue ? 4 : 0) |
+			(alpha ? 8 : 0);
+	if(mask == gli->colormask)
+	{
+		++gli->hits;
+		return;
+	}
+	gli->ColorMask(red, green, blue, alpha);
+	gli->colormask = mask;
+	++gli->misses;
+}
+
+static inline void gli_MatrixMode(ZD_glinterface *gli, GLenum mode)
+{
+	if(mode == gli->matrixmode)
+	{
+		++gli->hits;
+		return;
+	}
+	gli->MatrixMode(mode);
+	gli->matrixmode = mode;
+	++gli->misses;
+}
+
+/*
+ * glDrawArrays() wrapper. With the color array enabled, the current color is
+ * undefined afterwards, so the cached color has to be dropped.
+ */
+static inline void gli_DrawArrays(ZD_glinterface *gli, GLenum mode,
+		GLint first, GLsizei count)
+{
+	gli->DrawArrays(mode, first, count);
+	if(gli->clientcaps.color_array)
+		gli->colorvalid = 0;
 }
 
 #endif /* ZD_GLI_H */
@@ -37,30 +37,245 @@ typedef struct ZD_backend ZD_backend;
 extern ZD_errors zd_lasterror;
 
 
+/*---------------------------------------------------------
+	Transform table
+---------------------------------------------------------*/
+
+/* Transform table slot flags */
+typedef enum ZD_xfflags
+{
+	ZD_XF_NEWMATRIX =	0x01,	/* Recalculate local matrix */
+	ZD_XF_CHANGED =		0x02,	/* Recalculate world transform */
+	ZD_XF_ANIMATED =	0x04,	/* Entity is animated */
+	ZD_XF_SPIN =		0x08	/* Animated scale and/or rotation */
+} ZD_xfflags;
+
+/*
+ * Entity transforms, stored as structure-of-arrays, and indexed by the 'xf'
+ * field of the entities. The slot of an entity is always greater than that of
+ * its parent, so world transforms can be calculated in a single pass in slot
+ * order. The root entity is in slot 0.
+ */
+typedef struct ZD_xftable
+{
+	unsigned	size;		/* Number of allocated slots */
+	unsigned	count;		/* Number of slots used, or free below */
+	unsigned	nfree;		/* Number of free slots below 'count' */
+	unsigned	nanimated;	/* Number of animated slots */
+	int		dirty;		/* Transforms have changed */
+	unsigned	*freelist;	/* Stack of free slots */
+	unsigned	*parent;	/* Slot of parent entity */
+	unsigned char	*flags;		/* ZD_xfflags */
+
+	/* Local transforms */
+	ZD_f		*x, *y, *z, *s, *r;
+	ZD_f		*dx, *dy, *dz, *ds, *dr;
+	ZD_f		*t0;		/* Animation start time */
+	ZD_f		*lmx;		/* Rotation + scaling; 4 per slot */
+
+	/* World transforms */
+	ZD_f		*tx, *ty, *tz, *ts, *tr;
+	ZD_f		*trmx;		/* Rotation + scaling; 4 per slot */
+} ZD_xftable;
+
+
+/*---------------------------------------------------------
+	Entity allocation
+---------------------------------------------------------*/
+
+/* Scene graph entity kinds */
+typedef enum ZD_entitykind
+{
+	ZD_EROOT = 0,
+	ZD_ELAYER,
+	ZD_EWINDOW,
+	ZD_EGROUP,
+	ZD_ESPRITE,
+	ZD_EPRIMITIVE,
+	ZD_EFILL
+} ZD_entitykind;
+
+/* Number of entity kinds */
+#define	ZD_EKINDS	(ZD_EFILL + 1)
+
+/* Page aligned block of memory that entities are carved from */
+typedef struct ZD_arena ZD_arena;
+struct ZD_arena
+{
+	ZD_arena	*next;
+	void		*block;		/* Unaligned block, for free() */
+};
+
+/* Allocator for entities of one kind */
+typedef struct ZD_slab
+{
+	unsigned	size;		/* Actual size of entities (bytes) */
+	ZD_entity	*pool;		/* Free entities */
+	char		*next, *end;	/* Unused space in current arena */
+} ZD_slab;
+
+
+/*---------------------------------------------------------
+	Entity handles
+---------------------------------------------------------*/
+
+/*
+ * A handle is a table index in the low ZD_HINDEXBITS bits, and a generation
+ * count in the rest. The generation of an index is bumped whenever the entity
+ * using it is destroyed, so stale handles are detected, until the count wraps.
+ */
+#define	ZD_HINDEXBITS	22
+#define	ZD_HINDEXMASK	((1U << ZD_HINDEXBITS) - 1)
+
+/* Table of entities by handle index. Index 0 is never used. */
+typedef struct ZD_handletable
+{
+	unsigned	size;		/* Number of allocated indices */
+	unsigned	count;		/* Number of indices used, or free below */
+	unsigned	nfree;		/* Number of free indices below 'count' */
+	unsigned	*freelist;	/* Stack of free indices */
+	ZD_handle	*handle;	/* Current handle of each index */
+	ZD_entity	**entity;	/* Entity of each index, or NULL */
+} ZD_handletable;
+
+
+/*---------------------------------------------------------
+	Draw lists
+---------------------------------------------------------*/
+
+/*
+ * zd_Render() traverses the scene graph, recording what to draw as a flat
+ * list of ops in painter's order, and then hands that over to the backend.
+ * Geometry is transformed to the space of the enclosing layer, so backends
+ * need not look at the entities at all.
+ *
+ * The ops between ZD_DBUFFER and ZD_DENDBUFFER are drawn into the buffer
+ * texture instead, which is cleared to transparent first. They are in the
+ * space of the buffer; the ZD_DBUFFER corners map to the buffer texture like
+ * the ZD_DLAYER corners map to the display, with the top at row 0.
+ */
+typedef enum ZD_drawopkind
+{
+	ZD_DLAYER,	/* Enter layer; corners of the view, background */
+	ZD_DENDLAYER,	/* Leave layer */
+	ZD_DWINDOW,	/* Enter window; corners of the window, background */
+	ZD_DENDWINDOW,	/* Leave window */
+	ZD_DQUAD,	/* Convex quad; sprite or fill */
+	ZD_DPRIMITIVE,	/* Vertex range drawn as a ZD_primitives kind */
+	ZD_DMESH,	/* Primitive entity; vertices and transform not copied */
+	ZD_DBUFFER,	/* Enter buffer; corners of the buffer area, texture */
+	ZD_DENDBUFFER	/* Leave buffer */
+} ZD_drawopkind;
+
+typedef enum ZD_drawopflags
+{
+	ZD_DCLEAR =	0x00000001,	/* Fill background (layer, window) */
+	ZD_DCLIP =	0x00000002,	/* Clip to window (window, end) */
+	ZD_DAXIAL =	0x00000004	/* Axis aligned rectangle (quad) */
+} ZD_drawopflags;
+
+/* Vertex in layer space, with normalized texture coordinates */
+typedef struct ZD_drawvertex
+{
+	ZD_f		x, y, z;
+	ZD_f		u, v;
+} ZD_drawvertex;
+
+typedef struct ZD_drawop
+{
+	ZD_drawopkind	kind;
+	unsigned	flags;		/* ZD_drawopflags */
+	ZD_entity	*entity;	/* Entity the op was recorded for */
+	ZD_texture	*texture;	/* Texture, or NULL */
+	float		r, g, b, a;	/* Color, or background color */
+	unsigned	first;		/* First vertex */
+	unsigned	count;		/* Number of vertices */
+	ZD_primitives	pkind;		/* ZD_DPRIMITIVE, ZD_DMESH */
+	int		layer;		/* ZD_DWINDOW: ZD_DLAYER/BUFFER op, or -1 */
+} ZD_drawop;
+
+typedef struct ZD_drawlist
+{
+	ZD_drawop	*ops;
+	unsigned	nops;
+	unsigned	opssize;
+	ZD_drawvertex	*vertices;
+	unsigned	nvertices;
+	unsigned	verticessize;
+	unsigned	groups;		/* Groups visited; they record no ops */
+} ZD_drawlist;
+
+static inline ZD_drawvertex *zd_OpVertices(ZD_drawlist *dl, ZD_drawop *op)
+{
+	return dl->vertices + op->first;
+}
+
+
 /*---------------------------------------------------------
 	States
 ---------------------------------------------------------*/
 
+/* Rendering traversal stack entry, for an entity with children */
+typedef struct ZD_travframe
+{
+	ZD_entity	*e;
+	ZD_entity	*next;		/* Next child to visit */
+	unsigned	fwflags;	/* Flags forwarded to children */
+	int		cull;		/* Cull children against 'lv' */
+	ZD_f		lv[4];		/* View in the local space of 'e' */
+	ZD_f		view[4];	/* View to restore after 'e' */
+	int		op;		/* Op recorded for 'e', or -1 */
+	int		buffer;		/* ZD_DBUFFER op for 'e', or -1 */
+} ZD_travframe;
+
 struct ZD_state
 {
 	ZD_entity	*root;
 	ZD_texture	*textures;
-	ZD_entity	*pool;
+	ZD_slab		slabs[ZD_EKINDS];
+	ZD_arena	*arenas;	/* Entity arenas of all slabs */
+	ZD_handletable	handles;
 	ZD_backend	*backend;
 	void		*bdata;
 	void		*context;
 	unsigned	flags;		/* ZD_openflags */
 	ZD_errors	lasterror;
-	unsigned	entitysize;	/* Actual size of ZD_entity (bytes) */
 	unsigned	texturesize;	/* Actual size of ZD_texture (bytes)*/
 	ZD_f		now;		/* Current mod/fx time */
 	ZD_f		vl, vr, vb, vt;	/* View extents */
+	ZD_travframe	*stack;		/* Rendering traversal stack */
+	unsigned	stacksize;	/* Number of allocated entries */
+	ZD_drawlist	drawlist;	/* Recorded by zd_Render() */
+	unsigned	frame;		/* zd_Render() calls, for tile caches */
+	unsigned	minmesh;	/* Min vertices for ZD_DMESH, or 0 */
+	ZD_xftable	xf;		/* Entity transforms */
+
+	/* ZD_BUFFERED support */
+	unsigned	maxbuffer;	/* Max buffer size (pixels), or 0 */
+	unsigned	displayw;	/* Display size (pixels), set by the */
+	unsigned	displayh;	/*	backend, for sizing buffers */
+	unsigned	nbuffered;	/* Buffered groups and windows */
+	unsigned	buffering;	/* Buffers being recorded */
+	unsigned	buffermark;	/* Last ZD_texture.mark used */
+
+	/* Texture atlas */
+	unsigned	atlassize;	/* Size of atlas pages, or 0 */
+	unsigned	atlasmax;	/* Max size of packed textures */
+	struct ZD_atlaspage *atlas;	/* Atlas pages */
+
+	/* zd_Compact() state */
+	ZD_arena	*oldarenas;	/* Arenas being emptied, if compacting */
+	char		*cnext, *cend;	/* Unused space for moved entities */
+	ZD_entity	*cursor;	/* Next entity to visit, or NULL */
+	unsigned	nold;		/* Live entities left in 'oldarenas' */
+	unsigned	phase;		/* ZD_PHASE of entities in 'arenas' */
 };
 
-static inline void zd_BumpEntitySize(ZD_state *st, unsigned size)
+static inline void zd_BumpEntitySize(ZD_state *st, ZD_entitykind kind,
+		unsigned size)
 {
-	if(size > st->entitysize)
-		st->entitysize = size;
+	if(size > st->slabs[kind].size)
+		st->slabs[kind].size = size;
 }
 
 static inline void zd_BumpTextureSize(ZD_state *st, unsigned size)
@@ -74,30 +289,16 @@ static inline void zd_BumpTextureSize(ZD_state *st, unsigned size)
 	Entities
 ---------------------------------------------------------*/
 
-/* Scene graph entity kinds */
-typedef enum ZD_entitykind
-{
-	ZD_EROOT = 0,
-	ZD_ELAYER,
-	ZD_EWINDOW,
-	ZD_EGROUP,
-	ZD_ESPRITE,
-	ZD_EPRIMITIVE,
-	ZD_EFILL
-} ZD_entitykind;
-
 /* Entity header */
 struct ZD_entity
 {
 	ZD_state	*state;
 	ZD_entity	*parent;
-	ZD_entity	*next;		/* Siblings */
+	ZD_entity	*prev, *next;	/* Siblings */
 	ZD_entity	*first, *last;	/* Children */
 
 	/* Backend methods */
 	ZD_errors (*Rethink)(ZD_entity *e);
-	ZD_errors (*Render)(ZD_entity *e);
-	ZD_errors (*RenderPost)(ZD_entity *e);
 	void (*Destroy)(ZD_entity *e);
 #if 0
 	/* Application callbacks */
@@ -112,15 +313,17 @@ struct ZD_entity
 	/* Parameters */
 	unsigned	flags;
 	float		cr, cg, cb, ca;
-	ZD_f		x, y, z, s, r;
-	ZD_f		dx, dy, dz, ds, dr;
+	unsigned	xf;		/* Transform table slot */
+	ZD_handle	handle;
 
 	/* Parameters transformed for rendering */
-	ZD_f		tx, ty, tz, ts, tr;
 	float		tcr, tcg, tcb, tca;
 
-	/* Rotation + scaling matrix for coordinates and children */
-	ZD_f		trmx[4];
+	/* Bounding box (x1, y1, x2, y2) of entity + children; local space */
+	ZD_f		lbounds[4];
+
+	/* 'lbounds' transformed into parent space */
+	ZD_f		bounds[4];
 };
 
 /* Layer entity */
@@ -131,13 +334,37 @@ typedef struct ZD_layer
 	float		bgr, bgg, bgb, bga;
 } ZD_layer;
 
+/* Texture drawn into a buffer, and its ZD_texture.serial at the time */
+typedef struct ZD_bufsource
+{
+	ZD_texture	*texture;
+	unsigned	serial;
+} ZD_bufsource;
+
+/* Offscreen buffer of a ZD_BUFFERED group or window */
+typedef struct ZD_buffer
+{
+	ZD_texture	*texture;	/* Buffer texture, or NULL */
+	float		cr, cg, cb, ca;	/* Transformed color when drawn */
+	ZD_bufsource	*sources;	/* Textures in the buffer (retained) */
+	unsigned	nsources;
+} ZD_buffer;
+
 /* Window entity */
 typedef struct ZD_window
 {
 	ZD_layer	l;
 	ZD_f		w, h;
+	ZD_buffer	buffer;
 } ZD_window;
 
+/* Group entity */
+typedef struct ZD_group
+{
+	ZD_entity	e;
+	ZD_buffer	buffer;
+} ZD_group;
+
 /* Textured entity (internal) */
 typedef struct ZD_txentity
 {
@@ -166,30 +393,76 @@ typedef struct ZD_primitive
 	unsigned	nvertices;	/* Vertices in use */
 	unsigned	svertices;	/* Size of vertex array */
 	ZD_vertex	*vertices;	/* Vertex array */
+	unsigned	serial;		/* Bumped when 'vertices' change */
+	ZD_f		ctx, cty;	/* Texcoord for new vertices */
 } ZD_primitive;
 
 /* Parent area fill entity */
 typedef struct ZD_fill
 {
 	ZD_txentity	txe;
-	ZD_layer	*client;
 } ZD_fill;
 
-ZD_entity *zd_alloc_entity(ZD_state *st);
+ZD_entity *zd_alloc_entity(ZD_state *st, ZD_entitykind kind);
 void zd_DestroyEntity(ZD_entity *e);
+ZD_errors zd_AllocTransform(ZD_entity *e);
+void zd_FreeTransform(ZD_entity *e);
+ZD_errors zd_AllocHandle(ZD_entity *e);
+void zd_FreeHandle(ZD_entity *e);
+
+/*
+ * Find the nearest layer or window at or above 'e', if any. This is what a
+ * fill entity under 'e' covers.
+ */
+static inline ZD_layer *zd_ClientOf(ZD_entity *e)
+{
+	for( ; e; e = e->parent)
+		if((e->kind == ZD_ELAYER) || (e->kind == ZD_EWINDOW))
+			return (ZD_layer *)e;
+	return NULL;
+}
+
+/* Get the buffer of group or window 'e', or NULL for other kinds */
+static inline ZD_buffer *zd_BufferOf(ZD_entity *e)
+{
+	switch(e->kind)
+	{
+	  case ZD_EGROUP:
+		return &((ZD_group *)e)->buffer;
+	  case ZD_EWINDOW:
+		return &((ZD_window *)e)->buffer;
+	  default:
+		return NULL;
+	}
+}
 
 static inline ZD_entity *zd_NewEntity(ZD_entity *parent, ZD_entitykind kind)
 {
 	ZD_state *st = parent->state;
-	ZD_entity *e = st->pool;
+	ZD_slab *sl = &st->slabs[kind];
+	ZD_entity *e = sl->pool;
 	if(e)
-		st->pool = e->next;
-	else if(!(e = zd_alloc_entity(st)))
+		sl->pool = e->next;
+	else if(!(e = zd_alloc_entity(st, kind)))
 		return NULL;
 	e->kind = kind;
+	e->flags = st->phase;
 	e->parent = parent;
+	e->first = e->last = NULL;
+	if((st->lasterror = zd_AllocTransform(e)))
+	{
+		e->next = sl->pool;
+		sl->pool = e;
+		return NULL;
+	}
+	if((st->lasterror = zd_AllocHandle(e)))
+	{
+		zd_FreeTransform(e);
+		e->next = sl->pool;
+		sl->pool = e;
+		return NULL;
+	}
 	e->Rethink = NULL;
-	e->RenderPost = NULL;
 	e->Destroy = NULL;
 	/*
 	 * NOTE:
@@ -199,25 +472,83 @@ static inline ZD_entity *zd_NewEntity(ZD_entity *parent, ZD_entitykind kind)
 	return e;
 }
 
+/*
+ * Flag the bounding boxes of 'e' and its ancestors for recalculation after
+ * changes to the contents or children of 'e'. If an entity is flagged, so are
+ * all of its ancestors, so we can stop there.
+ */
+static inline void zd_InvalidateContent(ZD_entity *e)
+{
+	while(e && !(e->flags & ZD_NEWCONTENT))
+	{
+		e->flags |= ZD_NEWCONTENT | ZD_NEWBOUNDS;
+		e = e->parent;
+	}
+}
+
+/* Like zd_InvalidateContent(), for changes to the transform of 'e' only */
+static inline void zd_InvalidateBounds(ZD_entity *e)
+{
+	e->flags |= ZD_NEWBOUNDS;
+	zd_InvalidateContent(e->parent);
+}
+
+/*
+ * Flag the buffers of 'e' and its buffered ancestors for redrawing, after
+ * changes to 'e' that do not affect bounding boxes, such as colors. Changes
+ * that do are caught by zd_calc_bounds().
+ */
+static inline void zd_InvalidateBuffers(ZD_entity *e)
+{
+	if(!e->state->nbuffered)
+		return;
+	for( ; e; e = e->parent)
+		if(e->flags & ZD_BUFFERED)
+			e->flags |= ZD_REBUFFER;
+}
+
 static inline void zd_LinkEntity(ZD_entity *e)
 {
 	ZD_entity *p = e->parent;
+	e->prev = p->last;
+	e->next = NULL;
 	if(p->last)
-	{
-		e->next = p->last;
 		p->last->next = e;
-		p->last = e;
-	}
 	else
-		p->first = p->last = e;
-	e->next = NULL;
+		p->first = e;
+	p->last = e;
+	zd_InvalidateContent(e);
+}
+
+/* Remove 'e' from the child list of its parent */
+static inline void zd_UnlinkEntity(ZD_entity *e)
+{
+	ZD_entity *p = e->parent;
+	if(e->prev)
+		e->prev->next = e->next;
+	else
+		p->first = e->next;
+	if(e->next)
+		e->next->prev = e->prev;
+	else
+		p->last = e->prev;
+	e->prev = e->next = NULL;
 }
 
 static inline void zd_FreeEntity(ZD_entity *e)
 {
 	ZD_state *st = e->state;
-	e->next = st->pool;
-	st->pool = e;
+	ZD_slab *sl = &st->slabs[e->kind];
+	zd_FreeTransform(e);
+	zd_FreeHandle(e);
+	if((e->flags & ZD_PHASE) != st->phase)
+	{
+		/* In an arena that zd_Compact() is emptying; don't reuse! */
+		--st->nold;
+		return;
+	}
+	e->next = sl->pool;
+	sl->pool = e;
 }
 
 static inline void zd_EntityIncRef(ZD_entity *e)
@@ -297,17 +628,21 @@ static inline void zd_InvTransformPoint(ZD_f *m, ZD_f xoffs, ZD_f yoffs,
 static inline void zd_TransformPointE(ZD_entity *e, ZD_f x, ZD_f y,
 		ZD_f *tx, ZD_f *ty)
 {
-	zd_TransformPoint(e->trmx, e->tx, e->ty, x, y, tx, ty);
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = e->xf;
+	zd_TransformPoint(xf->trmx + i * 4, xf->tx[i], xf->ty[i], x, y, tx, ty);
 }
 
 /* Transform (x, y) into (tx, ty) using the inverse transform of 'e' */
 static inline void zd_InvTransformPointE(ZD_entity *e, ZD_f x, ZD_f y,
 		ZD_f *tx, ZD_f *ty)
 {
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = e->xf;
 	ZD_f m[4];
-	ZD_f si = e->ts ? 1.0f / e->ts : 1000.0f;
-	zd_CalculateMatrix(-e->tr, si, m);
-	zd_InvTransformPoint(m, e->tx, e->ty, x, y, tx, ty);
+	ZD_f si = xf->ts[i] ? 1.0f / xf->ts[i] : 1000.0f;
+	zd_CalculateMatrix(-xf->tr[i], si, m);
+	zd_InvTransformPoint(m, xf->tx[i], xf->ty[i], x, y, tx, ty);
 }
 
 
@@ -330,17 +665,59 @@ typedef struct ZD_phystexture
 	void (*Unload)(ZD_state *st, ZD_entity *e);
 } ZD_phystexture;
 
+/*
+ * Virtual textures are drawn in tiles of ZD_VTILESIZE x ZD_VTILESIZE pixels,
+ * that are rendered via the texture callback when first needed, and kept in
+ * a cache of up to 'maxtiles' physical textures. Each tile has a border of
+ * ZD_VTILEBORDER pixels from the neighbouring tiles, for filtering; at the
+ * edges of the texture, from the opposite edge if wrapping. Tiles are
+ * reused least recently used first, but never in the frame they were used.
+ */
+#define	ZD_VTILESIZE	256
+#define	ZD_VTILEBORDER	1
+#define	ZD_VTILESTEP	(ZD_VTILESIZE - 2 * ZD_VTILEBORDER)
+#define	ZD_VCACHESIZE	128	/* Default max tiles per virtual texture */
+#define	ZD_VMAXPIECES	4096	/* Max tile pieces drawn per quad */
+
+typedef struct ZD_vtile
+{
+	ZD_texture	*texture;	/* Physical texture */
+	int		x, y;		/* Position in tile map, or -1 */
+	unsigned	used;		/* Frame last used in */
+} ZD_vtile;
+
 typedef struct ZD_virtualtexture
 {
 	int		w, h;	/* Size of tile map */
+	ZD_vtile	*tiles;	/* Tile cache */
+	unsigned	ntiles;	/* Tiles allocated */
+	unsigned	maxtiles;	/* Size of tile cache */
 } ZD_virtualtexture;
 
 typedef struct ZD_subtexture
 {
 	ZD_texture	*phys;	/* Physical texture */
 	int		x, y;	/* Offset inside physical texture */
+	struct ZD_atlaspage *page;	/* Atlas page of 'phys' */
 } ZD_subtexture;
 
+/*
+ * Atlas page; a physical texture that small textures are packed into, as
+ * subtextures. Each subtexture gets a border of one pixel, that repeats its
+ * edge pixels, so that filtering does not pick up the neighbours. Packing is
+ * bottom-left over a skyline; space is only reclaimed when all subtextures
+ * of the page are gone, at which point the page is destroyed.
+ */
+typedef struct ZD_atlaspage
+{
+	struct ZD_atlaspage *next;
+	ZD_texture	*texture;	/* Physical texture */
+	unsigned	nsub;		/* Subtextures on the page */
+	unsigned	*skyline;	/* Top of used area, per column */
+} ZD_atlaspage;
+
+#define	ZD_ATLASBORDER	1
+
 struct ZD_texture
 {
 	ZD_state	*state;
@@ -355,6 +732,8 @@ struct ZD_texture
 	unsigned	w, h;
 	ZD_pixelformats	format;
 	int		flags;		/* ZD_texflags */
+	unsigned	serial;		/* Bumped when the pixels change */
+	unsigned	mark;		/* For listing buffer sources */
 
 //TODO: Filtering, wrapping, mipmapping etc
 
@@ -391,6 +770,7 @@ struct ZD_backend
 
 	/* Top level scene rendering */
 	ZD_errors (*PreRender)(ZD_state *st);
+	ZD_errors (*Submit)(ZD_state *st, ZD_drawlist *dl);
 	ZD_errors (*PostRender)(ZD_state *st);
 
 	/* Entity initializers */
@@ -405,6 +785,10 @@ struct ZD_backend
 	ZD_errors (*InitTexture)(ZD_texture *tx);
 	ZD_errors (*UploadTexture)(ZD_pixels *px);
 	ZD_errors (*CloseTexture)(ZD_texture *tx);
+
+	/* Statistics */
+	ZD_errors (*CacheCounts)(ZD_state *st, unsigned *hits,
+			unsigned *misses);
 };
 
 
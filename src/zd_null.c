@@ -0,0 +1,163 @@
+/*
+ * ZeeDraw - Null backend
+ *
+ * Copyright 2013 David Olofson
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "zd_null.h"
+#include <stdlib.h>
+
+/*
+ * This backend does no drawing at all. The scene graph is traversed and
+ * transformed as usual, and the draw list is recorded, but Submit() only
+ * counts the ops in it, per entity kind. This is for measuring the overhead
+ * of the scene graph itself, and for running ZeeDraw without any display.
+ *
+ * The counters are kept in the ZD_rendercounts struct passed as context to
+ * zd_Open(), if any. They are only ever incremented, so the application can
+ * read and reset them at any time between frames.
+ */
+
+typedef struct ZDNULL_state {
+	ZD_rendercounts	*counts;
+	ZD_rendercounts	owncounts;	/* Used if there is no context */
+} ZDNULL_state;
+
+
+static ZD_errors zdnull_Open(ZD_state *st)
+{
+	ZDNULL_state *ns;
+	if(!(ns = (ZDNULL_state *)calloc(1, sizeof(ZDNULL_state))))
+		return ZD_OOMEMORY;
+	if(st->context)
+		ns->counts = (ZD_rendercounts *)st->context;
+	else
+		ns->counts = &ns->owncounts;
+	st->bdata = ns;
+
+	/* Buffers are recorded as usual, but there are no pixels to keep */
+	st->maxbuffer = 1;
+	st->displayw = st->displayh = 1;
+	return ZD_OK;
+}
+
+static void zdnull_Close(ZD_state *st)
+{
+	free(st->bdata);
+}
+
+static ZD_errors zdnull_PreRender(ZD_state *st)
+{
+	ZDNULL_state *ns = (ZDNULL_state *)st->bdata;
+	++ns->counts->frames;
+	return ZD_OK;
+}
+
+
+/*
+ * Entities
+ */
+
+static ZD_errors zdnull_InitPrimitive(ZD_entity *e)
+{
+	ZD_primitive *pe = (ZD_primitive *)e;
+	switch(pe->pkind)
+	{
+	  case ZD_POINTS:
+	  case ZD_LINES:
+	  case ZD_LINESTRIP:
+	  case ZD_LINELOOP:
+	  case ZD_TRIANGLES:
+	  case ZD_TRIANGLESTRIP:
+	  case ZD_TRIANGLEFAN:
+	  case ZD_QUADS:
+		break;
+	  default:
+		return ZD_BADPRIMITIVE;
+	}
+	return ZD_OK;
+}
+
+
+/*
+ * Draw list
+ */
+
+static ZD_errors zdnull_Submit(ZD_state *st, ZD_drawlist *dl)
+{
+	ZD_rendercounts *c = ((ZDNULL_state *)st->bdata)->counts;
+	unsigned i;
+	c->groups += dl->groups;
+	for(i = 0; i < dl->nops; ++i)
+	{
+		ZD_drawop *op = dl->ops + i;
+		switch(op->kind)
+		{
+		  case ZD_DLAYER:
+			++c->layers;
+			break;
+		  case ZD_DWINDOW:
+			++c->windows;
+			break;
+		  case ZD_DQUAD:
+			if(op->entity->kind == ZD_EFILL)
+				++c->fills;
+			else if(op->entity->kind == ZD_ESPRITE)
+				++c->sprites;
+			break;
+		  case ZD_DPRIMITIVE:
+			++c->primitives;
+			c->vertices += op->count;
+			break;
+		  case ZD_DMESH:
+			++c->primitives;
+			c->vertices += ((ZD_primitive *)op->entity)->nvertices;
+			break;
+		  case ZD_DBUFFER:
+			++c->buffers;
+			break;
+		  default:
+			break;
+		}
+	}
+	return ZD_OK;
+}
+
+
+ZD_backend zd_null_backend = {
+	zdnull_Open,
+	zdnull_Close,
+
+	zdnull_PreRender,
+	zdnull_Submit,
+	NULL,
+
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	zdnull_InitPrimitive,
+	NULL,
+
+	NULL,
+	NULL,
+	NULL,
+
+	NULL
+};
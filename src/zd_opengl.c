@@ -24,45 +24,238 @@
 #include "zd_gli.h"
 #include "SDL.h"
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 
+/* OpenGL entry points and types matching ZD_f */
+#ifdef	ZD_SINGLE_PRECISION
+#	define	zdogl_Vertex3(gli, x, y, z)	(gli)->Vertex3f(x, y, z)
+#	define	zdogl_MultMatrix(gli, m)	(gli)->MultMatrixf(m)
+#else
+#	define	zdogl_Vertex3(gli, x, y, z)	(gli)->Vertex3d(x, y, z)
+#	define	zdogl_MultMatrix(gli, m)	(gli)->MultMatrixd(m)
+#endif
+
+
+/* Maximum number of vertices to accumulate before drawing them */
+#define	ZDOGL_MAXBATCH	16384
+
 /*
- * Define this to use OpenGL matrix transforms instead of custom code. Disabled
- * by default, as it tends to be significantly slower when dealing with the
- * small numbers of vertices per object we have here. This MIGHT be different
- * on platforms with slow CPUs and fast 3D accelerators, such as tablets and
- * cell phones, so it's left in as an easy-to-try potential optimization.
+ * Primitives with at least this many vertices are kept in buffer objects,
+ * and only uploaded when changed. Smaller ones are batched.
  */
-#undef	ZDOGL_USE_OGL_MATRIX
+#define	ZDOGL_MINMESH	64
 
+/*
+ * Stencil values for clip windows that are not axis aligned. Each top level
+ * window gets a block of ZDOGL_STENCILNEST values, unique until the stencil
+ * buffer is next cleared, at least once per frame, and nested windows
+ * increment the value of their parent within that block.
+ */
+#define	ZDOGL_STENCILMAX	255	/* Largest stencil value (8 bits) */
+#define	ZDOGL_STENCILNEST	4	/* Stencil nesting levels */
 
-#ifdef	ZDOGL_USE_OGL_MATRIX
-/* Multiply the transform for entity 'e' into the current OpenGL matrix */
-static inline void zdogl_apply_matrix(ZD_entity *e)
-{
-	ZD_glinterface *gli = (ZD_glinterface *)e->state->bdata;
-	GLdouble m[16];
-	m[0] = e->trmx[0]; m[4] = e->trmx[1]; m[8] = 0.0f;  m[12] = e->tx;
-	m[1] = e->trmx[2]; m[5] = e->trmx[3]; m[9] = 0.0f;  m[13] = e->ty;
-	m[2] = 0.0f;       m[6] = 0.0f;       m[10] = 1.0f; m[14] = 0.0f;
-	m[3] = 0.0f;       m[7] = 0.0f;       m[11] = 0.0f; m[15] = 1.0f;
-	gli->MultMatrixd(m);
-}
-#endif
+/*
+ * Max width and height of buffers (ZD_BUFFERED), which are rendered via
+ * framebuffer objects. These have no stencil buffer, so windows inside
+ * buffers clip to their bounding rectangles only.
+ */
+#define	ZDOGL_MAXBUFFER		4096
+
+/*
+ * Textures up to ZDOGL_ATLASMAX pixels wide and high are packed into atlas
+ * pages of ZDOGL_ATLASSIZE x ZDOGL_ATLASSIZE pixels, so that sprites using
+ * different textures can still be drawn in the same batch.
+ */
+#define	ZDOGL_ATLASSIZE		1024
+#define	ZDOGL_ATLASMAX		128
 
 
 typedef struct ZDOGL_texture {
 	ZD_texture	tx;
 	GLuint		name;
+	GLuint		fbo;		/* Framebuffer object of buffer, or 0 */
 	ZD_f		x1, y1, x2, y2;
 } ZDOGL_texture;
 
+/* Interleaved vertex, as passed to glDrawArrays() */
+typedef struct ZDOGL_vertex {
+	GLfloat		x, y, z;
+	GLfloat		u, v;
+	GLfloat		r, g, b, a;
+} ZDOGL_vertex;
+
+/* Primitive vertex, as stored in buffer objects */
+typedef struct ZDOGL_meshvertex {
+	GLfloat		x, y, z;
+	GLfloat		u, v;
+} ZDOGL_meshvertex;
+
+typedef struct ZDOGL_primitive {
+	ZD_primitive	pe;
+	GLuint		vbo;		/* Buffer object, or 0 */
+	unsigned	serial;		/* 'pe.serial' when last uploaded */
+	unsigned	nvbo;		/* Number of vertices in 'vbo' */
+} ZDOGL_primitive;
 
 typedef struct ZDOGL_window {
 	ZD_window	w;
-	ZD_layer	*layer;	/* Layer we're on, if any, for clipping setup */
+	int		active;		/* Stencil clipping in effect */
+	int		ref;		/* Stencil value of the window area */
+	int		parentref;	/* Stencil value outside, or 0 */
+	unsigned	first;		/* First vertex of the window op */
 } ZDOGL_window;
 
+/* Buffer being rendered, and the state to restore after it */
+typedef struct ZDOGL_target {
+	ZDOGL_texture	*texture;
+	int		scissor;	/* GL_SCISSOR_TEST; 1, 0 or -1 */
+	GLint		box[4];		/* Scissor box */
+} ZDOGL_target;
+
+typedef struct ZDOGL_state {
+	ZD_glinterface	*gli;
+
+	/* Vertices not yet drawn; all with the same texture and mode */
+	ZDOGL_vertex	*batch;
+	int		nbatch;
+	int		batchsize;
+	ZDOGL_texture	*btexture;
+	GLenum		bmode;
+
+	/* Stencil allocation; see zdogl_stencil_begin() */
+	int		stencilref;	/* Current clip value, or 0 */
+	int		stencilbase;	/* Block of the current top level window */
+	int		stencilnext;	/* Next free block */
+
+	/* Stack of buffers being rendered */
+	ZDOGL_target	*targets;
+	int		ntargets;
+	int		targetssize;
+} ZDOGL_state;
+
+
+static inline ZD_glinterface *zdogl_gli(ZD_state *st)
+{
+	return ((ZDOGL_state *)st->bdata)->gli;
+}
+
+/* OpenGL texture name of 'xtx', or 0 for no texture */
+static inline GLuint zdogl_texname(ZDOGL_texture *xtx)
+{
+	return xtx ? xtx->name : 0;
+}
+
+/*
+ * Set the blend function for drawing texture 'xtx'. Alpha is always blended
+ * as GL_ONE, GL_ONE_MINUS_SRC_ALPHA, so that buffers, which are cleared to 0,
+ * end up with premultiplied alpha, and buffers are drawn accordingly.
+ */
+static inline void zdogl_set_blend(ZD_glinterface *gli, ZDOGL_texture *xtx)
+{
+	if(!gli->_BlendFuncSeparate)
+		gli_BlendFunc(gli, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	else if(xtx && (xtx->tx.flags & ZD_PREMULTIPLIED))
+		gli_BlendFunc(gli, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	else
+		gli_BlendFuncSeparate(gli, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA,
+				GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+static inline void zdogl_set_texture(ZD_glinterface *gli, ZDOGL_texture *xtx)
+{
+	if(xtx)
+	{
+		gli_Enable(gli, GL_TEXTURE_2D);
+		gli_BindTexture(gli, GL_TEXTURE_2D, xtx->name);
+	}
+	else
+		gli_Disable(gli, GL_TEXTURE_2D);
+	zdogl_set_blend(gli, xtx);
+}
+
+/* Draw the untextured quad 'v', in the current color */
+static void zdogl_quad(ZD_glinterface *gli, ZD_drawvertex *v)
+{
+	gli->Begin(GL_QUADS);
+	zdogl_Vertex3(gli, v[0].x, v[0].y, v[0].z);
+	zdogl_Vertex3(gli, v[1].x, v[1].y, v[1].z);
+	zdogl_Vertex3(gli, v[2].x, v[2].y, v[2].z);
+	zdogl_Vertex3(gli, v[3].x, v[3].y, v[3].z);
+	gli->End();
+}
+
+
+/*
+ * Batching
+ */
+
+/* Draw and empty the current batch, if any */
+static void zdogl_flush(ZDOGL_state *gs)
+{
+	ZD_glinterface *gli = gs->gli;
+	ZDOGL_vertex *v = gs->batch;
+	if(!gs->nbatch)
+		return;
+	zdogl_set_texture(gli, gs->btexture);
+	gli->VertexPointer(3, GL_FLOAT, sizeof(ZDOGL_vertex), &v->x);
+	gli->TexCoordPointer(2, GL_FLOAT, sizeof(ZDOGL_vertex), &v->u);
+	gli->ColorPointer(4, GL_FLOAT, sizeof(ZDOGL_vertex), &v->r);
+	gli_EnableClientState(gli, GL_COLOR_ARRAY);	/* Meshes disable it */
+	gli_DrawArrays(gli, gs->bmode, 0, gs->nbatch);
+	gs->nbatch = 0;
+}
+
+/*
+ * Add the vertices of 'op' to the batch, to be drawn as 'mode', flushing
+ * first if the batch has a different texture or mode, or is full.
+ */
+static ZD_errors zdogl_batch(ZDOGL_state *gs, ZD_drawlist *dl, ZD_drawop *op,
+		GLenum mode)
+{
+	ZDOGL_texture *xtx = (ZDOGL_texture *)op->texture;
+	ZD_drawvertex *dv = zd_OpVertices(dl, op);
+	ZDOGL_vertex *v;
+	int i, n = op->count;
+	if((zdogl_texname(xtx) != zdogl_texname(gs->btexture)) ||
+			(mode != gs->bmode) ||
+			(gs->nbatch + n > ZDOGL_MAXBATCH))
+		zdogl_flush(gs);
+	if(gs->nbatch + n > gs->batchsize)
+	{
+		int ns = n > ZDOGL_MAXBATCH ? n : ZDOGL_MAXBATCH;
+		ZDOGL_vertex *nb = (ZDOGL_vertex *)realloc(gs->batch,
+				ns * sizeof(ZDOGL_vertex));
+		if(!nb)
+			return ZD_OOMEMORY;
+		gs->batch = nb;
+		gs->batchsize = ns;
+	}
+	gs->btexture = xtx;
+	gs->bmode = mode;
+	v = gs->batch + gs->nbatch;
+	for(i = 0; i < n; ++i)
+	{
+		v[i].x = dv[i].x;
+		v[i].y = dv[i].y;
+		v[i].z = dv[i].z;
+		if(xtx)
+		{
+			/* Map to the area of the texture actually used */
+			v[i].u = xtx->x1 + dv[i].u * (xtx->x2 - xtx->x1);
+			v[i].v = xtx->y1 + dv[i].v * (xtx->y2 - xtx->y1);
+		}
+		else
+			v[i].u = v[i].v = 0.0f;
+		v[i].r = op->r;
+		v[i].g = op->g;
+		v[i].b = op->b;
+		v[i].a = op->a;
+	}
+	gs->nbatch += n;
+	return ZD_OK;
+}
+
 
 static void zdogl_get_display_size(ZD_state *st, int *w, int *h)
 {
@@ -74,24 +267,48 @@ static void zdogl_get_display_size(ZD_state *st, int *w, int *h)
 
 static ZD_errors zdogl_Open(ZD_state *st)
 {
+	ZDOGL_state *gs;
 	ZD_glinterface *gli;
-	zd_BumpEntitySize(st, sizeof(ZDOGL_window));
+	int w, h;
 	zd_BumpTextureSize(st, sizeof(ZDOGL_texture));
-	st->bdata = gli = gli_Open(NULL);
+	zd_BumpEntitySize(st, ZD_EWINDOW, sizeof(ZDOGL_window));
+	zd_BumpEntitySize(st, ZD_EPRIMITIVE, sizeof(ZDOGL_primitive));
+	if(!(gs = (ZDOGL_state *)calloc(1, sizeof(ZDOGL_state))))
+		return ZD_OOMEMORY;
+	st->bdata = gs;
+	gs->gli = gli = gli_Open(NULL);
 	if(!gli)
+	{
+		free(gs);
 		return ZD_DRIVEROPEN;
+	}
 	gli->ShadeModel(GL_SMOOTH);
 	gli_Disable(gli, GL_DEPTH_TEST);
 	gli_Disable(gli, GL_CULL_FACE);
 	gli->Hint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
 	gli->ClearStencil(0);
+	if(gli->_GenBuffers && gli->_DeleteBuffers && gli->_BindBuffer &&
+			gli->_BufferData)
+		st->minmesh = ZDOGL_MINMESH;
+	if(gli->_GenFramebuffers && gli->_DeleteFramebuffers &&
+			gli->_BindFramebuffer && gli->_FramebufferTexture2D &&
+			gli->_CheckFramebufferStatus && gli->_BlendFuncSeparate)
+		st->maxbuffer = ZDOGL_MAXBUFFER;
+	st->atlassize = ZDOGL_ATLASSIZE;
+	st->atlasmax = ZDOGL_ATLASMAX;
+	zdogl_get_display_size(st, &w, &h);
+	st->displayw = w;
+	st->displayh = h;
 	return ZD_OK;
 }
 
 static void zdogl_Close(ZD_state *st)
 {
-	ZD_glinterface *gli = (ZD_glinterface *)st->bdata;
-	gli_Close(gli);
+	ZDOGL_state *gs = (ZDOGL_state *)st->bdata;
+	gli_Close(gs->gli);
+	free(gs->batch);
+	free(gs->targets);
+	free(gs);
 }
 
 
@@ -101,25 +318,39 @@ static void zdogl_Close(ZD_state *st)
 
 static ZD_errors zdogl_PreRender(ZD_state *st)
 {
-	ZD_glinterface *gli = (ZD_glinterface *)st->bdata;
-	gli->MatrixMode(GL_PROJECTION);
+	ZDOGL_state *gs = (ZDOGL_state *)st->bdata;
+	ZD_glinterface *gli = gs->gli;
+	int w, h;
+	zdogl_get_display_size(st, &w, &h);
+	st->displayw = w;
+	st->displayh = h;
+	gli_MatrixMode(gli, GL_PROJECTION);
 	gli->PushMatrix();
 	gli->LoadIdentity();
-	gli->MatrixMode(GL_MODELVIEW);
+	gli_MatrixMode(gli, GL_MODELVIEW);
 	gli->PushMatrix();
 	gli->LoadIdentity();
 	gli_Enable(gli, GL_TEXTURE_2D);
 	gli_Enable(gli, GL_BLEND);
-	gli_BlendFunc(gli, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	zdogl_set_blend(gli, NULL);
+	gs->stencilref = 0;
+	gs->stencilnext = ZDOGL_STENCILMAX + 1;	/* Clear before first use */
+	gs->ntargets = 0;
+	gli_EnableClientState(gli, GL_VERTEX_ARRAY);
+	gli_EnableClientState(gli, GL_TEXTURE_COORD_ARRAY);
+	gli_EnableClientState(gli, GL_COLOR_ARRAY);
 	return ZD_OK;
 }
 
 static ZD_errors zdogl_PostRender(ZD_state *st)
 {
-	ZD_glinterface *gli = (ZD_glinterface *)st->bdata;
-	gli->MatrixMode(GL_PROJECTION);
+	ZD_glinterface *gli = zdogl_gli(st);
+	gli_DisableClientState(gli, GL_VERTEX_ARRAY);
+	gli_DisableClientState(gli, GL_TEXTURE_COORD_ARRAY);
+	gli_DisableClientState(gli, GL_COLOR_ARRAY);
+	gli_MatrixMode(gli, GL_PROJECTION);
 	gli->PopMatrix();
-	gli->MatrixMode(GL_MODELVIEW);
+	gli_MatrixMode(gli, GL_MODELVIEW);
 	gli->PopMatrix();
 	return ZD_OK;
 }
@@ -129,48 +360,26 @@ static ZD_errors zdogl_PostRender(ZD_state *st)
  * Layer
  */
 
-static ZD_errors zdogl_render_layer(ZD_entity *e)
+static void zdogl_draw_layer(ZD_glinterface *gli, ZD_drawlist *dl,
+		ZD_drawop *op)
 {
-	ZD_glinterface *gli = (ZD_glinterface *)e->state->bdata;
-	ZD_layer *le = (ZD_layer *)e;
+	ZD_drawvertex *v = zd_OpVertices(dl, op);
 	gli->PushMatrix();
-	gli->Ortho(le->left, le->right, le->bottom, le->top, 0.0f, 10.0f);
-	if(e->flags & ZD_CLEAR)
+	gli->Ortho(v[0].x, v[2].x, v[0].y, v[2].y, 0.0f, 10.0f);
+	if(op->flags & ZD_DCLEAR)
 	{
-		if(le->bga * e->tca >= 1.0f)
+		if(op->a >= 1.0f)
 		{
-			gli->ClearColor(le->bgr * e->tcr, le->bgg * e->tcg,
-					le->bgb * e->tcb, 1.0f);
+			gli->ClearColor(op->r, op->g, op->b, 1.0f);
 			gli->Clear(GL_COLOR_BUFFER_BIT);
 		}
 		else
 		{
-			gli_Disable(gli, GL_TEXTURE_2D);
-			gli->Color4f(le->bgr * e->tcr, le->bgg * e->tcg,
-					le->bgb * e->tcb, le->bga * e->tca);
-			gli->Begin(GL_QUADS);
-			gli->Vertex2d(le->left, le->bottom);
-			gli->Vertex2d(le->right, le->bottom);
-			gli->Vertex2d(le->right, le->top);
-			gli->Vertex2d(le->left, le->top);
-			gli->End();
+			zdogl_set_texture(gli, NULL);
+			gli_Color4f(gli, op->r, op->g, op->b, op->a);
+			zdogl_quad(gli, v);
 		}
 	}
-	return ZD_OK;
-}
-
-static ZD_errors zdogl_render_post_layer(ZD_entity *e)
-{
-	ZD_glinterface *gli = (ZD_glinterface *)e->state->bdata;
-	gli->PopMatrix();
-	return ZD_OK;
-}
-
-static ZD_errors zdogl_InitLayer(ZD_entity *e)
-{
-	e->Render = zdogl_render_layer;
-	e->RenderPost = zdogl_render_post_layer;
-	return ZD_OK;
 }
 
 
@@ -178,47 +387,101 @@ static ZD_errors zdogl_InitLayer(ZD_entity *e)
  * Window
  */
 
-static ZD_errors zdogl_render_window(ZD_entity *e)
+/*
+ * Set up stencil clipping for 'xw'. Returns 1 if the stencil needs to be
+ * painted by drawing the window quad, or -1 if the window is nested too deep
+ * to get a stencil value of its own.
+ *
+ * Top level windows get unique values, so their areas need no clearing in
+ * between. The contents of the stencil buffer are undefined after swapping
+ * buffers, so it's cleared before the first stencil window of every frame,
+ * and then only when out of values.
+ */
+static int zdogl_stencil_begin(ZDOGL_state *gs, ZDOGL_window *xw)
 {
-	ZDOGL_window *we = (ZDOGL_window *)e;
-	ZD_glinterface *gli = (ZD_glinterface *)e->state->bdata;
-	ZD_layer *le = (ZD_layer *)e;
-	ZD_f wx[4], wy[4];
-	int use_stencil = 0;
+	ZD_glinterface *gli = gs->gli;
+	xw->parentref = gs->stencilref;
+	if(gs->stencilref)
+	{
+		/* Nested: Increment the parent value, within the parent area */
+		if(gs->stencilref - gs->stencilbase >= ZDOGL_STENCILNEST - 1)
+			return -1;
+		xw->active = 1;
+		xw->ref = gs->stencilref = gs->stencilref + 1;
+		gli_StencilFunc(gli, GL_EQUAL, xw->parentref,
+				ZDOGL_STENCILMAX);
+		gli_StencilOp(gli, GL_KEEP, GL_KEEP, GL_INCR);
+		return 1;
+	}
 
-	/* Transform the window position to viewport coordinates */
-	zd_TransformPointE(e->parent, le->left, le->bottom, &wx[0], &wy[0]);
-	zd_TransformPointE(e->parent, le->right, le->bottom, &wx[1], &wy[1]);
-	zd_TransformPointE(e->parent, le->right, le->top, &wx[2], &wy[2]);
-	zd_TransformPointE(e->parent, le->left, le->top, &wx[3], &wy[3]);
+	xw->active = 1;
+	gli_Enable(gli, GL_STENCIL_TEST);
+
+	/* Out of values? Then clear the stencil buffer and start over. */
+	if(gs->stencilnext + ZDOGL_STENCILNEST - 1 > ZDOGL_STENCILMAX)
+	{
+		gli_Disable(gli, GL_SCISSOR_TEST);
+		gli->Clear(GL_STENCIL_BUFFER_BIT);
+		gs->stencilnext = 1;
+	}
+	xw->ref = gs->stencilnext;
+	gs->stencilnext += ZDOGL_STENCILNEST;
+
+	gs->stencilref = gs->stencilbase = xw->ref;
+	gli_StencilFunc(gli, GL_ALWAYS, xw->ref, ZDOGL_STENCILMAX);
+	gli_StencilOp(gli, GL_REPLACE, GL_REPLACE, GL_REPLACE);
+	return 1;
+}
+
+static void zdogl_draw_window(ZD_state *st, ZD_drawlist *dl, ZD_drawop *op)
+{
+	ZDOGL_state *gs = (ZDOGL_state *)st->bdata;
+	ZD_glinterface *gli = gs->gli;
+	ZDOGL_window *xw = (ZDOGL_window *)op->entity;
+	ZD_drawvertex *v = zd_OpVertices(dl, op);
+	int paint = 0;
+	int inbuffer = 0;
+
+	xw->active = 0;
+	xw->first = op->first;
 
 	/* Set up scissor and/or stencil */
-	if(e->flags & ZD_CLIP)
+	if(op->flags & ZD_DCLIP)
 	{
 		int w, h, i;
+		GLint box[4];
 		ZD_f sx, sy, ox, oy, xmin, xmax, ymin, ymax;
-		xmin = xmax = wx[0];
-		ymin = ymax = wy[0];
+		xmin = xmax = v[0].x;
+		ymin = ymax = v[0].y;
 		for(i = 1; i < 4; ++i)
 		{
-			if(wx[i] < xmin)
-				xmin = wx[i];
-			if(wy[i] < ymin)
-				ymin = wy[i];
-			if(wx[i] > xmax)
-				xmax = wx[i];
-			if(wy[i] > ymax)
-				ymax = wy[i];
+			if(v[i].x < xmin)
+				xmin = v[i].x;
+			if(v[i].y < ymin)
+				ymin = v[i].y;
+			if(v[i].x > xmax)
+				xmax = v[i].x;
+			if(v[i].y > ymax)
+				ymax = v[i].y;
 		}
 
 		/* OpenGL viewport to window coordinate transform */
-		zdogl_get_display_size(e->state, &w, &h);
-		if(we->layer)
+		zdogl_get_display_size(st, &w, &h);
+		if(op->layer >= 0)
 		{
-			ox = -we->layer->left;
-			oy = -we->layer->bottom;
-			sx = w / (we->layer->right - we->layer->left);
-			sy = h / (we->layer->top - we->layer->bottom);
+			ZD_drawop *lop = dl->ops + op->layer;
+			ZD_drawvertex *lv = zd_OpVertices(dl, lop);
+			if(lop->kind == ZD_DBUFFER)
+			{
+				/* Upside down; see zdogl_begin_buffer() */
+				inbuffer = 1;
+				w = lop->texture->w;
+				h = lop->texture->h;
+			}
+			ox = -lv[0].x;
+			oy = -lv[0].y;
+			sx = w / (lv[2].x - lv[0].x);
+			sy = h / (lv[2].y - lv[0].y);
 		}
 		else
 		{
@@ -228,235 +491,226 @@ static ZD_errors zdogl_render_window(ZD_entity *e)
 			sy = h * 0.5f;
 		}
 
-		/* Transform and apply! */
-		gli->Scissor((xmin + ox) * sx, (ymin + oy) * sy,
-				ceil((xmax - xmin) * sx),
-				ceil((ymax - ymin) * sy));
-		gli_Enable(gli, GL_SCISSOR_TEST);
-
-		if(wx[0] != wx[1])
+		/* Transform */
+		box[0] = (xmin + ox) * sx;
+		box[1] = (ymin + oy) * sy;
+		box[2] = ceil((xmax - xmin) * sx);
+		box[3] = ceil((ymax - ymin) * sy);
+		if(inbuffer)
+			box[1] = h - box[1] - box[3];
+
+		if(!inbuffer &&
+				!((v[0].y == v[1].y) && (v[1].x == v[2].x)) &&
+				!((v[0].x == v[1].x) && (v[1].y == v[2].y)))
 		{
-/*
-TODO: Manage stencil bits/values centrally, and only repaint the stencil
-TODO: buffer when windows have been moved!
-*/
-			/* Not axis aligned - prepare the stencil! */
-			gli->Clear(GL_STENCIL_BUFFER_BIT);
-			gli_Enable(gli, GL_STENCIL_TEST);
-			gli->StencilFunc(GL_ALWAYS, 0x1, 0x1);
-			gli->StencilOp(GL_REPLACE, GL_REPLACE, GL_REPLACE);
-			use_stencil = 1;
+			/* Not axis aligned - use the stencil! */
+			paint = zdogl_stencil_begin(gs, xw) > 0;
 		}
+
+		/* ...and apply! */
+		gli_Scissor(gli, box[0], box[1], box[2], box[3]);
+		gli_Enable(gli, GL_SCISSOR_TEST);
 	}
 
-	/* Clear and/or fill background */
-	if((e->flags & ZD_CLEAR) || use_stencil)
+	/* Clear and/or fill background, painting the stencil if needed */
+	if((op->flags & ZD_DCLEAR) || paint)
 	{
-		if(!(e->flags & ZD_CLEAR))
-			gli->ColorMask(0, 0, 0, 0);
-		gli_Disable(gli, GL_TEXTURE_2D);
-		gli->Color4f(le->bgr * e->tcr, le->bgg * e->tcg,
-				le->bgb * e->tcb, le->bga * e->tca);
-		gli->Begin(GL_QUADS);
-		gli->Vertex2d(wx[0], wy[0]);
-		gli->Vertex2d(wx[1], wy[1]);
-		gli->Vertex2d(wx[2], wy[2]);
-		gli->Vertex2d(wx[3], wy[3]);
-		gli->End();
-		if(!(e->flags & ZD_CLEAR))
-			gli->ColorMask(1, 1, 1, 1);
+		if(!(op->flags & ZD_DCLEAR))
+			gli_ColorMask(gli, 0, 0, 0, 0);
+		zdogl_set_texture(gli, NULL);
+		gli_Color4f(gli, op->r, op->g, op->b, op->a);
+		zdogl_quad(gli, v);
+		if(!(op->flags & ZD_DCLEAR))
+			gli_ColorMask(gli, 1, 1, 1, 1);
 	}
 
 	/* Set up stencil clipping for subsequent rendering */
-	if(use_stencil)
+	if(xw->active)
 	{
-		gli->StencilFunc(GL_EQUAL, 0x1, 0x1);
-		gli->StencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+		gli_StencilFunc(gli, GL_EQUAL, xw->ref, ZDOGL_STENCILMAX);
+		gli_StencilOp(gli, GL_KEEP, GL_KEEP, GL_KEEP);
 	}
-	return ZD_OK;
 }
 
-static ZD_errors zdogl_render_post_window(ZD_entity *e)
+static void zdogl_draw_end_window(ZDOGL_state *gs, ZD_drawlist *dl,
+		ZD_drawop *op)
 {
-	ZD_glinterface *gli = (ZD_glinterface *)e->state->bdata;
-	if(e->flags & ZD_CLIP)
+	ZD_glinterface *gli = gs->gli;
+	ZDOGL_window *xw = (ZDOGL_window *)op->entity;
+	if(!(op->flags & ZD_DCLIP))
+		return;
+	if(xw->active)
 	{
-		gli_Disable(gli, GL_SCISSOR_TEST);
-		gli_Disable(gli, GL_STENCIL_TEST);
-	}
-	return ZD_OK;
-}
-
-static ZD_errors zdogl_InitWindow(ZD_entity *e)
-{
-	ZDOGL_window *we = (ZDOGL_window *)e;
-	ZD_entity *le;
-	e->Render = zdogl_render_window;
-	e->RenderPost = zdogl_render_post_window;
-	we->layer = NULL;
-	for(le = e->parent; le; le = le->parent)
-		if(le->kind == ZD_ELAYER)
+		if(xw->parentref)
 		{
-			we->layer = (ZD_layer *)le;
-			break;
+			/* Hand the area back to the parent window */
+			gli_StencilFunc(gli, GL_EQUAL, xw->ref,
+					ZDOGL_STENCILMAX);
+			gli_StencilOp(gli, GL_KEEP, GL_KEEP, GL_DECR);
+			gli_ColorMask(gli, 0, 0, 0, 0);
+			zdogl_quad(gli, dl->vertices + xw->first);
+			gli_ColorMask(gli, 1, 1, 1, 1);
+			gli_StencilFunc(gli, GL_EQUAL, xw->parentref,
+					ZDOGL_STENCILMAX);
+			gli_StencilOp(gli, GL_KEEP, GL_KEEP, GL_KEEP);
 		}
-	return ZD_OK;
+		else
+			gli_Disable(gli, GL_STENCIL_TEST);
+		gs->stencilref = xw->parentref;
+		xw->active = 0;
+	}
+	gli_Disable(gli, GL_SCISSOR_TEST);
 }
 
 
 /*
- * Group
+ * Primitive
  */
 
-static ZD_errors zdogl_InitGroup(ZD_entity *e)
+static GLenum zdogl_primitive_mode(ZD_primitives pkind)
 {
-	e->Render = NULL;
-	return ZD_OK;
+	switch(pkind)
+	{
+	  case ZD_POINTS:	return GL_POINTS;
+	  case ZD_LINES:	return GL_LINES;
+	  case ZD_LINESTRIP:	return GL_LINE_STRIP;
+	  case ZD_LINELOOP:	return GL_LINE_LOOP;
+	  case ZD_TRIANGLES:	return GL_TRIANGLES;
+	  case ZD_TRIANGLESTRIP:return GL_TRIANGLE_STRIP;
+	  case ZD_TRIANGLEFAN:	return GL_TRIANGLE_FAN;
+	  case ZD_QUADS:	return GL_QUADS;
+	}
+	return GL_POINTS;
 }
 
-
-/*
- * Sprite
- */
-
-static ZD_errors zdogl_render_sprite(ZD_entity *e)
+static ZD_errors zdogl_draw_primitive(ZDOGL_state *gs, ZD_drawlist *dl,
+		ZD_drawop *op)
 {
-	ZD_glinterface *gli = (ZD_glinterface *)e->state->bdata;
-	ZD_sprite *spr = (ZD_sprite *)e;
-	ZDOGL_texture *xtx = (ZDOGL_texture *)spr->txe.texture;
-	ZD_f sx1 = -spr->cx;
-	ZD_f sy1 = -spr->cy;
-	ZD_f sx2 = 1.0f - spr->cx;
-	ZD_f sy2 = 1.0f - spr->cy;
-#ifdef ZDOGL_USE_OGL_MATRIX
-	gli->PushMatrix();
-	zdogl_apply_matrix(e);
-#else
-	ZD_f x[4], y[4];
-	zd_TransformPointE(e, sx1, sy1, &x[0], &y[0]);
-	zd_TransformPointE(e, sx2, sy1, &x[1], &y[1]);
-	zd_TransformPointE(e, sx2, sy2, &x[2], &y[2]);
-	zd_TransformPointE(e, sx1, sy2, &x[3], &y[3]);
-#endif
-	if(xtx)
-	{
-		gli_Enable(gli, GL_TEXTURE_2D);
-		gli_BindTexture(gli, GL_TEXTURE_2D, xtx->name);
-	}
-	else
-		gli_Disable(gli, GL_TEXTURE_2D);
-	gli->Color4f(e->tcr, e->tcg, e->tcb, e->tca);
-	gli->Begin(GL_QUADS);
-	if(xtx)
-	{
-#ifdef ZDOGL_USE_OGL_MATRIX
-		gli->TexCoord2d(xtx->x1, xtx->y2);
-		gli->Vertex3d(sx1, sy1, e->tz);
-		gli->TexCoord2d(xtx->x2, xtx->y2);
-		gli->Vertex3d(sx2, sy1, e->tz);
-		gli->TexCoord2d(xtx->x2, xtx->y1);
-		gli->Vertex3d(sx2, sy2, e->tz);
-		gli->TexCoord2d(xtx->x1, xtx->y1);
-		gli->Vertex3d(sx1, sy2, e->tz);
-#else
-		gli->TexCoord2d(xtx->x1, xtx->y2);
-		gli->Vertex3d(x[0], y[0], e->tz);
-		gli->TexCoord2d(xtx->x2, xtx->y2);
-		gli->Vertex3d(x[1], y[1], e->tz);
-		gli->TexCoord2d(xtx->x2, xtx->y1);
-		gli->Vertex3d(x[2], y[2], e->tz);
-		gli->TexCoord2d(xtx->x1, xtx->y1);
-		gli->Vertex3d(x[3], y[3], e->tz);
-#endif
-	}
-	else
+	ZD_errors res;
+	GLenum mode = zdogl_primitive_mode(op->pkind);
+	if((res = zdogl_batch(gs, dl, op, mode)))
+		return res;
+	switch(mode)
 	{
-#ifdef ZDOGL_USE_OGL_MATRIX
-		gli->Vertex3d(sx1, sy1, e->tz);
-		gli->Vertex3d(sx2, sy1, e->tz);
-		gli->Vertex3d(sx2, sy2, e->tz);
-		gli->Vertex3d(sx1, sy2, e->tz);
-#else
-		gli->Vertex3d(x[0], y[0], e->tz);
-		gli->Vertex3d(x[1], y[1], e->tz);
-		gli->Vertex3d(x[2], y[2], e->tz);
-		gli->Vertex3d(x[3], y[3], e->tz);
-#endif
+	  case GL_LINE_STRIP:
+	  case GL_LINE_LOOP:
+	  case GL_TRIANGLE_STRIP:
+	  case GL_TRIANGLE_FAN:
+		/* Connected primitives can't share a batch */
+		zdogl_flush(gs);
+		break;
 	}
-	gli->End();
-#ifdef ZDOGL_USE_OGL_MATRIX
-	gli->PopMatrix();
-#endif
 	return ZD_OK;
 }
 
-static ZD_errors zdogl_InitSprite(ZD_entity *e)
+/* Upload the vertices of 'xpe' into its buffer object, creating it if needed */
+static ZD_errors zdogl_upload_mesh(ZD_glinterface *gli, ZDOGL_primitive *xpe)
 {
-	e->Render = zdogl_render_sprite;
+	ZD_primitive *pe = &xpe->pe;
+	ZDOGL_meshvertex *mv;
+	unsigned i;
+	if(!(mv = (ZDOGL_meshvertex *)malloc(pe->nvertices *
+			sizeof(ZDOGL_meshvertex))))
+		return ZD_OOMEMORY;
+	for(i = 0; i < pe->nvertices; ++i)
+	{
+		ZD_vertex *vx = pe->vertices + i;
+		mv[i].x = vx->x;
+		mv[i].y = vx->y;
+		mv[i].z = vx->z;
+		mv[i].u = vx->tx;
+		mv[i].v = vx->ty;
+	}
+	if(!xpe->vbo)
+		gli->_GenBuffers(1, &xpe->vbo);
+	gli->_BindBuffer(GL_ARRAY_BUFFER, xpe->vbo);
+	gli->_BufferData(GL_ARRAY_BUFFER,
+			pe->nvertices * sizeof(ZDOGL_meshvertex), mv,
+			GL_STATIC_DRAW);
+	free(mv);
+	xpe->serial = pe->serial;
+	xpe->nvbo = pe->nvertices;
 	return ZD_OK;
 }
 
-
 /*
- * Primitive
+ * Draw a primitive from its buffer object, uploading the vertices first if
+ * they have changed. The entity transform is applied by OpenGL.
  */
-
-static ZD_errors zdogl_render_primitive(ZD_entity *e)
+static ZD_errors zdogl_draw_mesh(ZD_state *st, ZD_drawop *op)
 {
-	ZD_glinterface *gli = (ZD_glinterface *)e->state->bdata;
-	ZD_primitive *pe = (ZD_primitive *)e;
-	ZDOGL_texture *xtx = (ZDOGL_texture *)pe->txe.texture;
-	int i;
-	GLenum mode;
-	switch(pe->pkind)
+	ZD_glinterface *gli = zdogl_gli(st);
+	ZDOGL_primitive *xpe = (ZDOGL_primitive *)op->entity;
+	ZDOGL_texture *xtx = (ZDOGL_texture *)op->texture;
+	ZD_xftable *xf = &st->xf;
+	unsigned i = op->entity->xf;
+	ZD_f *trmx = xf->trmx + i * 4;
+	ZD_f m[16];
+	int txmatrix = xtx && ((xtx->x1 != 0.0f) || (xtx->y1 != 0.0f) ||
+			(xtx->x2 != 1.0f) || (xtx->y2 != 1.0f));
+	if(!xpe->vbo || (xpe->serial != xpe->pe.serial))
 	{
-	  case ZD_POINTS:	mode = GL_POINTS;		break;
-	  case ZD_LINES:	mode = GL_LINES;		break;
-	  case ZD_LINESTRIP:	mode = GL_LINE_STRIP;		break;
-	  case ZD_LINELOOP:	mode = GL_LINE_LOOP;		break;
-	  case ZD_TRIANGLES:	mode = GL_TRIANGLES;		break;
-	  case ZD_TRIANGLESTRIP:mode = GL_TRIANGLE_STRIP;	break;
-	  case ZD_TRIANGLEFAN:	mode = GL_TRIANGLE_FAN;		break;
-	  case ZD_QUADS:	mode = GL_QUADS;		break;
+		ZD_errors res = zdogl_upload_mesh(gli, xpe);
+		if(res)
+			return res;
 	}
-	if(xtx)
+	else
+		gli->_BindBuffer(GL_ARRAY_BUFFER, xpe->vbo);
+
+	zdogl_set_texture(gli, xtx);
+	gli_Color4f(gli, op->r, op->g, op->b, op->a);
+	gli_DisableClientState(gli, GL_COLOR_ARRAY);
+	gli->VertexPointer(3, GL_FLOAT, sizeof(ZDOGL_meshvertex),
+			(GLvoid *)offsetof(ZDOGL_meshvertex, x));
+	gli->TexCoordPointer(2, GL_FLOAT, sizeof(ZDOGL_meshvertex),
+			(GLvoid *)offsetof(ZDOGL_meshvertex, u));
+
+	/* Map texcoords to the area of the texture actually used */
+	if(txmatrix)
 	{
-		gli_Enable(gli, GL_TEXTURE_2D);
-		gli_BindTexture(gli, GL_TEXTURE_2D, xtx->name);
+		gli_MatrixMode(gli, GL_TEXTURE);
+		gli->PushMatrix();
+		gli->Translated(xtx->x1, xtx->y1, 0.0f);
+		gli->Scaled(xtx->x2 - xtx->x1, xtx->y2 - xtx->y1, 1.0f);
+		gli_MatrixMode(gli, GL_MODELVIEW);
 	}
-	else
-		gli_Disable(gli, GL_TEXTURE_2D);
-	gli->Color4f(e->tcr, e->tcg, e->tcb, e->tca);
-	gli->Begin(mode);
-	if(xtx)
-		for(i = 0; i < pe->nvertices; ++i)
-		{
-			ZD_f x, y;
-			ZD_vertex *vx = pe->vertices + i;
-			zd_TransformPointE(e, vx->x, vx->y, &x, &y);
-			gli->TexCoord2d(vx->tx, vx->ty);
-			gli->Vertex3d(x, y, vx->z + e->tz);
-		}
-	else
-		for(i = 0; i < pe->nvertices; ++i)
-		{
-			ZD_f x, y;
-			ZD_vertex *vx = pe->vertices + i;
-			zd_TransformPointE(e, vx->x, vx->y, &x, &y);
-			gli->Vertex3d(x, y, vx->z + e->tz);
-		}
-	gli->End();
+
+	m[0] = trmx[0]; m[4] = trmx[1]; m[8] = 0.0f;  m[12] = xf->tx[i];
+	m[1] = trmx[2]; m[5] = trmx[3]; m[9] = 0.0f;  m[13] = xf->ty[i];
+	m[2] = 0.0f;    m[6] = 0.0f;    m[10] = 1.0f; m[14] = xf->tz[i];
+	m[3] = 0.0f;    m[7] = 0.0f;    m[11] = 0.0f; m[15] = 1.0f;
+	gli->PushMatrix();
+	zdogl_MultMatrix(gli, m);
+	gli_DrawArrays(gli, zdogl_primitive_mode(op->pkind), 0, xpe->nvbo);
+	gli->PopMatrix();
+
+	if(txmatrix)
+	{
+		gli_MatrixMode(gli, GL_TEXTURE);
+		gli->PopMatrix();
+		gli_MatrixMode(gli, GL_MODELVIEW);
+	}
+	gli->_BindBuffer(GL_ARRAY_BUFFER, 0);
+	return ZD_OK;
+}
+
+static ZD_errors zdogl_InitWindow(ZD_entity *e)
+{
+	ZDOGL_window *xw = (ZDOGL_window *)e;
+	xw->active = xw->ref = xw->parentref = 0;
 	return ZD_OK;
 }
 
 static void zdogl_destroy_primitive(ZD_entity *e)
 {
-	ZD_primitive *pe = (ZD_primitive *)e;
-	free(pe->vertices);
+	ZDOGL_primitive *xpe = (ZDOGL_primitive *)e;
+	if(xpe->vbo)
+		zdogl_gli(e->state)->_DeleteBuffers(1, &xpe->vbo);
 }
 
 static ZD_errors zdogl_InitPrimitive(ZD_entity *e)
 {
+	ZDOGL_primitive *xpe = (ZDOGL_primitive *)e;
 	ZD_primitive *pe = (ZD_primitive *)e;
 	switch(pe->pkind)
 	{
@@ -472,110 +726,176 @@ static ZD_errors zdogl_InitPrimitive(ZD_entity *e)
 	  default:
 		return ZD_BADPRIMITIVE;
 	}
-	e->Render = zdogl_render_primitive;
+	xpe->vbo = 0;
+	xpe->serial = xpe->nvbo = 0;
 	e->Destroy = zdogl_destroy_primitive;
 	return ZD_OK;
 }
 
 
 /*
- * Fill
+ * Buffer
  */
 
-static ZD_errors zdogl_render_fill(ZD_entity *e)
+/* Set up texture 'xtx' as a render target */
+static ZD_errors zdogl_init_fbo(ZD_glinterface *gli, ZDOGL_texture *xtx)
 {
-	ZD_glinterface *gli = (ZD_glinterface *)e->state->bdata;
-	ZD_fill *fe = (ZD_fill *)e;
-	ZDOGL_texture *xtx = (ZDOGL_texture *)fe->txe.texture;
-	ZD_layer *c = fe->client;
-	ZD_f cr;
-	ZD_f wx[4], wy[4];
-
-	if(c->e.kind == ZD_EWINDOW)
-	{
-		/* Transform the window position to viewport coordinates */
-		ZD_entity *wp = c->e.parent;
-		zd_TransformPointE(wp, c->left, c->bottom, &wx[0], &wy[0]);
-		zd_TransformPointE(wp, c->right, c->bottom, &wx[1], &wy[1]);
-		zd_TransformPointE(wp, c->right, c->top, &wx[2], &wy[2]);
-		zd_TransformPointE(wp, c->left, c->top, &wx[3], &wy[3]);
-		cr = c->e.tr;
-	}
-	else /* if(c->e.kind == ZD_ELAYER) */
+	gli_BindTexture(gli, GL_TEXTURE_2D, xtx->name);
+	gli->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	gli->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	gli->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	gli->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	gli->TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, xtx->tx.w, xtx->tx.h, 0,
+			GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	gli->_GenFramebuffers(1, &xtx->fbo);
+	gli->_BindFramebuffer(GL_FRAMEBUFFER, xtx->fbo);
+	gli->_FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			GL_TEXTURE_2D, xtx->name, 0);
+	if(gli->_CheckFramebufferStatus(GL_FRAMEBUFFER) !=
+			GL_FRAMEBUFFER_COMPLETE)
 	{
-		wx[0] = c->left;	wy[0] = c->bottom;
-		wx[1] = c->right;	wy[1] = c->bottom;
-		wx[2] = c->right;	wy[2] = c->top;
-		wx[3] = c->left;	wy[3] = c->top;
-		cr = 0.0f;
+		gli->_DeleteFramebuffers(1, &xtx->fbo);
+		xtx->fbo = 0;
+		return ZD_NOTSUPPORTED;
 	}
+	return ZD_OK;
+}
 
-	if(xtx)
+/* Bind the framebuffer and viewport of the current target */
+static void zdogl_set_target(ZD_state *st)
+{
+	ZDOGL_state *gs = (ZDOGL_state *)st->bdata;
+	ZD_glinterface *gli = gs->gli;
+	if(gs->ntargets)
 	{
-		gli_Enable(gli, GL_TEXTURE_2D);
-		gli_BindTexture(gli, GL_TEXTURE_2D, xtx->name);
+		ZDOGL_texture *xtx = gs->targets[gs->ntargets - 1].texture;
+		gli->_BindFramebuffer(GL_FRAMEBUFFER, xtx->fbo);
+		gli->Viewport(0, 0, xtx->tx.w, xtx->tx.h);
 	}
 	else
-		gli_Disable(gli, GL_TEXTURE_2D);
-	gli->Color4f(e->tcr, e->tcg, e->tcb, e->tca);
-	if(xtx)
 	{
-		ZD_errors res;
-		ZD_f xs, ys, tx1, ty1, tx2, ty2;
-		ZD_f tx[4], ty[4];
-		ZD_f m[4], xo, yo;
-		ZD_f ctz = e->tz - c->e.tz;
-
-		/* Map texture coordinates to match the client rectangle */
-		xs = c->right - c->left;
-		ys = c->top - c->bottom;
-		tx1 = xtx->x1 * xs + c->left;
-		ty1 = xtx->y1 * ys + c->bottom;
-		tx2 = xtx->x2 * xs + c->left;
-		ty2 = xtx->y2 * ys + c->bottom;
-
-		/* Set up texcoord transform, adjusting for window rotation */
-		zd_CalculateMatrix(cr - e->tr, e->ts, m);
-		/* FIXME: This isn't doing what it's supposed to... */
-		zd_TransformPoint(m, 0.0f, 0.0f, e->tx, e->ty, &xo, &yo);
-
-		/* Invert matrix, because we're dealing with texcoords! */
-		if((res = zd_InverseMatrix(m, m)))
-			return res;
+		int w, h;
+		zdogl_get_display_size(st, &w, &h);
+		gli->_BindFramebuffer(GL_FRAMEBUFFER, 0);
+		gli->Viewport(0, 0, w, h);
+	}
+}
 
-		/* Now we can transform the texture coordinates! */
-		zd_InvTransformPoint(m, xo, yo, tx1, ty2, &tx[0], &ty[0]);
-		zd_InvTransformPoint(m, xo, yo, tx2, ty2, &tx[1], &ty[1]);
-		zd_InvTransformPoint(m, xo, yo, tx2, ty1, &tx[2], &ty[2]);
-		zd_InvTransformPoint(m, xo, yo, tx1, ty1, &tx[3], &ty[3]);
-
-		gli->Begin(GL_QUADS);
-		gli->TexCoord2d(tx[0], ty[0]);
-		gli->Vertex3d(wx[0], wy[0], ctz);
-		gli->TexCoord2d(tx[1], ty[1]);
-		gli->Vertex3d(wx[1], wy[1], ctz);
-		gli->TexCoord2d(tx[2], ty[2]);
-		gli->Vertex3d(wx[2], wy[2], ctz);
-		gli->TexCoord2d(tx[3], ty[3]);
-		gli->Vertex3d(wx[3], wy[3], ctz);
-		gli->End();
+/*
+ * Start rendering into the buffer texture of 'op'. The projection is upside
+ * down, so that the top of the buffer ends up in row 0 of the texture, like
+ * the first row of uploaded pixels.
+ */
+static ZD_errors zdogl_begin_buffer(ZD_state *st, ZD_drawlist *dl,
+		ZD_drawop *op)
+{
+	ZDOGL_state *gs = (ZDOGL_state *)st->bdata;
+	ZD_glinterface *gli = gs->gli;
+	ZDOGL_texture *xtx = (ZDOGL_texture *)op->texture;
+	ZD_drawvertex *v = zd_OpVertices(dl, op);
+	ZDOGL_target *t;
+	ZD_errors res;
+	if(!xtx->fbo && (res = zdogl_init_fbo(gli, xtx)))
+	{
+		st->maxbuffer = 0;	/* Don't try again! */
+		zdogl_set_target(st);
+		return res;
 	}
-	else
+	if(gs->ntargets == gs->targetssize)
 	{
-		gli->Begin(GL_QUADS);
-		gli->Vertex3d(wx[0], wy[0], e->tz);
-		gli->Vertex3d(wx[1], wy[1], e->tz);
-		gli->Vertex3d(wx[2], wy[2], e->tz);
-		gli->Vertex3d(wx[3], wy[3], e->tz);
-		gli->End();
+		int ns = gs->targetssize ? gs->targetssize * 2 : 4;
+		ZDOGL_target *nt = (ZDOGL_target *)realloc(gs->targets,
+				ns * sizeof(ZDOGL_target));
+		if(!nt)
+			return ZD_OOMEMORY;
+		gs->targets = nt;
+		gs->targetssize = ns;
 	}
+	t = gs->targets + gs->ntargets++;
+	t->texture = xtx;
+	t->scissor = gli->caps.scissor_test;
+	memcpy(t->box, gli->scissor, sizeof(t->box));
+	zdogl_set_target(st);
+	gli_Disable(gli, GL_SCISSOR_TEST);
+	gli->ClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	gli->Clear(GL_COLOR_BUFFER_BIT);
+	gli->PushMatrix();
+	gli->LoadIdentity();
+	gli->Ortho(v[0].x, v[2].x, v[2].y, v[0].y, 0.0f, 10.0f);
 	return ZD_OK;
 }
 
-static ZD_errors zdogl_InitFill(ZD_entity *e)
+/* Go back to rendering into the enclosing buffer, or the display */
+static void zdogl_end_buffer(ZD_state *st)
 {
-	e->Render = zdogl_render_fill;
-	return ZD_OK;
+	ZDOGL_state *gs = (ZDOGL_state *)st->bdata;
+	ZD_glinterface *gli = gs->gli;
+	ZDOGL_target *t = gs->targets + --gs->ntargets;
+	gli->PopMatrix();
+	zdogl_set_target(st);
+	if(t->scissor > 0)
+	{
+		gli_Scissor(gli, t->box[0], t->box[1], t->box[2], t->box[3]);
+		gli_Enable(gli, GL_SCISSOR_TEST);
+	}
+	else
+		gli_Disable(gli, GL_SCISSOR_TEST);
+}
+
+
+/*
+ * Draw list
+ */
+
+static ZD_errors zdogl_Submit(ZD_state *st, ZD_drawlist *dl)
+{
+	ZDOGL_state *gs = (ZDOGL_state *)st->bdata;
+	ZD_glinterface *gli = gs->gli;
+	ZD_errors res = ZD_OK;
+	unsigned i;
+	for(i = 0; !res && i < dl->nops; ++i)
+	{
+		ZD_drawop *op = dl->ops + i;
+		switch(op->kind)
+		{
+		  case ZD_DLAYER:
+			zdogl_flush(gs);
+			zdogl_draw_layer(gli, dl, op);
+			break;
+		  case ZD_DENDLAYER:
+			zdogl_flush(gs);
+			gli->PopMatrix();
+			break;
+		  case ZD_DWINDOW:
+			zdogl_flush(gs);
+			zdogl_draw_window(st, dl, op);
+			break;
+		  case ZD_DENDWINDOW:
+			zdogl_flush(gs);
+			zdogl_draw_end_window(gs, dl, op);
+			break;
+		  case ZD_DQUAD:
+			res = zdogl_batch(gs, dl, op, GL_QUADS);
+			break;
+		  case ZD_DPRIMITIVE:
+			res = zdogl_draw_primitive(gs, dl, op);
+			break;
+		  case ZD_DMESH:
+			zdogl_flush(gs);
+			res = zdogl_draw_mesh(st, op);
+			break;
+		  case ZD_DBUFFER:
+			zdogl_flush(gs);
+			res = zdogl_begin_buffer(st, dl, op);
+			break;
+		  case ZD_DENDBUFFER:
+			zdogl_flush(gs);
+			zdogl_end_buffer(st);
+			break;
+		}
+	}
+	zdogl_flush(gs);
+	return res;
 }
 
 
@@ -585,8 +905,20 @@ static ZD_errors zdogl_InitFill(ZD_entity *e)
 
 static ZD_errors zdogl_InitTexture(ZD_texture *tx)
 {
-	ZD_glinterface *gli = (ZD_glinterface *)tx->state->bdata;
+	ZD_glinterface *gli = zdogl_gli(tx->state);
 	ZDOGL_texture *xtx = (ZDOGL_texture *)tx;
+	xtx->fbo = 0;
+	if(tx->type == ZD_TT_SUBTEXTURE)
+	{
+		/* Use the area of the texture of the atlas page */
+		ZD_texture *phys = tx->t.s.phys;
+		xtx->name = ((ZDOGL_texture *)phys)->name;
+		xtx->x1 = (ZD_f)tx->t.s.x / phys->w;
+		xtx->y1 = (ZD_f)tx->t.s.y / phys->h;
+		xtx->x2 = (ZD_f)(tx->t.s.x + tx->w) / phys->w;
+		xtx->y2 = (ZD_f)(tx->t.s.y + tx->h) / phys->h;
+		return ZD_OK;
+	}
 	gli->GenTextures(1, &xtx->name);
 	xtx->x1 = xtx->y1 = 0.0f;
 	xtx->x2 = xtx->y2 = 1.0f;
@@ -594,14 +926,38 @@ static ZD_errors zdogl_InitTexture(ZD_texture *tx)
 }
 
 
+/*
+ * Upload subtexture 'tx', including the border, into the texture of its
+ * atlas page. Filtering and clamping are set up for the whole page.
+ */
+static ZD_errors zdogl_upload_subtexture(ZD_texture *tx)
+{
+	ZD_glinterface *gli = zdogl_gli(tx->state);
+	ZD_texture *phys = tx->t.s.phys;
+	int pxsize = zd_PixelSize(phys->format);
+	int x = tx->t.s.x - ZD_ATLASBORDER;
+	int y = tx->t.s.y - ZD_ATLASBORDER;
+	gli_BindTexture(gli, GL_TEXTURE_2D, ((ZDOGL_texture *)phys)->name);
+	gli->PixelStorei(GL_UNPACK_ROW_LENGTH, phys->w);
+	gli->TexSubImage2D(GL_TEXTURE_2D, 0, x, y,
+			tx->w + 2 * ZD_ATLASBORDER, tx->h + 2 * ZD_ATLASBORDER,
+			GL_RGBA, GL_UNSIGNED_BYTE,
+			phys->t.p.pixels + (y * phys->w + x) * pxsize);
+	return ZD_OK;
+}
+
+
 static ZD_errors zdogl_UploadTexture(ZD_pixels *px)
 {
 	ZD_texture *tx = px->texture;
-	ZD_glinterface *gli = (ZD_glinterface *)tx->state->bdata;
+	ZD_glinterface *gli = zdogl_gli(tx->state);
 	ZDOGL_texture *xtx = (ZDOGL_texture *)tx;
 	GLint iformat;
 	GLenum format;
 
+	if(tx->type == ZD_TT_SUBTEXTURE)
+		return zdogl_upload_subtexture(tx);
+
 	/* Setup... */
 	gli_BindTexture(gli, GL_TEXTURE_2D, xtx->name);
 	gli->PixelStorei(GL_UNPACK_ROW_LENGTH,
@@ -731,28 +1087,49 @@ static ZD_errors zdogl_UploadTexture(ZD_pixels *px)
 
 static ZD_errors zdogl_CloseTexture(ZD_texture *tx)
 {
-	ZD_glinterface *gli = (ZD_glinterface *)tx->state->bdata;
+	ZD_glinterface *gli = zdogl_gli(tx->state);
 	ZDOGL_texture *xtx = (ZDOGL_texture *)tx;
+	if(tx->type == ZD_TT_SUBTEXTURE)
+		return ZD_OK;	/* The atlas page owns the name */
+	if(xtx->fbo)
+		gli->_DeleteFramebuffers(1, &xtx->fbo);
 	gli->DeleteTextures(1, &xtx->name);
 	return ZD_OK;
 }
 
 
+/*
+ * Statistics
+ */
+
+static ZD_errors zdogl_CacheCounts(ZD_state *st, unsigned *hits,
+		unsigned *misses)
+{
+	ZD_glinterface *gli = zdogl_gli(st);
+	*hits = gli->hits;
+	*misses = gli->misses;
+	return ZD_OK;
+}
+
+
 ZD_backend zd_opengl_backend = {
 	zdogl_Open,
 	zdogl_Close,
 
 	zdogl_PreRender,
+	zdogl_Submit,
 	zdogl_PostRender,
 
-	zdogl_InitLayer,
+	NULL,
 	zdogl_InitWindow,
-	zdogl_InitGroup,
-	zdogl_InitSprite,
+	NULL,
+	NULL,
 	zdogl_InitPrimitive,
-	zdogl_InitFill,
+	NULL,
 
 	zdogl_InitTexture,
 	zdogl_UploadTexture,
-	zdogl_CloseTexture
+	zdogl_CloseTexture,
+
+	zdogl_CacheCounts
 };
@@ -21,66 +21,1645 @@
  */
 
 #include "zd_software.h"
+#include "zd_swspan.h"
+#include "SDL.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+/*
+ * Rendering is done into the RGBA buffer described by the ZD_pixels struct
+ * passed as context to zd_Open(). Output matches that of the OpenGL backend,
+ * with the top row of the buffer corresponding to the top of the display.
+ *
+ * Sprites, fills and backgrounds are rasterized by clipping convex polygons
+ * against a set of half-planes; one for each polygon edge, plus those of any
+ * rotated clipping windows. Pixels are sampled at their centers.
+ *
+ * Unrotated sprites are drawn as rectangles, with no edge tests at all, and
+ * if they are also unscaled, by copying or blending texel rows directly.
+ *
+ * Primitive triangles use integer edge functions instead, with vertices
+ * snapped to 1/16 pixel, and the top-left fill rule, so that triangles sharing
+ * an edge never touch the same pixel. Coverage is tested for 8x8 pixel blocks
+ * first, so that the interior of large triangles is filled without per-pixel
+ * tests, in spans as long as the triangle is wide.
+ *
+ * Rendering is deferred: the entity Render() callbacks only record drawing
+ * commands, which are binned into screen tiles as they are recorded. The tiles
+ * are rasterized by PostRender(), using the number of threads specified via
+ * the ZD__THREADS field of the zd_Open() flags. Each tile is owned by a single
+ * thread at a time, and executes its commands in the order they were
+ * recorded, so the output does not depend on the number of threads.
+ *
+ * Buffers (ZD_BUFFERED) are rendered the same way, but into the pixels of the
+ * buffer texture, using a state of their own, as soon as the ops of the buffer
+ * have been recorded.
+ */
+
+/* Max number of clipping half-planes; that is, four nested rotated windows */
+#define	ZDSW_MAXPLANES	16
+
+/* Size of the screen tiles commands are binned into */
+#define	ZDSW_TILESIZE	64
+
+/* Size of triangle coverage test blocks. ZDSW_TILESIZE must be a multiple! */
+#define	ZDSW_BLOCKSIZE	8
+
+/*
+ * Triangles with vertices further than this (pixels) from the origin are
+ * rendered as polygons instead, to keep edge functions within range.
+ */
+#define	ZDSW_GUARDBAND	65536.0f
+
+/*
+ * Clamped texture coordinates further than this (texels) outside the texture
+ * are held at this distance, as they sample the edge texels only anyway.
+ */
+#define	ZDSW_CLAMPMARGIN	2.0f
+
+/* Max width and height of buffers (ZD_BUFFERED) */
+#define	ZDSW_MAXBUFFER	4096
+
+
+/* Clipping region; rectangle + optional half-planes (ax + by + c >= 0) */
+typedef struct ZDSW_clip {
+	int		x1, y1, x2, y2;	/* x2 and y2 are exclusive */
+	int		nplanes;
+	float		planes[ZDSW_MAXPLANES][3];
+} ZDSW_clip;
+
+/* Screen space vertex with normalized texture coordinates */
+typedef struct ZDSW_vertex {
+	float		x, y;
+	float		u, v;
+} ZDSW_vertex;
+
+typedef enum ZDSW_cmdkind {
+	ZDSW_POLYGON,
+	ZDSW_TRIANGLE,
+	ZDSW_RECT,
+	ZDSW_CLEAR,
+	ZDSW_POINT,
+	ZDSW_LINE
+} ZDSW_cmdkind;
+
+/* Recorded drawing command */
+typedef struct ZDSW_cmd {
+	ZDSW_cmdkind	kind;
+	int		clip;		/* Index of clipping region */
+	int		x1, y1, x2, y2;	/* Bounding box, within clip rectangle */
+	ZDSW_paint	paint;		/* ZDSW_CLEAR: r, g, b is the pixel */
+	union {
+		struct {		/* ZDSW_POLYGON */
+			int	n;
+			float	planes[4][3];	/* Edge half-planes */
+		} poly;
+		struct {		/* ZDSW_TRIANGLE */
+			/*
+			 * Edge functions; E(x, y) = a*x + b*y + c >= 0 inside,
+			 * with (x, y) in 1/16 pixels. The top-left fill rule
+			 * is applied through 'c'.
+			 */
+			int	a[3], b[3];
+			int64_t	c[3];
+		} tri;
+		struct {		/* ZDSW_RECT */
+			int	direct;		/* Unscaled texture */
+			int	copy;		/* ...and opaque */
+		} rect;
+		ZDSW_vertex	v[2];	/* ZDSW_POINT, ZDSW_LINE */
+	} d;
+} ZDSW_cmd;
+
+/* Screen tile; list of commands that touch it, in submission order */
+typedef struct ZDSW_tile {
+	int		*cmds;
+	int		ncmds;
+	int		size;
+} ZDSW_tile;
+
+typedef struct ZDSW_state ZDSW_state;
+struct ZDSW_state {
+	unsigned char	*pixels;	/* Target buffer */
+	int		w, h, pitch;
+
+	/* View transform; display coordinates to pixel coordinates */
+	ZD_f		vsx, vsy, vox, voy;
+
+	/* Clipping regions used in this frame */
+	ZDSW_clip	*clips;
+	int		nclips;
+	int		clipssize;
+
+	/* Clipping region stack; indices into 'clips' */
+	int		*clipstack;
+	int		clipdepth;
+	int		clipsize;
+
+	/* Commands recorded in this frame */
+	ZDSW_cmd	*cmds;
+	int		ncmds;
+	int		cmdssize;
+
+	/* Primitive vertices in pixel coordinates */
+	ZDSW_vertex	*vertices;
+	int		verticessize;
+
+	/* Screen tiles */
+	ZDSW_tile	*tiles;
+	int		tw, th;		/* Tile grid size */
+	int		ntiles;		/* Number of allocated tiles */
+
+	/* Rendering threads, not counting the thread calling zd_Render() */
+	SDL_Thread	**threads;
+	int		nthreads;
+	SDL_sem		*start;		/* Posted once per thread to start */
+	SDL_sem		*done;		/* Posted by each thread when done */
+	SDL_mutex	*lock;		/* Protects 'nexttile' */
+	int		nexttile;	/* Next tile to render */
+	int		quit;
+
+	ZDSW_spanfuncs	*spans;		/* Span blitters for this CPU */
+
+	ZDSW_state	*buffer;	/* For rendering buffers, or NULL */
+};
+
+
+/*
+ * Grow the array '*a' of '*size' elements of 'esize' bytes, so that it holds
+ * at least 'n' elements. Returns 0 if out of memory.
+ */
+static int zdsw_grow(void **a, int *size, int n, size_t esize)
+{
+	int ns;
+	void *na;
+	if(n <= *size)
+		return 1;
+	ns = *size ? *size : 16;
+	while(ns < n)
+		ns *= 2;
+	if(!(na = realloc(*a, ns * esize)))
+		return 0;
+	*a = na;
+	*size = ns;
+	return 1;
+}
+
+
+/*
+ * Tile rendering
+ */
+
+static void zdsw_render_tile(ZDSW_state *sw, int ti);
+
+/* Render tiles until there are none left */
+static void zdsw_render_tiles(ZDSW_state *sw)
+{
+	int n = sw->tw * sw->th;
+	if(!sw->nthreads)
+	{
+		int ti;
+		for(ti = 0; ti < n; ++ti)
+			zdsw_render_tile(sw, ti);
+		return;
+	}
+	while(1)
+	{
+		int ti;
+		SDL_mutexP(sw->lock);
+		ti = sw->nexttile++;
+		SDL_mutexV(sw->lock);
+		if(ti >= n)
+			return;
+		zdsw_render_tile(sw, ti);
+	}
+}
+
+static int zdsw_thread(void *data)
+{
+	ZDSW_state *sw = (ZDSW_state *)data;
+	while(1)
+	{
+		SDL_SemWait(sw->start);
+		if(sw->quit)
+			return 0;
+		zdsw_render_tiles(sw);
+		SDL_SemPost(sw->done);
+	}
+}
+
+static void zdsw_stop_threads(ZDSW_state *sw)
+{
+	int i;
+	sw->quit = 1;
+	for(i = 0; i < sw->nthreads; ++i)
+		SDL_SemPost(sw->start);
+	for(i = 0; i < sw->nthreads; ++i)
+		SDL_WaitThread(sw->threads[i], NULL);
+	sw->nthreads = 0;
+	free(sw->threads);
+	sw->threads = NULL;
+	if(sw->start)
+		SDL_DestroySemaphore(sw->start);
+	if(sw->done)
+		SDL_DestroySemaphore(sw->done);
+	if(sw->lock)
+		SDL_DestroyMutex(sw->lock);
+	sw->start = sw->done = NULL;
+	sw->lock = NULL;
+}
+
+static ZD_errors zdsw_start_threads(ZDSW_state *sw, int n)
+{
+	sw->start = SDL_CreateSemaphore(0);
+	sw->done = SDL_CreateSemaphore(0);
+	sw->lock = SDL_CreateMutex();
+	sw->threads = (SDL_Thread **)calloc(n, sizeof(SDL_Thread *));
+	if(!sw->start || !sw->done || !sw->lock || !sw->threads)
+	{
+		zdsw_stop_threads(sw);
+		return ZD_OOMEMORY;
+	}
+	for(sw->nthreads = 0; sw->nthreads < n; ++sw->nthreads)
+		if(!(sw->threads[sw->nthreads] = SDL_CreateThread(zdsw_thread,
+				sw)))
+		{
+			zdsw_stop_threads(sw);
+			return ZD_INTERNAL;
+		}
+	return ZD_OK;
+}
+
+
+static void zdsw_free_state(ZDSW_state *sw)
+{
+	int i;
+	while(sw)
+	{
+		ZDSW_state *next = sw->buffer;
+		for(i = 0; i < sw->ntiles; ++i)
+			free(sw->tiles[i].cmds);
+		free(sw->tiles);
+		free(sw->cmds);
+		free(sw->vertices);
+		free(sw->clips);
+		free(sw->clipstack);
+		free(sw);
+		sw = next;
+	}
+}
+
+/* Create a state with no target, threads or buffer state */
+static ZDSW_state *zdsw_new_state(void)
+{
+	ZDSW_state *sw;
+	if(!(sw = (ZDSW_state *)calloc(1, sizeof(ZDSW_state))))
+		return NULL;
+	if(!zdsw_grow((void **)&sw->clipstack, &sw->clipsize, 8, sizeof(int)) ||
+			!zdsw_grow((void **)&sw->clips, &sw->clipssize, 8,
+			sizeof(ZDSW_clip)))
+	{
+		zdsw_free_state(sw);
+		return NULL;
+	}
+	sw->spans = zdsw_GetSpanFuncs();
+	return sw;
+}
+
+static void zdsw_Close(ZD_state *st);
 
 static ZD_errors zdsw_Open(ZD_state *st)
 {
-	return ZD_NOTIMPLEMENTED;
+	ZDSW_state *sw;
+	ZD_pixels *target = (ZD_pixels *)st->context;
+	int nthreads = st->flags & ZD__THREADS;
+	if(!target)
+		return ZD_BADARGUMENTS;
+	switch(target->format)
+	{
+	  case ZD_RGB:
+	  case ZD_RGBA:
+		break;
+	  default:
+		return ZD_BADFORMAT;
+	}
+	zd_BumpTextureSize(st, sizeof(ZDSW_texture));
+	if(!(sw = zdsw_new_state()))
+		return ZD_OOMEMORY;
+	st->bdata = sw;
+	st->maxbuffer = ZDSW_MAXBUFFER;
+	st->displayw = target->w;
+	st->displayh = target->h;
+	if(nthreads > 1)
+	{
+		ZD_errors res = zdsw_start_threads(sw, nthreads - 1);
+		if(res)
+		{
+			zdsw_Close(st);
+			return res;
+		}
+	}
+	return ZD_OK;
 }
 
 static void zdsw_Close(ZD_state *st)
 {
+	ZDSW_state *sw = (ZDSW_state *)st->bdata;
+	if(sw->nthreads)
+		zdsw_stop_threads(sw);
+	zdsw_free_state(sw);
+	st->bdata = NULL;
 }
 
 
 /*
- * Top level scene rendering
+ * View and clipping
  */
 
-static ZD_errors zdsw_PreRender(ZD_state *st)
+/* Set up the default view; (-1, -1) to (1, 1), like OpenGL */
+static void zdsw_reset_view(ZDSW_state *sw)
+{
+	sw->vsx = sw->w * 0.5f;
+	sw->vox = sw->w * 0.5f;
+	sw->vsy = -sw->h * 0.5f;
+	sw->voy = sw->h * 0.5f;
+}
+
+static inline void zdsw_to_screen(ZDSW_state *sw, ZD_f x, ZD_f y,
+		float *sx, float *sy)
+{
+	*sx = x * sw->vsx + sw->vox;
+	*sy = y * sw->vsy + sw->voy;
+}
+
+/* Transform 'n' draw list vertices 'dv' to pixel coordinates */
+static void zdsw_to_pixels(ZDSW_state *sw, ZD_drawvertex *dv, ZDSW_vertex *v,
+		int n)
+{
+	int i;
+	for(i = 0; i < n; ++i)
+	{
+		zdsw_to_screen(sw, dv[i].x, dv[i].y, &v[i].x, &v[i].y);
+		v[i].u = dv[i].u;
+		v[i].v = dv[i].v;
+	}
+}
+
+/*
+ * Return the index of the first pixel with its center at or after 'x',
+ * clamped to [min, max].
+ */
+static inline int zdsw_pixel_edge(float x, int min, int max)
+{
+	int i;
+	x -= 0.5f;
+	if(x <= min)
+		return min;
+	else if(x >= max)
+		return max;
+	i = ceil(x);
+	return i;
+}
+
+static inline ZDSW_clip *zdsw_clip(ZDSW_state *sw)
 {
+	return sw->clips + sw->clipstack[sw->clipdepth];
+}
+
+/* Push a copy of the current clipping region */
+static ZD_errors zdsw_push_clip(ZDSW_state *sw)
+{
+	if(!zdsw_grow((void **)&sw->clipstack, &sw->clipsize,
+			sw->clipdepth + 2, sizeof(int)))
+		return ZD_OOMEMORY;
+	sw->clipstack[sw->clipdepth + 1] = sw->clipstack[sw->clipdepth];
+	++sw->clipdepth;
 	return ZD_OK;
 }
 
-static ZD_errors zdsw_PostRender(ZD_state *st)
+/*
+ * Replace the current clipping region with a new copy of it, that can be
+ * modified without affecting commands already recorded.
+ */
+static ZDSW_clip *zdsw_new_clip(ZDSW_state *sw)
+{
+	if(!zdsw_grow((void **)&sw->clips, &sw->clipssize, sw->nclips + 1,
+			sizeof(ZDSW_clip)))
+		return NULL;
+	sw->clips[sw->nclips] = *zdsw_clip(sw);
+	sw->clipstack[sw->clipdepth] = sw->nclips;
+	return sw->clips + sw->nclips++;
+}
+
+static void zdsw_pop_clip(ZDSW_state *sw)
 {
+	if(sw->clipdepth)
+		--sw->clipdepth;
+}
+
+/*
+ * Calculate the inward facing edge half-planes of the convex polygon 'v'.
+ * Returns the number of planes, or 0 if the polygon is degenerate.
+ */
+static int zdsw_edge_planes(ZDSW_vertex *v, int n, float (*planes)[3])
+{
+	int i;
+	float area = 0.0f;
+	for(i = 0; i < n; ++i)
+	{
+		ZDSW_vertex *v0 = v + i;
+		ZDSW_vertex *v1 = v + (i + 1) % n;
+		area += v0->x * v1->y - v1->x * v0->y;
+	}
+	if(!area || (area != area))
+		return 0;
+	for(i = 0; i < n; ++i)
+	{
+		ZDSW_vertex *v0 = v + i;
+		ZDSW_vertex *v1 = v + (i + 1) % n;
+		float a = v0->y - v1->y;
+		float b = v1->x - v0->x;
+		if(area < 0.0f)
+		{
+			a = -a;
+			b = -b;
+		}
+		planes[i][0] = a;
+		planes[i][1] = b;
+		planes[i][2] = -(a * v0->x + b * v0->y);
+	}
+	return n;
+}
+
+/*
+ * Narrow the span [*x1, *x2) of row 'y' to the pixels whose centers are inside
+ * the specified half-planes.
+ */
+static inline void zdsw_clip_span(float (*planes)[3], int n, float yc,
+		int *x1, int *x2)
+{
+	int i;
+	for(i = 0; i < n; ++i)
+	{
+		float a = planes[i][0];
+		float d = planes[i][1] * yc + planes[i][2];
+		if(a > 0.0f)
+		{
+			float lo = -d / a;
+			if(lo - 0.5f > *x1)
+				*x1 = zdsw_pixel_edge(lo, *x1, *x2);
+		}
+		else if(a < 0.0f)
+		{
+			float hi = -d / a;
+			if(hi - 0.5f < *x2)
+				*x2 = zdsw_pixel_edge(hi, *x1, *x2);
+		}
+		else if(d < 0.0f)
+			*x2 = *x1;
+		if(*x1 >= *x2)
+			return;
+	}
+}
+
+
+/*
+ * Pixel processing
+ */
+
+/*
+ * Find the pixels [*i1, *i2) of an 'n' pixel span where texel coordinate
+ * 'c' + 'dc' * i is within ZDSW_CLAMPMARGIN of the 'size' texels of a clamped
+ * texture axis.
+ */
+static void zdsw_clamp_range(float c, float dc, int size, int n,
+		int *i1, int *i2)
+{
+	float a, b;
+	if(dc == 0.0f)
+	{
+		*i1 = 0;
+		*i2 = (c >= -ZDSW_CLAMPMARGIN) &&
+				(c <= size + ZDSW_CLAMPMARGIN) ? n : 0;
+		return;
+	}
+	a = (-ZDSW_CLAMPMARGIN - c) / dc;
+	b = (size + ZDSW_CLAMPMARGIN - c) / dc;
+	if(dc < 0.0f)
+	{
+		float t = a;
+		a = b;
+		b = t;
+	}
+	/* First pixel at or after 'a', and the one after the last up to 'b' */
+	if(a <= 0.0f)
+		*i1 = 0;
+	else if(a >= n)
+		*i1 = n;
+	else
+		*i1 = (int)a + ((int)a < a);
+	if(b < 0.0f)
+		*i2 = 0;
+	else if(b >= n)
+		*i2 = n;
+	else
+		*i2 = (int)b + 1;
+	if(*i2 < *i1)
+		*i2 = *i1;
+}
+
+/* Draw 'n' texels, with 16:16 texel coordinates */
+static inline void zdsw_texels(ZDSW_spanfuncs *sf, unsigned char *d, int n,
+		ZDSW_paint *p, uint32_t u, uint32_t v, int du, int dv)
+{
+	if(p->tx->bilinear)
+		sf->Bilinear(d, n, p, u, v, du, dv);
+	else
+		sf->Nearest(d, n, p, u, v, du, dv);
+}
+
+static void zdsw_span(ZDSW_state *sw, ZDSW_paint *p, int x1, int x2, int y)
+{
+	unsigned char *d = sw->pixels + y * sw->pitch + x1 * 4;
+	float xc, yc, u, v;
+	ZDSW_texture *xtx = p->tx;
+	ZDSW_spanfuncs *sf = sw->spans;
+	int n = x2 - x1;
+	int i, cut[4];
+	uint32_t fu, fv;
+	int du, dv;
+	if(!xtx)
+	{
+		sf->Color(d, n, p);
+		return;
+	}
+	if(!xtx->simd)
+		sf = &zdsw_scalar_spans;
+
+	/* Evaluate texcoords at the center of the first pixel */
+	xc = x1 + 0.5f;
+	yc = y + 0.5f;
+	u = p->u0 + p->dudx * xc + p->dudy * yc;
+	v = p->v0 + p->dvdx * xc + p->dvdy * yc;
+
+	/* Keep wrapping coordinates near the texture, to avoid overflow */
+	if(xtx->hwrap)
+		u -= floor(u / xtx->tx.w) * xtx->tx.w;
+	if(xtx->vwrap)
+		v -= floor(v / xtx->tx.h) * xtx->tx.h;
+
+	/*
+	 * Find where clamped coordinates are near the texture. Further out,
+	 * they may not fit in 16:16 fixed point, so the span is cut there,
+	 * and they are held at the margin outside.
+	 */
+	cut[0] = cut[2] = 0;
+	cut[1] = cut[3] = n;
+	if(!xtx->hwrap)
+		zdsw_clamp_range(u, p->dudx, xtx->tx.w, n, &cut[0], &cut[1]);
+	if(!xtx->vwrap)
+		zdsw_clamp_range(v, p->dvdx, xtx->tx.h, n, &cut[2], &cut[3]);
+
+	/* Via int, as negative (clamped) coordinates are fine here */
+	du = p->dudx * 65536.0f;
+	dv = p->dvdx * 65536.0f;
+	if(!cut[0] && !cut[2] && (cut[1] == n) && (cut[3] == n))
+	{
+		zdsw_texels(sf, d, n, p, (int)(u * 65536.0f),
+				(int)(v * 65536.0f), du, dv);
+		return;
+	}
+	fu = cut[0] ? 0 : (int)(u * 65536.0f);
+	fv = cut[2] ? 0 : (int)(v * 65536.0f);
+	for(i = 0; i < n; )
+	{
+		int j = n, k;
+		uint32_t su, sv;
+		int sdu = du, sdv = dv;
+		for(k = 0; k < 4; ++k)
+			if((cut[k] > i) && (cut[k] < j))
+				j = cut[k];
+		if((i < cut[0]) || (i >= cut[1]))
+		{
+			sdu = 0;
+			su = (int)((u + p->dudx * i < 0.0f ? -ZDSW_CLAMPMARGIN :
+					xtx->tx.w + ZDSW_CLAMPMARGIN) * 65536.0f);
+		}
+		else if(cut[0])
+			su = (int)((u + p->dudx * i) * 65536.0f);
+		else
+			su = fu + (uint32_t)i * du;
+		if((i < cut[2]) || (i >= cut[3]))
+		{
+			sdv = 0;
+			sv = (int)((v + p->dvdx * i < 0.0f ? -ZDSW_CLAMPMARGIN :
+					xtx->tx.h + ZDSW_CLAMPMARGIN) * 65536.0f);
+		}
+		else if(cut[2])
+			sv = (int)((v + p->dvdx * i) * 65536.0f);
+		else
+			sv = fv + (uint32_t)i * dv;
+		zdsw_texels(sf, d + i * 4, j - i, p, su, sv, sdu, sdv);
+		i = j;
+	}
+}
+
+/* Blend pixel (x, y) if inside the clip region; the rectangle is checked */
+static inline void zdsw_plot(ZDSW_state *sw, ZDSW_clip *c, int x, int y,
+		ZDSW_paint *p)
+{
+	int i;
+	for(i = 0; i < c->nplanes; ++i)
+		if(c->planes[i][0] * (x + 0.5f) + c->planes[i][1] * (y + 0.5f) +
+				c->planes[i][2] < 0.0f)
+			return;
+	zdsw_blend(sw->pixels + y * sw->pitch + x * 4,
+			p->r - (p->r >> 8), p->g - (p->g >> 8),
+			p->b - (p->b >> 8), p->a - (p->a >> 8));
+}
+
+
+/*
+ * Command execution. (x1, y1, x2, y2) is the intersection of the command
+ * bounding box and the tile being rendered.
+ */
+
+static void zdsw_exec_polygon(ZDSW_state *sw, ZDSW_cmd *cmd, ZDSW_clip *c,
+		int x1, int y1, int x2, int y2)
+{
+	int y;
+	for(y = y1; y < y2; ++y)
+	{
+		float yc = y + 0.5f;
+		int sx1 = x1;
+		int sx2 = x2;
+		zdsw_clip_span(cmd->d.poly.planes, cmd->d.poly.n, yc,
+				&sx1, &sx2);
+		if(sx1 >= sx2)
+			continue;
+		if(c->nplanes)
+		{
+			zdsw_clip_span(c->planes, c->nplanes, yc, &sx1, &sx2);
+			if(sx1 >= sx2)
+				continue;
+		}
+		zdsw_span(sw, &cmd->paint, sx1, sx2, y);
+	}
+}
+
+/*
+ * Rectangle, textured with no rotation. The 'direct' case reads texel rows
+ * straight from the texture, as long as they are inside it.
+ */
+static void zdsw_exec_rect(ZDSW_state *sw, ZDSW_cmd *cmd, ZDSW_clip *c,
+		int x1, int y1, int x2, int y2)
+{
+	ZDSW_paint *p = &cmd->paint;
+	ZDSW_texture *xtx = p->tx;
+	int y;
+	for(y = y1; y < y2; ++y)
+	{
+		int sx1 = x1;
+		int sx2 = x2;
+		if(c->nplanes)
+		{
+			zdsw_clip_span(c->planes, c->nplanes, y + 0.5f,
+					&sx1, &sx2);
+			if(sx1 >= sx2)
+				continue;
+		}
+		if(cmd->d.rect.direct)
+		{
+			int tx = floor(p->u0 + p->dudx * (sx1 + 0.5f));
+			int ty = floor(p->v0 + p->dvdy * (y + 0.5f));
+			if((tx >= 0) && (tx + sx2 - sx1 <= xtx->tx.w) &&
+					(ty >= 0) && (ty < xtx->tx.h))
+			{
+				unsigned char *d = sw->pixels + y * sw->pitch +
+						sx1 * 4;
+				unsigned char *s = xtx->pixels +
+						(ty * xtx->tx.w + tx) * 4;
+				if(cmd->d.rect.copy)
+					memcpy(d, s, (sx2 - sx1) * 4);
+				else
+					sw->spans->Blit(d, s, sx2 - sx1, p);
+				continue;
+			}
+		}
+		zdsw_span(sw, p, sx1, sx2, y);
+	}
+}
+
+static void zdsw_exec_clear(ZDSW_state *sw, ZDSW_cmd *cmd,
+		int x1, int y1, int x2, int y2)
+{
+	unsigned char px[4];
+	int x, y;
+	px[0] = cmd->paint.r;
+	px[1] = cmd->paint.g;
+	px[2] = cmd->paint.b;
+	px[3] = 255;
+	for(y = y1; y < y2; ++y)
+	{
+		unsigned char *d = sw->pixels + y * sw->pitch + x1 * 4;
+		for(x = x1; x < x2; ++x, d += 4)
+			memcpy(d, px, 4);
+	}
+}
+
+/* Narrow the span [*x1, *x2) to the pixels covered by 'tri' in one row */
+static inline void zdsw_tri_row(ZDSW_cmd *cmd, int64_t *e, int x1, int x2,
+		int *sx1, int *sx2)
+{
+	int x;
+	int64_t e0 = e[0], e1 = e[1], e2 = e[2];
+	int a0 = cmd->d.tri.a[0] * 16;
+	int a1 = cmd->d.tri.a[1] * 16;
+	int a2 = cmd->d.tri.a[2] * 16;
+	for(x = x1; x < x2; ++x, e0 += a0, e1 += a1, e2 += a2)
+		if((e0 | e1 | e2) >= 0)
+		{
+			if(x < *sx1)
+				*sx1 = x;
+			if(x >= *sx2)
+				*sx2 = x + 1;
+		}
+}
+
+/*
+ * Render a triangle one row of 8x8 blocks at a time. Each block is tested
+ * against the edge functions at the corners that maximize and minimize them.
+ * Blocks outside any edge are skipped, blocks inside all edges are covered
+ * without further testing, and only the remaining blocks are scanned per
+ * pixel. Since triangles are convex, the result is one span per row.
+ */
+static void zdsw_exec_triangle(ZDSW_state *sw, ZDSW_cmd *cmd, ZDSW_clip *c,
+		int x1, int y1, int x2, int y2)
+{
+	int sx1[ZDSW_BLOCKSIZE], sx2[ZDSW_BLOCKSIZE];
+	int64_t bmin[3], bmax[3];
+	int by, i;
+
+	/* Block corner offsets that minimize and maximize the edge functions */
+	for(i = 0; i < 3; ++i)
+	{
+		int da = cmd->d.tri.a[i] * 16 * (ZDSW_BLOCKSIZE - 1);
+		int db = cmd->d.tri.b[i] * 16 * (ZDSW_BLOCKSIZE - 1);
+		bmin[i] = (da < 0 ? da : 0) + (db < 0 ? db : 0);
+		bmax[i] = (da > 0 ? da : 0) + (db > 0 ? db : 0);
+	}
+
+	for(by = y1 & ~(ZDSW_BLOCKSIZE - 1); by < y2; by += ZDSW_BLOCKSIZE)
+	{
+		int bx, y;
+		int ry1 = by > y1 ? by : y1;
+		int ry2 = by + ZDSW_BLOCKSIZE < y2 ? by + ZDSW_BLOCKSIZE : y2;
+		for(y = ry1; y < ry2; ++y)
+		{
+			sx1[y - by] = x2;
+			sx2[y - by] = x1;
+		}
+		for(bx = x1 & ~(ZDSW_BLOCKSIZE - 1); bx < x2;
+				bx += ZDSW_BLOCKSIZE)
+		{
+			int64_t e[3];
+			int full = 1;
+			int rx1 = bx > x1 ? bx : x1;
+			int rx2 = bx + ZDSW_BLOCKSIZE < x2 ?
+					bx + ZDSW_BLOCKSIZE : x2;
+			for(i = 0; i < 3; ++i)
+			{
+				e[i] = cmd->d.tri.a[i] * (int64_t)(bx * 16 + 8) +
+						cmd->d.tri.b[i] *
+						(int64_t)(by * 16 + 8) +
+						cmd->d.tri.c[i];
+				if(e[i] + bmax[i] < 0)
+					break;
+				if(e[i] + bmin[i] < 0)
+					full = 0;
+			}
+			if(i < 3)
+				continue;	/* Outside an edge */
+			if(full)
+			{
+				for(y = ry1; y < ry2; ++y)
+				{
+					if(rx1 < sx1[y - by])
+						sx1[y - by] = rx1;
+					if(rx2 > sx2[y - by])
+						sx2[y - by] = rx2;
+				}
+				continue;
+			}
+			for(i = 0; i < 3; ++i)
+				e[i] += cmd->d.tri.a[i] * (int64_t)(rx1 - bx) * 16 +
+						cmd->d.tri.b[i] *
+						(int64_t)(ry1 - by) * 16;
+			for(y = ry1; y < ry2; ++y)
+			{
+				zdsw_tri_row(cmd, e, rx1, rx2,
+						&sx1[y - by], &sx2[y - by]);
+				for(i = 0; i < 3; ++i)
+					e[i] += cmd->d.tri.b[i] * 16;
+			}
+		}
+		for(y = ry1; y < ry2; ++y)
+		{
+			int xl = sx1[y - by];
+			int xr = sx2[y - by];
+			if(xl >= xr)
+				continue;
+			if(c->nplanes)
+			{
+				zdsw_clip_span(c->planes, c->nplanes, y + 0.5f,
+						&xl, &xr);
+				if(xl >= xr)
+					continue;
+			}
+			zdsw_span(sw, &cmd->paint, xl, xr, y);
+		}
+	}
+}
+
+/* Line DDA; only the pixels inside the tile are drawn */
+static void zdsw_exec_line(ZDSW_state *sw, ZDSW_cmd *cmd, ZDSW_clip *c,
+		int x1, int y1, int x2, int y2)
+{
+	ZDSW_vertex *v0 = &cmd->d.v[0];
+	ZDSW_vertex *v1 = &cmd->d.v[1];
+	float dx = v1->x - v0->x;
+	float dy = v1->y - v0->y;
+	int i, n = ceil(fabs(dx) > fabs(dy) ? fabs(dx) : fabs(dy));
+	if(!n)
+		return;
+	dx /= n;
+	dy /= n;
+	for(i = 0; i < n; ++i)
+	{
+		float x = v0->x + dx * i;
+		float y = v0->y + dy * i;
+		int ix, iy;
+		if(x < x1 || x >= x2 || y < y1 || y >= y2)
+			continue;
+		ix = floor(x);
+		iy = floor(y);
+		zdsw_plot(sw, c, ix, iy, &cmd->paint);
+	}
+}
+
+static void zdsw_render_tile(ZDSW_state *sw, int ti)
+{
+	ZDSW_tile *t = sw->tiles + ti;
+	int tx1 = ti % sw->tw * ZDSW_TILESIZE;
+	int ty1 = ti / sw->tw * ZDSW_TILESIZE;
+	int tx2 = tx1 + ZDSW_TILESIZE;
+	int ty2 = ty1 + ZDSW_TILESIZE;
+	int i;
+	if(tx2 > sw->w)
+		tx2 = sw->w;
+	if(ty2 > sw->h)
+		ty2 = sw->h;
+	for(i = 0; i < t->ncmds; ++i)
+	{
+		ZDSW_cmd *cmd = sw->cmds + t->cmds[i];
+		ZDSW_clip *c = sw->clips + cmd->clip;
+		int x1 = cmd->x1 > tx1 ? cmd->x1 : tx1;
+		int y1 = cmd->y1 > ty1 ? cmd->y1 : ty1;
+		int x2 = cmd->x2 < tx2 ? cmd->x2 : tx2;
+		int y2 = cmd->y2 < ty2 ? cmd->y2 : ty2;
+		switch(cmd->kind)
+		{
+		  case ZDSW_POLYGON:
+			zdsw_exec_polygon(sw, cmd, c, x1, y1, x2, y2);
+			break;
+		  case ZDSW_TRIANGLE:
+			zdsw_exec_triangle(sw, cmd, c, x1, y1, x2, y2);
+			break;
+		  case ZDSW_RECT:
+			zdsw_exec_rect(sw, cmd, c, x1, y1, x2, y2);
+			break;
+		  case ZDSW_CLEAR:
+			zdsw_exec_clear(sw, cmd, x1, y1, x2, y2);
+			break;
+		  case ZDSW_POINT:
+			zdsw_plot(sw, c, cmd->x1, cmd->y1, &cmd->paint);
+			break;
+		  case ZDSW_LINE:
+			zdsw_exec_line(sw, cmd, c, x1, y1, x2, y2);
+			break;
+		}
+	}
+}
+
+
+/*
+ * Command recording
+ */
+
+/*
+ * Get the next free command slot. It becomes part of the frame once it is
+ * passed to zdsw_bin().
+ */
+static ZDSW_cmd *zdsw_new_cmd(ZDSW_state *sw, ZDSW_cmdkind kind)
+{
+	ZDSW_cmd *cmd;
+	if(!zdsw_grow((void **)&sw->cmds, &sw->cmdssize, sw->ncmds + 1,
+			sizeof(ZDSW_cmd)))
+		return NULL;
+	cmd = sw->cmds + sw->ncmds;
+	cmd->kind = kind;
+	cmd->clip = sw->clipstack[sw->clipdepth];
+	return cmd;
+}
+
+/*
+ * Add the command last returned by zdsw_new_cmd() to every tile its bounding
+ * box touches. The bounding box must be within the clip rectangle.
+ */
+static ZD_errors zdsw_bin(ZDSW_state *sw, ZDSW_cmd *cmd)
+{
+	int tx, ty;
+	int tx1 = cmd->x1 / ZDSW_TILESIZE;
+	int ty1 = cmd->y1 / ZDSW_TILESIZE;
+	int tx2 = (cmd->x2 - 1) / ZDSW_TILESIZE;
+	int ty2 = (cmd->y2 - 1) / ZDSW_TILESIZE;
+	if((cmd->x1 >= cmd->x2) || (cmd->y1 >= cmd->y2))
+		return ZD_OK;
+	for(ty = ty1; ty <= ty2; ++ty)
+		for(tx = tx1; tx <= tx2; ++tx)
+		{
+			ZDSW_tile *t = sw->tiles + ty * sw->tw + tx;
+			if(!zdsw_grow((void **)&t->cmds, &t->size,
+					t->ncmds + 1, sizeof(int)))
+				return ZD_OOMEMORY;
+			t->cmds[t->ncmds++] = sw->ncmds;
+		}
+	++sw->ncmds;
 	return ZD_OK;
 }
 
+static inline int zdsw_color(float c)
+{
+	if(c <= 0.0f)
+		return 0;
+	else if(c >= 1.0f)
+		return 256;
+	return (int)(c * 256.0f);
+}
+
+/* Set up color modulation and texture for 'paint' */
+static void zdsw_init_paint(ZDSW_paint *p, ZD_drawop *op)
+{
+	p->tx = (ZDSW_texture *)op->texture;
+	if(p->tx && !p->tx->pixels)
+		p->tx = NULL;
+	p->r = zdsw_color(op->r);
+	p->g = zdsw_color(op->g);
+	p->b = zdsw_color(op->b);
+	p->a = zdsw_color(op->a);
+}
 
 /*
- * Entity initializers
+ * Calculate texel space texcoord gradients for 'p' from the first three
+ * vertices of 'v'. Returns 0 if the vertices are degenerate.
  */
+static int zdsw_gradients(ZDSW_paint *p, ZDSW_vertex *v)
+{
+	float tw, th, dx1, dy1, dx2, dy2, du1, du2, dv1, dv2, d;
+	if(!p->tx)
+		return 1;
+	tw = p->tx->tx.w;
+	th = p->tx->tx.h;
+	dx1 = v[1].x - v[0].x;
+	dy1 = v[1].y - v[0].y;
+	dx2 = v[2].x - v[0].x;
+	dy2 = v[2].y - v[0].y;
+	d = dx1 * dy2 - dx2 * dy1;
+	if(!d)
+		return 0;
+	d = 1.0f / d;
+	du1 = (v[1].u - v[0].u) * tw;
+	du2 = (v[2].u - v[0].u) * tw;
+	dv1 = (v[1].v - v[0].v) * th;
+	dv2 = (v[2].v - v[0].v) * th;
+	p->dudx = (du1 * dy2 - du2 * dy1) * d;
+	p->dudy = (du2 * dx1 - du1 * dx2) * d;
+	p->dvdx = (dv1 * dy2 - dv2 * dy1) * d;
+	p->dvdy = (dv2 * dx1 - dv1 * dx2) * d;
+	p->u0 = v[0].u * tw - p->dudx * v[0].x - p->dudy * v[0].y;
+	p->v0 = v[0].v * th - p->dvdx * v[0].x - p->dvdy * v[0].y;
+	return 1;
+}
 
-static ZD_errors zdsw_InitLayer(ZD_entity *e)
+/* Fill convex polygon 'v' (3 or 4 vertices) with affine texture mapping */
+static ZD_errors zdsw_polygon(ZDSW_state *sw, ZDSW_vertex *v, int n,
+		ZDSW_paint *p)
 {
+	ZDSW_clip *c = zdsw_clip(sw);
+	ZDSW_cmd *cmd;
+	float xmin, xmax, ymin, ymax;
+	int i;
+	if(!(cmd = zdsw_new_cmd(sw, ZDSW_POLYGON)))
+		return ZD_OOMEMORY;
+	if(!(cmd->d.poly.n = zdsw_edge_planes(v, n, cmd->d.poly.planes)))
+		return ZD_OK;
+	cmd->paint = *p;
+	if(!zdsw_gradients(&cmd->paint, v))
+		return ZD_OK;
+	xmin = xmax = v[0].x;
+	ymin = ymax = v[0].y;
+	for(i = 1; i < n; ++i)
+	{
+		if(v[i].x < xmin)
+			xmin = v[i].x;
+		if(v[i].x > xmax)
+			xmax = v[i].x;
+		if(v[i].y < ymin)
+			ymin = v[i].y;
+		if(v[i].y > ymax)
+			ymax = v[i].y;
+	}
+	cmd->x1 = zdsw_pixel_edge(xmin, c->x1, c->x2);
+	cmd->x2 = zdsw_pixel_edge(xmax, c->x1, c->x2);
+	cmd->y1 = zdsw_pixel_edge(ymin, c->y1, c->y2);
+	cmd->y2 = zdsw_pixel_edge(ymax, c->y1, c->y2);
+	return zdsw_bin(sw, cmd);
+}
+
+/*
+ * Snap 'x' to 'to' if the difference, multiplied by 'range', is less than
+ * 1/256; that is, too small to affect 8 bit output. Returns 1 if snapped.
+ */
+static inline int zdsw_snap(float *x, float to, float range)
+{
+	if(!(fabs(*x - to) * range < 1.0f / 256.0f))
+		return 0;
+	*x = to;
+	return 1;
+}
+
+/*
+ * Fill the axis aligned rectangle with corners 'v[0]' and 'v[2]'. If this
+ * maps texels 1:1 to pixels, texels are blended, or when possible, copied
+ * directly to the target.
+ */
+static ZD_errors zdsw_rect(ZDSW_state *sw, ZDSW_vertex *v, ZDSW_paint *p)
+{
+	ZDSW_clip *c = zdsw_clip(sw);
+	ZDSW_cmd *cmd;
+	float xmin = v[0].x < v[2].x ? v[0].x : v[2].x;
+	float xmax = v[0].x < v[2].x ? v[2].x : v[0].x;
+	float ymin = v[0].y < v[2].y ? v[0].y : v[2].y;
+	float ymax = v[0].y < v[2].y ? v[2].y : v[0].y;
+	if(!(cmd = zdsw_new_cmd(sw, ZDSW_RECT)))
+		return ZD_OOMEMORY;
+	cmd->paint = *p;
+	if(!zdsw_gradients(&cmd->paint, v))
+		return ZD_OK;
+	cmd->d.rect.direct = cmd->d.rect.copy = 0;
+	p = &cmd->paint;
+	if(p->tx && !p->dudy && !p->dvdx)
+	{
+		ZDSW_texture *xtx = p->tx;
+		float w = xtx->tx.w;
+		float h = xtx->tx.h;
+		if(zdsw_snap(&p->dudx, 1.0f, w) &&
+				(zdsw_snap(&p->dvdy, 1.0f, h) ||
+				zdsw_snap(&p->dvdy, -1.0f, h)))
+		{
+			/* Bilinear is the same as nearest at texel centers */
+			cmd->d.rect.direct = !xtx->bilinear ||
+					(zdsw_snap(&p->u0, rint(p->u0), 1.0f) &&
+					zdsw_snap(&p->v0, rint(p->v0), 1.0f));
+			cmd->d.rect.copy = cmd->d.rect.direct && !xtx->translucent &&
+					(p->r == 256) && (p->g == 256) &&
+					(p->b == 256) && (p->a == 256);
+		}
+	}
+	cmd->x1 = zdsw_pixel_edge(xmin, c->x1, c->x2);
+	cmd->x2 = zdsw_pixel_edge(xmax, c->x1, c->x2);
+	cmd->y1 = zdsw_pixel_edge(ymin, c->y1, c->y2);
+	cmd->y2 = zdsw_pixel_edge(ymax, c->y1, c->y2);
+	return zdsw_bin(sw, cmd);
+}
+
+/* Fill triangle 'v' with affine texture mapping, using the top-left rule */
+static ZD_errors zdsw_triangle(ZDSW_state *sw, ZDSW_vertex *v, ZDSW_paint *p)
+{
+	ZDSW_clip *c = zdsw_clip(sw);
+	ZDSW_cmd *cmd;
+	int x[3], y[3];
+	int i, xmin, xmax, ymin, ymax;
+	int64_t area;
+	for(i = 0; i < 3; ++i)
+	{
+		if(!(fabs(v[i].x) < ZDSW_GUARDBAND) ||
+				!(fabs(v[i].y) < ZDSW_GUARDBAND))
+			return zdsw_polygon(sw, v, 3, p);
+		x[i] = lrintf(v[i].x * 16.0f);
+		y[i] = lrintf(v[i].y * 16.0f);
+	}
+	area = (int64_t)(x[1] - x[0]) * (y[2] - y[0]) -
+			(int64_t)(x[2] - x[0]) * (y[1] - y[0]);
+	if(!area)
+		return ZD_OK;
+	if(!(cmd = zdsw_new_cmd(sw, ZDSW_TRIANGLE)))
+		return ZD_OOMEMORY;
+	cmd->paint = *p;
+	if(!zdsw_gradients(&cmd->paint, v))
+		return ZD_OK;
+	for(i = 0; i < 3; ++i)
+	{
+		int j = (i + 1) % 3;
+		int a = y[i] - y[j];
+		int b = x[j] - x[i];
+		if(area < 0)
+		{
+			a = -a;
+			b = -b;
+		}
+		cmd->d.tri.a[i] = a;
+		cmd->d.tri.b[i] = b;
+		cmd->d.tri.c[i] = -((int64_t)a * x[i] + (int64_t)b * y[i]);
+		/* Pixels exactly on an edge only belong to top and left edges */
+		if(!((a > 0) || ((a == 0) && (b > 0))))
+			cmd->d.tri.c[i] -= 1;
+	}
+	xmin = xmax = x[0];
+	ymin = ymax = y[0];
+	for(i = 1; i < 3; ++i)
+	{
+		if(x[i] < xmin)
+			xmin = x[i];
+		if(x[i] > xmax)
+			xmax = x[i];
+		if(y[i] < ymin)
+			ymin = y[i];
+		if(y[i] > ymax)
+			ymax = y[i];
+	}
+	cmd->x1 = zdsw_pixel_edge(xmin / 16.0f, c->x1, c->x2);
+	cmd->x2 = zdsw_pixel_edge(xmax / 16.0f + 1.0f, c->x1, c->x2);
+	cmd->y1 = zdsw_pixel_edge(ymin / 16.0f, c->y1, c->y2);
+	cmd->y2 = zdsw_pixel_edge(ymax / 16.0f + 1.0f, c->y1, c->y2);
+	return zdsw_bin(sw, cmd);
+}
+
+/* Plot a single pixel at screen coordinates (x, y), if inside the clip region */
+static ZD_errors zdsw_point(ZDSW_state *sw, float x, float y, ZDSW_paint *p)
+{
+	ZDSW_clip *c = zdsw_clip(sw);
+	ZDSW_cmd *cmd;
+	if(x < c->x1 || x >= c->x2 || y < c->y1 || y >= c->y2)
+		return ZD_OK;
+	if(!(cmd = zdsw_new_cmd(sw, ZDSW_POINT)))
+		return ZD_OOMEMORY;
+	cmd->x1 = floor(x);
+	cmd->y1 = floor(y);
+	cmd->x2 = cmd->x1 + 1;
+	cmd->y2 = cmd->y1 + 1;
+	cmd->paint = *p;
+	return zdsw_bin(sw, cmd);
+}
+
+/* Draw a one pixel wide line, excluding the end point */
+static ZD_errors zdsw_line(ZDSW_state *sw, ZDSW_vertex *v0, ZDSW_vertex *v1,
+		ZDSW_paint *p)
+{
+	ZDSW_clip *c = zdsw_clip(sw);
+	ZDSW_cmd *cmd;
+	float xmin = v0->x < v1->x ? v0->x : v1->x;
+	float xmax = v0->x < v1->x ? v1->x : v0->x;
+	float ymin = v0->y < v1->y ? v0->y : v1->y;
+	float ymax = v0->y < v1->y ? v1->y : v0->y;
+	if(!(cmd = zdsw_new_cmd(sw, ZDSW_LINE)))
+		return ZD_OOMEMORY;
+	cmd->d.v[0] = *v0;
+	cmd->d.v[1] = *v1;
+	cmd->paint = *p;
+	/* Pixels are plotted at floor(x, y); bin by covering the whole range */
+	cmd->x1 = zdsw_pixel_edge(xmin - 0.5f, c->x1, c->x2);
+	cmd->x2 = zdsw_pixel_edge(xmax + 1.0f, c->x1, c->x2);
+	cmd->y1 = zdsw_pixel_edge(ymin - 0.5f, c->y1, c->y2);
+	cmd->y2 = zdsw_pixel_edge(ymax + 1.0f, c->y1, c->y2);
+	return zdsw_bin(sw, cmd);
+}
+
+/* Fill the clip rectangle with an opaque color, like glClear() */
+static ZD_errors zdsw_clear(ZDSW_state *sw, float r, float g, float b)
+{
+	ZDSW_clip *c = zdsw_clip(sw);
+	ZDSW_cmd *cmd;
+	if(!(cmd = zdsw_new_cmd(sw, ZDSW_CLEAR)))
+		return ZD_OOMEMORY;
+	cmd->paint.tx = NULL;
+	cmd->paint.r = zdsw_color(r) * 255 >> 8;
+	cmd->paint.g = zdsw_color(g) * 255 >> 8;
+	cmd->paint.b = zdsw_color(b) * 255 >> 8;
+	cmd->x1 = c->x1;
+	cmd->y1 = c->y1;
+	cmd->x2 = c->x2;
+	cmd->y2 = c->y2;
+	return zdsw_bin(sw, cmd);
+}
+
+
+/*
+ * Top level scene rendering
+ */
+
+/* Start recording commands for rendering into 'pixels' */
+static ZD_errors zdsw_begin(ZDSW_state *sw, unsigned char *pixels, int w,
+		int h, int pitch)
+{
+	ZDSW_clip *c;
+	int i, n;
+	sw->pixels = pixels;
+	sw->w = w;
+	sw->h = h;
+	sw->pitch = pitch;
+	zdsw_reset_view(sw);
+
+	/* Set up the tile grid */
+	sw->tw = (sw->w + ZDSW_TILESIZE - 1) / ZDSW_TILESIZE;
+	sw->th = (sw->h + ZDSW_TILESIZE - 1) / ZDSW_TILESIZE;
+	n = sw->tw * sw->th;
+	if(n > sw->ntiles)
+	{
+		ZDSW_tile *nt = (ZDSW_tile *)realloc(sw->tiles,
+				n * sizeof(ZDSW_tile));
+		if(!nt)
+		{
+			sw->tw = sw->th = 0;
+			return ZD_OOMEMORY;
+		}
+		memset(nt + sw->ntiles, 0, (n - sw->ntiles) * sizeof(ZDSW_tile));
+		sw->tiles = nt;
+		sw->ntiles = n;
+	}
+	for(i = 0; i < n; ++i)
+		sw->tiles[i].ncmds = 0;
+	sw->ncmds = 0;
+
+	sw->clipdepth = 0;
+	sw->clipstack[0] = 0;
+	sw->nclips = 1;
+	c = sw->clips;
+	c->x1 = c->y1 = 0;
+	c->x2 = sw->w;
+	c->y2 = sw->h;
+	c->nplanes = 0;
 	return ZD_OK;
 }
 
-static ZD_errors zdsw_InitWindow(ZD_entity *e)
+static ZD_errors zdsw_PreRender(ZD_state *st)
 {
+	ZDSW_state *sw = (ZDSW_state *)st->bdata;
+	ZD_pixels *target = (ZD_pixels *)st->context;
+
+	/* The target may have been changed by the application since last frame */
+	st->displayw = target->w;
+	st->displayh = target->h;
+	return zdsw_begin(sw, target->pixels, target->w, target->h,
+			target->pitch);
+}
+
+static ZD_errors zdsw_PostRender(ZD_state *st)
+{
+	ZDSW_state *sw = (ZDSW_state *)st->bdata;
+	int i;
+	if(!sw->ncmds)
+		return ZD_OK;
+	sw->nexttile = 0;
+	for(i = 0; i < sw->nthreads; ++i)
+		SDL_SemPost(sw->start);
+	zdsw_render_tiles(sw);
+	for(i = 0; i < sw->nthreads; ++i)
+		SDL_SemWait(sw->done);
 	return ZD_OK;
 }
 
-static ZD_errors zdsw_InitGroup(ZD_entity *e)
+
+/*
+ * Layer
+ */
+
+static ZD_errors zdsw_draw_layer(ZDSW_state *sw, ZD_drawlist *dl,
+		ZD_drawop *op)
 {
+	ZD_drawvertex *lv = zd_OpVertices(dl, op);
+	ZD_f left = lv[0].x;
+	ZD_f bottom = lv[0].y;
+	ZD_f right = lv[2].x;
+	ZD_f top = lv[2].y;
+	sw->vsx = sw->w / (right - left);
+	sw->vox = -left * sw->vsx;
+	sw->vsy = -sw->h / (top - bottom);
+	sw->voy = -top * sw->vsy;
+	if(op->flags & ZD_DCLEAR)
+	{
+		if(op->a >= 1.0f)
+			return zdsw_clear(sw, op->r, op->g, op->b);
+		else
+		{
+			ZDSW_clip *c = zdsw_clip(sw);
+			ZDSW_vertex v[4];
+			ZDSW_paint p;
+			memset(v, 0, sizeof(v));
+			v[0].x = v[3].x = c->x1;
+			v[1].x = v[2].x = c->x2;
+			v[0].y = v[1].y = c->y1;
+			v[2].y = v[3].y = c->y2;
+			zdsw_init_paint(&p, op);
+			return zdsw_polygon(sw, v, 4, &p);
+		}
+	}
 	return ZD_OK;
 }
 
-static ZD_errors zdsw_InitSprite(ZD_entity *e)
+
+/*
+ * Window
+ */
+
+static ZD_errors zdsw_draw_window(ZDSW_state *sw, ZD_drawlist *dl,
+		ZD_drawop *op)
 {
+	ZDSW_vertex v[4];
+	ZD_errors res;
+	int i;
+
+	/* Transform the window corners to pixel coordinates */
+	zdsw_to_pixels(sw, zd_OpVertices(dl, op), v, 4);
+
+	/* Clear and/or fill background */
+	if(op->flags & ZD_DCLEAR)
+	{
+		ZDSW_paint p;
+		zdsw_init_paint(&p, op);
+		if((res = zdsw_polygon(sw, v, 4, &p)))
+			return res;
+	}
+
+	/* Set up clipping for subsequent rendering */
+	if((res = zdsw_push_clip(sw)))
+		return res;
+	if(op->flags & ZD_DCLIP)
+	{
+		float xmin, xmax, ymin, ymax;
+		ZDSW_clip *c;
+		if(!(c = zdsw_new_clip(sw)))
+			return ZD_OOMEMORY;
+		xmin = xmax = v[0].x;
+		ymin = ymax = v[0].y;
+		for(i = 1; i < 4; ++i)
+		{
+			if(v[i].x < xmin)
+				xmin = v[i].x;
+			if(v[i].y < ymin)
+				ymin = v[i].y;
+			if(v[i].x > xmax)
+				xmax = v[i].x;
+			if(v[i].y > ymax)
+				ymax = v[i].y;
+		}
+		c->x1 = zdsw_pixel_edge(xmin, c->x1, c->x2);
+		c->y1 = zdsw_pixel_edge(ymin, c->y1, c->y2);
+		c->x2 = zdsw_pixel_edge(xmax, c->x1, c->x2);
+		c->y2 = zdsw_pixel_edge(ymax, c->y1, c->y2);
+
+		/* Not axis aligned - add the window edges as clip planes */
+		if(!((v[0].y == v[1].y) && (v[1].x == v[2].x)) &&
+				!((v[0].x == v[1].x) && (v[1].y == v[2].y)) &&
+				(c->nplanes + 4 <= ZDSW_MAXPLANES))
+			c->nplanes += zdsw_edge_planes(v, 4,
+					c->planes + c->nplanes);
+	}
 	return ZD_OK;
 }
 
+
+/*
+ * Quad (sprite, fill)
+ */
+
+static ZD_errors zdsw_draw_quad(ZDSW_state *sw, ZD_drawlist *dl,
+		ZD_drawop *op)
+{
+	ZDSW_vertex v[4];
+	ZDSW_paint p;
+	zdsw_to_pixels(sw, zd_OpVertices(dl, op), v, 4);
+	zdsw_init_paint(&p, op);
+	if(op->flags & ZD_DAXIAL)
+		return zdsw_rect(sw, v, &p);
+	return zdsw_polygon(sw, v, 4, &p);
+}
+
+
+/*
+ * Primitive
+ */
+
+static ZD_errors zdsw_draw_primitive(ZDSW_state *sw, ZD_drawlist *dl,
+		ZD_drawop *op)
+{
+	ZDSW_vertex *v;
+	ZDSW_paint p;
+	ZD_errors res = ZD_OK;
+	int i, n = op->count;
+	if(!n)
+		return ZD_OK;
+	if(!zdsw_grow((void **)&sw->vertices, &sw->verticessize, n,
+			sizeof(ZDSW_vertex)))
+		return ZD_OOMEMORY;
+	v = sw->vertices;
+	zdsw_to_pixels(sw, zd_OpVertices(dl, op), v, n);
+	zdsw_init_paint(&p, op);
+	switch(op->pkind)
+	{
+	  case ZD_POINTS:
+		for(i = 0; !res && i < n; ++i)
+			res = zdsw_point(sw, v[i].x, v[i].y, &p);
+		break;
+	  case ZD_LINES:
+		for(i = 0; !res && i + 1 < n; i += 2)
+			res = zdsw_line(sw, v + i, v + i + 1, &p);
+		break;
+	  case ZD_LINESTRIP:
+		for(i = 0; !res && i + 1 < n; ++i)
+			res = zdsw_line(sw, v + i, v + i + 1, &p);
+		break;
+	  case ZD_LINELOOP:
+		for(i = 0; !res && i < n; ++i)
+			res = zdsw_line(sw, v + i, v + (i + 1) % n, &p);
+		break;
+	  case ZD_TRIANGLES:
+		for(i = 0; !res && i + 2 < n; i += 3)
+			res = zdsw_triangle(sw, v + i, &p);
+		break;
+	  case ZD_TRIANGLESTRIP:
+		for(i = 0; !res && i + 2 < n; ++i)
+			res = zdsw_triangle(sw, v + i, &p);
+		break;
+	  case ZD_TRIANGLEFAN:
+		for(i = 1; !res && i + 1 < n; ++i)
+		{
+			ZDSW_vertex t[3];
+			t[0] = v[0];
+			t[1] = v[i];
+			t[2] = v[i + 1];
+			res = zdsw_triangle(sw, t, &p);
+		}
+		break;
+	  case ZD_QUADS:
+		for(i = 0; !res && i + 3 < n; i += 4)
+		{
+			ZDSW_vertex t[3];
+			if((res = zdsw_triangle(sw, v + i, &p)))
+				break;
+			t[0] = v[i];
+			t[1] = v[i + 2];
+			t[2] = v[i + 3];
+			res = zdsw_triangle(sw, t, &p);
+		}
+		break;
+	}
+	return res;
+}
+
 static ZD_errors zdsw_InitPrimitive(ZD_entity *e)
 {
+	ZD_primitive *pe = (ZD_primitive *)e;
+	switch(pe->pkind)
+	{
+	  case ZD_POINTS:
+	  case ZD_LINES:
+	  case ZD_LINESTRIP:
+	  case ZD_LINELOOP:
+	  case ZD_TRIANGLES:
+	  case ZD_TRIANGLESTRIP:
+	  case ZD_TRIANGLEFAN:
+	  case ZD_QUADS:
+		break;
+	  default:
+		return ZD_BADPRIMITIVE;
+	}
 	return ZD_OK;
 }
 
-static ZD_errors zdsw_InitFill(ZD_entity *e)
+
+/*
+ * Draw list
+ */
+
+static ZD_errors zdsw_submit(ZDSW_state *sw, ZD_drawlist *dl, unsigned *i);
+
+/*
+ * Convert 'n' pixels from premultiplied to straight alpha. Drawing the result
+ * with zdsw_blend() is equivalent to GL_ONE, GL_ONE_MINUS_SRC_ALPHA with the
+ * premultiplied pixels, which is how the OpenGL backend draws buffers.
+ */
+static void zdsw_unpremultiply(unsigned char *p, int n)
 {
+	for( ; n; --n, p += 4)
+	{
+		int c, a = p[3];
+		if(!a || (a == 255))
+			continue;
+		for(c = 0; c < 3; ++c)
+		{
+			int v = (p[c] * 255 + (a >> 1)) / a;
+			p[c] = v > 255 ? 255 : v;
+		}
+	}
+}
+
+/*
+ * Render the ops of the buffer that starts at op '*i' into the buffer texture,
+ * leaving '*i' at the end of the buffer. This uses a state of its own, that is
+ * rendered right away, by the calling thread only, so that the texture is
+ * ready before the buffer is drawn.
+ */
+static ZD_errors zdsw_draw_buffer(ZDSW_state *sw, ZD_drawlist *dl,
+		unsigned *i)
+{
+	ZD_drawop *op = dl->ops + *i;
+	ZDSW_texture *xtx = (ZDSW_texture *)op->texture;
+	int w = xtx->tx.w;
+	int h = xtx->tx.h;
+	ZDSW_state *bs;
+	ZD_errors res;
+	if(!sw->buffer && !(sw->buffer = zdsw_new_state()))
+		return ZD_OOMEMORY;
+	bs = sw->buffer;
+	if(!xtx->pixels)
+		w = h = 0;	/* Nothing to render into! */
+	else
+		memset(xtx->pixels, 0, w * h * 4);
+	if((res = zdsw_begin(bs, xtx->pixels, w, h, w * 4)))
+		return res;
+	zdsw_draw_layer(bs, dl, op);
+	++*i;
+	if((res = zdsw_submit(bs, dl, i)))
+		return res;
+	zdsw_render_tiles(bs);
+	if(xtx->pixels)
+		zdsw_unpremultiply(xtx->pixels, w * h);
 	return ZD_OK;
 }
 
+/*
+ * Record the ops from '*i' on, until the end of the draw list, or of the
+ * buffer being rendered.
+ */
+static ZD_errors zdsw_submit(ZDSW_state *sw, ZD_drawlist *dl, unsigned *i)
+{
+	ZD_errors res = ZD_OK;
+	for( ; !res && *i < dl->nops; ++*i)
+	{
+		ZD_drawop *op = dl->ops + *i;
+		switch(op->kind)
+		{
+		  case ZD_DLAYER:
+			res = zdsw_draw_layer(sw, dl, op);
+			break;
+		  case ZD_DENDLAYER:
+			zdsw_reset_view(sw);
+			break;
+		  case ZD_DWINDOW:
+			res = zdsw_draw_window(sw, dl, op);
+			break;
+		  case ZD_DENDWINDOW:
+			zdsw_pop_clip(sw);
+			break;
+		  case ZD_DQUAD:
+			res = zdsw_draw_quad(sw, dl, op);
+			break;
+		  case ZD_DPRIMITIVE:
+			res = zdsw_draw_primitive(sw, dl, op);
+			break;
+		  case ZD_DMESH:
+			/* Not recorded, as we leave 'minmesh' at 0 */
+			res = ZD_NOTIMPLEMENTED;
+			break;
+		  case ZD_DBUFFER:
+			res = zdsw_draw_buffer(sw, dl, i);
+			break;
+		  case ZD_DENDBUFFER:
+			return ZD_OK;
+		}
+	}
+	return res;
+}
+
+static ZD_errors zdsw_Submit(ZD_state *st, ZD_drawlist *dl)
+{
+	unsigned i = 0;
+	return zdsw_submit((ZDSW_state *)st->bdata, dl, &i);
+}
+
 
 /*
  * Texture management
@@ -88,18 +1667,84 @@ static ZD_errors zdsw_InitFill(ZD_entity *e)
 
 static ZD_errors zdsw_InitTexture(ZD_texture *tx)
 {
+	ZDSW_texture *xtx = (ZDSW_texture *)tx;
+	xtx->pixels = NULL;
+	xtx->hwrap = (tx->flags & ZD__HMODE) != ZD_HCLAMP;
+	xtx->vwrap = (tx->flags & ZD__VMODE) != ZD_VCLAMP;
+	xtx->bilinear = (tx->flags & ZD__SMODE) != ZD_NEAREST;
+	xtx->simd = (!xtx->hwrap || zdsw_is_pot(tx->w)) &&
+			(!xtx->vwrap || zdsw_is_pot(tx->h));
+	xtx->translucent = 0;
+	if(!zd_PixelSize(tx->format) || !tx->w || !tx->h)
+		return ZD_OK;
+	if(!(xtx->pixels = (unsigned char *)calloc(tx->w * tx->h, 4)))
+		return ZD_OOMEMORY;
+	xtx->translucent = tx->w * tx->h;	/* All transparent black */
 	return ZD_OK;
 }
 
 
+/* Count the texels with alpha below 255 among the 'n' RGBA texels at 'p' */
+static unsigned zdsw_count_translucent(const unsigned char *p, unsigned n)
+{
+	unsigned count = 0;
+	for( ; n; --n, p += 4)
+		count += p[3] != 255;
+	return count;
+}
+
+
 static ZD_errors zdsw_UploadTexture(ZD_pixels *px)
 {
+	ZDSW_texture *xtx = (ZDSW_texture *)px->texture;
+	unsigned y;
+	if(!xtx->pixels)
+		return ZD_OK;
+	if((px->format != ZD_RGB) && (px->format != ZD_RGBA))
+		return ZD_NOTIMPLEMENTED;
+
+	/*
+	 * Keep track of the number of translucent texels, scanning only the
+	 * area uploaded, so we know when we can copy this texture rather
+	 * than blending it.
+	 */
+	for(y = 0; y < px->h; ++y)
+	{
+		unsigned char *s = px->pixels + y * px->pitch;
+		unsigned char *d = xtx->pixels +
+				((px->y + y) * xtx->tx.w + px->x) * 4;
+		xtx->translucent -= zdsw_count_translucent(d, px->w);
+		switch(px->format)
+		{
+		  case ZD_RGB:
+		  {
+			unsigned x;
+			for(x = 0; x < px->w; ++x, s += 4, d += 4)
+			{
+				d[0] = s[0];
+				d[1] = s[1];
+				d[2] = s[2];
+				d[3] = 255;
+			}
+			break;
+		  }
+		  case ZD_RGBA:
+			memcpy(d, s, px->w * 4);
+			xtx->translucent += zdsw_count_translucent(d, px->w);
+			break;
+		  default:
+			break;
+		}
+	}
 	return ZD_OK;
 }
 
 
 static ZD_errors zdsw_CloseTexture(ZD_texture *tx)
 {
+	ZDSW_texture *xtx = (ZDSW_texture *)tx;
+	free(xtx->pixels);
+	xtx->pixels = NULL;
 	return ZD_OK;
 }
 
@@ -109,16 +1754,19 @@ ZD_backend zd_software_backend = {
 	zdsw_Close,
 
 	zdsw_PreRender,
+	zdsw_Submit,
 	zdsw_PostRender,
 
-	zdsw_InitLayer,
-	zdsw_InitWindow,
-	zdsw_InitGroup,
-	zdsw_InitSprite,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
 	zdsw_InitPrimitive,
-	zdsw_InitFill,
+	NULL,
 
 	zdsw_InitTexture,
 	zdsw_UploadTexture,
-	zdsw_CloseTexture
+	zdsw_CloseTexture,
+
+	NULL
 };
@@ -0,0 +1,565 @@
+/*
+ * ZeeDraw - Software rendering backend span blitters
+ *
+ * Copyright 2013 David Olofson
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "zd_swspan.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#	define	ZDSW_X86
+#	include <immintrin.h>
+#	define	ZDSW_SSE2	__attribute__((target("sse2")))
+#	define	ZDSW_AVX2	__attribute__((target("avx2")))
+#endif
+
+
+/*---------------------------------------------------------
+	Portable C reference implementation
+---------------------------------------------------------*/
+
+/* Wrap or clamp texel coordinate 'i' */
+static inline int zdsw_texel_index(int i, int size, int wrap)
+{
+	if(wrap)
+	{
+		i %= size;
+		return i < 0 ? i + size : i;
+	}
+	return i < 0 ? 0 : (i >= size ? size - 1 : i);
+}
+
+/* Interpolate between 'a' and 'b'; 'w' is in [0, 255] */
+static inline int zdsw_lerp(int a, int b, int w)
+{
+	return (a * (256 - w) + b * w) >> 8;
+}
+
+static void zdsw_span_color_c(unsigned char *d, int n, ZDSW_paint *p)
+{
+	int r = p->r - (p->r >> 8);
+	int g = p->g - (p->g >> 8);
+	int b = p->b - (p->b >> 8);
+	int a = p->a - (p->a >> 8);
+	for( ; n; --n, d += 4)
+		zdsw_blend(d, r, g, b, a);
+}
+
+static void zdsw_span_nearest_c(unsigned char *d, int n, ZDSW_paint *p,
+		uint32_t u, uint32_t v, int du, int dv)
+{
+	ZDSW_texture *xtx = p->tx;
+	int tw = xtx->tx.w;
+	int th = xtx->tx.h;
+	for( ; n; --n, d += 4, u += du, v += dv)
+	{
+		int x = zdsw_texel_index(zdsw_texel(u), tw, xtx->hwrap);
+		int y = zdsw_texel_index(zdsw_texel(v), th, xtx->vwrap);
+		unsigned char *s = xtx->pixels + (y * tw + x) * 4;
+		zdsw_blend(d, (s[0] * p->r) >> 8, (s[1] * p->g) >> 8,
+				(s[2] * p->b) >> 8, (s[3] * p->a) >> 8);
+	}
+}
+
+static void zdsw_span_bilinear_c(unsigned char *d, int n, ZDSW_paint *p,
+		uint32_t u, uint32_t v, int du, int dv)
+{
+	ZDSW_texture *xtx = p->tx;
+	int tw = xtx->tx.w;
+	int th = xtx->tx.h;
+	u -= 0x8000;	/* Filter around texel centers */
+	v -= 0x8000;
+	for( ; n; --n, d += 4, u += du, v += dv)
+	{
+		int c, px[4];
+		int fx = (u >> 8) & 0xff;
+		int fy = (v >> 8) & 0xff;
+		int x0 = zdsw_texel_index(zdsw_texel(u), tw, xtx->hwrap);
+		int x1 = zdsw_texel_index(zdsw_texel(u) + 1, tw, xtx->hwrap);
+		int y0 = zdsw_texel_index(zdsw_texel(v), th, xtx->vwrap);
+		int y1 = zdsw_texel_index(zdsw_texel(v) + 1, th, xtx->vwrap);
+		unsigned char *s00 = xtx->pixels + (y0 * tw + x0) * 4;
+		unsigned char *s01 = xtx->pixels + (y0 * tw + x1) * 4;
+		unsigned char *s10 = xtx->pixels + (y1 * tw + x0) * 4;
+		unsigned char *s11 = xtx->pixels + (y1 * tw + x1) * 4;
+		for(c = 0; c < 4; ++c)
+			px[c] = zdsw_lerp(zdsw_lerp(s00[c], s01[c], fx),
+					zdsw_lerp(s10[c], s11[c], fx), fy);
+		zdsw_blend(d, (px[0] * p->r) >> 8, (px[1] * p->g) >> 8,
+				(px[2] * p->b) >> 8, (px[3] * p->a) >> 8);
+	}
+}
+
+static void zdsw_span_blit_c(unsigned char *d, const unsigned char *s, int n,
+		ZDSW_paint *p)
+{
+	for( ; n; --n, d += 4, s += 4)
+		zdsw_blend(d, (s[0] * p->r) >> 8, (s[1] * p->g) >> 8,
+				(s[2] * p->b) >> 8, (s[3] * p->a) >> 8);
+}
+
+ZDSW_spanfuncs zdsw_scalar_spans = {
+	"C",
+	zdsw_span_color_c,
+	zdsw_span_nearest_c,
+	zdsw_span_bilinear_c,
+	zdsw_span_blit_c
+};
+
+
+#ifdef ZDSW_X86
+
+/*
+ * Texel addressing for the SIMD blitters. These only deal with clamping and
+ * power-of-two wrapping; that is, textures with ZDSW_texture.simd set.
+ */
+static inline int zdsw_texel_index_pot(int i, int size, int wrap)
+{
+	if(wrap)
+		return i & (size - 1);
+	return i < 0 ? 0 : (i >= size ? size - 1 : i);
+}
+
+/*---------------------------------------------------------
+	SSE2 implementation
+---------------------------------------------------------*/
+
+/*
+ * Modulate unpacked texels 's' by 'mod', and blend the result into unpacked
+ * pixels 'd', as zdsw_blend() does. Two pixels per register; four 16 bit
+ * channels per pixel.
+ */
+static inline ZDSW_SSE2 __m128i zdsw_sse2_blend(__m128i s, __m128i d,
+		__m128i mod)
+{
+	__m128i a, ia;
+	s = _mm_srli_epi16(_mm_mullo_epi16(s, mod), 8);
+	a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+	a = _mm_add_epi16(a, _mm_srli_epi16(a, 7));
+	s = _mm_or_si128(s, _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0));
+	ia = _mm_sub_epi16(_mm_set1_epi16(256), a);
+	return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(s, a),
+			_mm_mullo_epi16(d, ia)), 8);
+}
+
+/* Interpolate unpacked pixels; weights 'w' in [0, 255] */
+static inline ZDSW_SSE2 __m128i zdsw_sse2_lerp(__m128i a, __m128i b, __m128i w)
+{
+	__m128i iw = _mm_sub_epi16(_mm_set1_epi16(256), w);
+	return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a, iw),
+			_mm_mullo_epi16(b, w)), 8);
+}
+
+static inline ZDSW_SSE2 __m128i zdsw_sse2_modulation(ZDSW_paint *p)
+{
+	return _mm_set_epi16(p->a, p->b, p->g, p->r, p->a, p->b, p->g, p->r);
+}
+
+static ZDSW_SSE2 void zdsw_span_color_sse2(unsigned char *d, int n,
+		ZDSW_paint *p)
+{
+	int a = p->a - (p->a >> 8);
+	int a256 = a + (a >> 7);
+	__m128i zero = _mm_setzero_si128();
+	__m128i ia = _mm_set1_epi16(256 - a256);
+	__m128i sa = _mm_set_epi16(255 * a256,
+			(p->b - (p->b >> 8)) * a256,
+			(p->g - (p->g >> 8)) * a256,
+			(p->r - (p->r >> 8)) * a256,
+			255 * a256,
+			(p->b - (p->b >> 8)) * a256,
+			(p->g - (p->g >> 8)) * a256,
+			(p->r - (p->r >> 8)) * a256);
+	for( ; n >= 4; n -= 4, d += 16)
+	{
+		__m128i px = _mm_loadu_si128((__m128i *)d);
+		__m128i lo = _mm_unpacklo_epi8(px, zero);
+		__m128i hi = _mm_unpackhi_epi8(px, zero);
+		lo = _mm_srli_epi16(_mm_add_epi16(sa,
+				_mm_mullo_epi16(lo, ia)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(sa,
+				_mm_mullo_epi16(hi, ia)), 8);
+		_mm_storeu_si128((__m128i *)d, _mm_packus_epi16(lo, hi));
+	}
+	if(n)
+		zdsw_span_color_c(d, n, p);
+}
+
+static ZDSW_SSE2 void zdsw_span_nearest_sse2(unsigned char *d, int n,
+		ZDSW_paint *p, uint32_t u, uint32_t v, int du, int dv)
+{
+	ZDSW_texture *xtx = p->tx;
+	int tw = xtx->tx.w;
+	int th = xtx->tx.h;
+	__m128i zero = _mm_setzero_si128();
+	__m128i mod = zdsw_sse2_modulation(p);
+	for( ; n >= 4; n -= 4, d += 16)
+	{
+		int i;
+		unsigned tex[4];
+		__m128i s, px;
+		for(i = 0; i < 4; ++i, u += du, v += dv)
+		{
+			int x = zdsw_texel_index_pot(zdsw_texel(u), tw,
+					xtx->hwrap);
+			int y = zdsw_texel_index_pot(zdsw_texel(v), th,
+					xtx->vwrap);
+			memcpy(tex + i, xtx->pixels + (y * tw + x) * 4, 4);
+		}
+		s = _mm_loadu_si128((__m128i *)tex);
+		px = _mm_loadu_si128((__m128i *)d);
+		_mm_storeu_si128((__m128i *)d, _mm_packus_epi16(
+				zdsw_sse2_blend(_mm_unpacklo_epi8(s, zero),
+					_mm_unpacklo_epi8(px, zero), mod),
+				zdsw_sse2_blend(_mm_unpackhi_epi8(s, zero),
+					_mm_unpackhi_epi8(px, zero), mod)));
+	}
+	if(n)
+		zdsw_span_nearest_c(d, n, p, u, v, du, dv);
+}
+
+static ZDSW_SSE2 void zdsw_span_bilinear_sse2(unsigned char *d, int n,
+		ZDSW_paint *p, uint32_t u, uint32_t v, int du, int dv)
+{
+	ZDSW_texture *xtx = p->tx;
+	int tw = xtx->tx.w;
+	int th = xtx->tx.h;
+	__m128i zero = _mm_setzero_si128();
+	__m128i mod = zdsw_sse2_modulation(p);
+	u -= 0x8000;
+	v -= 0x8000;
+	for( ; n >= 4; n -= 4, d += 16)
+	{
+		int i;
+		unsigned s00[4], s01[4], s10[4], s11[4], wx[4], wy[4];
+		__m128i t00, t01, t10, t11, fx, fy, px, lo, hi;
+		for(i = 0; i < 4; ++i, u += du, v += dv)
+		{
+			int x0 = zdsw_texel_index_pot(zdsw_texel(u), tw,
+					xtx->hwrap);
+			int x1 = zdsw_texel_index_pot(zdsw_texel(u) + 1, tw,
+					xtx->hwrap);
+			int y0 = zdsw_texel_index_pot(zdsw_texel(v), th,
+					xtx->vwrap);
+			int y1 = zdsw_texel_index_pot(zdsw_texel(v) + 1, th,
+					xtx->vwrap);
+			memcpy(s00 + i, xtx->pixels + (y0 * tw + x0) * 4, 4);
+			memcpy(s01 + i, xtx->pixels + (y0 * tw + x1) * 4, 4);
+			memcpy(s10 + i, xtx->pixels + (y1 * tw + x0) * 4, 4);
+			memcpy(s11 + i, xtx->pixels + (y1 * tw + x1) * 4, 4);
+			wx[i] = ((u >> 8) & 0xff) * 0x01010101u;
+			wy[i] = ((v >> 8) & 0xff) * 0x01010101u;
+		}
+		t00 = _mm_loadu_si128((__m128i *)s00);
+		t01 = _mm_loadu_si128((__m128i *)s01);
+		t10 = _mm_loadu_si128((__m128i *)s10);
+		t11 = _mm_loadu_si128((__m128i *)s11);
+		fx = _mm_loadu_si128((__m128i *)wx);
+		fy = _mm_loadu_si128((__m128i *)wy);
+		px = _mm_loadu_si128((__m128i *)d);
+		lo = zdsw_sse2_lerp(
+				zdsw_sse2_lerp(_mm_unpacklo_epi8(t00, zero),
+					_mm_unpacklo_epi8(t01, zero),
+					_mm_unpacklo_epi8(fx, zero)),
+				zdsw_sse2_lerp(_mm_unpacklo_epi8(t10, zero),
+					_mm_unpacklo_epi8(t11, zero),
+					_mm_unpacklo_epi8(fx, zero)),
+				_mm_unpacklo_epi8(fy, zero));
+		hi = zdsw_sse2_lerp(
+				zdsw_sse2_lerp(_mm_unpackhi_epi8(t00, zero),
+					_mm_unpackhi_epi8(t01, zero),
+					_mm_unpackhi_epi8(fx, zero)),
+				zdsw_sse2_lerp(_mm_unpackhi_epi8(t10, zero),
+					_mm_unpackhi_epi8(t11, zero),
+					_mm_unpackhi_epi8(fx, zero)),
+				_mm_unpackhi_epi8(fy, zero));
+		_mm_storeu_si128((__m128i *)d, _mm_packus_epi16(
+				zdsw_sse2_blend(lo,
+					_mm_unpacklo_epi8(px, zero), mod),
+				zdsw_sse2_blend(hi,
+					_mm_unpackhi_epi8(px, zero), mod)));
+	}
+	if(n)
+		zdsw_span_bilinear_c(d, n, p, u + 0x8000, v + 0x8000, du, dv);
+}
+
+static ZDSW_SSE2 void zdsw_span_blit_sse2(unsigned char *d,
+		const unsigned char *s, int n, ZDSW_paint *p)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i mod = zdsw_sse2_modulation(p);
+	for( ; n >= 4; n -= 4, d += 16, s += 16)
+	{
+		__m128i t = _mm_loadu_si128((const __m128i *)s);
+		__m128i px = _mm_loadu_si128((__m128i *)d);
+		_mm_storeu_si128((__m128i *)d, _mm_packus_epi16(
+				zdsw_sse2_blend(_mm_unpacklo_epi8(t, zero),
+					_mm_unpacklo_epi8(px, zero), mod),
+				zdsw_sse2_blend(_mm_unpackhi_epi8(t, zero),
+					_mm_unpackhi_epi8(px, zero), mod)));
+	}
+	if(n)
+		zdsw_span_blit_c(d, s, n, p);
+}
+
+static ZDSW_spanfuncs zdsw_sse2_spans = {
+	"SSE2",
+	zdsw_span_color_sse2,
+	zdsw_span_nearest_sse2,
+	zdsw_span_bilinear_sse2,
+	zdsw_span_blit_sse2
+};
+
+
+/*---------------------------------------------------------
+	AVX2 implementation
+---------------------------------------------------------*/
+
+/* AVX2 versions of the SSE2 helpers above; 2 x 2 pixels per register */
+static inline ZDSW_AVX2 __m256i zdsw_avx2_blend(__m256i s, __m256i d,
+		__m256i mod)
+{
+	__m256i a, ia;
+	s = _mm256_srli_epi16(_mm256_mullo_epi16(s, mod), 8);
+	a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xff), 0xff);
+	a = _mm256_add_epi16(a, _mm256_srli_epi16(a, 7));
+	s = _mm256_or_si256(s, _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0,
+			255, 0, 0, 0, 255, 0, 0, 0));
+	ia = _mm256_sub_epi16(_mm256_set1_epi16(256), a);
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s, a),
+			_mm256_mullo_epi16(d, ia)), 8);
+}
+
+static inline ZDSW_AVX2 __m256i zdsw_avx2_lerp(__m256i a, __m256i b, __m256i w)
+{
+	__m256i iw = _mm256_sub_epi16(_mm256_set1_epi16(256), w);
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(a, iw),
+			_mm256_mullo_epi16(b, w)), 8);
+}
+
+/* Wrap or clamp eight texel coordinates */
+static inline ZDSW_AVX2 __m256i zdsw_avx2_index(__m256i i, int size, int wrap)
+{
+	if(wrap)
+		return _mm256_and_si256(i, _mm256_set1_epi32(size - 1));
+	return _mm256_max_epi32(_mm256_setzero_si256(),
+			_mm256_min_epi32(i, _mm256_set1_epi32(size - 1)));
+}
+
+/* Fetch eight texels */
+static inline ZDSW_AVX2 __m256i zdsw_avx2_gather(ZDSW_texture *xtx,
+		__m256i x, __m256i y)
+{
+	__m256i i = _mm256_add_epi32(_mm256_mullo_epi32(y,
+			_mm256_set1_epi32(xtx->tx.w)), x);
+	return _mm256_i32gather_epi32((const int *)xtx->pixels, i, 4);
+}
+
+static ZDSW_AVX2 void zdsw_span_color_avx2(unsigned char *d, int n,
+		ZDSW_paint *p)
+{
+	int a = p->a - (p->a >> 8);
+	int a256 = a + (a >> 7);
+	int r = (p->r - (p->r >> 8)) * a256;
+	int g = (p->g - (p->g >> 8)) * a256;
+	int b = (p->b - (p->b >> 8)) * a256;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i ia = _mm256_set1_epi16(256 - a256);
+	__m256i sa = _mm256_set_epi16(255 * a256, b, g, r,
+			255 * a256, b, g, r, 255 * a256, b, g, r,
+			255 * a256, b, g, r);
+	for( ; n >= 8; n -= 8, d += 32)
+	{
+		__m256i px = _mm256_loadu_si256((__m256i *)d);
+		__m256i lo = _mm256_unpacklo_epi8(px, zero);
+		__m256i hi = _mm256_unpackhi_epi8(px, zero);
+		lo = _mm256_srli_epi16(_mm256_add_epi16(sa,
+				_mm256_mullo_epi16(lo, ia)), 8);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(sa,
+				_mm256_mullo_epi16(hi, ia)), 8);
+		_mm256_storeu_si256((__m256i *)d, _mm256_packus_epi16(lo, hi));
+	}
+	if(n)
+	{
+		_mm256_zeroupper();	/* Avoid AVX/SSE transition penalties */
+		zdsw_span_color_sse2(d, n, p);
+	}
+}
+
+static ZDSW_AVX2 void zdsw_span_nearest_avx2(unsigned char *d, int n,
+		ZDSW_paint *p, uint32_t u, uint32_t v, int du, int dv)
+{
+	ZDSW_texture *xtx = p->tx;
+	int tw = xtx->tx.w;
+	int th = xtx->tx.h;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i mod = _mm256_set_epi16(p->a, p->b, p->g, p->r,
+			p->a, p->b, p->g, p->r, p->a, p->b, p->g, p->r,
+			p->a, p->b, p->g, p->r);
+	__m256i ramp = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i vu = _mm256_add_epi32(_mm256_set1_epi32(u),
+			_mm256_mullo_epi32(ramp, _mm256_set1_epi32(du)));
+	__m256i vv = _mm256_add_epi32(_mm256_set1_epi32(v),
+			_mm256_mullo_epi32(ramp, _mm256_set1_epi32(dv)));
+	__m256i vdu = _mm256_set1_epi32((uint32_t)du * 8);
+	__m256i vdv = _mm256_set1_epi32((uint32_t)dv * 8);
+	for( ; n >= 8; n -= 8, d += 32)
+	{
+		__m256i x = zdsw_avx2_index(_mm256_srai_epi32(vu, 16),
+				tw, xtx->hwrap);
+		__m256i y = zdsw_avx2_index(_mm256_srai_epi32(vv, 16),
+				th, xtx->vwrap);
+		__m256i s = zdsw_avx2_gather(xtx, x, y);
+		__m256i px = _mm256_loadu_si256((__m256i *)d);
+		_mm256_storeu_si256((__m256i *)d, _mm256_packus_epi16(
+				zdsw_avx2_blend(_mm256_unpacklo_epi8(s, zero),
+					_mm256_unpacklo_epi8(px, zero), mod),
+				zdsw_avx2_blend(_mm256_unpackhi_epi8(s, zero),
+					_mm256_unpackhi_epi8(px, zero), mod)));
+		vu = _mm256_add_epi32(vu, vdu);
+		vv = _mm256_add_epi32(vv, vdv);
+		u += (uint32_t)du * 8;
+		v += (uint32_t)dv * 8;
+	}
+	if(n)
+	{
+		_mm256_zeroupper();	/* Avoid AVX/SSE transition penalties */
+		zdsw_span_nearest_sse2(d, n, p, u, v, du, dv);
+	}
+}
+
+static ZDSW_AVX2 void zdsw_span_bilinear_avx2(unsigned char *d, int n,
+		ZDSW_paint *p, uint32_t u, uint32_t v, int du, int dv)
+{
+	ZDSW_texture *xtx = p->tx;
+	int tw = xtx->tx.w;
+	int th = xtx->tx.h;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i one = _mm256_set1_epi32(1);
+	__m256i fmask = _mm256_set1_epi32(0xff);
+	__m256i splat = _mm256_set1_epi32(0x01010101);
+	__m256i mod = _mm256_set_epi16(p->a, p->b, p->g, p->r,
+			p->a, p->b, p->g, p->r, p->a, p->b, p->g, p->r,
+			p->a, p->b, p->g, p->r);
+	__m256i ramp = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i vu = _mm256_add_epi32(_mm256_set1_epi32(u - 0x8000),
+			_mm256_mullo_epi32(ramp, _mm256_set1_epi32(du)));
+	__m256i vv = _mm256_add_epi32(_mm256_set1_epi32(v - 0x8000),
+			_mm256_mullo_epi32(ramp, _mm256_set1_epi32(dv)));
+	__m256i vdu = _mm256_set1_epi32((uint32_t)du * 8);
+	__m256i vdv = _mm256_set1_epi32((uint32_t)dv * 8);
+	for( ; n >= 8; n -= 8, d += 32)
+	{
+		__m256i ix = _mm256_srai_epi32(vu, 16);
+		__m256i iy = _mm256_srai_epi32(vv, 16);
+		__m256i x0 = zdsw_avx2_index(ix, tw, xtx->hwrap);
+		__m256i x1 = zdsw_avx2_index(_mm256_add_epi32(ix, one),
+				tw, xtx->hwrap);
+		__m256i y0 = zdsw_avx2_index(iy, th, xtx->vwrap);
+		__m256i y1 = zdsw_avx2_index(_mm256_add_epi32(iy, one),
+				th, xtx->vwrap);
+		__m256i t00 = zdsw_avx2_gather(xtx, x0, y0);
+		__m256i t01 = zdsw_avx2_gather(xtx, x1, y0);
+		__m256i t10 = zdsw_avx2_gather(xtx, x0, y1);
+		__m256i t11 = zdsw_avx2_gather(xtx, x1, y1);
+		__m256i fx = _mm256_mullo_epi32(_mm256_and_si256(
+				_mm256_srli_epi32(vu, 8), fmask), splat);
+		__m256i fy = _mm256_mullo_epi32(_mm256_and_si256(
+				_mm256_srli_epi32(vv, 8), fmask), splat);
+		__m256i px = _mm256_loadu_si256((__m256i *)d);
+		__m256i lo = zdsw_avx2_lerp(
+				zdsw_avx2_lerp(_mm256_unpacklo_epi8(t00, zero),
+					_mm256_unpacklo_epi8(t01, zero),
+					_mm256_unpacklo_epi8(fx, zero)),
+				zdsw_avx2_lerp(_mm256_unpacklo_epi8(t10, zero),
+					_mm256_unpacklo_epi8(t11, zero),
+					_mm256_unpacklo_epi8(fx, zero)),
+				_mm256_unpacklo_epi8(fy, zero));
+		__m256i hi = zdsw_avx2_lerp(
+				zdsw_avx2_lerp(_mm256_unpackhi_epi8(t00, zero),
+					_mm256_unpackhi_epi8(t01, zero),
+					_mm256_unpackhi_epi8(fx, zero)),
+				zdsw_avx2_lerp(_mm256_unpackhi_epi8(t10, zero),
+					_mm256_unpackhi_epi8(t11, zero),
+					_mm256_unpackhi_epi8(fx, zero)),
+				_mm256_unpackhi_epi8(fy, zero));
+		_mm256_storeu_si256((__m256i *)d, _mm256_packus_epi16(
+				zdsw_avx2_blend(lo,
+					_mm256_unpacklo_epi8(px, zero), mod),
+				zdsw_avx2_blend(hi,
+					_mm256_unpackhi_epi8(px, zero), mod)));
+		vu = _mm256_add_epi32(vu, vdu);
+		vv = _mm256_add_epi32(vv, vdv);
+		u += (uint32_t)du * 8;
+		v += (uint32_t)dv * 8;
+	}
+	if(n)
+	{
+		_mm256_zeroupper();	/* Avoid AVX/SSE transition penalties */
+		zdsw_span_bilinear_sse2(d, n, p, u, v, du, dv);
+	}
+}
+
+static ZDSW_AVX2 void zdsw_span_blit_avx2(unsigned char *d,
+		const unsigned char *s, int n, ZDSW_paint *p)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i mod = _mm256_set_epi16(p->a, p->b, p->g, p->r,
+			p->a, p->b, p->g, p->r, p->a, p->b, p->g, p->r,
+			p->a, p->b, p->g, p->r);
+	for( ; n >= 8; n -= 8, d += 32, s += 32)
+	{
+		__m256i t = _mm256_loadu_si256((const __m256i *)s);
+		__m256i px = _mm256_loadu_si256((__m256i *)d);
+		_mm256_storeu_si256((__m256i *)d, _mm256_packus_epi16(
+				zdsw_avx2_blend(_mm256_unpacklo_epi8(t, zero),
+					_mm256_unpacklo_epi8(px, zero), mod),
+				zdsw_avx2_blend(_mm256_unpackhi_epi8(t, zero),
+					_mm256_unpackhi_epi8(px, zero), mod)));
+	}
+	if(n)
+	{
+		_mm256_zeroupper();	/* Avoid AVX/SSE transition penalties */
+		zdsw_span_blit_sse2(d, s, n, p);
+	}
+}
+
+static ZDSW_spanfuncs zdsw_avx2_spans = {
+	"AVX2",
+	zdsw_span_color_avx2,
+	zdsw_span_nearest_avx2,
+	zdsw_span_bilinear_avx2,
+	zdsw_span_blit_avx2
+};
+
+#endif /* ZDSW_X86 */
+
+
+ZDSW_spanfuncs *zdsw_GetSpanFuncs(void)
+{
+#if defined(ZDSW_X86) && !defined(ZDSW_SCALAR_ONLY)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		return &zdsw_avx2_spans;
+	if(__builtin_cpu_supports("sse2"))
+		return &zdsw_sse2_spans;
+#endif
+	return &zdsw_scalar_spans;
+}
@@ -0,0 +1,112 @@
+/*
+ * ZeeDraw - Software rendering backend span blitters
+ *
+ * Copyright 2013 David Olofson
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef	ZD_SWSPAN_H
+#define	ZD_SWSPAN_H
+
+#include "zd_internals.h"
+#include <stdint.h>
+
+/*
+ * Define this (here, or via -DZDSW_SCALAR_ONLY) to always use the portable C
+ * span blitters. These are the reference implementations; the SIMD versions
+ * produce identical output, as checked by test/spantest.c.
+ */
+#ifndef	ZDSW_SCALAR_ONLY
+#undef	ZDSW_SCALAR_ONLY
+#endif
+
+
+typedef struct ZDSW_texture {
+	ZD_texture	tx;
+	unsigned char	*pixels;	/* RGBA copy of the texture */
+	int		hwrap, vwrap;	/* 1 for wrapping, 0 for clamping */
+	int		bilinear;
+	int		simd;		/* Addressing supported by SIMD spans */
+	unsigned	translucent;	/* Texels with alpha below 255 */
+} ZDSW_texture;
+
+/* Fill style for a polygon */
+typedef struct ZDSW_paint {
+	ZDSW_texture	*tx;		/* NULL for plain color fill */
+	int		r, g, b, a;	/* Color modulation, [0, 256] */
+	/* Texel space texcoord gradients; U(x, y) = u0 + dudx*x + dudy*y */
+	float		u0, dudx, dudy;
+	float		v0, dvdx, dvdy;
+} ZDSW_paint;
+
+/*
+ * Textured span; (u, v) and (du, dv) are 16:16 fixed point texel coordinates.
+ * (u, v) are stepped as uint32_t, as they may wrap around when tiling.
+ */
+typedef void (*ZDSW_texspan)(unsigned char *d, int n, ZDSW_paint *p,
+		uint32_t u, uint32_t v, int du, int dv);
+
+/* Integer part of 16:16 fixed point texel coordinate 'u' */
+static inline int zdsw_texel(uint32_t u)
+{
+	return (int32_t)u >> 16;
+}
+
+typedef struct ZDSW_spanfuncs {
+	const char	*name;
+	void (*Color)(unsigned char *d, int n, ZDSW_paint *p);
+	ZDSW_texspan	Nearest;
+	ZDSW_texspan	Bilinear;
+	/* Unscaled; same as Nearest() with du = 1.0, dv = 0, from texels 's' */
+	void (*Blit)(unsigned char *d, const unsigned char *s, int n,
+			ZDSW_paint *p);
+} ZDSW_spanfuncs;
+
+/* Portable C reference implementation */
+extern ZDSW_spanfuncs zdsw_scalar_spans;
+
+/* Get the fastest span blitters supported by the CPU we're running on */
+ZDSW_spanfuncs *zdsw_GetSpanFuncs(void);
+
+
+/*
+ * Blend (r, g, b, a) into pixel 'd' using GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA
+ * for color, and GL_ONE, GL_ONE_MINUS_SRC_ALPHA for alpha, so that rendering
+ * into a buffer cleared to 0 results in premultiplied alpha.
+ *
+ * NOTE:
+ *	The weights add up to 256, so that all intermediate results fit in 16
+ *	bits. The SIMD blitters rely on this!
+ */
+static inline void zdsw_blend(unsigned char *d, int r, int g, int b, int a)
+{
+	int a256 = a + (a >> 7);
+	int ia256 = 256 - a256;
+	d[0] = (r * a256 + d[0] * ia256) >> 8;
+	d[1] = (g * a256 + d[1] * ia256) >> 8;
+	d[2] = (b * a256 + d[2] * ia256) >> 8;
+	d[3] = (255 * a256 + d[3] * ia256) >> 8;
+}
+
+/* Check if 'x' is a power of two */
+static inline int zdsw_is_pot(unsigned x)
+{
+	return x && !(x & (x - 1));
+}
+
+#endif /* ZD_SWSPAN_H */
@@ -23,22 +23,36 @@
 #include "zd_internals.h"
 #include "zd_opengl.h"
 #include "zd_software.h"
+#include "zd_null.h"
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 
 
+/* Size and alignment of entity arenas (bytes) */
+#define	ZD_ARENASIZE	65536
+#define	ZD_PAGESIZE	4096
+
+/* Space reserved for the ZD_arena header; one cache line */
+#define	ZD_ARENAHEADER	64
+
+
 /* Create a root entity (no parent!) */
 static ZD_entity *zd_create_root(ZD_state *st)
 {
-	ZD_entity *e = zd_alloc_entity(st);
+	ZD_entity *e = zd_alloc_entity(st, ZD_EROOT);
 	if(!e)
 		return NULL;
 	/* NOTE: We rely on zd_alloc_entity() to return a zero-filled block! */
 	e->kind = ZD_EROOT;
 	e->flags = ZD_RETHINK | ZD_VISIBLE;
 	e->refcount = 1;
-	e->s = 1.0f;
+	if((st->lasterror = zd_AllocTransform(e)))
+		return NULL;
+	if((st->lasterror = zd_AllocHandle(e)))
+		return NULL;
 	e->cr = 1.0f;
 	e->cg = 1.0f;
 	e->cb = 1.0f;
@@ -50,26 +64,58 @@ static ZD_entity *zd_create_root(ZD_state *st)
 }
 
 
-/* Destroy entity 'e', which must not be linked into any list! */
-static void zd_destroy_entity(ZD_entity *e)
+/*
+ * Next entity after 'e' in depth first order, within the subtree of 'top', or
+ * NULL if there are no more. Pass NULL for 'top' to walk the whole scene.
+ */
+static inline ZD_entity *zd_dfs_next(ZD_entity *e, ZD_entity *top)
+{
+	if(e->first)
+		return e->first;
+	for( ; e != top; e = e->parent)
+		if(e->next)
+			return e->next;
+	return NULL;
+}
+
+
+/* Release the textures listed as drawn into buffer 'b' */
+static void zd_free_buffer_sources(ZD_buffer *b)
+{
+	unsigned i;
+	for(i = 0; i < b->nsources; ++i)
+		zd_TextureDecRef(b->sources[i].texture);
+	free(b->sources);
+	b->sources = NULL;
+	b->nsources = 0;
+}
+
+
+/* Destroy entity 'e', which must have no children */
+static void zd_destroy_leaf(ZD_entity *e)
 {
-	while(e->first)
-	{
-		ZD_entity *ne = e->first->next;
-		zd_destroy_entity(e->first);
-		e->first = ne;
-	}
 	if(e->Destroy)
 		e->Destroy(e);
 	switch(e->kind)
 	{
 	  case ZD_EROOT:
 	  case ZD_ELAYER:
+		break;
 	  case ZD_EWINDOW:
 	  case ZD_EGROUP:
+	  {
+		ZD_buffer *b = zd_BufferOf(e);
+		if(b->texture)
+			zd_TextureDecRef(b->texture);
+		zd_free_buffer_sources(b);
+		if(e->flags & ZD_BUFFERED)
+			--e->state->nbuffered;
 		break;
-	  case ZD_ESPRITE:
+	  }
 	  case ZD_EPRIMITIVE:
+		free(((ZD_primitive *)e)->vertices);
+		/* Fall through! */
+	  case ZD_ESPRITE:
 	  case ZD_EFILL:
 	  {
 		ZD_txentity *txe = (ZD_txentity *)e;
@@ -81,6 +127,249 @@ static void zd_destroy_entity(ZD_entity *e)
 	zd_FreeEntity(e);
 }
 
+/*
+ * Destroy entity 'e' and its children, children first, in order. 'e' must not
+ * be linked into any list!
+ */
+static void zd_destroy_entity(ZD_entity *e)
+{
+	ZD_entity *top = e;
+	while(1)
+	{
+		ZD_entity *p;
+		while(e->first)
+			e = e->first;
+		if(e == top)
+			break;
+		p = e->parent;
+		if(!(p->first = e->next))
+			p->last = NULL;
+		zd_destroy_leaf(e);
+		e = p;
+	}
+	zd_destroy_leaf(top);
+}
+
+
+/*---------------------------------------------------------
+	Transform table
+---------------------------------------------------------*/
+
+/* Arrays of ZD_xftable, with element sizes. Slot data starts at ZD_XF_DATA. */
+static const struct {
+	size_t	offset;
+	size_t	size;
+} zd_xf_arrays[] = {
+	{ offsetof(ZD_xftable, freelist),	sizeof(unsigned) },
+	{ offsetof(ZD_xftable, parent),	sizeof(unsigned) },
+	{ offsetof(ZD_xftable, flags),	sizeof(unsigned char) },
+	{ offsetof(ZD_xftable, x),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, y),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, z),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, s),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, r),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, dx),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, dy),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, dz),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, ds),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, dr),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, t0),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, lmx),	4 * sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, tx),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, ty),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, tz),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, ts),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, tr),	sizeof(ZD_f) },
+	{ offsetof(ZD_xftable, trmx),	4 * sizeof(ZD_f) }
+};
+
+#define	ZD_XF_ARRAYS	(sizeof(zd_xf_arrays) / sizeof(zd_xf_arrays[0]))
+#define	ZD_XF_DATA	3
+
+static inline void **zd_xf_array(ZD_xftable *xf, unsigned a)
+{
+	return (void **)((char *)xf + zd_xf_arrays[a].offset);
+}
+
+/* Double the size of the transform table */
+static ZD_errors zd_xf_grow(ZD_xftable *xf)
+{
+	unsigned a;
+	unsigned ns = xf->size ? xf->size * 2 : 64;
+	for(a = 0; a < ZD_XF_ARRAYS; ++a)
+	{
+		void **p = zd_xf_array(xf, a);
+		void *np = realloc(*p, ns * zd_xf_arrays[a].size);
+		if(!np)
+			return ZD_OOMEMORY;
+		*p = np;
+	}
+	xf->size = ns;
+	return ZD_OK;
+}
+
+static void zd_xf_free(ZD_xftable *xf)
+{
+	unsigned a;
+	for(a = 0; a < ZD_XF_ARRAYS; ++a)
+	{
+		void **p = zd_xf_array(xf, a);
+		free(*p);
+		*p = NULL;
+	}
+	xf->size = xf->count = xf->nfree = 0;
+}
+
+/*
+ * Allocate and initialize a transform table slot for 'e', which must have its
+ * parent set. Free slots are reused only if they are after the parent slot.
+ */
+ZD_errors zd_AllocTransform(ZD_entity *e)
+{
+	ZD_xftable *xf = &e->state->xf;
+	unsigned p = e->parent ? e->parent->xf : 0;
+	unsigned i;
+	if(xf->nfree && (xf->freelist[xf->nfree - 1] > p))
+		i = xf->freelist[--xf->nfree];
+	else
+	{
+		ZD_errors res;
+		if(xf->count == xf->size)
+			if((res = zd_xf_grow(xf)))
+				return res;
+		i = xf->count++;
+	}
+	e->xf = i;
+	xf->parent[i] = p;
+	xf->flags[i] = ZD_XF_NEWMATRIX | ZD_XF_CHANGED;
+	xf->x[i] = xf->y[i] = xf->z[i] = xf->r[i] = 0.0f;
+	xf->s[i] = 1.0f;
+	xf->dx[i] = xf->dy[i] = xf->dz[i] = xf->ds[i] = xf->dr[i] = 0.0f;
+	xf->t0[i] = e->state->now;
+	xf->tx[i] = xf->ty[i] = xf->tz[i] = xf->tr[i] = 0.0f;
+	xf->ts[i] = 1.0f;
+	xf->trmx[i * 4] = xf->trmx[i * 4 + 3] = 1.0f;
+	xf->trmx[i * 4 + 1] = xf->trmx[i * 4 + 2] = 0.0f;
+	xf->dirty = 1;
+	return ZD_OK;
+}
+
+/* Return slot 'i' to the free list */
+static inline void zd_xf_release(ZD_xftable *xf, unsigned i)
+{
+	xf->flags[i] = 0;
+	xf->parent[i] = 0;
+	xf->dx[i] = xf->dy[i] = xf->dz[i] = xf->ds[i] = xf->dr[i] = 0.0f;
+	xf->freelist[xf->nfree++] = i;
+}
+
+void zd_FreeTransform(ZD_entity *e)
+{
+	ZD_xftable *xf = &e->state->xf;
+	if(xf->flags[e->xf] & ZD_XF_ANIMATED)
+		--xf->nanimated;
+	zd_xf_release(xf, e->xf);
+}
+
+/* Count 'e' and all of its descendants */
+static unsigned zd_count_entities(ZD_entity *top)
+{
+	ZD_entity *e;
+	unsigned n = 0;
+	for(e = top; e; e = zd_dfs_next(e, top))
+		++n;
+	return n;
+}
+
+/*
+ * Move the transforms of 'e' and its descendants to new slots, after the slot
+ * of the new parent of 'e'. The table must have room for the whole subtree.
+ */
+static void zd_reslot_transforms(ZD_entity *top)
+{
+	ZD_xftable *xf = &top->state->xf;
+	ZD_entity *e;
+	for(e = top; e; e = zd_dfs_next(e, top))
+	{
+		unsigned from = e->xf;
+		unsigned to;
+		unsigned a;
+		zd_AllocTransform(e);
+		to = e->xf;
+		xf->flags[to] = xf->flags[from] | ZD_XF_CHANGED;
+		for(a = ZD_XF_DATA; a < ZD_XF_ARRAYS; ++a)
+		{
+			size_t size = zd_xf_arrays[a].size;
+			char *d = *(char **)zd_xf_array(xf, a);
+			memcpy(d + to * size, d + from * size, size);
+		}
+		zd_xf_release(xf, from);
+	}
+}
+
+
+/*---------------------------------------------------------
+	Entity handles
+---------------------------------------------------------*/
+
+/* Double the size of the handle table */
+static ZD_errors zd_handles_grow(ZD_handletable *ht)
+{
+	unsigned ns = ht->size ? ht->size * 2 : 64;
+	unsigned *nfl;
+	ZD_handle *nh;
+	ZD_entity **ne;
+	if(ns > ZD_HINDEXMASK + 1)
+		return ZD_OOMEMORY;
+	if(!(nfl = (unsigned *)realloc(ht->freelist, ns * sizeof(unsigned))))
+		return ZD_OOMEMORY;
+	ht->freelist = nfl;
+	if(!(nh = (ZD_handle *)realloc(ht->handle, ns * sizeof(ZD_handle))))
+		return ZD_OOMEMORY;
+	ht->handle = nh;
+	if(!(ne = (ZD_entity **)realloc(ht->entity, ns * sizeof(ZD_entity *))))
+		return ZD_OOMEMORY;
+	ht->entity = ne;
+	ht->size = ns;
+	return ZD_OK;
+}
+
+ZD_errors zd_AllocHandle(ZD_entity *e)
+{
+	ZD_handletable *ht = &e->state->handles;
+	unsigned i;
+	if(ht->nfree)
+		i = ht->freelist[--ht->nfree];
+	else
+	{
+		ZD_errors res;
+		if(ht->count == ht->size)
+			if((res = zd_handles_grow(ht)))
+				return res;
+		if(!ht->count)
+		{
+			/* Index 0; never used, so 0 is never a valid handle */
+			ht->handle[0] = 0;
+			ht->entity[0] = NULL;
+			ht->count = 1;
+		}
+		i = ht->count++;
+		ht->handle[i] = i;
+	}
+	ht->entity[i] = e;
+	e->handle = ht->handle[i];
+	return ZD_OK;
+}
+
+void zd_FreeHandle(ZD_entity *e)
+{
+	ZD_handletable *ht = &e->state->handles;
+	unsigned i = e->handle & ZD_HINDEXMASK;
+	ht->entity[i] = NULL;
+	ht->handle[i] += 1U << ZD_HINDEXBITS;
+	ht->freelist[ht->nfree++] = i;
+}
+
 
 /*---------------------------------------------------------
 -----------------------------------------------------------
@@ -99,15 +388,20 @@ ZD_state *zd_Open(const char *renderer, ZD_openflags flags, void *context)
 	}
 	st->flags = flags;
 	st->context = context;
-	zd_BumpEntitySize(st, sizeof(ZD_layer));
-	zd_BumpEntitySize(st, sizeof(ZD_window));
-	zd_BumpEntitySize(st, sizeof(ZD_sprite));
-	zd_BumpEntitySize(st, sizeof(ZD_fill));
+	zd_BumpEntitySize(st, ZD_EROOT, sizeof(ZD_entity));
+	zd_BumpEntitySize(st, ZD_ELAYER, sizeof(ZD_layer));
+	zd_BumpEntitySize(st, ZD_EWINDOW, sizeof(ZD_window));
+	zd_BumpEntitySize(st, ZD_EGROUP, sizeof(ZD_group));
+	zd_BumpEntitySize(st, ZD_ESPRITE, sizeof(ZD_sprite));
+	zd_BumpEntitySize(st, ZD_EPRIMITIVE, sizeof(ZD_primitive));
+	zd_BumpEntitySize(st, ZD_EFILL, sizeof(ZD_fill));
 	zd_BumpTextureSize(st, sizeof(ZD_texture));
 	if(!renderer || !strcmp(renderer, "opengl"))
 		st->backend = &zd_opengl_backend;
 	else if(!strcmp(renderer, "software"))
 		st->backend = &zd_software_backend;
+	else if(!strcmp(renderer, "null"))
+		st->backend = &zd_null_backend;
 	if(!st->backend)
 	{
 		free(st);
@@ -125,21 +419,44 @@ ZD_state *zd_Open(const char *renderer, ZD_openflags flags, void *context)
 }
 
 
-void zd_Close(ZD_state *state)
+static void zd_free_arenas(ZD_arena *a)
 {
-	zd_destroy_entity(state->root);
-	while(state->pool)
+	while(a)
 	{
-		ZD_entity *e = state->pool;
-		state->pool = e->next;
-		free(e);
+		ZD_arena *na = a->next;
+		free(a->block);
+		a = na;
 	}
+}
+
+
+void zd_Close(ZD_state *state)
+{
+	zd_destroy_entity(state->root);
+	zd_free_arenas(state->arenas);
+	zd_free_arenas(state->oldarenas);
 	state->root = NULL;
+	zd_xf_free(&state->xf);
+	free(state->stack);
+	free(state->drawlist.ops);
+	free(state->drawlist.vertices);
+	free(state->handles.entity);
+	free(state->handles.handle);
+	free(state->handles.freelist);
 	state->backend->Close(state);
 	free(state);
 }
 
 
+ZD_errors zd_StateCacheCounts(ZD_state *state, unsigned *hits,
+		unsigned *misses)
+{
+	if(!state->backend->CacheCounts)
+		return ZD_NOTSUPPORTED;
+	return state->backend->CacheCounts(state, hits, misses);
+}
+
+
 /*---------------------------------------------------------
 -----------------------------------------------------------
 	Textures
@@ -149,13 +466,25 @@ void zd_Close(ZD_state *state)
 static inline void zd_PixelsFromTexture(ZD_pixels *pixels, ZD_texture *texture)
 {
 	pixels->texture = texture;
-	pixels->pixels = texture->t.p.pixels;
 	pixels->x = 0;
 	pixels->y = 0;
 	pixels->w = texture->w;
 	pixels->h = texture->h;
-	pixels->pitch = texture->w * zd_PixelSize(texture->format);
 	pixels->format = texture->format;
+	if(texture->type == ZD_TT_SUBTEXTURE)
+	{
+		/* Subtextures are areas of the pixels of their atlas page */
+		ZD_texture *phys = texture->t.s.phys;
+		pixels->pitch = phys->w * zd_PixelSize(phys->format);
+		pixels->pixels = phys->t.p.pixels +
+				texture->t.s.y * pixels->pitch +
+				texture->t.s.x * zd_PixelSize(phys->format);
+	}
+	else
+	{
+		pixels->pixels = texture->t.p.pixels;
+		pixels->pitch = texture->w * zd_PixelSize(texture->format);
+	}
 }
 
 
@@ -172,28 +501,9 @@ static ZD_errors zd_default_texonrender(ZD_pixels *pixels, void *userdata)
 }
 
 
-ZD_errors zd_TextureOnRender(ZD_texture *texture,
-		ZD_texrendercb callback, void *userdata)
-{
-	if(!(texture->flags & (ZD_VIRTUAL | ZD_ONDEMAND)))
-		return ZD_NOTSUPPORTED;
-	if(callback)
-	{
-		texture->Render = callback;
-		texture->userdata = userdata;
-	}
-	else
-	{
-		texture->Render = zd_default_texonrender;
-		texture->userdata = NULL;
-	}
-	return ZD_OK;
-}
-
-
 static void zd_FreeTexturePixels(ZD_texture *texture)
 {
-	if(texture->t.p.pixels)
+	if((texture->type == ZD_TT_PHYSICAL) && texture->t.p.pixels)
 		free(texture->t.p.pixels);
 }
 
@@ -223,8 +533,8 @@ static ZD_texture *zd_AllocTexture(ZD_state *st)
 	return tx;
 }
 
-/* Create a new texture */
-ZD_texture *zd_Texture(ZD_state *state, ZD_pixelformats format,
+/* Create a new physical texture, that is never packed into an atlas */
+static ZD_texture *zd_new_texture(ZD_state *state, ZD_pixelformats format,
 		ZD_texflags flags, unsigned w, unsigned h)
 {
 	ZD_backend *be = state->backend;
@@ -232,7 +542,7 @@ ZD_texture *zd_Texture(ZD_state *state, ZD_pixelformats format,
 	ZD_texture *tx;
 	if(flags & ZD_VIRTUAL)
 	{
-		zd_lasterror = ZD_NOTIMPLEMENTED;
+		zd_lasterror = ZD_NOTSUPPORTED;
 		return NULL;
 	}
 	if(flags & ZD_ONDEMAND)
@@ -297,86 +607,589 @@ ZD_texture *zd_Texture(ZD_state *state, ZD_pixelformats format,
 }
 
 
-ZD_texture *zd_OnDemandTexture(ZD_state *state, ZD_pixelformats format,
-		ZD_texflags flags, unsigned w, unsigned h,
-		ZD_texrendercb callback, void *userdata)
+/*---------------------------------------------------------
+	Texture atlas
+---------------------------------------------------------*/
+
+/* Create a new, empty atlas page for subtextures with 'format' and 'flags' */
+static ZD_atlaspage *zd_atlas_new_page(ZD_state *st, ZD_pixelformats format,
+		ZD_texflags flags)
 {
-	ZD_texture *tx = zd_Texture(state, format, flags | ZD_NOCLEAR, w, h);
-	if(!tx)
+	ZD_pixels px;
+	unsigned size = st->atlassize;
+	ZD_atlaspage *pg = (ZD_atlaspage *)calloc(1, sizeof(ZD_atlaspage));
+	if(!pg)
 		return NULL;
-	tx->flags |= ZD_ONDEMAND;
-	tx->Render = callback;
-	tx->userdata = userdata;
-	return tx;
-}
+	if(!(pg->skyline = (unsigned *)calloc(size, sizeof(unsigned))))
+	{
+		free(pg);
+		return NULL;
+	}
+	pg->texture = zd_new_texture(st, format, (flags & ZD__SMODE) |
+			ZD_HCLAMP | ZD_VCLAMP | ZD_NOCLEAR, size, size);
+	if(!pg->texture)
+	{
+		free(pg->skyline);
+		free(pg);
+		return NULL;
+	}
 
+	/* Clear, and have the backend allocate the whole page */
+	zd_LockTexture(pg->texture, &px);
+	memset(px.pixels, 0, px.pitch * px.h);
+	zd_UnlockTexture(&px);
 
-void zd_DestroyTexture(ZD_texture *tx)
-{
-	ZD_backend *be = tx->state->backend;
-	if(be->CloseTexture)
-		be->CloseTexture(tx);
-	zd_FreeTexturePixels(tx);
-	free(tx);
+	pg->next = st->atlas;
+	st->atlas = pg;
+	return pg;
 }
 
-
-void zd_RetainTexture(ZD_texture *tx)
+/*
+ * Find the lowest place for a w x h area on page 'pg', leftmost if there are
+ * several. Returns 0, and the position in '*x' and '*y', or -1 if the area
+ * does not fit. The area is not reserved; see zd_atlas_reserve().
+ */
+static int zd_atlas_place(ZD_atlaspage *pg, unsigned w, unsigned h,
+		unsigned *x, unsigned *y)
 {
-	zd_TextureIncRef(tx);
+	unsigned size = pg->texture->w;
+	unsigned i, j, bestx = 0, besty = size;
+	for(i = 0; i + w <= size; ++i)
+	{
+		unsigned top = 0;
+		for(j = i; j < i + w; ++j)
+			if(pg->skyline[j] > top)
+				top = pg->skyline[j];
+		if(top < besty)
+		{
+			bestx = i;
+			besty = top;
+		}
+	}
+	if(besty + h > size)
+		return -1;
+	*x = bestx;
+	*y = besty;
+	return 0;
 }
 
-
-void zd_ReleaseTexture(ZD_texture *tx)
+/* Reserve the w x h area at (x, y) on page 'pg', found by zd_atlas_place() */
+static void zd_atlas_reserve(ZD_atlaspage *pg, unsigned x, unsigned y,
+		unsigned w, unsigned h)
 {
-	zd_TextureDecRef(tx);
+	unsigned i;
+	for(i = x; i < x + w; ++i)
+		pg->skyline[i] = y + h;
 }
 
+/* Drop a subtexture from page 'pg', destroying the page if empty */
+static void zd_atlas_release(ZD_atlaspage *pg)
+{
+	ZD_state *st = pg->texture->state;
+	ZD_atlaspage **pgp;
+	if(--pg->nsub)
+		return;
+	for(pgp = &st->atlas; *pgp != pg; pgp = &(*pgp)->next)
+		;
+	*pgp = pg->next;
+	zd_TextureDecRef(pg->texture);
+	free(pg->skyline);
+	free(pg);
+}
 
-/*---------------------------------------------------------
-	Texture pixel access
----------------------------------------------------------*/
-
-ZD_texture *zd_TextureFromData(ZD_state *state, ZD_pixelformats format,
-		ZD_texflags flags, unsigned w, unsigned h, void *pixels)
+/*
+ * Create a subtexture on a suitable atlas page, adding a new page if needed.
+ * Returns NULL if the texture is not small enough, or uses mipmapping.
+ */
+static ZD_texture *zd_atlas_texture(ZD_state *st, ZD_pixelformats format,
+		ZD_texflags flags, unsigned w, unsigned h)
 {
-	ZD_errors res;
-	ZD_pixels px;
-	ZD_texture *tx = zd_Texture(state, format, flags | ZD_NOCLEAR, w, h);
-	if(!tx)
+	ZD_backend *be = st->backend;
+	unsigned bw = w + 2 * ZD_ATLASBORDER;
+	unsigned bh = h + 2 * ZD_ATLASBORDER;
+	unsigned x = 0, y = 0;
+	ZD_atlaspage *pg;
+	ZD_texture *tx;
+	switch(flags & ZD__SMODE)
+	{
+	  case ZD_NEAREST:
+	  case ZD_BILINEAR:
+		break;
+	  default:
 		return NULL;
-	if((res = zd_LockTexture(tx, &px)))
+	}
+	if(!w || !h || (w > st->atlasmax) || (h > st->atlasmax) ||
+			(bw > st->atlassize) || (bh > st->atlassize))
 		return NULL;
-/*TODO: Padding for row alignment! */
-	memcpy(px.pixels, pixels, w * h * zd_PixelSize(format));
-	zd_UnlockTexture(&px);
+	if((format != ZD_RGB) && (format != ZD_RGBA))
+		return NULL;
+	if(flags & (ZD_VIRTUAL | ZD_ONDEMAND))
+		return NULL;
+
+	if(!(tx = zd_AllocTexture(st)))
+		return NULL;
+	for(pg = st->atlas; pg; pg = pg->next)
+		if((pg->texture->format == format) &&
+				((pg->texture->flags & ZD__SMODE) ==
+				(flags & ZD__SMODE)) &&
+				!zd_atlas_place(pg, bw, bh, &x, &y))
+			break;
+	if(!pg)
+	{
+		if(!(pg = zd_atlas_new_page(st, format, flags)))
+		{
+			free(tx);
+			return NULL;
+		}
+		zd_atlas_place(pg, bw, bh, &x, &y);	/* Fits when empty */
+	}
+
+	tx->flags = flags | ZD_UNDEFINED;
+	tx->format = format;
+	tx->w = w;
+	tx->h = h;
+	tx->type = ZD_TT_SUBTEXTURE;
+	tx->t.s.phys = pg->texture;
+	tx->t.s.x = x + ZD_ATLASBORDER;
+	tx->t.s.y = y + ZD_ATLASBORDER;
+	tx->t.s.page = pg;
+	++pg->nsub;
+	if(be->InitTexture && be->InitTexture(tx))
+	{
+		zd_atlas_release(pg);	/* Destroys the page if new */
+		free(tx);
+		return NULL;
+	}
+	zd_atlas_reserve(pg, x, y, bw, bh);
+	tx->next = st->textures;
+	st->textures = tx;
+	tx->refcount = 1;
 	return tx;
 }
 
-
-/*
- * NOTE:
- *	Currently, we keep textures buffered unless they're set up to be
- *	rendered on demand (callbacks), so we don't need to do download
- *	anything when locking.
- */
-ZD_errors zd_LockTexture(ZD_texture *texture, ZD_pixels *pixels)
+/* Repeat the edge pixels of subtexture 'tx' into its border */
+static void zd_atlas_border(ZD_texture *tx)
 {
-	zd_PixelsFromTexture(pixels, texture);
-	if(!(texture->flags & ZD_NOCLEAR) && (texture->flags & ZD_UNDEFINED))
+	ZD_pixels px;
+	unsigned char *p;
+	unsigned y;
+	zd_PixelsFromTexture(&px, tx);
+	p = px.pixels;
+	for(y = 0; y < px.h; ++y, p += px.pitch)
 	{
-		zd_default_texonrender(pixels, NULL);
-		texture->flags &= ~ZD_UNDEFINED;
+		memcpy(p - 4, p, 4);
+		memcpy(p + px.w * 4, p + (px.w - 1) * 4, 4);
 	}
-	zd_TextureIncRef(texture);
-	return ZD_OK;
+	p = px.pixels - 4;
+	memcpy(p - px.pitch, p, (px.w + 2) * 4);
+	p += (px.h - 1) * px.pitch;
+	memcpy(p + px.pitch, p, (px.w + 2) * 4);
 }
 
-
-ZD_errors zd_LockTextureRegion(ZD_texture *texture, ZD_pixels *pixels,
-		unsigned x, unsigned y, unsigned w, unsigned h)
+/*
+ * Move subtexture 'tx' out of its atlas page, into a physical texture of its
+ * own, so that texture coordinates outside the texture wrap or clamp as
+ * usual. Does nothing to physical textures.
+ */
+static ZD_errors zd_unpack_texture(ZD_texture *tx)
 {
-	if(x > texture->w || y > texture->h ||
+	ZD_backend *be = tx->state->backend;
+	ZD_errors res;
+	ZD_pixels px;
+	ZD_subtexture sub;
+	unsigned char *pixels;
+	unsigned y, rowsize = tx->w * zd_PixelSize(tx->format);
+	if(tx->type != ZD_TT_SUBTEXTURE)
+		return ZD_OK;
+	if(!(pixels = (unsigned char *)malloc(rowsize * tx->h)))
+		return ZD_OOMEMORY;
+	zd_PixelsFromTexture(&px, tx);
+	for(y = 0; y < tx->h; ++y)
+		memcpy(pixels + y * rowsize, px.pixels + y * px.pitch, rowsize);
+	if(be->CloseTexture)
+		be->CloseTexture(tx);
+	sub = tx->t.s;
+	memset(&tx->t, 0, sizeof(tx->t));
+	tx->type = ZD_TT_PHYSICAL;
+	tx->t.p.pixels = pixels;
+	if(be->InitTexture && (res = be->InitTexture(tx)))
+	{
+		/*
+		 * Put the texture back where it was, so it can still be drawn.
+		 * Its place on the atlas page was never given up, and making a
+		 * subtexture only refers to the page, so this cannot fail.
+		 */
+		free(pixels);
+		memset(&tx->t, 0, sizeof(tx->t));
+		tx->type = ZD_TT_SUBTEXTURE;
+		tx->t.s = sub;
+		be->InitTexture(tx);
+		return res;
+	}
+	zd_atlas_release(sub.page);
+	zd_PixelsFromTexture(&px, tx);
+	if(be->UploadTexture)
+		return be->UploadTexture(&px);
+	return ZD_OK;
+}
+
+
+/*---------------------------------------------------------
+	Virtual textures
+---------------------------------------------------------*/
+
+static ZD_texture *zd_virtual_texture(ZD_state *state, ZD_pixelformats format,
+		ZD_texflags flags, unsigned w, unsigned h)
+{
+	ZD_texture *tx;
+	if(flags & ZD_ONDEMAND)
+	{
+		zd_lasterror = ZD_NOTSUPPORTED;
+		return NULL;
+	}
+	if((format != ZD_RGB) && (format != ZD_RGBA))
+	{
+		zd_lasterror = ZD_BADFORMAT;
+		return NULL;
+	}
+	if(!w || !h)
+	{
+		zd_lasterror = ZD_BADARGUMENTS;
+		return NULL;
+	}
+	if(!(tx = zd_AllocTexture(state)))
+		return NULL;
+	tx->flags = flags;
+	tx->format = format;
+	tx->w = w;
+	tx->h = h;
+	tx->type = ZD_TT_VIRTUAL;
+	tx->t.v.w = (w + ZD_VTILESTEP - 1) / ZD_VTILESTEP;
+	tx->t.v.h = (h + ZD_VTILESTEP - 1) / ZD_VTILESTEP;
+	tx->t.v.maxtiles = ZD_VCACHESIZE;
+	tx->next = state->textures;
+	state->textures = tx;
+	tx->refcount = 1;
+	return tx;
+}
+
+/* Release all tiles of virtual texture 'tx' */
+static void zd_vtile_flush(ZD_texture *tx)
+{
+	ZD_virtualtexture *vt = &tx->t.v;
+	unsigned i;
+	for(i = 0; i < vt->ntiles; ++i)
+		zd_TextureDecRef(vt->tiles[i].texture);
+	free(vt->tiles);
+	vt->tiles = NULL;
+	vt->ntiles = 0;
+}
+
+/* Have all tiles of virtual texture 'tx' rendered again when next used */
+static void zd_vtile_invalidate(ZD_texture *tx)
+{
+	ZD_virtualtexture *vt = &tx->t.v;
+	unsigned i;
+	for(i = 0; i < vt->ntiles; ++i)
+		vt->tiles[i].x = vt->tiles[i].y = -1;
+}
+
+/*
+ * Repeat the pixels at the edges of the w x h area at (x, y) of 'px' into
+ * the pixels around it, where the area does not reach the edges of 'px'.
+ */
+static void zd_vtile_edges(ZD_pixels *px, unsigned x, unsigned y,
+		unsigned w, unsigned h)
+{
+	unsigned char *p = px->pixels + y * px->pitch;
+	unsigned i;
+	for(i = 0; i < h; ++i, p += px->pitch)
+	{
+		if(x > 0)
+			memcpy(p + (x - 1) * 4, p + x * 4, 4);
+		if(x + w < px->w)
+			memcpy(p + (x + w) * 4, p + (x + w - 1) * 4, 4);
+	}
+	if(x > 0)
+	{
+		--x;
+		++w;
+	}
+	if(x + w < px->w)
+		++w;
+	p = px->pixels + y * px->pitch + x * 4;
+	if(y > 0)
+		memcpy(p - px->pitch, p, w * 4);
+	if(y + h < px->h)
+		memcpy(p + h * px->pitch, p + (h - 1) * px->pitch, w * 4);
+}
+
+/*
+ * Set up the segments of axis 'n' (0 == x) of a tile starting at texel 'o',
+ * in a virtual texture of size 'size'. Segments outside the texture are only
+ * added for wrapping axes, and are rendered from the opposite edge.
+ */
+static int zd_vtile_segments(int o, int size, int wrap, int seg[3][3])
+{
+	int n = 0;
+	int e = o + ZD_VTILESIZE;
+	if(o < 0 && wrap)
+	{
+		seg[n][0] = o;
+		seg[n][1] = 0;
+		seg[n++][2] = o + size;
+	}
+	seg[n][0] = o < 0 ? 0 : o;
+	seg[n][1] = e > size ? size : e;
+	seg[n][2] = seg[n][0];
+	++n;
+	if(e > size && wrap)
+	{
+		seg[n][0] = size;
+		seg[n][1] = e < size + ZD_VTILEBORDER ? e : size + ZD_VTILEBORDER;
+		seg[n++][2] = 0;
+	}
+	return n;
+}
+
+/* Render tile 't' of virtual texture 'tx' via the texture callback */
+static ZD_errors zd_vtile_render(ZD_texture *tx, ZD_vtile *t)
+{
+	ZD_texrendercb cb = tx->Render ? tx->Render : zd_default_texonrender;
+	ZD_pixels px, vpx;
+	ZD_errors res = ZD_OK, ures;
+	int ox = t->x * ZD_VTILESTEP - ZD_VTILEBORDER;
+	int oy = t->y * ZD_VTILESTEP - ZD_VTILEBORDER;
+	int xs[3][3], ys[3][3];
+	int nx = zd_vtile_segments(ox, tx->w,
+			(tx->flags & ZD__HMODE) != ZD_HCLAMP, xs);
+	int ny = zd_vtile_segments(oy, tx->h,
+			(tx->flags & ZD__VMODE) != ZD_VCLAMP, ys);
+	int i, j;
+
+	if((ures = zd_LockTexture(t->texture, &px)))
+		return ures;
+	vpx = px;
+	vpx.texture = tx;
+	for(j = 0; j < ny && !res; ++j)
+		for(i = 0; i < nx && !res; ++i)
+		{
+			vpx.x = xs[i][2];
+			vpx.y = ys[j][2];
+			vpx.w = xs[i][1] - xs[i][0];
+			vpx.h = ys[j][1] - ys[j][0];
+			vpx.pixels = px.pixels + (ys[j][0] - oy) * px.pitch +
+					(xs[i][0] - ox) * zd_PixelSize(px.format);
+			res = cb(&vpx, tx->userdata);
+		}
+
+	/* Replicate the edges where nothing was rendered around the area */
+	zd_vtile_edges(&px, xs[0][0] - ox, ys[0][0] - oy,
+			xs[nx - 1][1] - xs[0][0], ys[ny - 1][1] - ys[0][0]);
+	ures = zd_UnlockTexture(&px);
+	return res ? res : ures;
+}
+
+/*
+ * Set '*tile' to the physical texture of tile (x, y) of virtual texture 'tx',
+ * rendering it if it's not in the cache. '*tile' is set to NULL if the cache
+ * is full of tiles used in the current frame.
+ */
+static ZD_errors zd_vtile(ZD_texture *tx, int x, int y, ZD_texture **tile)
+{
+	ZD_state *st = tx->state;
+	ZD_virtualtexture *vt = &tx->t.v;
+	ZD_vtile *t, *lru = NULL;
+	ZD_errors res;
+	unsigned i;
+	*tile = NULL;
+	for(i = 0; i < vt->ntiles; ++i)
+	{
+		t = vt->tiles + i;
+		if((t->x == x) && (t->y == y))
+		{
+			t->used = st->frame;
+			*tile = t->texture;
+			return ZD_OK;
+		}
+		if((t->used != st->frame) && (!lru ||
+				(st->frame - t->used > st->frame - lru->used)))
+			lru = t;
+	}
+	if(vt->ntiles < vt->maxtiles)
+	{
+		if(!vt->tiles && !(vt->tiles = (ZD_vtile *)calloc(vt->maxtiles,
+				sizeof(ZD_vtile))))
+			return ZD_OOMEMORY;
+		t = vt->tiles + vt->ntiles;
+		t->texture = zd_new_texture(st, tx->format,
+				(tx->flags & ZD__SMODE) | ZD_HCLAMP |
+				ZD_VCLAMP | ZD_NOCLEAR,
+				ZD_VTILESIZE, ZD_VTILESIZE);
+		if(!t->texture)
+			return zd_lasterror;
+		++vt->ntiles;
+	}
+	else if(!(t = lru))
+		return ZD_OK;
+	t->x = x;
+	t->y = y;
+	t->used = st->frame;
+	if((res = zd_vtile_render(tx, t)))
+	{
+		t->x = t->y = -1;
+		return res;
+	}
+	*tile = t->texture;
+	return ZD_OK;
+}
+
+
+ZD_errors zd_TextureCacheSize(ZD_texture *texture, unsigned tiles)
+{
+	if(texture->type != ZD_TT_VIRTUAL)
+		return ZD_NOTSUPPORTED;
+	if(!tiles)
+		return ZD_BADARGUMENTS;
+	zd_vtile_flush(texture);
+	texture->t.v.maxtiles = tiles;
+	return ZD_OK;
+}
+
+
+ZD_errors zd_TextureOnRender(ZD_texture *texture,
+		ZD_texrendercb callback, void *userdata)
+{
+	if(!(texture->flags & (ZD_VIRTUAL | ZD_ONDEMAND)))
+		return ZD_NOTSUPPORTED;
+	if(texture->type == ZD_TT_VIRTUAL)
+		zd_vtile_invalidate(texture);
+	++texture->serial;
+	if(callback)
+	{
+		texture->Render = callback;
+		texture->userdata = userdata;
+	}
+	else
+	{
+		texture->Render = zd_default_texonrender;
+		texture->userdata = NULL;
+	}
+	return ZD_OK;
+}
+
+
+/*
+ * Create a new texture. Small textures are packed into atlas pages, if the
+ * backend supports that.
+ */
+ZD_texture *zd_Texture(ZD_state *state, ZD_pixelformats format,
+		ZD_texflags flags, unsigned w, unsigned h)
+{
+	if(flags & ZD_VIRTUAL)
+		return zd_virtual_texture(state, format, flags, w, h);
+	if(state->atlassize)
+	{
+		ZD_texture *tx = zd_atlas_texture(state, format, flags, w, h);
+		if(tx)
+			return tx;
+	}
+	return zd_new_texture(state, format, flags, w, h);
+}
+
+
+ZD_texture *zd_OnDemandTexture(ZD_state *state, ZD_pixelformats format,
+		ZD_texflags flags, unsigned w, unsigned h,
+		ZD_texrendercb callback, void *userdata)
+{
+	ZD_texture *tx = zd_new_texture(state, format, flags | ZD_NOCLEAR,
+			w, h);
+	if(!tx)
+		return NULL;
+	tx->flags |= ZD_ONDEMAND;
+	tx->Render = callback;
+	tx->userdata = userdata;
+	return tx;
+}
+
+
+void zd_DestroyTexture(ZD_texture *tx)
+{
+	ZD_backend *be = tx->state->backend;
+	if(tx->type == ZD_TT_VIRTUAL)
+		zd_vtile_flush(tx);	/* Backends never see these */
+	else if(be->CloseTexture)
+		be->CloseTexture(tx);
+	if(tx->type == ZD_TT_SUBTEXTURE)
+		zd_atlas_release(tx->t.s.page);
+	zd_FreeTexturePixels(tx);
+	free(tx);
+}
+
+
+void zd_RetainTexture(ZD_texture *tx)
+{
+	zd_TextureIncRef(tx);
+}
+
+
+void zd_ReleaseTexture(ZD_texture *tx)
+{
+	zd_TextureDecRef(tx);
+}
+
+
+/*---------------------------------------------------------
+	Texture pixel access
+---------------------------------------------------------*/
+
+ZD_texture *zd_TextureFromData(ZD_state *state, ZD_pixelformats format,
+		ZD_texflags flags, unsigned w, unsigned h, void *pixels)
+{
+	ZD_errors res;
+	ZD_pixels px;
+	unsigned y, rowsize = w * zd_PixelSize(format);
+	ZD_texture *tx = zd_Texture(state, format, flags | ZD_NOCLEAR, w, h);
+	if(!tx)
+		return NULL;
+	if((res = zd_LockTexture(tx, &px)))
+		return NULL;
+	/* Row by row, as subtextures have the pitch of their atlas page */
+	for(y = 0; y < h; ++y)
+		memcpy(px.pixels + y * px.pitch,
+				(unsigned char *)pixels + y * rowsize, rowsize);
+	zd_UnlockTexture(&px);
+	return tx;
+}
+
+
+/*
+ * NOTE:
+ *	Currently, we keep textures buffered unless they're set up to be
+ *	rendered on demand (callbacks), so we don't need to do download
+ *	anything when locking.
+ */
+ZD_errors zd_LockTexture(ZD_texture *texture, ZD_pixels *pixels)
+{
+	if(texture->type == ZD_TT_VIRTUAL)
+		return ZD_NOTSUPPORTED;	/* Rendered via callback only */
+	zd_PixelsFromTexture(pixels, texture);
+	if(!(texture->flags & ZD_NOCLEAR) && (texture->flags & ZD_UNDEFINED))
+	{
+		zd_default_texonrender(pixels, NULL);
+		texture->flags &= ~ZD_UNDEFINED;
+	}
+	zd_TextureIncRef(texture);
+	return ZD_OK;
+}
+
+
+ZD_errors zd_LockTextureRegion(ZD_texture *texture, ZD_pixels *pixels,
+		unsigned x, unsigned y, unsigned w, unsigned h)
+{
+	if(texture->type == ZD_TT_VIRTUAL)
+		return ZD_NOTSUPPORTED;
+	if(x > texture->w || y > texture->h ||
 			(x + w) > texture->w || (y + h) > texture->h)
 		return ZD_CLIPPING;
 	zd_PixelsFromTexture(pixels, texture);
@@ -390,6 +1203,7 @@ ZD_errors zd_LockTextureRegion(ZD_texture *texture, ZD_pixels *pixels,
 	pixels->y = y;
 	pixels->w = w;
 	pixels->h = h;
+	zd_TextureIncRef(texture);
 	return ZD_OK;
 }
 
@@ -402,6 +1216,9 @@ ZD_errors zd_UnlockTexture(ZD_pixels *pixels)
 	if(!tx)
 		return ZD_UNLOCKED;
 	be = tx->state->backend;
+	if(tx->type == ZD_TT_SUBTEXTURE)
+		zd_atlas_border(tx);
+	++tx->serial;	/* Buffers drawing this need redrawing */
 	if(be->UploadTexture)
 		res = be->UploadTexture(pixels);
 	zd_TextureDecRef(tx);
@@ -432,19 +1249,43 @@ ZD_entity *zd_Next(ZD_entity *entity)
 }
 
 
-ZD_entity *zd_alloc_entity(ZD_state *st)
+/* Add a new arena to 'st', and set '*next' and '*end' to its usable space */
+static ZD_errors zd_new_arena(ZD_state *st, char **next, char **end)
 {
-	ZD_entity *e = (ZD_entity *)calloc(1, st->entitysize);
-	if(!e)
-	{
-		st->lasterror = ZD_OOMEMORY;
-		return NULL;
-	}
+	ZD_arena *a;
+	char *b = (char *)malloc(ZD_ARENASIZE + ZD_PAGESIZE);
+	if(!b)
+		return ZD_OOMEMORY;
+	a = (ZD_arena *)(b + ZD_PAGESIZE - (uintptr_t)b % ZD_PAGESIZE);
+	a->block = b;
+	a->next = st->arenas;
+	st->arenas = a;
+	*next = (char *)a + ZD_ARENAHEADER;
+	*end = (char *)a + ZD_ARENASIZE;
+	return ZD_OK;
+}
+
+/*
+ * Carve a new, zero-filled entity of the specified kind out of the current
+ * arena of its slab, allocating a new arena if needed. Entities are never
+ * returned to the arenas; free entities are kept in the pools of the slabs.
+ */
+ZD_entity *zd_alloc_entity(ZD_state *st, ZD_entitykind kind)
+{
+	ZD_slab *sl = &st->slabs[kind];
+	ZD_entity *e;
+	if((size_t)(sl->end - sl->next) < sl->size)
+		if((st->lasterror = zd_new_arena(st, &sl->next, &sl->end)))
+			return NULL;
+	e = (ZD_entity *)sl->next;
+	sl->next += sl->size;
+	memset(e, 0, sl->size);
 	e->state = st;
 	return e;
 }
 
 
+
 /*---------------------------------------------------------
 	Layer entity
 ---------------------------------------------------------*/
@@ -468,10 +1309,7 @@ ZD_entity *zd_Layer(ZD_entity *parent, ZD_entityflags flags,
 	le = (ZD_layer *)e;
 	if(!e)
 		return NULL;
-	e->flags = flags | ZD_RETHINK | ZD_VISIBLE;
-	e->x = e->y = e->z = 0.0f;
-	e->s = 1.0f;
-	e->r = 0.0f;
+	e->flags |= flags | ZD_RETHINK | ZD_VISIBLE;
 	e->cr = e->cg = e->cb = e->ca = 1.0f;
 	le->left = left;
 	le->right = right;
@@ -502,18 +1340,12 @@ ZD_entity *zd_Window(ZD_entity *parent, ZD_entityflags flags,
 	ZD_window *we = (ZD_window *)e;
 	if(!e)
 		return NULL;
-	e->flags = flags | ZD_RETHINK | ZD_VISIBLE;
+	e->flags |= flags | ZD_RETHINK | ZD_VISIBLE;
 	if(flags & ZD_SETORIGO)
 	{
-		e->x = x;
-		e->y = y;
+		st->xf.x[e->xf] = x;
+		st->xf.y[e->xf] = y;
 	}
-	else
-	{
-		e->x = 0.0f;
-		e->y = 0.0f;
-	}
-	e->z = 0.0f;
 	we->w = w;
 	we->h = h;
 	we->l.left = x;
@@ -522,8 +1354,7 @@ ZD_entity *zd_Window(ZD_entity *parent, ZD_entityflags flags,
 	we->l.top = y + h;
 	we->l.bgr = we->l.bgg = we->l.bgb = 0.0f;
 	we->l.bga = 1.0f;
-	e->s = 1.0f;
-	e->r = 0.0f;
+	memset(&we->buffer, 0, sizeof(we->buffer));
 	e->cr = e->cg = e->cb = e->ca = 1.0f;
 	if(st->backend->InitWindow)
 		if((st->lasterror = st->backend->InitWindow(e)))
@@ -531,6 +1362,8 @@ ZD_entity *zd_Window(ZD_entity *parent, ZD_entityflags flags,
 			zd_FreeEntity(e);
 			return NULL;
 		}
+	if(flags & ZD_BUFFERED)
+		++st->nbuffered;
 	zd_LinkEntity(e);
 	return e;
 }
@@ -546,17 +1379,17 @@ ZD_entity *zd_Group(ZD_entity *parent, ZD_entityflags flags)
 	ZD_entity *e = zd_NewEntity(parent, ZD_EGROUP);
 	if(!e)
 		return NULL;
-	e->flags = flags | ZD_RETHINK | ZD_VISIBLE;
-	e->x = e->y = e->z = 0.0f;
-	e->s = 1.0f;
-	e->r = 0.0f;
+	e->flags |= flags | ZD_RETHINK | ZD_VISIBLE;
 	e->cr = e->cg = e->cb = e->ca = 1.0f;
+	memset(&((ZD_group *)e)->buffer, 0, sizeof(ZD_buffer));
 	if(st->backend->InitGroup)
 		if((st->lasterror = st->backend->InitGroup(e)))
 		{
 			zd_FreeEntity(e);
 			return NULL;
 		}
+	if(flags & ZD_BUFFERED)
+		++st->nbuffered;
 	zd_LinkEntity(e);
 	return e;
 }
@@ -574,15 +1407,12 @@ ZD_entity *zd_Sprite(ZD_entity *parent, ZD_entityflags flags,
 	ZD_sprite *se = (ZD_sprite *)e;
 	if(!e)
 		return NULL;
-	e->flags = flags | ZD_RETHINK | ZD_VISIBLE;
+	e->flags |= flags | ZD_RETHINK | ZD_VISIBLE;
 	se->txe.texture = texture;
 	if(texture)
 		zd_TextureIncRef(texture);
 	se->cx = cx;
 	se->cy = cy;
-	e->x = e->y = e->z = 0.0f;
-	e->s = 1.0f;
-	e->r = 0.0f;
 	e->cr = e->cg = e->cb = e->ca = 1.0f;
 	if(st->backend->InitSprite)
 		if((st->lasterror = st->backend->InitSprite(e)))
@@ -601,35 +1431,22 @@ ZD_entity *zd_Sprite(ZD_entity *parent, ZD_entityflags flags,
 
 ZD_entity *zd_Fill(ZD_entity *parent, ZD_entityflags flags, ZD_texture *texture)
 {
-	ZD_entity *le;
 	ZD_state *st = parent->state;
-	ZD_entity *e = zd_NewEntity(parent, ZD_EFILL);
-	ZD_fill *fe = (ZD_fill *)e;
+	ZD_entity *e;
+	ZD_fill *fe;
+	/* Fills wrap textures, so they can't use atlas pages */
+	if(texture && (st->lasterror = zd_unpack_texture(texture)))
+		return NULL;
+	e = zd_NewEntity(parent, ZD_EFILL);
+	fe = (ZD_fill *)e;
 	if(!e)
 		return NULL;
-	e->flags = flags | ZD_RETHINK | ZD_VISIBLE;
+	e->flags |= flags | ZD_RETHINK | ZD_VISIBLE;
 	fe->txe.texture = texture;
 	if(texture)
 		zd_TextureIncRef(texture);
-	e->x = e->y = e->z = 0.0f;
-	e->s = 1.0f;
-	e->r = 0.0f;
 	e->cr = e->cg = e->cb = e->ca = 1.0f;
-	fe->client = NULL;
-	for(le = e->parent; le; le = le->parent)
-	{
-		switch(le->kind)
-		{
-		  case ZD_ELAYER:
-		  case ZD_EWINDOW:
-			fe->client = (ZD_layer *)le;
-			break;
-		  default:
-			continue;
-		}
-		break;
-	}
-	if(!fe->client)
+	if(!zd_ClientOf(e->parent))
 	{
 		st->lasterror = ZD_INVALIDPARENT;
 		zd_FreeEntity(e);
@@ -650,116 +1467,202 @@ ZD_entity *zd_Fill(ZD_entity *parent, ZD_entityflags flags, ZD_texture *texture)
 	Entity control
 ---------------------------------------------------------*/
 
+/*
+ * Prepare the transform of 'e' for changes, and return its transform table
+ * slot.
+ *
+ * Animation is evaluated in closed form; the current value of a parameter is
+ * its base value plus velocity times the time passed since 't0'. Before
+ * changing base values or velocities, this folds the animation into the base
+ * values, and restarts it at the current time.
+ */
+static inline unsigned zd_edit_transform(ZD_entity *e)
+{
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = e->xf;
+	if(xf->flags[i] & ZD_XF_ANIMATED)
+	{
+		ZD_f t = e->state->now - xf->t0[i];
+		xf->x[i] += xf->dx[i] * t;
+		xf->y[i] += xf->dy[i] * t;
+		xf->z[i] += xf->dz[i] * t;
+		xf->s[i] += xf->ds[i] * t;
+		xf->r[i] += xf->dr[i] * t;
+	}
+	xf->t0[i] = e->state->now;
+	xf->flags[i] |= ZD_XF_CHANGED;
+	xf->dirty = 1;
+	return i;
+}
+
 ZD_errors zd_SetTransform(ZD_entity *e, ZD_f x, ZD_f y, ZD_f z, ZD_f s, ZD_f r)
 {
-	e->x = x;
-	e->y = y;
-	e->z = z;
-	e->s = s;
-	e->r = r;
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = zd_edit_transform(e);
+	xf->x[i] = x;
+	xf->y[i] = y;
+	xf->z[i] = z;
+	xf->s[i] = s;
+	xf->r[i] = r;
+	xf->flags[i] |= ZD_XF_NEWMATRIX;
 	e->flags |= ZD_RETHINK;
+	zd_InvalidateBounds(e);
 	return ZD_OK;
 }
 
 ZD_errors zd_SetPosition(ZD_entity *e, ZD_f x, ZD_f y)
 {
-	e->x = x;
-	e->y = y;
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = zd_edit_transform(e);
+	xf->x[i] = x;
+	xf->y[i] = y;
 	e->flags |= ZD_RETHINK;
+	zd_InvalidateBounds(e);
 	return ZD_OK;
 }
 
 ZD_errors zd_SetPosition3D(ZD_entity *e, ZD_f x, ZD_f y, ZD_f z)
 {
-	e->x = x;
-	e->y = y;
-	e->z = z;
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = zd_edit_transform(e);
+	xf->x[i] = x;
+	xf->y[i] = y;
+	xf->z[i] = z;
 	e->flags |= ZD_RETHINK;
+	zd_InvalidateBounds(e);
 	return ZD_OK;
 }
 
 ZD_errors zd_SetScale(ZD_entity *e, ZD_f scale)
 {
-	e->s = scale;
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = zd_edit_transform(e);
+	xf->s[i] = scale;
+	xf->flags[i] |= ZD_XF_NEWMATRIX;
 	e->flags |= ZD_RETHINK;
+	zd_InvalidateBounds(e);
 	return ZD_OK;
 }
 
 ZD_errors zd_SetRotation(ZD_entity *e, ZD_f rotation)
 {
-	e->r = rotation;
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = zd_edit_transform(e);
+	xf->r[i] = rotation;
+	xf->flags[i] |= ZD_XF_NEWMATRIX;
 	e->flags |= ZD_RETHINK;
+	zd_InvalidateBounds(e);
 	return ZD_OK;
 }
 
 
 ZD_errors zd_Move(ZD_entity *e, ZD_f x, ZD_f y)
 {
-	e->x += x;
-	e->y += y;
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = zd_edit_transform(e);
+	xf->x[i] += x;
+	xf->y[i] += y;
 	e->flags |= ZD_RETHINK;
+	zd_InvalidateBounds(e);
 	return ZD_OK;
 }
 
 ZD_errors zd_Move3D(ZD_entity *e, ZD_f x, ZD_f y, ZD_f z)
 {
-	e->x += x;
-	e->y += y;
-	e->z += z;
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = zd_edit_transform(e);
+	xf->x[i] += x;
+	xf->y[i] += y;
+	xf->z[i] += z;
 	e->flags |= ZD_RETHINK;
+	zd_InvalidateBounds(e);
 	return ZD_OK;
 }
 
 ZD_errors zd_Scale(ZD_entity *e, ZD_f scale)
 {
-	e->s *= scale;
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = zd_edit_transform(e);
+	xf->s[i] *= scale;
+	xf->flags[i] |= ZD_XF_NEWMATRIX;
 	e->flags |= ZD_RETHINK;
+	zd_InvalidateBounds(e);
 	return ZD_OK;
 }
 
 ZD_errors zd_Rotate(ZD_entity *e, ZD_f rotation)
 {
-	e->r += rotation;
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = zd_edit_transform(e);
+	xf->r[i] += rotation;
+	xf->flags[i] |= ZD_XF_NEWMATRIX;
 	e->flags |= ZD_RETHINK;
+	zd_InvalidateBounds(e);
 	return ZD_OK;
 }
 
 
 static inline void zd_update_animstate(ZD_entity *e)
 {
-	if(e->dx || e->dy || e->dz || e->ds || e->dr)
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = e->xf;
+	unsigned f = xf->flags[i] & ~(ZD_XF_ANIMATED | ZD_XF_SPIN);
+	if(xf->ds[i] || xf->dr[i])
+		f |= ZD_XF_SPIN | ZD_XF_ANIMATED;
+	else if(xf->dx[i] || xf->dy[i] || xf->dz[i])
+		f |= ZD_XF_ANIMATED;
+	if(f & ZD_XF_ANIMATED)
+	{
+		if(!(xf->flags[i] & ZD_XF_ANIMATED))
+			++xf->nanimated;
 		e->flags |= ZD_ANIMATED;
+	}
 	else
+	{
+		if(xf->flags[i] & ZD_XF_ANIMATED)
+			--xf->nanimated;
 		e->flags &= ~ZD_ANIMATED;
+	}
+	xf->flags[i] = f | ZD_XF_NEWMATRIX;
+	e->flags |= ZD_RETHINK;
+	zd_InvalidateContent(e);
 }
 
 ZD_errors zd_CMove(ZD_entity *e, ZD_f x, ZD_f y)
 {
-	e->dx = x;
-	e->dy = y;
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = zd_edit_transform(e);
+	xf->dx[i] = x;
+	xf->dy[i] = y;
 	zd_update_animstate(e);
 	return ZD_OK;
 }
 
 ZD_errors zd_CMove3D(ZD_entity *e, ZD_f x, ZD_f y, ZD_f z)
 {
-	e->dx = x;
-	e->dy = y;
-	e->dz = z;
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = zd_edit_transform(e);
+	xf->dx[i] = x;
+	xf->dy[i] = y;
+	xf->dz[i] = z;
 	zd_update_animstate(e);
 	return ZD_OK;
 }
 
 ZD_errors zd_CScale(ZD_entity *e, ZD_f scale)
 {
-	e->ds = scale;
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = zd_edit_transform(e);
+	xf->ds[i] = scale;
 	zd_update_animstate(e);
 	return ZD_OK;
 }
 
 ZD_errors zd_CRotate(ZD_entity *e, ZD_f rotation)
 {
-	e->dr = rotation;
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = zd_edit_transform(e);
+	xf->dr[i] = rotation;
 	zd_update_animstate(e);
 	return ZD_OK;
 }
@@ -767,12 +1670,14 @@ ZD_errors zd_CRotate(ZD_entity *e, ZD_f rotation)
 
 ZD_errors zd_CStop(ZD_entity *e)
 {
-	e->dx = 0.0f;
-	e->dy = 0.0f;
-	e->dz = 0.0f;
-	e->ds = 0.0f;
-	e->dr = 0.0f;
-	e->flags &= ~ZD_ANIMATED;
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = zd_edit_transform(e);
+	xf->dx[i] = 0.0f;
+	xf->dy[i] = 0.0f;
+	xf->dz[i] = 0.0f;
+	xf->ds[i] = 0.0f;
+	xf->dr[i] = 0.0f;
+	zd_update_animstate(e);
 	return ZD_OK;
 }
 
@@ -784,6 +1689,7 @@ ZD_errors zd_SetColor(ZD_entity *e, float r, float g, float b, float a)
 	e->cb = b;
 	e->ca = a;
 	e->flags |= ZD_RETHINK;
+	zd_InvalidateBuffers(e);
 	return ZD_OK;
 }
 
@@ -804,6 +1710,7 @@ ZD_errors zd_SetBGColor(ZD_entity *e, float r, float g, float b, float a)
 	l->bgb = b;
 	l->bga = a;
 	e->flags |= ZD_RETHINK;
+	zd_InvalidateBuffers(e);
 	return ZD_OK;
 }
 
@@ -822,11 +1729,21 @@ ZD_errors zd_SetTexture(ZD_entity *e, ZD_entityflags flags, ZD_texture *texture)
 	  case ZD_EFILL:
 	  {
 		ZD_txentity *txe = (ZD_txentity *)e;
+		if(texture && (e->kind != ZD_ESPRITE))
+		{
+			ZD_errors res = zd_unpack_texture(texture);
+			if(res)
+				return res;
+		}
+		if(texture && (texture->type == ZD_TT_VIRTUAL) &&
+				(e->kind == ZD_EPRIMITIVE))
+			return ZD_NOTSUPPORTED;
 		if(txe->texture)
 			zd_TextureDecRef(txe->texture);
 		txe->texture = texture;
 		if(txe->texture)
 			zd_TextureIncRef(txe->texture);
+		zd_InvalidateBuffers(e);
 		return ZD_OK;
 	  }
 	}
@@ -852,6 +1769,7 @@ ZD_errors zd_SetView(ZD_entity *e, ZD_f left, ZD_f right, ZD_f bottom, ZD_f top)
 	l->bottom = bottom;
 	l->top = top;
 	e->flags |= ZD_RETHINK;
+	zd_InvalidateBounds(e);
 	return ZD_OK;
 }
 
@@ -874,26 +1792,53 @@ ZD_errors zd_OnTransformChange(ZD_entity *entity, ZD_entitycb callback, void *us
 
 ZD_errors zd_SetParameter(ZD_entity *e, ZD_parameter param, ZD_f value)
 {
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = e->xf;
+	e->flags |= ZD_RETHINK;
+	zd_InvalidateContent(e);
+	if(param <= ZD_VROTATION)
+		zd_edit_transform(e);
 	switch(param)
 	{
-	  case ZD_X:		e->x = value; break;
-	  case ZD_Y:		e->y = value; break;
-	  case ZD_Z:		e->z = value; break;
-	  case ZD_SCALE:	e->s = value; break;
-	  case ZD_ROTATION:	e->r = value; break;
-	  case ZD_VX:		e->dx = value; break;
-	  case ZD_VY:		e->dy = value; break;
-	  case ZD_VZ:		e->dz = value; break;
-	  case ZD_VSCALE:	e->ds = value; break;
-	  case ZD_VROTATION:	e->dr = value; break;
-	  case ZD_RED:		e->cr = value; break;
-	  case ZD_GREEN:	e->cg = value; break;
-	  case ZD_BLUE:		e->cb = value; break;
-	  case ZD_ALPHA:	e->ca = value; break;
-	  case ZD_MX0:		e->trmx[0] = value; break;
-	  case ZD_MX1:		e->trmx[1] = value; break;
-	  case ZD_MX2:		e->trmx[2] = value; break;
-	  case ZD_MX3:		e->trmx[3] = value; break;
+	  case ZD_X:		xf->x[i] = value; return ZD_OK;
+	  case ZD_Y:		xf->y[i] = value; return ZD_OK;
+	  case ZD_Z:		xf->z[i] = value; return ZD_OK;
+	  case ZD_SCALE:
+		xf->s[i] = value;
+		xf->flags[i] |= ZD_XF_NEWMATRIX;
+		return ZD_OK;
+	  case ZD_ROTATION:
+		xf->r[i] = value;
+		xf->flags[i] |= ZD_XF_NEWMATRIX;
+		return ZD_OK;
+	  case ZD_VX:
+		xf->dx[i] = value;
+		zd_update_animstate(e);
+		return ZD_OK;
+	  case ZD_VY:
+		xf->dy[i] = value;
+		zd_update_animstate(e);
+		return ZD_OK;
+	  case ZD_VZ:
+		xf->dz[i] = value;
+		zd_update_animstate(e);
+		return ZD_OK;
+	  case ZD_VSCALE:
+		xf->ds[i] = value;
+		zd_update_animstate(e);
+		return ZD_OK;
+	  case ZD_VROTATION:
+		xf->dr[i] = value;
+		zd_update_animstate(e);
+		return ZD_OK;
+	  case ZD_RED:		e->cr = value; return ZD_OK;
+	  case ZD_GREEN:	e->cg = value; return ZD_OK;
+	  case ZD_BLUE:		e->cb = value; return ZD_OK;
+	  case ZD_ALPHA:	e->ca = value; return ZD_OK;
+	  case ZD_MX0:		xf->trmx[i * 4] = value; return ZD_OK;
+	  case ZD_MX1:		xf->trmx[i * 4 + 1] = value; return ZD_OK;
+	  case ZD_MX2:		xf->trmx[i * 4 + 2] = value; return ZD_OK;
+	  case ZD_MX3:		xf->trmx[i * 4 + 3] = value; return ZD_OK;
 	  default:		break;
 	}
 	switch(e->kind)
@@ -903,8 +1848,8 @@ ZD_errors zd_SetParameter(ZD_entity *e, ZD_parameter param, ZD_f value)
 		ZD_window *we = (ZD_window *)e;
 		switch(param)
 		{
-		  case ZD_WIDTH:	we->w = value; break;
-		  case ZD_HEIGHT:	we->h = value; break;
+		  case ZD_WIDTH:	we->w = value; return ZD_OK;
+		  case ZD_HEIGHT:	we->h = value; return ZD_OK;
 		  default:		break;
 		}
 		/* Fall through if no hit! */
@@ -938,32 +1883,50 @@ ZD_errors zd_SetParameter(ZD_entity *e, ZD_parameter param, ZD_f value)
 	  default:
 		return ZD_INVALIDPARAM;
 	}
-	e->flags |= ZD_RETHINK;
-	return ZD_OK;
+}
+
+/* Current value of a parameter with base value 'v' and velocity 'dv' */
+static inline ZD_f zd_anim_value(ZD_entity *e, ZD_f v, ZD_f dv)
+{
+	if(e->flags & ZD_ANIMATED)
+		return v + dv * (e->state->now - e->state->xf.t0[e->xf]);
+	return v;
 }
 
 ZD_errors zd_GetParameter(ZD_entity *e, ZD_parameter param, ZD_f *value)
 {
+	ZD_xftable *xf = &e->state->xf;
+	unsigned i = e->xf;
 	switch(param)
 	{
-	  case ZD_X:		*value = e->x; return ZD_OK;
-	  case ZD_Y:		*value = e->y; return ZD_OK;
-	  case ZD_Z:		*value = e->z; return ZD_OK;
-	  case ZD_SCALE:	*value = e->s; return ZD_OK;
-	  case ZD_ROTATION:	*value = e->r; return ZD_OK;
-	  case ZD_VX:		*value = e->dx; return ZD_OK;
-	  case ZD_VY:		*value = e->dy; return ZD_OK;
-	  case ZD_VZ:		*value = e->dz; return ZD_OK;
-	  case ZD_VSCALE:	*value = e->ds; return ZD_OK;
-	  case ZD_VROTATION:	*value = e->dr; return ZD_OK;
+	  case ZD_X:
+		*value = zd_anim_value(e, xf->x[i], xf->dx[i]);
+		return ZD_OK;
+	  case ZD_Y:
+		*value = zd_anim_value(e, xf->y[i], xf->dy[i]);
+		return ZD_OK;
+	  case ZD_Z:
+		*value = zd_anim_value(e, xf->z[i], xf->dz[i]);
+		return ZD_OK;
+	  case ZD_SCALE:
+		*value = zd_anim_value(e, xf->s[i], xf->ds[i]);
+		return ZD_OK;
+	  case ZD_ROTATION:
+		*value = zd_anim_value(e, xf->r[i], xf->dr[i]);
+		return ZD_OK;
+	  case ZD_VX:		*value = xf->dx[i]; return ZD_OK;
+	  case ZD_VY:		*value = xf->dy[i]; return ZD_OK;
+	  case ZD_VZ:		*value = xf->dz[i]; return ZD_OK;
+	  case ZD_VSCALE:	*value = xf->ds[i]; return ZD_OK;
+	  case ZD_VROTATION:	*value = xf->dr[i]; return ZD_OK;
 	  case ZD_RED:		*value = e->cr; return ZD_OK;
 	  case ZD_GREEN:	*value = e->cg; return ZD_OK;
 	  case ZD_BLUE:		*value = e->cb; return ZD_OK;
 	  case ZD_ALPHA:	*value = e->ca; return ZD_OK;
-	  case ZD_MX0:		*value = e->trmx[0]; return ZD_OK;
-	  case ZD_MX1:		*value = e->trmx[1]; return ZD_OK;
-	  case ZD_MX2:		*value = e->trmx[2]; return ZD_OK;
-	  case ZD_MX3:		*value = e->trmx[3]; return ZD_OK;
+	  case ZD_MX0:		*value = xf->trmx[i * 4]; return ZD_OK;
+	  case ZD_MX1:		*value = xf->trmx[i * 4 + 1]; return ZD_OK;
+	  case ZD_MX2:		*value = xf->trmx[i * 4 + 2]; return ZD_OK;
+	  case ZD_MX3:		*value = xf->trmx[i * 4 + 3]; return ZD_OK;
 	  default:		break;
 	}
 	switch(e->kind)
@@ -1042,29 +2005,84 @@ ZD_errors zd_GetParameters(ZD_entity *e,
 	Entity management
 ---------------------------------------------------------*/
 
+/*
+ * If the zd_Compact() cursor is inside the subtree of 'e', which is about to
+ * be destroyed, move it to the entity following the subtree, so that the next
+ * step carries on from there, rather than starting over from the root.
+ */
+static void zd_skip_cursor(ZD_entity *e)
+{
+	ZD_state *st = e->state;
+	ZD_entity *c;
+	for(c = st->cursor; c && (c != e); c = c->parent)
+		;
+	if(!c)
+		return;
+	for(st->cursor = NULL; e; e = e->parent)
+		if(e->next)
+		{
+			st->cursor = e->next;
+			break;
+		}
+}
+
 void zd_DestroyEntity(ZD_entity *entity)
 {
-	ZD_entity *e;
 	ZD_entity *p = entity->parent;
 	if(!p)
 	{
 		fprintf(stderr, "ZeeDraw: Tried to destroy the root entity!\n");
 		return;
 	}
-	e = p->first;
-	while(e)
+	if(entity->state->cursor)
+		zd_skip_cursor(entity);
+	zd_UnlinkEntity(entity);
+	zd_destroy_entity(entity);
+	zd_InvalidateContent(p);
+}
+
+
+ZD_errors zd_SetParent(ZD_entity *e, ZD_entity *parent)
+{
+	ZD_state *st = e->state;
+	ZD_xftable *xf = &st->xf;
+	ZD_entity *pe;
+	if(!e->parent || (parent->state != st))
+		return ZD_INVALIDPARENT;
+	for(pe = parent; pe; pe = pe->parent)
+		if(pe == e)
+			return ZD_INVALIDPARENT;	/* Own subtree! */
+	if(zd_ClientOf(parent) != zd_ClientOf(e->parent))
+		return ZD_INVALIDPARENT;
+	if((e->kind == ZD_ELAYER) && (parent->kind != ZD_EROOT))
+		return ZD_INVALIDPARENT;	/* As in zd_Layer() */
+	if(parent->xf > e->xf)
 	{
-		if(e->next == entity)
+		/* Make sure reslotting cannot fail half way through */
+		unsigned n = zd_count_entities(e);
+		while(xf->count + n > xf->size)
 		{
-			if(p->last == entity)
-				p->last = e;
-			e->next = e->next->next;
-			zd_destroy_entity(entity);
-			return;	/* Done! --> */
+			ZD_errors res;
+			if((res = zd_xf_grow(xf)))
+				return res;
 		}
-		e = e->next;
 	}
-	fprintf(stderr, "ZeeDraw: Entity not found under its parent!?\n");
+	zd_UnlinkEntity(e);
+	zd_InvalidateContent(e->parent);
+	e->parent = parent;
+	if(parent->xf > e->xf)
+		zd_reslot_transforms(e);
+	else
+	{
+		xf->parent[e->xf] = parent->xf;
+		xf->flags[e->xf] |= ZD_XF_CHANGED;
+		xf->dirty = 1;
+	}
+	e->flags |= ZD_RETHINK;
+	zd_LinkEntity(e);
+	/* 'e' may be flagged already, so that won't reach the new parent */
+	zd_InvalidateContent(parent);
+	return ZD_OK;
 }
 
 
@@ -1080,6 +2098,183 @@ void zd_ReleaseEntity(ZD_entity *e)
 }
 
 
+/*---------------------------------------------------------
+	Entity handles
+---------------------------------------------------------*/
+
+ZD_handle zd_Handle(ZD_entity *entity)
+{
+	return entity->handle;
+}
+
+ZD_entity *zd_Entity(ZD_state *state, ZD_handle handle)
+{
+	ZD_handletable *ht = &state->handles;
+	unsigned i = handle & ZD_HINDEXMASK;
+	if((i >= ht->count) || (ht->handle[i] != handle))
+		return NULL;
+	return ht->entity[i];
+}
+
+ZD_errors zd_HSetParent(ZD_state *state, ZD_handle h, ZD_handle parent)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	ZD_entity *pe = zd_Entity(state, parent);
+	return e && pe ? zd_SetParent(e, pe) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HReleaseEntity(ZD_state *state, ZD_handle h)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	if(!e)
+		return ZD_BADHANDLE;
+	zd_ReleaseEntity(e);
+	return ZD_OK;
+}
+
+ZD_errors zd_HSetTransform(ZD_state *state, ZD_handle h,
+		ZD_f x, ZD_f y, ZD_f z, ZD_f s, ZD_f r)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_SetTransform(e, x, y, z, s, r) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HSetPosition(ZD_state *state, ZD_handle h, ZD_f x, ZD_f y)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_SetPosition(e, x, y) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HSetPosition3D(ZD_state *state, ZD_handle h,
+		ZD_f x, ZD_f y, ZD_f z)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_SetPosition3D(e, x, y, z) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HSetScale(ZD_state *state, ZD_handle h, ZD_f scale)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_SetScale(e, scale) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HSetRotation(ZD_state *state, ZD_handle h, ZD_f rotation)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_SetRotation(e, rotation) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HMove(ZD_state *state, ZD_handle h, ZD_f x, ZD_f y)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_Move(e, x, y) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HMove3D(ZD_state *state, ZD_handle h, ZD_f x, ZD_f y, ZD_f z)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_Move3D(e, x, y, z) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HScale(ZD_state *state, ZD_handle h, ZD_f scale)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_Scale(e, scale) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HRotate(ZD_state *state, ZD_handle h, ZD_f rotation)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_Rotate(e, rotation) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HSetColor(ZD_state *state, ZD_handle h,
+		float r, float g, float b, float a)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_SetColor(e, r, g, b, a) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HSetBGColor(ZD_state *state, ZD_handle h,
+		float r, float g, float b, float a)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_SetBGColor(e, r, g, b, a) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HSetTexture(ZD_state *state, ZD_handle h,
+		ZD_entityflags flags, ZD_texture *texture)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_SetTexture(e, flags, texture) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HSetView(ZD_state *state, ZD_handle h,
+		ZD_f left, ZD_f right, ZD_f bottom, ZD_f top)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_SetView(e, left, right, bottom, top) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HSetParameter(ZD_state *state, ZD_handle h,
+		ZD_parameter param, ZD_f value)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_SetParameter(e, param, value) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HGetParameter(ZD_state *state, ZD_handle h,
+		ZD_parameter param, ZD_f *value)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_GetParameter(e, param, value) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HSetParameters(ZD_state *state, ZD_handle h,
+		unsigned count, unsigned *params, ZD_f *values)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_SetParameters(e, count, params, values) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HGetParameters(ZD_state *state, ZD_handle h,
+		unsigned count, unsigned *params, ZD_f *values)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_GetParameters(e, count, params, values) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HCMove(ZD_state *state, ZD_handle h, ZD_f x, ZD_f y)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_CMove(e, x, y) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HCMove3D(ZD_state *state, ZD_handle h, ZD_f x, ZD_f y, ZD_f z)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_CMove3D(e, x, y, z) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HCScale(ZD_state *state, ZD_handle h, ZD_f scale)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_CScale(e, scale) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HCRotate(ZD_state *state, ZD_handle h, ZD_f rotation)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_CRotate(e, rotation) : ZD_BADHANDLE;
+}
+
+ZD_errors zd_HCStop(ZD_state *state, ZD_handle h)
+{
+	ZD_entity *e = zd_Entity(state, h);
+	return e ? zd_CStop(e) : ZD_BADHANDLE;
+}
+
+
 /*---------------------------------------------------------
 -----------------------------------------------------------
 	Primitives
@@ -1091,22 +2286,34 @@ ZD_entity *zd_Primitive(ZD_entity *parent, ZD_entityflags flags,
 		ZD_f x, ZD_f y, ZD_f size, ZD_f rotation)
 {
 	ZD_state *st = parent->state;
-	ZD_entity *e = zd_NewEntity(parent, ZD_ESPRITE);
-	ZD_primitive *pe = (ZD_primitive *)e;
+	ZD_entity *e;
+	ZD_primitive *pe;
+	/* Texture coordinates may be anything, so no atlas pages here */
+	if(texture && (st->lasterror = zd_unpack_texture(texture)))
+		return NULL;
+	if(texture && (texture->type == ZD_TT_VIRTUAL))
+	{
+		st->lasterror = ZD_NOTSUPPORTED;
+		return NULL;
+	}
+	e = zd_NewEntity(parent, ZD_EPRIMITIVE);
+	pe = (ZD_primitive *)e;
 	if(!e)
 		return NULL;
-	e->flags = flags | ZD_RETHINK | ZD_VISIBLE;
+	e->flags |= flags | ZD_RETHINK | ZD_VISIBLE;
 	pe->pkind = pkind;
 	pe->txe.texture = texture;
 	if(texture)
 		zd_TextureIncRef(texture);
 	pe->nvertices = 0;
+	pe->svertices = 0;
 	pe->vertices = NULL;
-	e->x = x;
-	e->y = y;
-	e->z = 0.0f;
-	e->s = size;
-	e->r = rotation;
+	pe->serial = 0;
+	pe->ctx = pe->cty = 0.0f;
+	st->xf.x[e->xf] = x;
+	st->xf.y[e->xf] = y;
+	st->xf.s[e->xf] = size;
+	st->xf.r[e->xf] = rotation;
 	e->cr = 1.0f;
 	e->cg = 1.0f;
 	e->cb = 1.0f;
@@ -1122,40 +2329,119 @@ ZD_entity *zd_Primitive(ZD_entity *parent, ZD_entityflags flags,
 }
 
 
-ZD_errors zd_Vertex2D(ZD_entity *entity, ZD_f x, ZD_f y);
-ZD_errors zd_Vertex3D(ZD_entity *entity, ZD_f x, ZD_f y, ZD_f z);
+/* Make room for 'count' more vertices in 'pe' */
+static ZD_errors zd_reserve_vertices(ZD_primitive *pe, unsigned count)
+{
+	unsigned ns;
+	ZD_vertex *nv;
+	if(pe->nvertices + count <= pe->svertices)
+		return ZD_OK;
+	ns = pe->svertices ? pe->svertices : 8;
+	while(ns < pe->nvertices + count)
+		ns *= 2;
+	if(!(nv = (ZD_vertex *)realloc(pe->vertices, ns * sizeof(ZD_vertex))))
+		return ZD_OOMEMORY;
+	pe->vertices = nv;
+	pe->svertices = ns;
+	return ZD_OK;
+}
+
+
+ZD_errors zd_Vertex2D(ZD_entity *entity, ZD_f x, ZD_f y)
+{
+	return zd_Vertex3D(entity, x, y, 0.0f);
+}
+
+
+ZD_errors zd_Vertex3D(ZD_entity *entity, ZD_f x, ZD_f y, ZD_f z)
+{
+	ZD_primitive *pe = (ZD_primitive *)entity;
+	ZD_vertex *v;
+	ZD_errors res;
+	if(entity->kind != ZD_EPRIMITIVE)
+		return ZD_WRONGTYPE;
+	if((res = zd_reserve_vertices(pe, 1)))
+		return res;
+	v = pe->vertices + pe->nvertices++;
+	v->x = x;
+	v->y = y;
+	v->z = z;
+	v->tx = pe->ctx;
+	v->ty = pe->cty;
+	++pe->serial;
+	zd_InvalidateContent(entity);
+	return ZD_OK;
+}
+
+
 ZD_errors zd_Vertices(ZD_entity *entity, unsigned dimensions, unsigned count,
-		ZD_f *data);
-ZD_errors zd_TexCoord(ZD_entity *entity, ZD_f x, ZD_f y);
-ZD_errors zd_TexCoords(ZD_entity *entity, unsigned count, ZD_f *data);
+		ZD_f *data)
+{
+	ZD_primitive *pe = (ZD_primitive *)entity;
+	ZD_errors res;
+	unsigned i;
+	if(entity->kind != ZD_EPRIMITIVE)
+		return ZD_WRONGTYPE;
+	if((dimensions < 2) || (dimensions > 3))
+		return ZD_BADARGUMENTS;
+	if((res = zd_reserve_vertices(pe, count)))
+		return res;
+	for(i = 0; i < count; ++i, data += dimensions)
+	{
+		ZD_vertex *v = pe->vertices + pe->nvertices++;
+		v->x = data[0];
+		v->y = data[1];
+		v->z = dimensions == 3 ? data[2] : 0.0f;
+		v->tx = pe->ctx;
+		v->ty = pe->cty;
+	}
+	++pe->serial;
+	zd_InvalidateContent(entity);
+	return ZD_OK;
+}
 
 
-/*---------------------------------------------------------
------------------------------------------------------------
-	Modulation and effects
------------------------------------------------------------
----------------------------------------------------------*/
+ZD_errors zd_TexCoord(ZD_entity *entity, ZD_f x, ZD_f y)
+{
+	ZD_primitive *pe = (ZD_primitive *)entity;
+	if(entity->kind != ZD_EPRIMITIVE)
+		return ZD_WRONGTYPE;
+	pe->ctx = x;
+	pe->cty = y;
+	return ZD_OK;
+}
+
 
-static void zd_advance_entity(ZD_entity *e, ZD_f dt)
+ZD_errors zd_TexCoords(ZD_entity *entity, unsigned count, ZD_f *data)
 {
-	ZD_entity *ce;
-	if(e->flags & ZD_ANIMATED)
+	ZD_primitive *pe = (ZD_primitive *)entity;
+	ZD_vertex *v;
+	unsigned i;
+	if(entity->kind != ZD_EPRIMITIVE)
+		return ZD_WRONGTYPE;
+	if(count > pe->nvertices)
+		return ZD_BADARGUMENTS;
+	v = pe->vertices + pe->nvertices - count;
+	for(i = 0; i < count; ++i, data += 2)
 	{
-		e->x += e->dx * dt;
-		e->y += e->dy * dt;
-		e->z += e->dz * dt;
-		e->s += e->ds * dt;
-		e->r += e->dr * dt;
-		e->flags |= ZD_RETHINK;
+		v[i].tx = data[0];
+		v[i].ty = data[1];
 	}
-	for(ce = e->first; ce; ce = ce->next)
-		zd_advance_entity(ce, dt);
+	++pe->serial;
+	zd_InvalidateBuffers(entity);
+	return ZD_OK;
 }
 
+
+/*---------------------------------------------------------
+-----------------------------------------------------------
+	Modulation and effects
+-----------------------------------------------------------
+---------------------------------------------------------*/
+
 ZD_errors zd_Advance(ZD_state *state, ZD_f dt)
 {
 	state->now += dt;
-	zd_advance_entity(state->root, dt);
 	return ZD_OK;
 }
 
@@ -1166,15 +2452,94 @@ ZD_errors zd_Advance(ZD_state *state, ZD_f dt)
 -----------------------------------------------------------
 ---------------------------------------------------------*/
 
-static inline void zd_apply_transform(ZD_entity *e)
+/*
+ * Update the world transform in slot 'i' of the transform table of 'st'. The
+ * local rotation + scaling matrix is only recalculated when ZD_XF_NEWMATRIX is
+ * set, so parent changes cost a matrix multiplication rather than trigonometry.
+ * Animated parameters are evaluated for the current time here.
+ */
+static inline void zd_apply_transform(ZD_state *st, unsigned i)
+{
+	ZD_xftable *xf = &st->xf;
+	unsigned f = xf->flags[i];
+	ZD_f x = xf->x[i], y = xf->y[i], z = xf->z[i];
+	ZD_f s = xf->s[i], r = xf->r[i];
+	ZD_f *lmx = xf->lmx + i * 4;
+	ZD_f *trmx = xf->trmx + i * 4;
+	if(f & ZD_XF_ANIMATED)
+	{
+		ZD_f t = st->now - xf->t0[i];
+		x += xf->dx[i] * t;
+		y += xf->dy[i] * t;
+		z += xf->dz[i] * t;
+		if(f & ZD_XF_SPIN)
+		{
+			s += xf->ds[i] * t;
+			r += xf->dr[i] * t;
+		}
+	}
+	if(f & (ZD_XF_NEWMATRIX | ZD_XF_SPIN))
+	{
+		zd_CalculateMatrix(r, s, lmx);
+		xf->flags[i] = f & ~ZD_XF_NEWMATRIX;
+	}
+	if(i)
+	{
+		unsigned p = xf->parent[i];
+		ZD_f *pm = xf->trmx + p * 4;
+		zd_TransformPoint(pm, xf->tx[p], xf->ty[p], x, y,
+				xf->tx + i, xf->ty + i);
+		xf->tz[i] = z + xf->tz[p];
+		xf->ts[i] = s * xf->ts[p];
+		xf->tr[i] = r + xf->tr[p];
+		zd_MultiplyMatrix(pm, lmx, trmx);
+	}
+	else
+	{
+		/* Root */
+		xf->tx[0] = x;
+		xf->ty[0] = y;
+		xf->tz[0] = z;
+		xf->ts[0] = s;
+		xf->tr[0] = r;
+		memcpy(trmx, lmx, 4 * sizeof(ZD_f));
+	}
+}
+
+/*
+ * ZD_BATCHTRANSFORM: Update the world transforms of entities that are animated
+ * or flagged with ZD_XF_CHANGED, and their descendants, in a single pass over
+ * the transform table. As parents are always in lower slots than their
+ * children, ZD_XF_CHANGED is propagated before children are visited.
+ */
+static void zd_update_transforms(ZD_state *st)
+{
+	ZD_xftable *xf = &st->xf;
+	unsigned i, n = xf->count;
+	unsigned *parent = xf->parent;
+	unsigned char *flags = xf->flags;
+	if(!xf->dirty && !xf->nanimated)
+		return;
+	for(i = 0; i < n; ++i)
+	{
+		unsigned f = flags[i] | (flags[parent[i]] & ZD_XF_CHANGED);
+		if(f & (ZD_XF_CHANGED | ZD_XF_ANIMATED))
+		{
+			flags[i] = f | ZD_XF_CHANGED;
+			zd_apply_transform(st, i);
+		}
+	}
+	for(i = 0; i < n; ++i)
+		flags[i] &= ~ZD_XF_CHANGED;
+	xf->dirty = 0;
+}
+
+/* Update the transformed color of 'e' */
+static inline void zd_apply_color(ZD_entity *e)
 {
 	if(e->parent)
 	{
 		ZD_entity *p = e->parent;
-		zd_TransformPointE(p, e->x, e->y, &e->tx, &e->ty);
-		e->tz = e->z + p->tz;
-		e->ts = e->s * p->ts;
-		e->tr = e->r + p->tr;
 		e->tcr = p->tcr * e->cr;
 		e->tcg = p->tcg * e->cg;
 		e->tcb = p->tcb * e->cb;
@@ -1182,56 +2547,1316 @@ static inline void zd_apply_transform(ZD_entity *e)
 	}
 	else
 	{
-		e->tx = e->x;
-		e->ty = e->y;
-		e->tz = e->z;
-		e->ts = e->s;
-		e->tr = e->r;
 		e->tcr = e->cr;
 		e->tcg = e->cg;
 		e->tcb = e->cb;
 		e->tca = e->ca;
 	}
-	zd_CalculateMatrix(e->tr, e->ts, e->trmx);
 }
 
-static ZD_errors zd_render_entity(ZD_entity *e, unsigned fwflags)
+/* Grow the box 'b' (x1, y1, x2, y2) to include (x, y) */
+static inline void zd_bounds_add(ZD_f *b, ZD_f x, ZD_f y)
 {
-	ZD_entity *ce;
-	e->flags |= fwflags;
-	if(e->flags & ZD_RETHINK)
+	if(x < b[0])
+		b[0] = x;
+	if(y < b[1])
+		b[1] = y;
+	if(x > b[2])
+		b[2] = x;
+	if(y > b[3])
+		b[3] = y;
+}
+
+/*
+ * Transform the box 'b' using matrix 'm' and offset (x, y), and return the
+ * axis aligned box around the result in 'tb'.
+ */
+static inline void zd_transform_bounds(ZD_f *m, ZD_f x, ZD_f y, ZD_f *b,
+		ZD_f *tb)
+{
+	ZD_f cx = (b[0] + b[2]) * 0.5f;
+	ZD_f cy = (b[1] + b[3]) * 0.5f;
+	ZD_f ex = (b[2] - b[0]) * 0.5f;
+	ZD_f ey = (b[3] - b[1]) * 0.5f;
+	ZD_f tex = fabs(m[0]) * ex + fabs(m[1]) * ey;
+	ZD_f tey = fabs(m[2]) * ex + fabs(m[3]) * ey;
+	zd_TransformPoint(m, x, y, cx, cy, &cx, &cy);
+	tb[0] = cx - tex;
+	tb[1] = cy - tey;
+	tb[2] = cx + tex;
+	tb[3] = cy + tey;
+}
+
+/*
+ * Recalculate the bounding boxes of 'e', which must have those of its children
+ * up to date. ZD_NOCULL is set on entities that cannot be culled by bounding
+ * box, as well as on their ancestors, up to the nearest clipping window.
+ *
+ * This is also where buffers are flagged for redrawing after changes to the
+ * subtree, or for windows, which are buffered in parent space, changes to the
+ * window itself.
+ */
+static void zd_calc_bounds(ZD_entity *e)
+{
+	ZD_xftable *xf = &e->state->xf;
+	unsigned xi = e->xf;
+	if((e->flags & ZD_BUFFERED) && ((e->flags & ZD_NEWCONTENT) ||
+			(e->kind == ZD_EWINDOW)))
+		e->flags |= ZD_REBUFFER;
+	if(e->flags & ZD_NEWCONTENT)
 	{
-		zd_apply_transform(e);
-		if(e->Rethink)
-			e->Rethink(e);
-		e->flags &= ~ZD_RETHINK;
-		fwflags |= ZD_RETHINK;	/* Recursively rethink children! */
+		ZD_entity *ce;
+		ZD_f *b = e->lbounds;
+		int empty = 1;
+		int nocull = (e->flags & ZD_ANIMATED) != 0;
+		int anim = 0;
+		for(ce = e->first; ce; ce = ce->next)
+		{
+			if(ce->flags & ZD_NOCULL)
+				nocull = 1;
+			if(ce->flags & (ZD_ANIMATED | ZD_ANIMCONTENT))
+				anim = 1;
+			if(empty)
+			{
+				memcpy(b, ce->bounds, sizeof(e->lbounds));
+				empty = 0;
+			}
+			else
+			{
+				zd_bounds_add(b, ce->bounds[0], ce->bounds[1]);
+				zd_bounds_add(b, ce->bounds[2], ce->bounds[3]);
+			}
+		}
+		switch(e->kind)
+		{
+		  case ZD_EROOT:
+		  case ZD_ELAYER:
+		  case ZD_EFILL:
+			/* These cover whatever view they're in */
+			nocull = 1;
+			break;
+		  case ZD_EWINDOW:
+			if(e->flags & ZD_CLIP)
+				nocull = 0;
+			break;
+		  case ZD_EGROUP:
+			break;
+		  case ZD_ESPRITE:
+		  {
+			ZD_sprite *se = (ZD_sprite *)e;
+			if(empty)
+			{
+				b[0] = b[2] = -se->cx;
+				b[1] = b[3] = -se->cy;
+				empty = 0;
+			}
+			zd_bounds_add(b, -se->cx, -se->cy);
+			zd_bounds_add(b, 1.0f - se->cx, 1.0f - se->cy);
+			break;
+		  }
+		  case ZD_EPRIMITIVE:
+		  {
+			ZD_primitive *pe = (ZD_primitive *)e;
+			unsigned i;
+			for(i = 0; i < pe->nvertices; ++i)
+			{
+				ZD_vertex *v = pe->vertices + i;
+				if(empty)
+				{
+					b[0] = b[2] = v->x;
+					b[1] = b[3] = v->y;
+					empty = 0;
+				}
+				else
+					zd_bounds_add(b, v->x, v->y);
+			}
+			break;
+		  }
+		}
+		if(empty)
+			b[0] = b[1] = b[2] = b[3] = 0.0f;
+		e->flags &= ~(ZD_NEWCONTENT | ZD_NOCULL | ZD_ANIMCONTENT);
+		if(nocull)
+			e->flags |= ZD_NOCULL;
+		if(anim)
+			e->flags |= ZD_ANIMCONTENT;
 	}
-	if(e->flags & ZD_VISIBLE)
+	if(xf->flags[xi] & ZD_XF_NEWMATRIX)
 	{
-		if(e->Render)
-			e->Render(e);
-		for(ce = e->first; ce; ce = ce->next)
+		zd_CalculateMatrix(xf->r[xi], xf->s[xi], xf->lmx + xi * 4);
+		xf->flags[xi] &= ~ZD_XF_NEWMATRIX;
+	}
+	if((e->kind == ZD_EWINDOW) && (e->flags & ZD_CLIP))
+	{
+		/* The window area is in parent space, and clips the children */
+		ZD_layer *le = (ZD_layer *)e;
+		e->bounds[0] = e->bounds[2] = le->left;
+		e->bounds[1] = e->bounds[3] = le->bottom;
+		zd_bounds_add(e->bounds, le->right, le->top);
+	}
+	else
+	{
+		zd_transform_bounds(xf->lmx + xi * 4, xf->x[xi], xf->y[xi],
+				e->lbounds, e->bounds);
+		if(e->kind == ZD_EWINDOW)
 		{
-			ZD_errors res = zd_render_entity(ce, fwflags);
-			if(res)
-				return res;
+			ZD_layer *le = (ZD_layer *)e;
+			zd_bounds_add(e->bounds, le->left, le->bottom);
+			zd_bounds_add(e->bounds, le->right, le->top);
 		}
-		if(e->RenderPost)
-			e->RenderPost(e);
 	}
-	return ZD_OK;
+	e->flags &= ~ZD_NEWBOUNDS;
 }
 
-ZD_errors zd_Render(ZD_state *state)
+/* First entity flagged with ZD_NEWBOUNDS at or after 'e' in a sibling list */
+static inline ZD_entity *zd_next_newbounds(ZD_entity *e)
 {
-	ZD_backend *b = state->backend;
-	ZD_errors res;
-	if(b->PreRender)
-		if((res = b->PreRender(state)))
-			return res;
-	if((res = zd_render_entity(state->root, 0)))
-		return res;
+	while(e && !(e->flags & ZD_NEWBOUNDS))
+		e = e->next;
+	return e;
+}
+
+/*
+ * Recalculate the bounding boxes of 'top' and any descendants flagged by
+ * zd_InvalidateContent() or zd_InvalidateBounds(), children first.
+ */
+static void zd_update_bounds(ZD_entity *top)
+{
+	ZD_entity *e = top;
+	while(1)
+	{
+		ZD_entity *ce;
+		while((e->flags & ZD_NEWCONTENT) &&
+				(ce = zd_next_newbounds(e->first)))
+			e = ce;
+		zd_calc_bounds(e);
+		if(e == top)
+			return;
+		/* Next flagged sibling, or the parent, when all are done */
+		ce = zd_next_newbounds(e->next);
+		e = ce ? ce : e->parent;
+	}
+}
+
+/*
+ * Check if box 'b' is entirely outside box 'v'.
+ *
+ * NOTE:
+ *	This is evaluated without branches, as most children of a large group
+ *	are typically culled in no predictable order, and mispredicted branches
+ *	stall the loads of the next sibling.
+ */
+static inline int zd_outside(ZD_f *b, ZD_f *v)
+{
+	return (b[2] < v[0]) | (b[0] > v[2]) | (b[3] < v[1]) | (b[1] > v[3]);
+}
+
+/*
+ * Calculate the current view in the local space of 'e', for culling its
+ * children. Returns 0 if there is no view to cull against.
+ */
+static inline int zd_local_view(ZD_entity *e, ZD_f *lv)
+{
+	ZD_state *st = e->state;
+	ZD_xftable *xf = &st->xf;
+	unsigned i = e->xf;
+	ZD_f mi[4], vb[4];
+	if(st->vr == HUGE_VAL)
+		return 0;
+	if(zd_InverseMatrix(xf->trmx + i * 4, mi))
+		return 0;
+	vb[0] = st->vl - xf->tx[i];
+	vb[1] = st->vb - xf->ty[i];
+	vb[2] = st->vr - xf->tx[i];
+	vb[3] = st->vt - xf->ty[i];
+	zd_transform_bounds(mi, 0.0f, 0.0f, vb, lv);
+	return 1;
+}
+
+/*
+ * Set up the culling view for the children of layer or clipping window 'e'.
+ * Views are in world coordinates. Layers inside layers or windows are not
+ * culled, as the OpenGL backend stacks their projections.
+ */
+static void zd_enter_view(ZD_entity *e)
+{
+	ZD_state *st = e->state;
+	ZD_layer *le = (ZD_layer *)e;
+	if(e->kind == ZD_ELAYER)
+	{
+		if(st->vr == HUGE_VAL)
+		{
+			/* No view set up yet */
+			st->vl = le->left < le->right ? le->left : le->right;
+			st->vr = le->left < le->right ? le->right : le->left;
+			st->vb = le->bottom < le->top ? le->bottom : le->top;
+			st->vt = le->bottom < le->top ? le->top : le->bottom;
+		}
+		else
+		{
+			st->vl = st->vb = -HUGE_VAL;
+			st->vr = st->vt = HUGE_VAL;
+		}
+	}
+	else
+	{
+		ZD_xftable *xf = &st->xf;
+		unsigned p = e->parent->xf;
+		ZD_f b[4], wb[4];
+		b[0] = b[2] = le->left;
+		b[1] = b[3] = le->bottom;
+		zd_bounds_add(b, le->right, le->top);
+		zd_transform_bounds(xf->trmx + p * 4, xf->tx[p], xf->ty[p], b,
+				wb);
+		if(wb[0] > st->vl)
+			st->vl = wb[0];
+		if(wb[2] < st->vr)
+			st->vr = wb[2];
+		if(wb[1] > st->vb)
+			st->vb = wb[1];
+		if(wb[3] < st->vt)
+			st->vt = wb[3];
+	}
+}
+
+/*
+ * Add an op of 'kind' for 'e' to the draw list, with room for 'nvertices'
+ * vertices. Returns NULL if out of memory.
+ */
+static ZD_drawop *zd_new_op(ZD_state *st, ZD_drawopkind kind, ZD_entity *e,
+		unsigned nvertices)
+{
+	ZD_drawlist *dl = &st->drawlist;
+	ZD_drawop *op;
+	if(dl->nops == dl->opssize)
+	{
+		unsigned ns = dl->opssize ? dl->opssize * 2 : 256;
+		ZD_drawop *o = (ZD_drawop *)realloc(dl->ops,
+				ns * sizeof(ZD_drawop));
+		if(!o)
+			return NULL;
+		dl->ops = o;
+		dl->opssize = ns;
+	}
+	if(dl->nvertices + nvertices > dl->verticessize)
+	{
+		unsigned ns = dl->verticessize ? dl->verticessize : 1024;
+		ZD_drawvertex *v;
+		while(ns < dl->nvertices + nvertices)
+			ns *= 2;
+		v = (ZD_drawvertex *)realloc(dl->vertices,
+				ns * sizeof(ZD_drawvertex));
+		if(!v)
+			return NULL;
+		dl->vertices = v;
+		dl->verticessize = ns;
+	}
+	op = dl->ops + dl->nops++;
+	op->kind = kind;
+	op->flags = 0;
+	op->entity = e;
+	op->texture = NULL;
+	op->r = e->tcr;
+	op->g = e->tcg;
+	op->b = e->tcb;
+	op->a = e->tca;
+	op->first = dl->nvertices;
+	op->count = nvertices;
+	op->layer = -1;
+	dl->nvertices += nvertices;
+	return op;
+}
+
+/* Set untextured vertex 'v' to (x, y, z) */
+static inline void zd_set_vertex(ZD_drawvertex *v, ZD_f x, ZD_f y, ZD_f z)
+{
+	v->x = x;
+	v->y = y;
+	v->z = z;
+	v->u = v->v = 0.0f;
+}
+
+/* Record the corners of layer or window 'e', and its background color */
+static ZD_drawop *zd_record_view(ZD_entity *e, ZD_drawopkind kind)
+{
+	ZD_layer *le = (ZD_layer *)e;
+	ZD_drawop *op;
+	ZD_drawvertex *v;
+	if(!(op = zd_new_op(e->state, kind, e, 4)))
+		return NULL;
+	v = zd_OpVertices(&e->state->drawlist, op);
+	if(kind == ZD_DWINDOW)
+	{
+		/* Window corners in the space of the enclosing layer */
+		ZD_f x, y;
+		zd_TransformPointE(e->parent, le->left, le->bottom, &x, &y);
+		zd_set_vertex(&v[0], x, y, 0.0f);
+		zd_TransformPointE(e->parent, le->right, le->bottom, &x, &y);
+		zd_set_vertex(&v[1], x, y, 0.0f);
+		zd_TransformPointE(e->parent, le->right, le->top, &x, &y);
+		zd_set_vertex(&v[2], x, y, 0.0f);
+		zd_TransformPointE(e->parent, le->left, le->top, &x, &y);
+		zd_set_vertex(&v[3], x, y, 0.0f);
+	}
+	else
+	{
+		zd_set_vertex(&v[0], le->left, le->bottom, 0.0f);
+		zd_set_vertex(&v[1], le->right, le->bottom, 0.0f);
+		zd_set_vertex(&v[2], le->right, le->top, 0.0f);
+		zd_set_vertex(&v[3], le->left, le->top, 0.0f);
+	}
+	if(e->flags & ZD_CLEAR)
+		op->flags |= ZD_DCLEAR;
+	if(e->flags & ZD_CLIP)
+		op->flags |= ZD_DCLIP;
+	op->r = le->bgr * e->tcr;
+	op->g = le->bgg * e->tcg;
+	op->b = le->bgb * e->tcb;
+	op->a = le->bga * e->tca;
+	return op;
+}
+
+/* Texel space position of vertex 'v' of an op with virtual texture 'tx' */
+static inline void zd_virtual_texel(ZD_texture *tx, ZD_drawvertex *v,
+		ZD_f *tu, ZD_f *tv)
+{
+	*tu = v->u * tx->w;
+	*tv = v->v * tx->h;
+}
+
+/* Polygon vertex in texel space */
+typedef struct ZD_texel
+{
+	ZD_f	c[2];	/* u, v */
+	int	edge;	/* Quad edge from here to the next vertex, or -1 */
+} ZD_texel;
+
+/*
+ * Clip convex polygon 'in' of 'n' vertices, cut out of the quad with texel
+ * space corners 't', against the line at 'c' on axis 'axis' (0: u, 1: v),
+ * keeping the side below if 'below' is set. Returns the number of vertices
+ * written to 'out'. Crossings are calculated from the edges of the quad, so
+ * that pieces on either side of a line get exactly the same vertices there.
+ */
+static int zd_clip_texels(ZD_f *t, ZD_texel *in, int n, ZD_texel *out,
+		int axis, ZD_f c, int below)
+{
+	int i, no = 0;
+	for(i = 0; i < n; ++i)
+	{
+		ZD_texel *a = in + i;
+		ZD_texel *b = in + (i + 1) % n;
+		int ain = below ? a->c[axis] <= c : a->c[axis] >= c;
+		int bin = below ? b->c[axis] <= c : b->c[axis] >= c;
+		if(ain)
+			out[no++] = *a;
+		if(ain != bin)
+		{
+			ZD_texel *x = out + no++;
+			ZD_f *p0 = a->c, *p1 = b->c, f;
+			if(a->edge >= 0)
+			{
+				p0 = t + a->edge * 2;
+				p1 = t + (a->edge + 1) % 4 * 2;
+			}
+			f = (c - p0[axis]) / (p1[axis] - p0[axis]);
+			x->c[0] = p0[0] + (p1[0] - p0[0]) * f;
+			x->c[1] = p0[1] + (p1[1] - p0[1]) * f;
+			x->c[axis] = c;
+			/* Leaving along the clip line, or entering along the edge */
+			x->edge = ain ? -1 : a->edge;
+		}
+	}
+	return no;
+}
+
+/*
+ * Record the part of quad 'q', with texel space corners 't', covering the
+ * area (x0, y0)-(x1, y1) of tile 'tile', which starts at (ox, oy) in texel
+ * space. 'm' and (mx, my) map texel space, relative to the first corner,
+ * to layer space. Texel axis aligned quads give quads, others triangle fans.
+ */
+static ZD_errors zd_record_vpiece(ZD_state *st, ZD_drawop *q, ZD_drawvertex *qv,
+		ZD_f *t, int rect, ZD_f *m, ZD_texture *tile, ZD_f ox, ZD_f oy,
+		ZD_f x0, ZD_f y0, ZD_f x1, ZD_f y1)
+{
+	ZD_texel pa[8], pb[8];
+	ZD_drawop *op;
+	ZD_drawvertex *v;
+	int i, n = 4;
+	if(rect)
+	{
+		/* Clamping the corners keeps the vertex order of the quad */
+		for(i = 0; i < 4; ++i)
+		{
+			ZD_f u = t[i * 2], w = t[i * 2 + 1];
+			pa[i].c[0] = u < x0 ? x0 : (u > x1 ? x1 : u);
+			pa[i].c[1] = w < y0 ? y0 : (w > y1 ? y1 : w);
+		}
+	}
+	else
+	{
+		for(i = 0; i < 4; ++i)
+		{
+			pa[i].c[0] = t[i * 2];
+			pa[i].c[1] = t[i * 2 + 1];
+			pa[i].edge = i;
+		}
+		n = zd_clip_texels(t, pa, 4, pb, 0, x0, 0);
+		n = zd_clip_texels(t, pb, n, pa, 0, x1, 1);
+		n = zd_clip_texels(t, pa, n, pb, 1, y0, 0);
+		n = zd_clip_texels(t, pb, n, pa, 1, y1, 1);
+		if(n < 3)
+			return ZD_OK;
+	}
+	if(!(op = zd_new_op(st, rect ? ZD_DQUAD : ZD_DPRIMITIVE, q->entity, n)))
+		return ZD_OOMEMORY;
+	op->flags = rect ? q->flags : 0;
+	op->r = q->r;
+	op->g = q->g;
+	op->b = q->b;
+	op->a = q->a;
+	op->texture = tile;
+	op->pkind = ZD_TRIANGLEFAN;
+	v = zd_OpVertices(&st->drawlist, op);
+	for(i = 0; i < n; ++i)
+	{
+		ZD_f u = pa[i].c[0], w = pa[i].c[1];
+		zd_TransformPoint(m, qv[0].x, qv[0].y, u - t[0], w - t[1],
+				&v[i].x, &v[i].y);
+		v[i].z = qv[0].z;
+		v[i].u = (u - ox + ZD_VTILEBORDER) / ZD_VTILESIZE;
+		v[i].v = (w - oy + ZD_VTILEBORDER) / ZD_VTILESIZE;
+	}
+	return ZD_OK;
+}
+
+/*
+ * Span from 'c' of tile row or column 'i' of a virtual texture 'size' texels
+ * wide, repeating every 'size' texels. Returns the end of the span, and sets
+ * '*i' to the tile index, and '*o' to the start of the tile in texel space.
+ */
+static ZD_f zd_virtual_span(ZD_f c, unsigned size, int *i, ZD_f *o)
+{
+	ZD_f period = floor(c / size) * size;
+	ZD_f end;
+	*i = (int)((c - period) / ZD_VTILESTEP);
+	if(*i > (int)((size - 1) / ZD_VTILESTEP))
+		*i = (size - 1) / ZD_VTILESTEP;	/* Rounding error */
+	*o = period + *i * ZD_VTILESTEP;
+	end = *o + ZD_VTILESTEP;
+	if(end > period + size)
+		end = period + size;
+	return end;
+}
+
+/*
+ * Replace quad 'op', the last op of the draw list, which has a virtual
+ * texture, with pieces textured with the tiles it covers, as far as they are
+ * in view. The texture repeats beyond its edges, unless clamped, in which
+ * case nothing is drawn there. Tiles that don't fit in the tile cache, and
+ * pieces beyond ZD_VMAXPIECES, as with heavily minified repeating textures,
+ * are not drawn.
+ */
+static ZD_errors zd_record_virtual(ZD_state *st, ZD_drawop *op)
+{
+	ZD_drawlist *dl = &st->drawlist;
+	ZD_texture *vtx = op->texture;
+	ZD_drawop q = *op;
+	ZD_drawvertex qv[4];
+	ZD_f t[8], a[4], m[4], mi[4], b[4];
+	ZD_f x0, x1, y0, y1, ox, oy;
+	int i, rect, pieces = 0;
+
+	/* Take the quad out of the draw list */
+	memcpy(qv, zd_OpVertices(dl, op), sizeof(qv));
+	--dl->nops;
+	dl->nvertices -= 4;
+
+	for(i = 0; i < 4; ++i)
+		zd_virtual_texel(vtx, qv + i, t + i * 2, t + i * 2 + 1);
+	rect = ((t[0] == t[6]) && (t[2] == t[4]) &&
+			(t[1] == t[3]) && (t[5] == t[7])) ||
+			((t[0] == t[2]) && (t[4] == t[6]) &&
+			(t[1] == t[7]) && (t[3] == t[5]));
+
+	/* Affine map from texel space, relative to corner 0, to layer space */
+	a[0] = t[2] - t[0];	a[1] = t[6] - t[0];
+	a[2] = t[3] - t[1];	a[3] = t[7] - t[1];
+	if(zd_InverseMatrix(a, a))
+		return ZD_OK;	/* Degenerate; nothing to draw */
+	m[0] = qv[1].x - qv[0].x;	m[1] = qv[3].x - qv[0].x;
+	m[2] = qv[1].y - qv[0].y;	m[3] = qv[3].y - qv[0].y;
+	zd_MultiplyMatrix(m, a, m);
+	if(zd_InverseMatrix(m, mi))
+		return ZD_OK;
+
+	/* Texel space bounds of the quad... */
+	b[0] = b[2] = t[0];
+	b[1] = b[3] = t[1];
+	for(i = 1; i < 4; ++i)
+		zd_bounds_add(b, t[i * 2], t[i * 2 + 1]);
+
+	/* ...and of the view, if there is one */
+	if((st->vl > -HUGE_VAL) && (st->vr < HUGE_VAL) &&
+			(st->vb > -HUGE_VAL) && (st->vt < HUGE_VAL))
+	{
+		ZD_f vb[4], u, w;
+		zd_TransformPoint(mi, t[0], t[1], st->vl - qv[0].x,
+				st->vb - qv[0].y, &u, &w);
+		vb[0] = vb[2] = u;
+		vb[1] = vb[3] = w;
+		zd_TransformPoint(mi, t[0], t[1], st->vr - qv[0].x,
+				st->vb - qv[0].y, &u, &w);
+		zd_bounds_add(vb, u, w);
+		zd_TransformPoint(mi, t[0], t[1], st->vr - qv[0].x,
+				st->vt - qv[0].y, &u, &w);
+		zd_bounds_add(vb, u, w);
+		zd_TransformPoint(mi, t[0], t[1], st->vl - qv[0].x,
+				st->vt - qv[0].y, &u, &w);
+		zd_bounds_add(vb, u, w);
+		for(i = 0; i < 2; ++i)
+		{
+			if(vb[i] > b[i])
+				b[i] = vb[i];
+			if(vb[i + 2] < b[i + 2])
+				b[i + 2] = vb[i + 2];
+		}
+	}
+
+	/* Clamped axes end at the edges of the texture */
+	if((vtx->flags & ZD__HMODE) == ZD_HCLAMP)
+	{
+		if(b[0] < 0.0f)
+			b[0] = 0.0f;
+		if(b[2] > vtx->w)
+			b[2] = vtx->w;
+	}
+	if((vtx->flags & ZD__VMODE) == ZD_VCLAMP)
+	{
+		if(b[1] < 0.0f)
+			b[1] = 0.0f;
+		if(b[3] > vtx->h)
+			b[3] = vtx->h;
+	}
+
+	for(y0 = b[1]; y0 < b[3]; y0 = y1)
+	{
+		int ty;
+		y1 = zd_virtual_span(y0, vtx->h, &ty, &oy);
+		if(y1 <= y0)
+			break;
+		if(y1 > b[3])
+			y1 = b[3];
+		for(x0 = b[0]; x0 < b[2]; x0 = x1)
+		{
+			ZD_texture *tile;
+			ZD_errors res;
+			int tx;
+			x1 = zd_virtual_span(x0, vtx->w, &tx, &ox);
+			if(x1 <= x0)
+				break;
+			if(x1 > b[2])
+				x1 = b[2];
+			if(++pieces > ZD_VMAXPIECES)
+				return ZD_OK;
+			if((res = zd_vtile(vtx, tx, ty, &tile)))
+				return res;
+			if(!tile)
+				return ZD_OK;	/* Tile cache full */
+			if((res = zd_record_vpiece(st, &q, qv, t, rect, m, tile,
+					ox, oy, x0, y0, x1, y1)))
+				return res;
+		}
+	}
+	return ZD_OK;
+}
+
+static ZD_errors zd_record_sprite(ZD_entity *e)
+{
+	ZD_state *st = e->state;
+	ZD_xftable *xf = &st->xf;
+	ZD_sprite *spr = (ZD_sprite *)e;
+	ZD_f sx1 = -spr->cx;
+	ZD_f sy1 = -spr->cy;
+	ZD_f sx2 = 1.0f - spr->cx;
+	ZD_f sy2 = 1.0f - spr->cy;
+	ZD_f m[4], tx, ty, tz;
+	ZD_drawop *op;
+	ZD_drawvertex *v;
+	if(!(op = zd_new_op(st, ZD_DQUAD, e, 4)))
+		return ZD_OOMEMORY;
+	v = zd_OpVertices(&st->drawlist, op);
+
+	/* Local copies, as the vertex stores could alias the table */
+	m[0] = xf->trmx[e->xf * 4];
+	m[1] = xf->trmx[e->xf * 4 + 1];
+	m[2] = xf->trmx[e->xf * 4 + 2];
+	m[3] = xf->trmx[e->xf * 4 + 3];
+	tx = xf->tx[e->xf];
+	ty = xf->ty[e->xf];
+	tz = xf->tz[e->xf];
+	zd_TransformPoint(m, tx, ty, sx1, sy1, &v[0].x, &v[0].y);
+	zd_TransformPoint(m, tx, ty, sx2, sy1, &v[1].x, &v[1].y);
+	zd_TransformPoint(m, tx, ty, sx2, sy2, &v[2].x, &v[2].y);
+	zd_TransformPoint(m, tx, ty, sx1, sy2, &v[3].x, &v[3].y);
+	v[0].z = v[1].z = v[2].z = v[3].z = tz;
+	v[0].u = v[3].u = 0.0f;
+	v[1].u = v[2].u = 1.0f;
+	v[0].v = v[1].v = 1.0f;
+	v[2].v = v[3].v = 0.0f;
+	op->texture = spr->txe.texture;
+	if(!m[1] && !m[2])
+		op->flags |= ZD_DAXIAL;
+	if(op->texture && (op->texture->type == ZD_TT_VIRTUAL))
+		return zd_record_virtual(st, op);
+	return ZD_OK;
+}
+
+static ZD_errors zd_record_primitive(ZD_entity *e)
+{
+	ZD_state *st = e->state;
+	ZD_primitive *pe = (ZD_primitive *)e;
+	ZD_f tz = st->xf.tz[e->xf];
+	ZD_drawop *op;
+	ZD_drawvertex *v;
+	unsigned i;
+	if(st->minmesh && !st->buffering && (pe->nvertices >= st->minmesh))
+	{
+		/* The backend keeps its own copy of the vertices */
+		if(!(op = zd_new_op(st, ZD_DMESH, e, 0)))
+			return ZD_OOMEMORY;
+		op->texture = pe->txe.texture;
+		op->pkind = pe->pkind;
+		return ZD_OK;
+	}
+	if(!(op = zd_new_op(st, ZD_DPRIMITIVE, e, pe->nvertices)))
+		return ZD_OOMEMORY;
+	v = zd_OpVertices(&st->drawlist, op);
+	for(i = 0; i < pe->nvertices; ++i)
+	{
+		ZD_vertex *vx = pe->vertices + i;
+		zd_TransformPointE(e, vx->x, vx->y, &v[i].x, &v[i].y);
+		v[i].z = vx->z + tz;
+		v[i].u = vx->tx;
+		v[i].v = vx->ty;
+	}
+	op->texture = pe->txe.texture;
+	op->pkind = pe->pkind;
+	return ZD_OK;
+}
+
+static ZD_errors zd_record_fill(ZD_entity *e)
+{
+	ZD_state *st = e->state;
+	ZD_xftable *xf = &st->xf;
+	ZD_fill *fe = (ZD_fill *)e;
+	ZD_layer *c = zd_ClientOf(e->parent);
+	ZD_f cr, ctz;
+	ZD_f wx[4], wy[4];
+	ZD_f tx[4], ty[4];
+	ZD_drawop *op;
+	ZD_drawvertex *v;
+	int i;
+
+	if(c->e.kind == ZD_EWINDOW)
+	{
+		/* Transform the window position to viewport coordinates */
+		ZD_entity *wp = c->e.parent;
+		zd_TransformPointE(wp, c->left, c->bottom, &wx[0], &wy[0]);
+		zd_TransformPointE(wp, c->right, c->bottom, &wx[1], &wy[1]);
+		zd_TransformPointE(wp, c->right, c->top, &wx[2], &wy[2]);
+		zd_TransformPointE(wp, c->left, c->top, &wx[3], &wy[3]);
+		cr = xf->tr[c->e.xf];
+	}
+	else /* if(c->e.kind == ZD_ELAYER) */
+	{
+		wx[0] = c->left;	wy[0] = c->bottom;
+		wx[1] = c->right;	wy[1] = c->bottom;
+		wx[2] = c->right;	wy[2] = c->top;
+		wx[3] = c->left;	wy[3] = c->top;
+		cr = 0.0f;
+	}
+
+	if(fe->txe.texture)
+	{
+		ZD_f xs, ys, tx1, ty1, tx2, ty2;
+		ZD_f m[4], xo, yo;
+
+		/* Map texture coordinates to match the client rectangle */
+		xs = c->right - c->left;
+		ys = c->top - c->bottom;
+		tx1 = c->left;
+		ty1 = c->bottom;
+		tx2 = xs + c->left;
+		ty2 = ys + c->bottom;
+
+		/* Set up texcoord transform, adjusting for window rotation */
+		zd_CalculateMatrix(cr - xf->tr[e->xf], xf->ts[e->xf], m);
+		/* FIXME: This isn't doing what it's supposed to... */
+		zd_TransformPoint(m, 0.0f, 0.0f, xf->tx[e->xf], xf->ty[e->xf],
+				&xo, &yo);
+
+		/* Invert matrix, because we're dealing with texcoords! */
+		if(zd_InverseMatrix(m, m))
+			return ZD_OK;	/* Scaled to nothing! */
+
+		zd_InvTransformPoint(m, xo, yo, tx1, ty2, &tx[0], &ty[0]);
+		zd_InvTransformPoint(m, xo, yo, tx2, ty2, &tx[1], &ty[1]);
+		zd_InvTransformPoint(m, xo, yo, tx2, ty1, &tx[2], &ty[2]);
+		zd_InvTransformPoint(m, xo, yo, tx1, ty1, &tx[3], &ty[3]);
+		ctz = xf->tz[e->xf] - xf->tz[c->e.xf];
+	}
+	else
+	{
+		for(i = 0; i < 4; ++i)
+			tx[i] = ty[i] = 0.0f;
+		ctz = xf->tz[e->xf];
+	}
+
+	if(!(op = zd_new_op(st, ZD_DQUAD, e, 4)))
+		return ZD_OOMEMORY;
+	v = zd_OpVertices(&st->drawlist, op);
+	for(i = 0; i < 4; ++i)
+	{
+		v[i].x = wx[i];
+		v[i].y = wy[i];
+		v[i].z = ctz;
+		v[i].u = tx[i];
+		v[i].v = ty[i];
+	}
+	op->texture = fe->txe.texture;
+	if(op->texture && (op->texture->type == ZD_TT_VIRTUAL))
+		return zd_record_virtual(st, op);
+	return ZD_OK;
+}
+
+/*
+ * Record the ops for visible entity 'e', before its children, if any. 'depth'
+ * is the number of traversal stack frames above 'e'.
+ */
+static ZD_errors zd_record_entity(ZD_entity *e, unsigned depth)
+{
+	ZD_state *st = e->state;
+	ZD_drawop *op;
+	switch(e->kind)
+	{
+	  case ZD_EROOT:
+	  case ZD_EGROUP:
+		++st->drawlist.groups;
+		return ZD_OK;
+	  case ZD_ELAYER:
+		return zd_record_view(e, ZD_DLAYER) ? ZD_OK : ZD_OOMEMORY;
+	  case ZD_EWINDOW:
+		if(!(op = zd_record_view(e, ZD_DWINDOW)))
+			return ZD_OOMEMORY;
+		/* Find the layer or buffer the window is on, for clipping */
+		while(depth--)
+		{
+			ZD_travframe *f = st->stack + depth;
+			if(f->buffer >= 0)
+			{
+				op->layer = f->buffer;
+				break;
+			}
+			if(f->e->kind == ZD_ELAYER)
+			{
+				op->layer = f->op;
+				break;
+			}
+		}
+		return ZD_OK;
+	  case ZD_ESPRITE:
+		return zd_record_sprite(e);
+	  case ZD_EPRIMITIVE:
+		return zd_record_primitive(e);
+	  case ZD_EFILL:
+		return zd_record_fill(e);
+	}
+	return ZD_INTERNAL + 2;	/* Illegal kind! */
+}
+
+/* Record the ops for 'e' after its children, if any */
+static ZD_errors zd_record_entity_post(ZD_entity *e)
+{
+	ZD_drawop *op;
+	switch(e->kind)
+	{
+	  case ZD_ELAYER:
+		return zd_new_op(e->state, ZD_DENDLAYER, e, 0) ?
+				ZD_OK : ZD_OOMEMORY;
+	  case ZD_EWINDOW:
+		if(!(op = zd_new_op(e->state, ZD_DENDWINDOW, e, 0)))
+			return ZD_OOMEMORY;
+		if(e->flags & ZD_CLIP)
+			op->flags |= ZD_DCLIP;
+		return ZD_OK;
+	  default:
+		return ZD_OK;
+	}
+}
+
+/*
+ * Buffers of groups are in the local space of the group, and cover its
+ * bounding box. Buffers of windows are in the space of the parent, as that is
+ * where windows are placed, and cover the window area, or without clipping,
+ * the bounding box of the window in parent space.
+ */
+static inline ZD_entity *zd_buffer_space(ZD_entity *e)
+{
+	return e->kind == ZD_EWINDOW ? e->parent : e;
+}
+
+static inline ZD_f *zd_buffer_rect(ZD_entity *e)
+{
+	return e->kind == ZD_EWINDOW ? e->bounds : e->lbounds;
+}
+
+/*
+ * Create a buffer texture. Only the backend keeps pixels for these, with
+ * premultiplied alpha, as the content is rendered into a transparent buffer.
+ */
+static ZD_texture *zd_buffer_texture(ZD_state *st, unsigned w, unsigned h)
+{
+	ZD_texture *tx = zd_new_texture(st, ZD_RGBA,
+			ZD_HCLAMP | ZD_VCLAMP | ZD_BILINEAR, w, h);
+	if(tx)
+	{
+		zd_FreeTexturePixels(tx);
+		tx->t.p.pixels = NULL;
+		tx->flags |= ZD_PREMULTIPLIED;
+	}
+	return tx;
+}
+
+/*
+ * Display pixels per unit in the layer that the entity at traversal stack
+ * depth 'depth' is on, or in the default view, if there is no layer.
+ */
+static ZD_f zd_pixel_density(ZD_state *st, unsigned depth)
+{
+	ZD_f w = 2.0f, h = 2.0f, dx, dy;
+	while(depth--)
+		if(st->stack[depth].e->kind == ZD_ELAYER)
+		{
+			ZD_layer *le = (ZD_layer *)st->stack[depth].e;
+			w = fabs(le->right - le->left);
+			h = fabs(le->top - le->bottom);
+			break;
+		}
+	dx = st->displayw / w;
+	dy = st->displayh / h;
+	return dx > dy ? dx : dy;
+}
+
+/*
+ * Check if ZD_BUFFERED entity 'e' can be drawn via its buffer, creating or
+ * resizing the buffer texture as needed. 'depth' is the number of traversal
+ * stack frames above 'e'. Returns -1 if 'e' is to be recorded as usual, 0 if
+ * the buffer needs to be redrawn, or 1 if it can be drawn as is.
+ */
+static int zd_prepare_buffer(ZD_entity *e, unsigned depth)
+{
+	ZD_state *st = e->state;
+	ZD_buffer *b = zd_BufferOf(e);
+	ZD_f *r, s, d, fw, fh;
+	unsigned w, h;
+	if(!b || !st->maxbuffer || (e->flags & ZD_ANIMCONTENT) ||
+			((e->kind == ZD_EWINDOW) && (e->flags & ZD_ANIMATED)))
+		return -1;
+
+	/* Fills etc cover the whole view, so the bounding box won't do */
+	if(e->flags & ZD_NOCULL)
+		return -1;
+
+	/* Size in pixels, at the current scale and display resolution */
+	r = zd_buffer_rect(e);
+	s = fabs(st->xf.ts[zd_buffer_space(e)->xf]);
+	d = zd_pixel_density(st, depth);
+	fw = ceil((r[2] - r[0]) * s * d);
+	fh = ceil((r[3] - r[1]) * s * d);
+	if(!(fw >= 1.0f) || !(fh >= 1.0f))
+		return -1;	/* Empty, or scaled to nothing */
+	w = fw < st->maxbuffer ? fw : st->maxbuffer;
+	h = fh < st->maxbuffer ? fh : st->maxbuffer;
+
+	if(!b->texture || (b->texture->w != w) || (b->texture->h != h))
+	{
+		ZD_texture *tx = zd_buffer_texture(st, w, h);
+		if(!tx)
+			return -1;
+		if(b->texture)
+			zd_TextureDecRef(b->texture);
+		b->texture = tx;
+		e->flags |= ZD_REBUFFER;
+	}
+
+	/* Colors of ancestors are applied in the buffer too */
+	if((b->cr != e->tcr) || (b->cg != e->tcg) || (b->cb != e->tcb) ||
+			(b->ca != e->tca))
+		e->flags |= ZD_REBUFFER;
+
+	/* Textures may have been written to since the buffer was drawn */
+	if(!(e->flags & ZD_REBUFFER))
+	{
+		unsigned i;
+		for(i = 0; i < b->nsources; ++i)
+			if(b->sources[i].texture->serial != b->sources[i].serial)
+			{
+				e->flags |= ZD_REBUFFER;
+				break;
+			}
+	}
+	return !(e->flags & ZD_REBUFFER);
+}
+
+/*
+ * The texture that 'op' draws from, as set by the application; that is, the
+ * virtual texture rather than one of its tiles.
+ */
+static ZD_texture *zd_op_source(ZD_drawop *op)
+{
+	switch(op->entity->kind)
+	{
+	  case ZD_ESPRITE:
+	  case ZD_EFILL:
+	  case ZD_EPRIMITIVE:
+		return ((ZD_txentity *)op->entity)->texture;
+	  default:
+		return op->texture;
+	}
+}
+
+/* Add 'tx' to the sources of buffer 'b', unless already marked as listed */
+static void zd_add_buffer_source(ZD_state *st, ZD_buffer *b, ZD_texture *tx,
+		unsigned serial)
+{
+	if(tx->mark == st->buffermark)
+		return;
+	tx->mark = st->buffermark;
+	zd_TextureIncRef(tx);
+	b->sources[b->nsources].texture = tx;
+	b->sources[b->nsources++].serial = serial;
+}
+
+/*
+ * List the textures drawn into the buffer of 'e' by the ops after op 'first',
+ * so that zd_prepare_buffer() can tell when they change. Nested buffers are
+ * represented by their own lists.
+ */
+static ZD_errors zd_list_buffer_sources(ZD_entity *e, unsigned first)
+{
+	ZD_state *st = e->state;
+	ZD_drawlist *dl = &st->drawlist;
+	ZD_buffer *b = zd_BufferOf(e);
+	unsigned i, j, n = 0, nest = 0;
+	zd_free_buffer_sources(b);
+	for(i = first + 1; i < dl->nops; ++i)
+	{
+		ZD_drawop *op = dl->ops + i;
+		ZD_buffer *nb = zd_BufferOf(op->entity);
+		if(op->kind == ZD_DBUFFER)
+			++nest;
+		else if(op->kind == ZD_DENDBUFFER)
+			--nest;
+		else if(nest || !op->texture)
+			continue;
+		else if(nb && (op->texture == nb->texture))
+			n += nb->nsources;
+		else
+			++n;
+	}
+	if(!n)
+		return ZD_OK;
+	if(!(b->sources = (ZD_bufsource *)malloc(n * sizeof(ZD_bufsource))))
+		return ZD_OOMEMORY;
+	++st->buffermark;
+	for(i = first + 1; i < dl->nops; ++i)
+	{
+		ZD_drawop *op = dl->ops + i;
+		ZD_buffer *nb = zd_BufferOf(op->entity);
+		if(op->kind == ZD_DBUFFER)
+			++nest;
+		else if(op->kind == ZD_DENDBUFFER)
+			--nest;
+		else if(nest || !op->texture)
+			continue;
+		else if(nb && (op->texture == nb->texture))
+			for(j = 0; j < nb->nsources; ++j)
+				zd_add_buffer_source(st, b,
+						nb->sources[j].texture,
+						nb->sources[j].serial);
+		else
+		{
+			ZD_texture *tx = zd_op_source(op);
+			zd_add_buffer_source(st, b, tx, tx->serial);
+		}
+	}
+	return ZD_OK;
+}
+
+/* Record the quad that draws the buffer of 'e' */
+static ZD_errors zd_record_buffer(ZD_entity *e)
+{
+	ZD_state *st = e->state;
+	ZD_xftable *xf = &st->xf;
+	unsigned i = zd_buffer_space(e)->xf;
+	ZD_f *r = zd_buffer_rect(e);
+	ZD_f m[4], tx, ty, tz;
+	ZD_drawop *op;
+	ZD_drawvertex *v;
+	if(!(op = zd_new_op(st, ZD_DQUAD, e, 4)))
+		return ZD_OOMEMORY;
+	v = zd_OpVertices(&st->drawlist, op);
+	memcpy(m, xf->trmx + i * 4, sizeof(m));
+	tx = xf->tx[i];
+	ty = xf->ty[i];
+	tz = xf->tz[i];
+	zd_TransformPoint(m, tx, ty, r[0], r[1], &v[0].x, &v[0].y);
+	zd_TransformPoint(m, tx, ty, r[2], r[1], &v[1].x, &v[1].y);
+	zd_TransformPoint(m, tx, ty, r[2], r[3], &v[2].x, &v[2].y);
+	zd_TransformPoint(m, tx, ty, r[0], r[3], &v[3].x, &v[3].y);
+	v[0].z = v[1].z = v[2].z = v[3].z = tz;
+	v[0].u = v[3].u = 0.0f;
+	v[1].u = v[2].u = 1.0f;
+	v[0].v = v[1].v = 1.0f;
+	v[2].v = v[3].v = 0.0f;
+	op->texture = zd_BufferOf(e)->texture;
+	op->r = op->g = op->b = op->a = 1.0f;
+	if(!m[1] && !m[2])
+		op->flags |= ZD_DAXIAL;
+	return ZD_OK;
+}
+
+/*
+ * Start recording the subtree of 'e' into its buffer. Nothing in it is culled,
+ * as the buffer is kept for as long as it can be used.
+ */
+static ZD_errors zd_begin_buffer(ZD_entity *e)
+{
+	ZD_state *st = e->state;
+	ZD_f *r = zd_buffer_rect(e);
+	ZD_drawop *op;
+	ZD_drawvertex *v;
+	if(!(op = zd_new_op(st, ZD_DBUFFER, e, 4)))
+		return ZD_OOMEMORY;
+	v = zd_OpVertices(&st->drawlist, op);
+	zd_set_vertex(&v[0], r[0], r[1], 0.0f);
+	zd_set_vertex(&v[1], r[2], r[1], 0.0f);
+	zd_set_vertex(&v[2], r[2], r[3], 0.0f);
+	zd_set_vertex(&v[3], r[0], r[3], 0.0f);
+	op->texture = zd_BufferOf(e)->texture;
+	st->vl = st->vb = -HUGE_VAL;
+	st->vr = st->vt = HUGE_VAL;
+	++st->buffering;
+	return ZD_OK;
+}
+
+/*
+ * Finish the buffer of 'e', started by the ZD_DBUFFER op 'first'. The ops
+ * recorded since are moved into the space of the buffer, except for those of
+ * nested buffers, which are in their own space already, apart from the quads
+ * that draw them.
+ */
+static ZD_errors zd_end_buffer(ZD_entity *e, unsigned first)
+{
+	ZD_state *st = e->state;
+	ZD_drawlist *dl = &st->drawlist;
+	ZD_buffer *b = zd_BufferOf(e);
+	unsigned xi = zd_buffer_space(e)->xf;
+	ZD_f tx = st->xf.tx[xi];
+	ZD_f ty = st->xf.ty[xi];
+	ZD_f mi[4];
+	unsigned i, j, nest = 0;
+	--st->buffering;
+	if(zd_InverseMatrix(st->xf.trmx + xi * 4, mi))
+		return ZD_DIVBYZERO;	/* Not sized if scaled to nothing! */
+	for(i = first + 1; i < dl->nops; ++i)
+	{
+		ZD_drawop *op = dl->ops + i;
+		ZD_drawvertex *v = zd_OpVertices(dl, op);
+		if(op->kind == ZD_DBUFFER)
+			++nest;
+		else if(op->kind == ZD_DENDBUFFER)
+			--nest;
+		else if(!nest)
+			for(j = 0; j < op->count; ++j)
+				zd_InvTransformPoint(mi, tx, ty, v[j].x, v[j].y,
+						&v[j].x, &v[j].y);
+	}
+	if(zd_list_buffer_sources(e, first) ||
+			!zd_new_op(st, ZD_DENDBUFFER, e, 0))
+		return ZD_OOMEMORY;
+	b->cr = e->tcr;
+	b->cg = e->tcg;
+	b->cb = e->tcb;
+	b->ca = e->tca;
+	e->flags &= ~ZD_REBUFFER;
+	return zd_record_buffer(e);
+}
+
+/*
+ * Update the transform, color etc of 'e', if needed. Returns the flags to
+ * forward to the children of 'e'.
+ */
+static inline unsigned zd_rethink_entity(ZD_entity *e, unsigned fwflags)
+{
+	ZD_state *st = e->state;
+	e->flags |= fwflags;
+	if(e->flags & (ZD_RETHINK | ZD_ANIMATED))
+	{
+		if(!(st->flags & ZD_BATCHTRANSFORM))
+			zd_apply_transform(st, e->xf);
+		zd_apply_color(e);
+		if(e->Rethink)
+			e->Rethink(e);
+		e->flags &= ~ZD_RETHINK;
+		fwflags |= ZD_RETHINK;	/* Recursively rethink children! */
+	}
+	return fwflags;
+}
+
+static ZD_errors zd_grow_stack(ZD_state *st)
+{
+	unsigned ns = st->stacksize ? st->stacksize * 2 : 32;
+	ZD_travframe *s = (ZD_travframe *)realloc(st->stack,
+			ns * sizeof(ZD_travframe));
+	if(!s)
+		return ZD_OOMEMORY;
+	st->stack = s;
+	st->stacksize = ns;
+	return ZD_OK;
+}
+
+/*
+ * Record the scene graph of 'st' into its draw list, depth first. Visible
+ * entities with children get a stack entry, holding the state needed for
+ * visiting the children, and for recording the ops that go after them.
+ */
+static ZD_errors zd_record_tree(ZD_state *st)
+{
+	ZD_drawlist *dl = &st->drawlist;
+	ZD_entity *e = st->root;
+	unsigned fwflags = 0;
+	unsigned depth = 0;
+	ZD_errors res;
+	dl->nops = dl->nvertices = dl->groups = 0;
+	st->buffering = 0;
+	while(1)
+	{
+		ZD_travframe *f;
+		int buffer = -1;
+		fwflags = zd_rethink_entity(e, fwflags);
+		if(!(e->flags & ZD_VISIBLE))
+		{
+			/* Skip! */
+		}
+		else if(!e->first)
+		{
+			if((res = zd_record_entity(e, depth)))
+				return res;
+			if((res = zd_record_entity_post(e)))
+				return res;
+		}
+		else if((e->flags & ZD_BUFFERED) &&
+				((buffer = zd_prepare_buffer(e, depth)) > 0))
+		{
+			/* Draw the buffer instead; rethink children when back */
+			ZD_entity *ce;
+			if((res = zd_record_buffer(e)))
+				return res;
+			for(ce = e->first; ce; ce = ce->next)
+				ce->flags |= fwflags;
+		}
+		else
+		{
+			if(depth == st->stacksize)
+				if((res = zd_grow_stack(st)))
+					return res;
+			f = st->stack + depth;
+			f->e = e;
+			f->next = e->first;
+			f->fwflags = fwflags;
+			f->view[0] = st->vl;
+			f->view[1] = st->vr;
+			f->view[2] = st->vb;
+			f->view[3] = st->vt;
+			f->buffer = -1;
+			if(!buffer)
+			{
+				f->buffer = dl->nops;
+				if((res = zd_begin_buffer(e)))
+					return res;
+			}
+			if((e->kind == ZD_ELAYER) ||
+					((e->kind == ZD_EWINDOW) &&
+					(e->flags & ZD_CLIP)))
+				zd_enter_view(e);
+			f->op = dl->nops;
+			if((res = zd_record_entity(e, depth)))
+				return res;
+			if(f->op == dl->nops)
+				f->op = -1;
+			else if(f->buffer >= 0)
+			{
+				/* A buffered window is on its own buffer */
+				dl->ops[f->op].layer = f->buffer;
+			}
+			f->cull = zd_local_view(e, f->lv);
+			++depth;
+		}
+
+		/* Find the next child to visit, leaving finished entities */
+		while(1)
+		{
+			if(!depth)
+				return ZD_OK;
+			f = st->stack + depth - 1;
+			while((e = f->next))
+			{
+				f->next = e->next;
+				if(!f->cull || (e->flags & ZD_NOCULL) ||
+						!zd_outside(e->bounds, f->lv))
+					break;
+				/* Outside the view; rethink when back in view */
+				e->flags |= f->fwflags;
+			}
+			if(e)
+				break;
+			if((res = zd_record_entity_post(f->e)))
+				return res;
+			if(f->buffer >= 0)
+				if((res = zd_end_buffer(f->e, f->buffer)))
+					return res;
+			st->vl = f->view[0];
+			st->vr = f->view[1];
+			st->vb = f->view[2];
+			st->vt = f->view[3];
+			--depth;
+		}
+		fwflags = f->fwflags;
+	}
+}
+
+ZD_errors zd_Render(ZD_state *state)
+{
+	ZD_backend *b = state->backend;
+	ZD_errors res;
+	++state->frame;
+	if(state->root->flags & ZD_NEWCONTENT)
+		zd_update_bounds(state->root);
+	if(state->flags & ZD_BATCHTRANSFORM)
+		zd_update_transforms(state);
+	state->vl = state->vb = -HUGE_VAL;
+	state->vr = state->vt = HUGE_VAL;
+	if((res = zd_record_tree(state)))
+		return res;
+	if(b->PreRender)
+		if((res = b->PreRender(state)))
+			return res;
+	if(b->Submit)
+		if((res = b->Submit(state, &state->drawlist)))
+			return res;
 	if(b->PostRender)
 		if((res = b->PostRender(state)))
 			return res;
@@ -1239,6 +3864,90 @@ ZD_errors zd_Render(ZD_state *state)
 }
 
 
+/*---------------------------------------------------------
+	Compaction
+---------------------------------------------------------*/
+
+/*
+ * Move 'e' to the end of the compacted entities, and fix up the links to it.
+ * Transforms are referenced by slot, and need no changes.
+ */
+static ZD_entity *zd_move_entity(ZD_entity *e)
+{
+	ZD_state *st = e->state;
+	unsigned size = st->slabs[e->kind].size;
+	ZD_entity *ne, *ce;
+	if((size_t)(st->cend - st->cnext) < size)
+		if((st->lasterror = zd_new_arena(st, &st->cnext, &st->cend)))
+			return NULL;
+	ne = (ZD_entity *)st->cnext;
+	st->cnext += size;
+	memcpy(ne, e, size);
+	ne->flags ^= ZD_PHASE;
+	if(!ne->parent)
+		st->root = ne;
+	else
+	{
+		if(ne->prev)
+			ne->prev->next = ne;
+		else
+			ne->parent->first = ne;
+		if(ne->next)
+			ne->next->prev = ne;
+		else
+			ne->parent->last = ne;
+	}
+	for(ce = ne->first; ce; ce = ce->next)
+		ce->parent = ne;
+	st->handles.entity[ne->handle & ZD_HINDEXMASK] = ne;
+	--st->nold;
+	return ne;
+}
+
+/*
+ * Compaction copies all entities, in depth first order, into new arenas, and
+ * frees the old arenas when they are empty. Entities created meanwhile are
+ * allocated from new arenas as well, and ZD_PHASE tells old and new entities
+ * apart. The old entities are tracked by count rather than by walking, as
+ * zd_SetParent() may move entities from ahead of the cursor to behind it.
+ */
+ZD_errors zd_Compact(ZD_state *state, unsigned count)
+{
+	ZD_state *st = state;
+	unsigned n = 0;
+	if(!st->oldarenas)
+	{
+		int k;
+		st->oldarenas = st->arenas;
+		st->arenas = NULL;
+		for(k = 0; k < ZD_EKINDS; ++k)
+		{
+			ZD_slab *sl = &st->slabs[k];
+			sl->pool = NULL;
+			sl->next = sl->end = NULL;
+		}
+		st->cnext = st->cend = NULL;
+		st->cursor = st->root;
+		st->phase ^= ZD_PHASE;
+		st->nold = st->handles.count - 1 - st->handles.nfree;
+	}
+	while(st->nold)
+	{
+		ZD_entity *e = st->cursor ? st->cursor : st->root;
+		if(count && (n++ == count))
+			return ZD_INCOMPLETE;
+		if((e->flags & ZD_PHASE) != st->phase)
+			if(!(e = zd_move_entity(e)))
+				return st->lasterror;
+		st->cursor = zd_dfs_next(e, NULL);
+	}
+	zd_free_arenas(st->oldarenas);
+	st->oldarenas = NULL;
+	st->cursor = NULL;
+	return ZD_OK;
+}
+
+
 /* Global error code */
 ZD_errors zd_lasterror = ZD_OK;
 
@@ -0,0 +1,303 @@
+/*
+ * glbatch.c - ZeeDraw OpenGL backend batching test
+ *
+ * Renders sprites and small primitives with the OpenGL backend, through the
+ * logging mock in glmock.c, and checks that the vertex stream that reaches
+ * OpenGL (position, texcoords, color and bound texture of every vertex) is
+ * what the scene describes, in order.
+ *
+ * Then counts OpenGL calls and draw calls per frame for a large number of
+ * sprites cycling through three textures, and all using the same texture.
+ * The latter should only be split into batches by the batch size limit.
+ *
+ * This code is in the public domain. Do what you like with it. NO WARRANTY!
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "SDL.h"
+#include "zeedraw.h"
+#include "glmock.h"
+
+#define	GB_WIDTH	640
+#define	GB_HEIGHT	400
+#define	GB_TEXSIZE	256	/* Too large for the texture atlas */
+#define	GB_SPRITES	300	/* Sprites in the vertex stream test */
+#define	GB_BENCHSPRITES	100000	/* Sprites in the call count test */
+#define	GB_MINBATCH	1000	/* Min average sprites per draw, one texture */
+
+/* glVertex*() modes, from GL/gl.h, as the test doesn't include OpenGL */
+#define	GB_LINE_LOOP		0x0002
+#define	GB_TRIANGLES		0x0004
+#define	GB_TRIANGLE_STRIP	0x0005
+#define	GB_QUADS		0x0007
+
+typedef struct GB_scene
+{
+	SDL_Surface	surface;
+	ZD_state	*state;
+	ZD_entity	*layer;
+	ZD_texture	*textures[3];
+} GB_scene;
+
+static int gb_errors = 0;
+
+static void gb_fail(ZD_errors err)
+{
+	fprintf(stderr, "ZeeDraw error: %s\n", zd_ErrorString(err));
+	exit(1);
+}
+
+static void gb_error(const char *what, int n)
+{
+	if(gb_errors++ < 10)
+		printf("Vertex stream: %s %d is wrong\n", what, n);
+}
+
+static int gb_same(float a, float b)
+{
+	return fabs(a - b) < 0.001f;
+}
+
+static void gb_open(GB_scene *s)
+{
+	int i, j;
+	memset(&s->surface, 0, sizeof(s->surface));
+	s->surface.w = GB_WIDTH;
+	s->surface.h = GB_HEIGHT;
+	if(!(s->state = zd_Open("opengl", 0, &s->surface)))
+		gb_fail(zd_LastError(NULL));
+	if(!(s->layer = zd_Layer(zd_Root(s->state), 0,
+			0, GB_WIDTH, 0, GB_HEIGHT)))
+		gb_fail(zd_LastError(s->state));
+	for(i = 0; i < 3; ++i)
+	{
+		ZD_errors res;
+		ZD_pixels px;
+		ZD_texture *tx = zd_Texture(s->state, ZD_RGBA, ZD_BILINEAR,
+				GB_TEXSIZE, GB_TEXSIZE);
+		if(!tx)
+			gb_fail(zd_LastError(s->state));
+		if((res = zd_LockTexture(tx, &px)))
+			gb_fail(res);
+		for(j = 0; j < GB_TEXSIZE * px.pitch; ++j)
+			px.pixels[j] = j * (i + 1);
+		zd_UnlockTexture(&px);
+		s->textures[i] = tx;
+	}
+}
+
+static void gb_close(GB_scene *s)
+{
+	int i;
+	for(i = 0; i < 3; ++i)
+		zd_ReleaseTexture(s->textures[i]);
+	zd_Close(s->state);
+}
+
+static void gb_render(GB_scene *s)
+{
+	ZD_errors res;
+	if((res = zd_Render(s->state)))
+		gb_fail(res);
+}
+
+/*
+ * Check that the four vertices at 'v' draw a 'size' x 'size' square centered
+ * at (x, y), in color (r, g, b, a), with the whole texture on it.
+ */
+static void gb_check_sprite(int n, GM_vertex *v, ZD_f x, ZD_f y, ZD_f size,
+		float r, float g, float b, float a)
+{
+	int i;
+	float x0 = v->x, y0 = v->y, x1 = v->x, y1 = v->y;
+	float su = 0.0f, sv = 0.0f;
+	for(i = 0; i < 4; ++i)
+	{
+		if(v[i].mode != GB_QUADS)
+			gb_error("mode of sprite", n);
+		if(!gb_same(v[i].r, r) || !gb_same(v[i].g, g) ||
+				!gb_same(v[i].b, b) || !gb_same(v[i].a, a))
+			gb_error("color of sprite", n);
+		if(v[i].texture != v->texture)
+			gb_error("texture of sprite", n);
+		if(v[i].x < x0)
+			x0 = v[i].x;
+		if(v[i].x > x1)
+			x1 = v[i].x;
+		if(v[i].y < y0)
+			y0 = v[i].y;
+		if(v[i].y > y1)
+			y1 = v[i].y;
+		su += v[i].u;
+		sv += v[i].v;
+	}
+	if(!gb_same(x0, x - size * 0.5f) || !gb_same(x1, x + size * 0.5f) ||
+			!gb_same(y0, y - size * 0.5f) ||
+			!gb_same(y1, y + size * 0.5f))
+		gb_error("position of sprite", n);
+	if(v->texture && (!gb_same(su, 2.0f) || !gb_same(sv, 2.0f)))
+		gb_error("texcoords of sprite", n);
+}
+
+/* Check that texture 'k' is always bound as the same, unique, OpenGL name */
+static void gb_check_texture(int n, unsigned names[3], int k, unsigned name)
+{
+	int i;
+	if(k < 0)
+	{
+		if(name)
+			gb_error("texture of untextured sprite", n);
+		return;
+	}
+	if(!names[k])
+	{
+		for(i = 0; i < 3; ++i)
+			if(names[i] == name)
+				gb_error("texture name of sprite", n);
+		names[k] = name;
+	}
+	if(!name || (names[k] != name))
+		gb_error("texture name of sprite", n);
+}
+
+/* Vertices of the test primitives, in local coordinates */
+static const ZD_f gb_strip[] = { 0, 0,  0, 10,  10, 0,  10, 10,  20, 0 };
+static const ZD_f gb_loop[] = { 0, 0,  30, 0,  30, 20,  0, 20 };
+static const ZD_f gb_tris[] = { 0, 0,  8, 0,  0, 8,  8, 8,  16, 8,  8, 16 };
+
+typedef struct GB_primitive
+{
+	ZD_primitives	pkind;
+	int		mode;
+	const ZD_f	*vertices;
+	int		nvertices;
+	ZD_f		x, y;
+} GB_primitive;
+
+static const GB_primitive gb_primitives[] = {
+	{ ZD_TRIANGLESTRIP, GB_TRIANGLE_STRIP, gb_strip, 5, 100, 50 },
+	{ ZD_LINELOOP, GB_LINE_LOOP, gb_loop, 4, 200, 300 },
+	{ ZD_TRIANGLES, GB_TRIANGLES, gb_tris, 6, 500, 100 },
+	{ ZD_TRIANGLES, GB_TRIANGLES, gb_tris, 3, 20, 20 }
+};
+#define	GB_PRIMITIVES	(int)(sizeof(gb_primitives) / sizeof(GB_primitive))
+
+static void gb_stream(void)
+{
+	GB_scene s;
+	ZD_f x[GB_SPRITES], y[GB_SPRITES], size[GB_SPRITES];
+	float color[GB_SPRITES][4];
+	unsigned names[3] = { 0, 0, 0 };
+	int i, j, f, nv;
+	gb_open(&s);
+	srand(1);
+	for(i = 0; i < GB_SPRITES; ++i)
+	{
+		ZD_entity *e;
+		int k = i % 4 - 1;
+		x[i] = 20 + rand() % (GB_WIDTH - 40);
+		y[i] = 20 + rand() % (GB_HEIGHT - 40);
+		size[i] = 4 + rand() % 30;
+		for(j = 0; j < 4; ++j)
+			color[i][j] = (rand() % 256) / 255.0f;
+		if(!(e = zd_Sprite(s.layer, 0, k < 0 ? NULL : s.textures[k],
+				0.5f, 0.5f)))
+			gb_fail(zd_LastError(s.state));
+		zd_SetTransform(e, x[i], y[i], 0, size[i], 0);
+		zd_SetColor(e, color[i][0], color[i][1], color[i][2],
+				color[i][3]);
+	}
+	nv = GB_SPRITES * 4;
+	for(i = 0; i < GB_PRIMITIVES; ++i)
+	{
+		const GB_primitive *p = &gb_primitives[i];
+		ZD_entity *e = zd_Primitive(s.layer, 0, p->pkind,
+				i == 2 ? s.textures[0] : NULL, p->x, p->y, 1, 0);
+		if(!e)
+			gb_fail(zd_LastError(s.state));
+		for(j = 0; j < p->nvertices; ++j)
+			zd_Vertex2D(e, p->vertices[j * 2],
+					p->vertices[j * 2 + 1]);
+		nv += p->nvertices;
+	}
+
+	/* Twice, so that the second frame has nothing to rethink */
+	for(f = 0; f < 2; ++f)
+	{
+		GM_vertex *v;
+		gm_Reset();
+		gb_render(&s);
+		if(gm_log.nvertices != nv)
+		{
+			printf("Vertex stream: %d vertices; expected %d\n",
+					gm_log.nvertices, nv);
+			++gb_errors;
+			break;
+		}
+		v = gm_log.vertices;
+		for(i = 0; i < GB_SPRITES; ++i, v += 4)
+		{
+			gb_check_sprite(i, v, x[i], y[i], size[i], color[i][0],
+					color[i][1], color[i][2], color[i][3]);
+			gb_check_texture(i, names, i % 4 - 1, v->texture);
+		}
+		for(i = 0; i < GB_PRIMITIVES; ++i)
+		{
+			const GB_primitive *p = &gb_primitives[i];
+			for(j = 0; j < p->nvertices; ++j, ++v)
+				if((v->mode != p->mode) ||
+						!gb_same(v->x, p->x +
+						p->vertices[j * 2]) ||
+						!gb_same(v->y, p->y +
+						p->vertices[j * 2 + 1]))
+					gb_error("vertex of primitive", i);
+		}
+	}
+	printf("Vertex stream: %d sprites, %d primitives, %d errors\n",
+			GB_SPRITES, GB_PRIMITIVES, gb_errors);
+	gb_close(&s);
+}
+
+/* OpenGL calls per frame, for sprites using 'ntextures' textures in turn */
+static long gb_count(int ntextures)
+{
+	GB_scene s;
+	int i;
+	gb_open(&s);
+	srand(2);
+	for(i = 0; i < GB_BENCHSPRITES; ++i)
+	{
+		ZD_entity *e = zd_Sprite(s.layer, 0,
+				s.textures[i % ntextures], 0.5f, 0.5f);
+		if(!e)
+			gb_fail(zd_LastError(s.state));
+		zd_SetTransform(e, rand() % GB_WIDTH, rand() % GB_HEIGHT, 0,
+				4 + rand() % 30, 0);
+		zd_SetColor(e, (rand() % 256) / 255.0f, 1, 1, 1);
+	}
+	gb_render(&s);
+	gm_Reset();
+	gb_render(&s);
+	printf("%d sprites, %d texture(s): %ld OpenGL calls, %ld draw calls "
+			"per frame\n", GB_BENCHSPRITES, ntextures,
+			gm_log.calls, gm_log.draws);
+	gb_close(&s);
+	return gm_log.draws;
+}
+
+int main(int argc, const char *argv[])
+{
+	long draws;
+	gb_stream();
+	gb_count(3);
+	draws = gb_count(1);
+	if(draws * GB_MINBATCH > GB_BENCHSPRITES)
+	{
+		printf("Too many draw calls with a single texture!\n");
+		++gb_errors;
+	}
+	return gb_errors ? 1 : 0;
+}
@@ -0,0 +1,217 @@
+/*
+ * glmesh.c - ZeeDraw OpenGL backend buffer object test
+ *
+ * Renders a scene with large primitives, that the OpenGL backend keeps in
+ * buffer objects, through the logging mock in glmock.c. Checks that each
+ * mesh is uploaded once, that adding a vertex to a mesh re-uploads that mesh
+ * only, and that moving or recoloring a mesh uploads nothing.
+ *
+ * Then renders the same frames again with buffer objects hidden from the
+ * backend, so that everything goes through the vertex array batches, and
+ * checks that the vertex streams are the same.
+ *
+ * This code is in the public domain. Do what you like with it. NO WARRANTY!
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "SDL.h"
+#include "zeedraw.h"
+#include "glmock.h"
+
+#define	GM_WIDTH	640
+#define	GM_HEIGHT	400
+#define	GM_TRIANGLES	96	/* Vertices of mesh A */
+#define	GM_LINES	70	/* Vertices of mesh B */
+#define	GM_FRAMES	5
+
+/* What a frame logged */
+typedef struct GM_frame
+{
+	GM_vertex	*vertices;
+	int		nvertices;
+	long		uploads;
+	long		uploadbytes;
+} GM_frame;
+
+static const char *gm_changes[GM_FRAMES] = {
+	"first frame",
+	"no change",
+	"vertex added to mesh B",
+	"mesh A moved",
+	"mesh A recolored"
+};
+
+static int gm_errors = 0;
+
+static void gm_fail(ZD_errors err)
+{
+	fprintf(stderr, "ZeeDraw error: %s\n", zd_ErrorString(err));
+	exit(1);
+}
+
+static void gm_error(int frame, const char *what)
+{
+	if(gm_errors++ < 10)
+		printf("Frame %d (%s): %s\n", frame, gm_changes[frame], what);
+}
+
+/* Render GM_FRAMES frames of the test scene, logging each one in 'frames' */
+static void gm_run(GM_frame *frames)
+{
+	SDL_Surface surface;
+	ZD_state *state;
+	ZD_entity *l, *a, *b, *e;
+	ZD_texture *tx;
+	ZD_pixels px;
+	ZD_errors res;
+	int i, f;
+	memset(&surface, 0, sizeof(surface));
+	surface.w = GM_WIDTH;
+	surface.h = GM_HEIGHT;
+	if(!(state = zd_Open("opengl", 0, &surface)))
+		gm_fail(zd_LastError(NULL));
+	l = zd_Layer(zd_Root(state), 0, 0, GM_WIDTH, 0, GM_HEIGHT);
+
+	if(!(tx = zd_Texture(state, ZD_RGBA, ZD_BILINEAR, 32, 32)))
+		gm_fail(zd_LastError(state));
+	if((res = zd_LockTexture(tx, &px)))
+		gm_fail(res);
+	for(i = 0; i < 32 * px.pitch; ++i)
+		px.pixels[i] = i;
+	zd_UnlockTexture(&px);
+
+	/* Mesh A: textured triangles */
+	if(!(a = zd_Primitive(l, 0, ZD_TRIANGLES, tx, 400, 200, 2, 0.4f)))
+		gm_fail(zd_LastError(state));
+	zd_SetColor(a, 1.0f, 0.5f, 0.25f, 0.75f);
+	for(i = 0; i < GM_TRIANGLES; ++i)
+	{
+		zd_TexCoord(a, (i % 5) * 0.25f, (i % 3) * 0.5f);
+		zd_Vertex3D(a, (i * 7) % 50, (i * 13) % 40, i % 3);
+	}
+
+	/* A sprite and a small primitive in between, drawn in batches */
+	e = zd_Sprite(l, 0, tx, 0.5f, 0.5f);
+	zd_SetTransform(e, 50, 50, 0, 20, 0.3f);
+	e = zd_Primitive(l, 0, ZD_TRIANGLESTRIP, NULL, 50, 10, 1, 0);
+	for(i = 0; i < 5; ++i)
+		zd_Vertex2D(e, i * 5, (i & 1) * 5);
+
+	/* Mesh B: untextured line strip */
+	if(!(b = zd_Primitive(l, 0, ZD_LINESTRIP, NULL, 100, 300, 1, -0.2f)))
+		gm_fail(zd_LastError(state));
+	for(i = 0; i < GM_LINES; ++i)
+		zd_Vertex2D(b, i, (i * i) % 17);
+
+	for(f = 0; f < GM_FRAMES; ++f)
+	{
+		GM_frame *fr = frames + f;
+		switch(f)
+		{
+		  case 2:
+			zd_Vertex2D(b, 80, 0);
+			break;
+		  case 3:
+			zd_Move(a, 5, 5);
+			break;
+		  case 4:
+			zd_SetColor(a, 0.25f, 1.0f, 0.5f, 1.0f);
+			break;
+		}
+		gm_Reset();
+		if((res = zd_Render(state)))
+			gm_fail(res);
+		fr->nvertices = gm_log.nvertices;
+		fr->uploads = gm_log.uploads;
+		fr->uploadbytes = gm_log.uploadbytes;
+		if(!(fr->vertices = (GM_vertex *)malloc(
+				gm_log.nvertices * sizeof(GM_vertex))))
+			gm_fail(ZD_OOMEMORY);
+		memcpy(fr->vertices, gm_log.vertices,
+				gm_log.nvertices * sizeof(GM_vertex));
+	}
+	zd_ReleaseTexture(tx);
+	zd_Close(state);
+}
+
+/* Check the uploads of frame 'f', given that of the first frame */
+static void gm_check_uploads(int f, GM_frame *fr, GM_frame *first)
+{
+	/* Bytes per vertex, from the first frame */
+	long vsize = first->uploadbytes / (GM_TRIANGLES + GM_LINES);
+	switch(f)
+	{
+	  case 0:
+		if(fr->uploads != 2)
+			gm_error(f, "meshes not uploaded once each");
+		break;
+	  case 2:
+		if((fr->uploads != 1) ||
+				(fr->uploadbytes != vsize * (GM_LINES + 1)))
+			gm_error(f, "not just mesh B re-uploaded");
+		break;
+	  default:
+		if(fr->uploads)
+			gm_error(f, "meshes re-uploaded");
+		break;
+	}
+}
+
+static int gm_same(float a, float b)
+{
+	return fabs(a - b) < 0.001f;
+}
+
+/* Compare the vertex streams of frame 'f' with and without buffer objects */
+static void gm_compare(int f, GM_frame *mesh, GM_frame *batch)
+{
+	int i;
+	if(mesh->nvertices != batch->nvertices)
+	{
+		gm_error(f, "vertex counts differ");
+		return;
+	}
+	for(i = 0; i < mesh->nvertices; ++i)
+	{
+		GM_vertex *m = mesh->vertices + i;
+		GM_vertex *b = batch->vertices + i;
+		if(!gm_same(m->x, b->x) || !gm_same(m->y, b->y) ||
+				!gm_same(m->z, b->z) ||
+				!gm_same(m->u, b->u) || !gm_same(m->v, b->v) ||
+				!gm_same(m->r, b->r) || !gm_same(m->g, b->g) ||
+				!gm_same(m->b, b->b) || !gm_same(m->a, b->a) ||
+				(m->texture != b->texture) ||
+				(m->mode != b->mode))
+		{
+			gm_error(f, "vertex streams differ");
+			return;
+		}
+	}
+}
+
+int main(int argc, const char *argv[])
+{
+	GM_frame mesh[GM_FRAMES], batch[GM_FRAMES];
+	int f;
+	gm_run(mesh);
+	gm_Hide("glGenBuffers");
+	gm_run(batch);
+	gm_Hide(NULL);
+	for(f = 0; f < GM_FRAMES; ++f)
+	{
+		printf("Frame %d (%s): %ld uploads, %d vertices\n", f,
+				gm_changes[f], mesh[f].uploads,
+				mesh[f].nvertices);
+		gm_check_uploads(f, mesh + f, mesh);
+		if(batch[f].uploads)
+			gm_error(f, "buffer objects used while hidden");
+		gm_compare(f, mesh + f, batch + f);
+		free(mesh[f].vertices);
+		free(batch[f].vertices);
+	}
+	printf("%d errors\n", gm_errors);
+	return gm_errors ? 1 : 0;
+}
@@ -0,0 +1,685 @@
+/*
+ * glmock.c - Logging OpenGL mock for ZeeDraw tests
+ *
+ * Provides every OpenGL call the backend requires, and buffer objects. State
+ * that affects what ends up on screen (current color and texcoord, bound
+ * texture, client side arrays, buffer objects, matrices) is tracked, so that
+ * vertices can be logged as they would be drawn. Everything else is ignored.
+ * Other optional calls are reported as missing.
+ *
+ * This code is in the public domain. Do what you like with it. NO WARRANTY!
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "SDL.h"
+#include "../src/zd_gli.h"
+#include "glmock.h"
+
+#define	GM_MAXHIDDEN	16	/* Max number of hidden calls */
+#define	GM_MAXBUFFERS	256	/* Max number of buffer objects */
+#define	GM_MAXDEPTH	32	/* Matrix stack depth */
+
+GM_log gm_log;
+
+/* Calls reported as missing */
+static const char *gm_hidden[GM_MAXHIDDEN];
+static int gm_nhidden;
+
+/* Current vertex attributes */
+static float gm_r = 1.0f, gm_g = 1.0f, gm_b = 1.0f, gm_a = 1.0f;
+static float gm_u, gm_v;
+
+/* Texturing */
+static int gm_texture2d;
+static GLuint gm_bound;
+static GLuint gm_lastname;
+
+/* Immediate mode */
+static GLenum gm_mode;
+
+/* Client side arrays */
+static int gm_colorarray;
+static const char *gm_vp, *gm_tp, *gm_cp;
+static GLsizei gm_vs, gm_ts, gm_cs;
+
+/* Buffer objects; 0 is "none" */
+static char *gm_buffers[GM_MAXBUFFERS];
+static GLuint gm_boundbuffer;
+
+/* Matrix stacks: modelview, projection, texture */
+static GLdouble gm_matrices[3][GM_MAXDEPTH][16];
+static int gm_depth[3];
+static int gm_matrixmode;
+
+
+void gm_Reset(void)
+{
+	gm_log.calls = gm_log.draws = 0;
+	gm_log.uploads = gm_log.uploadbytes = 0;
+	gm_log.nvertices = 0;
+}
+
+void gm_Hide(const char *name)
+{
+	if(!name)
+		gm_nhidden = 0;
+	else if(gm_nhidden < GM_MAXHIDDEN)
+		gm_hidden[gm_nhidden++] = name;
+}
+
+/* Top of stack for matrix mode 'm' */
+static GLdouble *gm_matrix(int m)
+{
+	return gm_matrices[m][gm_depth[m]];
+}
+
+/* Apply matrix 'm' to (x, y, z, 1) in 'v' */
+static void gm_transform(const GLdouble *m, float *v)
+{
+	float x = v[0], y = v[1], z = v[2];
+	v[0] = m[0] * x + m[4] * y + m[8] * z + m[12];
+	v[1] = m[1] * x + m[5] * y + m[9] * z + m[13];
+	v[2] = m[2] * x + m[6] * y + m[10] * z + m[14];
+}
+
+static void gm_vertex(float x, float y, float z, float u, float v,
+		float r, float g, float b, float a)
+{
+	GM_vertex *vx;
+	float p[3], t[3];
+	if(gm_log.nvertices >= gm_log.maxvertices)
+	{
+		int n = gm_log.maxvertices ? gm_log.maxvertices * 2 : 1024;
+		if(!(vx = (GM_vertex *)realloc(gm_log.vertices,
+				n * sizeof(GM_vertex))))
+		{
+			fprintf(stderr, "glmock: Out of memory!\n");
+			exit(1);
+		}
+		gm_log.vertices = vx;
+		gm_log.maxvertices = n;
+	}
+	p[0] = x;
+	p[1] = y;
+	p[2] = z;
+	gm_transform(gm_matrix(0), p);
+	t[0] = u;
+	t[1] = v;
+	t[2] = 0.0f;
+	gm_transform(gm_matrix(2), t);
+	vx = gm_log.vertices + gm_log.nvertices++;
+	vx->x = p[0];
+	vx->y = p[1];
+	vx->z = p[2];
+	vx->u = gm_texture2d ? t[0] : 0.0f;
+	vx->v = gm_texture2d ? t[1] : 0.0f;
+	vx->r = r;
+	vx->g = g;
+	vx->b = b;
+	vx->a = a;
+	vx->texture = gm_texture2d ? gm_bound : 0;
+	vx->mode = gm_mode;
+}
+
+
+/*---------------------------------------------------------
+	Tracked calls
+---------------------------------------------------------*/
+
+static void APIENTRY gm_Enable(GLenum cap)
+{
+	++gm_log.calls;
+	if(cap == GL_TEXTURE_2D)
+		gm_texture2d = 1;
+}
+
+static void APIENTRY gm_Disable(GLenum cap)
+{
+	++gm_log.calls;
+	if(cap == GL_TEXTURE_2D)
+		gm_texture2d = 0;
+}
+
+static void APIENTRY gm_EnableClientState(GLenum cap)
+{
+	++gm_log.calls;
+	if(cap == GL_COLOR_ARRAY)
+		gm_colorarray = 1;
+}
+
+static void APIENTRY gm_DisableClientState(GLenum cap)
+{
+	++gm_log.calls;
+	if(cap == GL_COLOR_ARRAY)
+		gm_colorarray = 0;
+}
+
+static void APIENTRY gm_GenTextures(GLsizei n, GLuint *textures)
+{
+	++gm_log.calls;
+	while(n--)
+		*textures++ = ++gm_lastname;
+}
+
+static void APIENTRY gm_BindTexture(GLenum target, GLuint texture)
+{
+	++gm_log.calls;
+	gm_bound = texture;
+}
+
+static void APIENTRY gm_Color4f(GLfloat r, GLfloat g, GLfloat b, GLfloat a)
+{
+	++gm_log.calls;
+	gm_r = r;
+	gm_g = g;
+	gm_b = b;
+	gm_a = a;
+}
+
+static void APIENTRY gm_Color4d(GLdouble r, GLdouble g, GLdouble b, GLdouble a)
+{
+	gm_Color4f(r, g, b, a);
+}
+
+static void APIENTRY gm_Color3d(GLdouble r, GLdouble g, GLdouble b)
+{
+	gm_Color4f(r, g, b, 1.0f);
+}
+
+static void APIENTRY gm_TexCoord2f(GLfloat s, GLfloat t)
+{
+	++gm_log.calls;
+	gm_u = s;
+	gm_v = t;
+}
+
+static void APIENTRY gm_TexCoord2d(GLdouble s, GLdouble t)
+{
+	gm_TexCoord2f(s, t);
+}
+
+static void APIENTRY gm_Begin(GLenum mode)
+{
+	++gm_log.calls;
+	gm_mode = mode;
+}
+
+static void APIENTRY gm_End(void)
+{
+	++gm_log.calls;
+	++gm_log.draws;
+}
+
+static void APIENTRY gm_Vertex3f(GLfloat x, GLfloat y, GLfloat z)
+{
+	++gm_log.calls;
+	gm_vertex(x, y, z, gm_u, gm_v, gm_r, gm_g, gm_b, gm_a);
+}
+
+static void APIENTRY gm_Vertex2f(GLfloat x, GLfloat y)
+{
+	gm_Vertex3f(x, y, 0.0f);
+}
+
+static void APIENTRY gm_Vertex3d(GLdouble x, GLdouble y, GLdouble z)
+{
+	gm_Vertex3f(x, y, z);
+}
+
+static void APIENTRY gm_Vertex2d(GLdouble x, GLdouble y)
+{
+	gm_Vertex3f(x, y, 0.0f);
+}
+
+static void APIENTRY gm_Vertex4d(GLdouble x, GLdouble y, GLdouble z,
+		GLdouble w)
+{
+	gm_Vertex3f(x / w, y / w, z / w);
+}
+
+/* 'pointer' is an offset into the bound buffer object, if there is one */
+static const char *gm_pointer(const GLvoid *pointer)
+{
+	if(gm_boundbuffer)
+		return gm_buffers[gm_boundbuffer] + (size_t)pointer;
+	return (const char *)pointer;
+}
+
+static void APIENTRY gm_VertexPointer(GLint size, GLenum type, GLsizei stride,
+		const GLvoid *pointer)
+{
+	++gm_log.calls;
+	gm_vp = gm_pointer(pointer);
+	gm_vs = stride;
+}
+
+static void APIENTRY gm_TexCoordPointer(GLint size, GLenum type,
+		GLsizei stride, const GLvoid *pointer)
+{
+	++gm_log.calls;
+	gm_tp = gm_pointer(pointer);
+	gm_ts = stride;
+}
+
+static void APIENTRY gm_ColorPointer(GLint size, GLenum type, GLsizei stride,
+		const GLvoid *pointer)
+{
+	++gm_log.calls;
+	gm_cp = gm_pointer(pointer);
+	gm_cs = stride;
+}
+
+/* Arrays are assumed to be GL_FLOAT, as that's all the backend uses */
+static void APIENTRY gm_DrawArrays(GLenum mode, GLint first, GLsizei count)
+{
+	int i;
+	++gm_log.calls;
+	++gm_log.draws;
+	gm_mode = mode;
+	for(i = first; i < first + count; ++i)
+	{
+		const GLfloat *v = (const GLfloat *)(gm_vp + i * gm_vs);
+		const GLfloat *t = (const GLfloat *)(gm_tp + i * gm_ts);
+		const GLfloat *c = (const GLfloat *)(gm_cp + i * gm_cs);
+		if(gm_colorarray)
+			gm_vertex(v[0], v[1], v[2], t[0], t[1],
+					c[0], c[1], c[2], c[3]);
+		else
+			gm_vertex(v[0], v[1], v[2], t[0], t[1],
+					gm_r, gm_g, gm_b, gm_a);
+	}
+}
+
+static void APIENTRY gm_GenBuffers(GLsizei n, GLuint *buffers)
+{
+	++gm_log.calls;
+	while(n--)
+	{
+		GLuint b;
+		for(b = 1; (b < GM_MAXBUFFERS) && gm_buffers[b]; ++b)
+			;
+		if(b >= GM_MAXBUFFERS)
+		{
+			fprintf(stderr, "glmock: Too many buffer objects!\n");
+			exit(1);
+		}
+		/* Placeholder until glBufferData() */
+		gm_buffers[b] = (char *)malloc(1);
+		*buffers++ = b;
+	}
+}
+
+static void APIENTRY gm_DeleteBuffers(GLsizei n, const GLuint *buffers)
+{
+	++gm_log.calls;
+	while(n--)
+	{
+		free(gm_buffers[*buffers]);
+		gm_buffers[*buffers++] = NULL;
+	}
+}
+
+static void APIENTRY gm_BindBuffer(GLenum target, GLuint buffer)
+{
+	++gm_log.calls;
+	gm_boundbuffer = buffer;
+}
+
+static void APIENTRY gm_BufferData(GLenum target, ptrdiff_t size,
+		const GLvoid *data, GLenum usage)
+{
+	char *b;
+	++gm_log.calls;
+	++gm_log.uploads;
+	gm_log.uploadbytes += size;
+	if(!(b = (char *)realloc(gm_buffers[gm_boundbuffer], size)))
+	{
+		fprintf(stderr, "glmock: Out of memory!\n");
+		exit(1);
+	}
+	memcpy(b, data, size);
+	gm_buffers[gm_boundbuffer] = b;
+}
+
+static void APIENTRY gm_MatrixMode(GLenum mode)
+{
+	++gm_log.calls;
+	switch(mode)
+	{
+	  case GL_MODELVIEW:	gm_matrixmode = 0; break;
+	  case GL_PROJECTION:	gm_matrixmode = 1; break;
+	  case GL_TEXTURE:	gm_matrixmode = 2; break;
+	}
+}
+
+static void APIENTRY gm_LoadMatrixd(const GLdouble *m)
+{
+	++gm_log.calls;
+	memcpy(gm_matrix(gm_matrixmode), m, sizeof(GLdouble) * 16);
+}
+
+static void APIENTRY gm_LoadIdentity(void)
+{
+	static const GLdouble identity[16] = {
+		1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  0, 0, 0, 1
+	};
+	gm_LoadMatrixd(identity);
+}
+
+static void APIENTRY gm_MultMatrixd(const GLdouble *m)
+{
+	GLdouble *c = gm_matrix(gm_matrixmode);
+	GLdouble r[16];
+	int i, j;
+	++gm_log.calls;
+	for(i = 0; i < 4; ++i)
+		for(j = 0; j < 4; ++j)
+			r[j * 4 + i] = c[i] * m[j * 4] + c[4 + i] * m[j * 4 + 1] +
+					c[8 + i] * m[j * 4 + 2] +
+					c[12 + i] * m[j * 4 + 3];
+	memcpy(c, r, sizeof(r));
+}
+
+static void APIENTRY gm_MultMatrixf(const GLfloat *m)
+{
+	GLdouble d[16];
+	int i;
+	for(i = 0; i < 16; ++i)
+		d[i] = m[i];
+	gm_MultMatrixd(d);
+}
+
+static void APIENTRY gm_Translated(GLdouble x, GLdouble y, GLdouble z)
+{
+	GLdouble m[16] = {
+		1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  0, 0, 0, 1
+	};
+	m[12] = x;
+	m[13] = y;
+	m[14] = z;
+	gm_MultMatrixd(m);
+}
+
+static void APIENTRY gm_Scaled(GLdouble x, GLdouble y, GLdouble z)
+{
+	GLdouble m[16] = {
+		0, 0, 0, 0,  0, 0, 0, 0,  0, 0, 0, 0,  0, 0, 0, 1
+	};
+	m[0] = x;
+	m[5] = y;
+	m[10] = z;
+	gm_MultMatrixd(m);
+}
+
+/* Rotation around the z axis only, which is all the backend uses */
+static void APIENTRY gm_Rotated(GLdouble a, GLdouble x, GLdouble y, GLdouble z)
+{
+	GLdouble m[16] = {
+		0, 0, 0, 0,  0, 0, 0, 0,  0, 0, 1, 0,  0, 0, 0, 1
+	};
+	a *= M_PI / 180.0f;
+	m[0] = m[5] = cos(a);
+	m[1] = sin(a);
+	m[4] = -m[1];
+	gm_MultMatrixd(m);
+}
+
+static void APIENTRY gm_PushMatrix(void)
+{
+	int m = gm_matrixmode;
+	++gm_log.calls;
+	if(gm_depth[m] + 1 >= GM_MAXDEPTH)
+	{
+		fprintf(stderr, "glmock: Matrix stack overflow!\n");
+		exit(1);
+	}
+	memcpy(gm_matrices[m][gm_depth[m] + 1], gm_matrix(m),
+			sizeof(GLdouble) * 16);
+	++gm_depth[m];
+}
+
+static void APIENTRY gm_PopMatrix(void)
+{
+	++gm_log.calls;
+	if(gm_depth[gm_matrixmode])
+		--gm_depth[gm_matrixmode];
+}
+
+static const GLubyte * APIENTRY gm_GetString(GLenum name)
+{
+	++gm_log.calls;
+	return (const GLubyte *)(name == GL_VERSION ? "2.1" : "glmock");
+}
+
+static GLenum APIENTRY gm_GetError(void)
+{
+	++gm_log.calls;
+	return GL_NO_ERROR;
+}
+
+static void APIENTRY gm_GetDoublev(GLenum pname, GLdouble *params)
+{
+	++gm_log.calls;
+}
+
+static GLboolean APIENTRY gm_IsTexture(GLuint texture)
+{
+	++gm_log.calls;
+	return texture && (texture <= gm_lastname);
+}
+
+
+/*---------------------------------------------------------
+	Ignored calls
+---------------------------------------------------------*/
+
+static void APIENTRY gm_ignore0(void)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_ignore1(GLenum a)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_ignore2(GLenum a, GLenum b)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_ignore3(GLenum a, GLenum b, GLenum c)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_ignore4i(GLint x, GLint y, GLsizei w, GLsizei h)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_ignore3d(GLdouble a, GLdouble b, GLdouble c)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_ignore4d(GLdouble a, GLdouble b, GLdouble c,
+		GLdouble d)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_ignore6d(GLdouble a, GLdouble b, GLdouble c,
+		GLdouble d, GLdouble e, GLdouble f)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_ignore1d(GLdouble a)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_ClearColor(GLclampf r, GLclampf g, GLclampf b,
+		GLclampf a)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_ColorMask(GLboolean r, GLboolean g, GLboolean b,
+		GLboolean a)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_StencilFunc(GLenum func, GLint ref, GLuint mask)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_DeleteTextures(GLsizei n, const GLuint *textures)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_TexImage2D(GLenum target, GLint level,
+		GLint internalformat, GLsizei width, GLsizei height,
+		GLint border, GLenum format, GLenum type, const GLvoid *pixels)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_TexSubImage2D(GLenum target, GLint level,
+		GLint xoffset, GLint yoffset, GLsizei width, GLsizei height,
+		GLenum format, GLenum type, const GLvoid *pixels)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_TexParameterf(GLenum target, GLenum pname,
+		GLfloat param)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_TexParameterfv(GLenum target, GLenum pname,
+		GLfloat *params)
+{
+	++gm_log.calls;
+}
+
+static void APIENTRY gm_ReadPixels(GLint x, GLint y, GLsizei width,
+		GLsizei height, GLenum format, GLenum type, GLvoid *pixels)
+{
+	++gm_log.calls;
+}
+
+
+/*---------------------------------------------------------
+	SDL replacements
+---------------------------------------------------------*/
+
+/* Reset state and texture names, as for a new context */
+static void gm_open(void)
+{
+	int m;
+	gm_texture2d = gm_colorarray = 0;
+	gm_bound = gm_lastname = gm_boundbuffer = 0;
+	for(m = 0; m < 3; ++m)
+	{
+		gm_depth[m] = 0;
+		memset(gm_matrix(m), 0, sizeof(GLdouble) * 16);
+		gm_matrix(m)[0] = gm_matrix(m)[5] = gm_matrix(m)[10] =
+				gm_matrix(m)[15] = 1.0f;
+	}
+	gm_matrixmode = 0;
+}
+
+#define	GM_CALL(n, f)	if(!strcmp(proc, "gl" #n)) return (void *)f;
+
+void *SDL_GL_GetProcAddress(const char *proc)
+{
+	int i;
+	for(i = 0; i < gm_nhidden; ++i)
+		if(!strcmp(proc, gm_hidden[i]))
+			return NULL;
+	if(!strcmp(proc, "glGetError"))
+		gm_open();	/* First call looked up */
+	GM_CALL(GetError, gm_GetError)
+	GM_CALL(GetDoublev, gm_GetDoublev)
+	GM_CALL(GetString, gm_GetString)
+	GM_CALL(Disable, gm_Disable)
+	GM_CALL(Enable, gm_Enable)
+	GM_CALL(BlendFunc, gm_ignore2)
+	GM_CALL(ClearColor, gm_ClearColor)
+	GM_CALL(ColorMask, gm_ColorMask)
+	GM_CALL(Clear, gm_ignore1)
+	GM_CALL(Flush, gm_ignore0)
+	GM_CALL(Hint, gm_ignore2)
+	GM_CALL(DisableClientState, gm_DisableClientState)
+	GM_CALL(EnableClientState, gm_EnableClientState)
+	GM_CALL(ClearDepth, gm_ignore1d)
+	GM_CALL(DepthFunc, gm_ignore1)
+	GM_CALL(ClearStencil, gm_ignore1)
+	GM_CALL(StencilOp, gm_ignore3)
+	GM_CALL(StencilFunc, gm_StencilFunc)
+	GM_CALL(MatrixMode, gm_MatrixMode)
+	GM_CALL(Ortho, gm_ignore6d)
+	GM_CALL(Frustum, gm_ignore6d)
+	GM_CALL(Viewport, gm_ignore4i)
+	GM_CALL(Scissor, gm_ignore4i)
+	GM_CALL(PushMatrix, gm_PushMatrix)
+	GM_CALL(PopMatrix, gm_PopMatrix)
+	GM_CALL(LoadIdentity, gm_LoadIdentity)
+	GM_CALL(LoadMatrixd, gm_LoadMatrixd)
+	GM_CALL(MultMatrixd, gm_MultMatrixd)
+	GM_CALL(MultMatrixf, gm_MultMatrixf)
+	GM_CALL(Rotated, gm_Rotated)
+	GM_CALL(Scaled, gm_Scaled)
+	GM_CALL(Translated, gm_Translated)
+	GM_CALL(IsTexture, gm_IsTexture)
+	GM_CALL(GenTextures, gm_GenTextures)
+	GM_CALL(BindTexture, gm_BindTexture)
+	GM_CALL(DeleteTextures, gm_DeleteTextures)
+	GM_CALL(TexImage2D, gm_TexImage2D)
+	GM_CALL(TexParameteri, gm_ignore3)
+	GM_CALL(TexParameterf, gm_TexParameterf)
+	GM_CALL(TexParameterfv, gm_TexParameterfv)
+	GM_CALL(TexSubImage2D, gm_TexSubImage2D)
+	GM_CALL(ShadeModel, gm_ignore1)
+	GM_CALL(PixelStorei, gm_ignore2)
+	GM_CALL(ReadPixels, gm_ReadPixels)
+	GM_CALL(Begin, gm_Begin)
+	GM_CALL(End, gm_End)
+	GM_CALL(Vertex2d, gm_Vertex2d)
+	GM_CALL(Vertex3d, gm_Vertex3d)
+	GM_CALL(Vertex2f, gm_Vertex2f)
+	GM_CALL(Vertex3f, gm_Vertex3f)
+	GM_CALL(Vertex4d, gm_Vertex4d)
+	GM_CALL(Normal3d, gm_ignore3d)
+	GM_CALL(Color3d, gm_Color3d)
+	GM_CALL(Color4d, gm_Color4d)
+	GM_CALL(Color4f, gm_Color4f)
+	GM_CALL(TexCoord1d, gm_ignore1d)
+	GM_CALL(TexCoord2d, gm_TexCoord2d)
+	GM_CALL(TexCoord2f, gm_TexCoord2f)
+	GM_CALL(TexCoord3d, gm_ignore3d)
+	GM_CALL(TexCoord4d, gm_ignore4d)
+	GM_CALL(VertexPointer, gm_VertexPointer)
+	GM_CALL(TexCoordPointer, gm_TexCoordPointer)
+	GM_CALL(ColorPointer, gm_ColorPointer)
+	GM_CALL(DrawArrays, gm_DrawArrays)
+	GM_CALL(GenBuffers, gm_GenBuffers)
+	GM_CALL(DeleteBuffers, gm_DeleteBuffers)
+	GM_CALL(BindBuffer, gm_BindBuffer)
+	GM_CALL(BufferData, gm_BufferData)
+	return NULL;
+}
+
+int SDL_GL_LoadLibrary(const char *path)
+{
+	return 0;
+}
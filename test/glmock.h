@@ -0,0 +1,52 @@
+/*
+ * glmock.h - Logging OpenGL mock for ZeeDraw tests
+ *
+ * Linked into a test program, this replaces SDL_GL_GetProcAddress(), so that
+ * the OpenGL backend gets stubs that record the vertices it draws and count
+ * the calls it makes, instead of a real OpenGL driver. Nothing is rendered,
+ * and no display or context is needed.
+ *
+ * Vertices are logged after the modelview and texture matrices are applied,
+ * except glOrtho() and glFrustum(), which are ignored. That is, positions are
+ * in the coordinate space of the layer or window being drawn.
+ *
+ * This code is in the public domain. Do what you like with it. NO WARRANTY!
+ */
+
+#ifndef	GLMOCK_H
+#define	GLMOCK_H
+
+/* Vertex as drawn through glBegin()/glEnd() or glDrawArrays() */
+typedef struct GM_vertex
+{
+	float		x, y, z;
+	float		u, v;		/* 0 when texturing is off */
+	float		r, g, b, a;
+	unsigned	texture;	/* Bound texture, or 0 when off */
+	unsigned	mode;		/* Primitive mode */
+} GM_vertex;
+
+typedef struct GM_log
+{
+	long		calls;		/* OpenGL calls */
+	long		draws;		/* glEnd() and glDrawArrays() calls */
+	long		uploads;	/* glBufferData() calls */
+	long		uploadbytes;	/* Bytes passed to glBufferData() */
+	GM_vertex	*vertices;	/* Vertices drawn */
+	int		nvertices;
+	int		maxvertices;
+} GM_log;
+
+extern GM_log gm_log;
+
+/* Clear the vertex log and the counters */
+void gm_Reset(void);
+
+/*
+ * Report OpenGL call 'name' (as in "glGenBuffers") as missing from now on,
+ * or if 'name' is NULL, stop hiding calls. Takes effect when the OpenGL
+ * backend is opened.
+ */
+void gm_Hide(const char *name);
+
+#endif /* GLMOCK_H */
@@ -0,0 +1,190 @@
+/*
+ * precision.c - ZeeDraw ZD_f precision test and benchmark
+ *
+ * Places sprites through transform chains with large coordinates, that cancel
+ * out to put the sprites on screen, and reports how far off they end up
+ * compared to sprites placed directly. Then times rendering of a large
+ * animated scene with the "null" backend.
+ *
+ * Run this against a normal and a ZD_SINGLE_PRECISION build of the library,
+ * and compare the reports.
+ *
+ * This code is in the public domain. Do what you like with it. NO WARRANTY!
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "zeedraw.h"
+
+#define	PT_SIZE		128	/* Test framebuffer size (pixels) */
+#define	PT_TRIALS	64	/* Positions tested per magnitude */
+
+static void pt_fail(ZD_errors err)
+{
+	fprintf(stderr, "ZeeDraw error: %s\n", zd_ErrorString(err));
+	exit(1);
+}
+
+/* Create an opaque white texture */
+static ZD_texture *pt_create_white(ZD_state *state, int size)
+{
+	int x, y;
+	ZD_pixels px;
+	ZD_texture *tx = zd_Texture(state, ZD_RGBA, ZD_BILINEAR, size, size);
+	if(!tx)
+		pt_fail(zd_LastError(state));
+	zd_LockTexture(tx, &px);
+	for(y = 0; y < size; ++y)
+		for(x = 0; x < size * 4; ++x)
+			px.pixels[y * px.pitch + x] = 255;
+	zd_UnlockTexture(&px);
+	return tx;
+}
+
+/* Render, and find the center of the (red channel) intensity of the image */
+static void pt_centroid(ZD_state *state, ZD_pixels *fb, double *cx, double *cy)
+{
+	int x, y;
+	double sum = 0.0f, sx = 0.0f, sy = 0.0f;
+	ZD_errors res;
+	if((res = zd_Render(state)))
+		pt_fail(res);
+	for(y = 0; y < fb->h; ++y)
+		for(x = 0; x < fb->w; ++x)
+		{
+			double v = fb->pixels[y * fb->pitch + x * 4];
+			sum += v;
+			sx += v * (x + 0.5f);
+			sy += v * (y + 0.5f);
+		}
+	*cx = sum ? sx / sum : 0.0f;
+	*cy = sum ? sy / sum : 0.0f;
+}
+
+static void pt_precision(void)
+{
+	static const double magnitudes[] = {
+		1e1, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 0.0f
+	};
+	int m, i;
+	ZD_pixels fb;
+	ZD_state *state;
+	ZD_texture *white;
+	ZD_entity *l, *ref, *cam, *obj, *spr;
+
+	fb.w = fb.h = PT_SIZE;
+	fb.pitch = PT_SIZE * 4;
+	fb.format = ZD_RGBA;
+	if(!(fb.pixels = calloc(PT_SIZE * PT_SIZE, 4)))
+		pt_fail(ZD_OOMEMORY);
+	if(!(state = zd_Open("software", 0, &fb)))
+		pt_fail(zd_LastError(NULL));
+	white = pt_create_white(state, 16);
+	l = zd_Layer(zd_Root(state), ZD_CLEAR, 0, PT_SIZE, 0, PT_SIZE);
+
+	/* Reference sprite, placed directly in the layer */
+	ref = zd_Sprite(l, 0, white, 0.5f, 0.5f);
+
+	/* Test sprite, placed via "camera" and "object" groups */
+	cam = zd_Group(l, 0);
+	obj = zd_Group(cam, 0);
+	spr = zd_Sprite(obj, 0, white, 0.5f, 0.5f);
+	if(!ref || !spr)
+		pt_fail(zd_LastError(state));
+
+	printf("Positioning error (pixels), %d bit ZD_f:\n",
+			(int)sizeof(ZD_f) * 8);
+	printf("%12s %12s %12s\n", "magnitude", "mean", "max");
+	srand(1);
+	for(m = 0; magnitudes[m]; ++m)
+	{
+		double mag = magnitudes[m];
+		double sum = 0.0f, max = 0.0f;
+		for(i = 0; i < PT_TRIALS; ++i)
+		{
+			double x = PT_SIZE * (0.25f + 0.5f * rand() / RAND_MAX);
+			double y = PT_SIZE * (0.25f + 0.5f * rand() / RAND_MAX);
+			double r = 6.283f * rand() / RAND_MAX;
+			double s = 16.0f + 16.0f * rand() / RAND_MAX;
+			double rx, ry, tx, ty, dx, dy, d;
+
+			zd_SetTransform(ref, x, y, 0, s, r);
+			zd_SetColor(ref, 1, 1, 1, 1);
+			zd_SetColor(spr, 1, 1, 1, 0);
+			pt_centroid(state, &fb, &rx, &ry);
+
+			zd_SetTransform(cam, -mag, -0.7f * mag, 0, 1, 0);
+			zd_SetTransform(obj, mag + x, 0.7f * mag + y, 0, 1, 0);
+			zd_SetTransform(spr, 0, 0, 0, s, r);
+			zd_SetColor(ref, 1, 1, 1, 0);
+			zd_SetColor(spr, 1, 1, 1, 1);
+			pt_centroid(state, &fb, &tx, &ty);
+
+			dx = tx - rx;
+			dy = ty - ry;
+			d = sqrt(dx * dx + dy * dy);
+			sum += d;
+			if(d > max)
+				max = d;
+		}
+		printf("%12g %12.4f %12.4f\n", mag, sum / PT_TRIALS, max);
+	}
+	zd_ReleaseTexture(white);
+	zd_Close(state);
+	free(fb.pixels);
+}
+
+static void pt_benchmark(int groups, int sprites, int frames)
+{
+	int i, j;
+	clock_t t;
+	ZD_rendercounts rc = { 0 };
+	ZD_state *state;
+	ZD_entity *l;
+	if(!(state = zd_Open("null", 0, &rc)))
+		pt_fail(zd_LastError(NULL));
+	l = zd_Layer(zd_Root(state), ZD_CLEAR, -1e6, 1e6, -1e6, 1e6);
+	srand(1);
+	for(i = 0; i < groups; ++i)
+	{
+		ZD_entity *g = zd_Group(l, 0);
+		zd_SetPosition(g, 1e6 * rand() / RAND_MAX - 5e5,
+				1e6 * rand() / RAND_MAX - 5e5);
+		zd_CRotate(g, 0.1f);
+		for(j = 0; j < sprites; ++j)
+		{
+			ZD_entity *e = zd_Sprite(g, 0, NULL, 0.5f, 0.5f);
+			if(!e)
+				pt_fail(zd_LastError(state));
+			zd_SetTransform(e, 1e3 * rand() / RAND_MAX,
+					1e3 * rand() / RAND_MAX, 0, 10, 0);
+			zd_CMove(e, 1, 2);
+			zd_CRotate(e, 0.5f);
+		}
+	}
+	t = clock();
+	for(i = 0; i < frames; ++i)
+	{
+		ZD_errors res;
+		zd_Advance(state, 0.02f);
+		if((res = zd_Render(state)))
+			pt_fail(res);
+	}
+	t = clock() - t;
+	printf("\n%d animated sprites, %d frames: %.3f ms/frame\n",
+			groups * sprites, frames,
+			t * 1000.0f / CLOCKS_PER_SEC / frames);
+	zd_Close(state);
+}
+
+int main(int argc, const char *argv[])
+{
+	int groups = argc > 1 ? atoi(argv[1]) : 100;
+	int sprites = argc > 2 ? atoi(argv[2]) : 1000;
+	int frames = argc > 3 ? atoi(argv[3]) : 50;
+	pt_precision();
+	pt_benchmark(groups, sprites, frames);
+	return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * spantest.c - ZeeDraw software backend span blitter test
+ *
+ * Runs the SIMD span blitters supported by the CPU on random textures,
+ * coordinates and colors, and checks that their output is identical to that
+ * of the portable C reference implementation. Exits with status 1 on any
+ * mismatch.
+ *
+ * This is built with the blitters compiled in, as the SIMD versions are not
+ * exported by the library.
+ *
+ * This code is in the public domain. Do what you like with it. NO WARRANTY!
+ */
+
+#include "../src/zd_swspan.c"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define	ST_ITERATIONS	20000
+#define	ST_MAXSPAN	100	/* Max span length (pixels) */
+
+/* Create a random w x h RGBA texture with random wrapping */
+static void st_texture(ZDSW_texture *t, int w, int h)
+{
+	int i;
+	memset(t, 0, sizeof(ZDSW_texture));
+	t->tx.w = w;
+	t->tx.h = h;
+	t->hwrap = rand() & 1;
+	t->vwrap = rand() & 1;
+	t->simd = 1;	/* Power of two sizes only */
+	if(!(t->pixels = (unsigned char *)malloc(w * h * 4)))
+	{
+		fprintf(stderr, "Out of memory!\n");
+		exit(1);
+	}
+	for(i = 0; i < w * h * 4; ++i)
+		t->pixels[i] = rand();
+}
+
+/* Random 16:16 texel coordinate, far out on wrapping axes */
+static uint32_t st_coordinate(int wrap)
+{
+	uint32_t c = rand() % (1 << 22) - (1 << 21);
+	return wrap ? c + 0x7fc00000u : c;
+}
+
+/* Run span kind 'k' of 'sf' over 'n' pixels of 'd'; Blit() reads 's' */
+static void st_span(ZDSW_spanfuncs *sf, int k, unsigned char *d, int n,
+		ZDSW_paint *p, uint32_t u, uint32_t v, int du, int dv,
+		const unsigned char *s)
+{
+	switch(k)
+	{
+	  case 0:
+		sf->Color(d, n, p);
+		break;
+	  case 1:
+		sf->Nearest(d, n, p, u, v, du, dv);
+		break;
+	  case 2:
+		sf->Bilinear(d, n, p, u, v, du, dv);
+		break;
+	  case 3:
+		sf->Blit(d, s, n, p);
+		break;
+	}
+}
+
+static const char *st_kinds[] = { "Color", "Nearest", "Bilinear", "Blit" };
+
+int main(int argc, const char *argv[])
+{
+	ZDSW_spanfuncs *simd[2];
+	unsigned char init[ST_MAXSPAN * 4], ref[ST_MAXSPAN * 4];
+	unsigned char out[ST_MAXSPAN * 4], src[ST_MAXSPAN * 4];
+	int nsimd = 0, bad = 0;
+	int i, j, k, f;
+#ifdef ZDSW_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2"))
+		simd[nsimd++] = &zdsw_sse2_spans;
+	if(__builtin_cpu_supports("avx2"))
+		simd[nsimd++] = &zdsw_avx2_spans;
+#endif
+	printf("Testing against %s:", zdsw_scalar_spans.name);
+	for(f = 0; f < nsimd; ++f)
+		printf(" %s", simd[f]->name);
+	printf("%s\n", nsimd ? "" : " (no SIMD blitters available)");
+
+	srand(3);
+	for(i = 0; i < ST_ITERATIONS; ++i)
+	{
+		ZDSW_texture t;
+		ZDSW_paint p;
+		int n = rand() % ST_MAXSPAN;
+		uint32_t u, v;
+		int du = rand() % (1 << 18) - (1 << 17);
+		int dv = rand() % (1 << 18) - (1 << 17);
+		st_texture(&t, 1 << (rand() % 6), 1 << (rand() % 6));
+		u = st_coordinate(t.hwrap);
+		v = st_coordinate(t.vwrap);
+		p.tx = &t;
+		p.r = rand() % 257;
+		p.g = rand() % 257;
+		p.b = rand() % 257;
+		p.a = (i & 1) ? 256 : rand() % 257;
+		for(j = 0; j < ST_MAXSPAN * 4; ++j)
+		{
+			init[j] = rand();
+			src[j] = rand();
+		}
+		for(k = 0; k < 4; ++k)
+		{
+			memcpy(ref, init, sizeof(ref));
+			st_span(&zdsw_scalar_spans, k, ref, n, &p,
+					u, v, du, dv, src);
+			for(f = 0; f < nsimd; ++f)
+			{
+				memcpy(out, init, sizeof(out));
+				st_span(simd[f], k, out, n, &p, u, v, du, dv,
+						src);
+				if(!memcmp(ref, out, sizeof(out)))
+					continue;
+				if(bad++ < 10)
+					printf("Mismatch: %s %s, %d pixels\n",
+							simd[f]->name,
+							st_kinds[k], n);
+			}
+		}
+		free(t.pixels);
+	}
+	printf("%d mismatches; %s selected\n", bad,
+			zdsw_GetSpanFuncs()->name);
+	return bad ? 1 : 0;
+}
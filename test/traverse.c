@@ -0,0 +1,235 @@
+/*
+ * traverse.c - ZeeDraw scene graph traversal test and benchmark
+ *
+ * Renders random trees of groups, clipping windows and sprites with the
+ * software backend, and checks that the sprites are drawn in depth first
+ * order. Sprite n covers columns n and up of the framebuffer, so column n
+ * ends up with the color of sprite n only if it's drawn after sprites 0..n-1.
+ *
+ * Then times rendering of deep and wide trees with the "null" backend, with
+ * nothing changing, and with the top group moving every frame.
+ *
+ * This code is in the public domain. Do what you like with it. NO WARRANTY!
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "zeedraw.h"
+
+#define	TT_MAXSPRITES	225	/* Sprites in a test tree (distinct colors) */
+#define	TT_HEIGHT	4	/* Test framebuffer height (pixels) */
+#define	TT_TREES	20	/* Random trees tested */
+#define	TT_FRAMES	15	/* Frames timed; the best one is reported */
+
+typedef struct TT_tree
+{
+	ZD_state	*state;
+	int		nsprites;
+} TT_tree;
+
+static void tt_fail(ZD_errors err)
+{
+	fprintf(stderr, "ZeeDraw error: %s\n", zd_ErrorString(err));
+	exit(1);
+}
+
+/* Color channel values for sprite 'n'; never black */
+static int tt_red(int n)
+{
+	return 16 * (1 + n % 15);
+}
+
+static int tt_green(int n)
+{
+	return 16 * (1 + n / 15);
+}
+
+/*
+ * Add a random subtree under 'parent' at nesting level 'level', numbering
+ * sprites in depth first order. 'x' is the translation of 'parent' relative
+ * to the layer.
+ */
+static void tt_subtree(TT_tree *t, ZD_entity *parent, int level, ZD_f x)
+{
+	int i, n = 1 + rand() % 4;
+	for(i = 0; (i < n) && (t->nsprites < TT_MAXSPRITES); ++i)
+	{
+		ZD_entity *e;
+		int k = level < 6 ? rand() % 4 : 0;
+		if(!k)
+		{
+			/* Sprite; left edge at column 'nsprites' */
+			int s = t->nsprites++;
+			if(!(e = zd_Sprite(parent, 0, NULL, 0.0f, 0.5f)))
+				tt_fail(zd_LastError(t->state));
+			zd_SetTransform(e, s - x, TT_HEIGHT * 0.5f, 0,
+					2 * TT_MAXSPRITES, 0);
+			zd_SetColor(e, tt_red(s) / 255.0f,
+					tt_green(s) / 255.0f, 0.0f, 1.0f);
+			continue;
+		}
+		if(k == 1)
+		{
+			/* Clipping window, around the whole framebuffer */
+			e = zd_Window(parent, ZD_CLIP, -x - 1.0f, -1.0f,
+					TT_MAXSPRITES + 2.0f, TT_HEIGHT + 2.0f);
+		}
+		else
+		{
+			/* Translated group */
+			ZD_f dx = rand() % 100 - 50;
+			if((e = zd_Group(parent, 0)))
+				zd_SetPosition(e, dx, 0.0f);
+			x += dx;
+			tt_subtree(t, e, level + 1, x);
+			x -= dx;
+			continue;
+		}
+		if(!e)
+			tt_fail(zd_LastError(t->state));
+		tt_subtree(t, e, level + 1, x);
+	}
+}
+
+/* Check that sprites are drawn in order; returns the number of errors */
+static int tt_order(void)
+{
+	int i, f, n, errors = 0;
+	ZD_pixels fb;
+	fb.w = TT_MAXSPRITES;
+	fb.h = TT_HEIGHT;
+	fb.pitch = TT_MAXSPRITES * 4;
+	fb.format = ZD_RGBA;
+	if(!(fb.pixels = calloc(TT_MAXSPRITES * TT_HEIGHT, 4)))
+		tt_fail(ZD_OOMEMORY);
+	srand(1);
+	for(i = 0; i < TT_TREES; ++i)
+	{
+		TT_tree t;
+		ZD_entity *l;
+		if(!(t.state = zd_Open("software", 0, &fb)))
+			tt_fail(zd_LastError(NULL));
+		t.nsprites = 0;
+		l = zd_Layer(zd_Root(t.state), ZD_CLEAR,
+				0, TT_MAXSPRITES, 0, TT_HEIGHT);
+		while(t.nsprites < 8)
+			tt_subtree(&t, l, 0, 0.0f);
+
+		/* Twice, so that the second frame has nothing to rethink */
+		for(f = 0; f < 2; ++f)
+		{
+			ZD_errors res;
+			if((res = zd_Render(t.state)))
+				tt_fail(res);
+			for(n = 0; n < t.nsprites; ++n)
+			{
+				unsigned char *p = fb.pixels + n * 4;
+				if((abs(p[0] - tt_red(n)) < 8) &&
+						(abs(p[1] - tt_green(n)) < 8))
+					continue;
+				if(errors++ < 10)
+					printf("Tree %d, frame %d: sprite %d "
+							"out of order\n",
+							i, f, n);
+			}
+		}
+		zd_Close(t.state);
+	}
+	free(fb.pixels);
+	printf("Drawing order: %d trees, %d errors\n", TT_TREES, errors);
+	return errors;
+}
+
+/* Best time of TT_FRAMES frames, moving 'top', if not NULL, every frame */
+static double tt_time(ZD_state *state, ZD_entity *top)
+{
+	int i;
+	double best = 1e9;
+	for(i = 0; i < TT_FRAMES; ++i)
+	{
+		ZD_errors res;
+		clock_t t;
+		if(top)
+			zd_SetPosition(top, i & 1, 0);
+		t = clock();
+		if((res = zd_Render(state)))
+			tt_fail(res);
+		t = clock() - t;
+		if(t * 1000.0f / CLOCKS_PER_SEC < best)
+			best = t * 1000.0f / CLOCKS_PER_SEC;
+	}
+	return best;
+}
+
+/* Add a 'fanout'-ary tree of groups 'depth' levels deep, with sprite leaves */
+static void tt_tree(ZD_state *state, ZD_entity *parent, int fanout, int depth)
+{
+	int i;
+	for(i = 0; i < fanout; ++i)
+	{
+		ZD_entity *e = depth ? zd_Group(parent, 0) :
+				zd_Sprite(parent, 0, NULL, 0.5f, 0.5f);
+		if(!e)
+			tt_fail(zd_LastError(state));
+		if(depth)
+			tt_tree(state, e, fanout, depth - 1);
+		else
+			zd_SetTransform(e, rand() % 1000, rand() % 1000, 0,
+					10, 0);
+	}
+}
+
+/*
+ * Time a scene of kind 'kind': a chain of 'n' groups with a sprite at the end,
+ * 'n' sprites in one group, or a tree 'n' levels deep of groups with four
+ * children each.
+ */
+static void tt_benchmark(const char *kind, int n)
+{
+	ZD_rendercounts rc = { 0 };
+	ZD_state *state;
+	ZD_entity *l, *top, *e;
+	int i;
+	if(!(state = zd_Open("null", 0, &rc)))
+		tt_fail(zd_LastError(NULL));
+	l = zd_Layer(zd_Root(state), 0, 0, 1000, 0, 1000);
+	if(!(top = e = zd_Group(l, 0)))
+		tt_fail(zd_LastError(state));
+	switch(kind[0])
+	{
+	  case 'c':
+		for(i = 0; i < n; ++i)
+			if(!(e = zd_Group(e, 0)))
+				tt_fail(zd_LastError(state));
+		zd_SetTransform(zd_Sprite(e, 0, NULL, 0.5f, 0.5f),
+				500, 500, 0, 10, 0);
+		break;
+	  case 'w':
+		for(i = 0; i < n; ++i)
+			if(!(e = zd_Sprite(top, 0, NULL, 0.5f, 0.5f)))
+				tt_fail(zd_LastError(state));
+			else
+				zd_SetTransform(e, rand() % 1000,
+						rand() % 1000, 0, 10, 0);
+		break;
+	  case 't':
+		tt_tree(state, top, 4, n - 1);
+		break;
+	}
+	printf("%-10s %7d %12.3f %12.3f\n", kind, n, tt_time(state, NULL),
+			tt_time(state, top));
+	zd_Close(state);
+}
+
+int main(int argc, const char *argv[])
+{
+	int errors = tt_order();
+	printf("\nBest of %d frames (ms):\n", TT_FRAMES);
+	printf("%-10s %7s %12s %12s\n", "scene", "n", "static", "moving");
+	tt_benchmark("chain", 10000);
+	tt_benchmark("chain", 100000);
+	tt_benchmark("wide", 200000);
+	tt_benchmark("tree", 8);
+	return errors ? 1 : 0;
+}
@@ -13,4 +13,4 @@ Version: @VERSION_MAJOR@.@VERSION_MINOR@.@VERSION_PATCH@
 Requires: sdl >= 1.2.10
 Libs: -L${libdir} -lzeedraw
 Libs.private: -L${libdir} -lSDL
-Cflags: -I${includedir}
+Cflags: -I${includedir}@ZD_CFLAGS@